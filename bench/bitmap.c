@@ -0,0 +1,117 @@
+/*
+    CRAB - Compact Random-Access Binary
+    Copyright © 2018  Ben Longbons
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "bitmap.h"
+#include "crab.h"
+#include "schema.h"
+#include "util.h"
+
+
+/*
+    Compare bitmap sections against boolean columns stored a byte per
+    row, which is what they replace.
+
+    "contains" is dependent lookups at random rows; "and" builds the
+    intersection of two columns (a new section, or a new byte array) and
+    counts it.
+*/
+
+static double now(void)
+{
+    struct timespec ts;
+    TRY(clock_gettime, (CLOCK_MONOTONIC, &ts));
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint64_t xorshift(uint64_t *state)
+{
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
+}
+
+int main(int argc, char **argv)
+{
+    uint64_t n = argc > 1 ? strtoull(argv[1], NULL, 0) : 1 << 24;
+    /* percent of rows that are set, in clumps so that runs show up */
+    unsigned density = argc > 2 ? strtoul(argv[2], NULL, 0) : 10;
+    uint64_t lookups = 1 << 22;
+    unsigned char *a = TRY_P(malloc, (n + 1));
+    unsigned char *b = TRY_P(malloc, (n + 1));
+    unsigned char *both = TRY_P(malloc, (n + 1));
+    uint64_t state = 88172645463325252ull, i, count_bytes = 0, count_bitmap;
+    uint32_t x, hits_bytes = 0, hits_bitmap = 0;
+    double t0, t1, t2;
+    CrabFile *c;
+    CrabBitmap va, vb, vboth;
+    CrabSection *s;
+
+    for (i = 0; i < n; ++i)
+    {
+        /* a clumps, b doesn't */
+        a[i] = i % 4096 < 4096 * density / 100 ? 1 : 0;
+        b[i] = xorshift(&state) % 100 < density;
+    }
+    c = TRY_P(crab_file_open, ("tmp/bench-bitmap.crab", CRAB_FILE_FLAG_PERROR | CRAB_FILE_FLAG_NEW));
+    s = TRY_P(crab_file_add_bitmap_bytes, (c, a, n, CRAB_SCHEMA, CRAB_PURPOSE_BITMAP));
+    TRY_B(crab_bitmap_open, (s, &va));
+    printf("%llu rows, %u%% set\n", (unsigned long long)n, density);
+    printf("  clumped column: %8.2f%% of the byte array\n", 100.0 * crab_section_data_size(s) / n);
+    s = TRY_P(crab_file_add_bitmap_bytes, (c, b, n, CRAB_SCHEMA, CRAB_PURPOSE_BITMAP));
+    TRY_B(crab_bitmap_open, (s, &vb));
+    printf("  random column:  %8.2f%% of the byte array\n", 100.0 * crab_section_data_size(s) / n);
+
+    /* Each row depends on the last answer, so loads can't overlap. */
+    t0 = now();
+    for (i = 0, x = 0; i < lookups; ++i)
+        hits_bitmap += x = crab_bitmap_contains(&vb, (x ^ i * 2654435761u) % n);
+    t1 = now();
+    for (i = 0, x = 0; i < lookups; ++i)
+        hits_bytes += x = b[(x ^ i * 2654435761u) % n];
+    t2 = now();
+    if (hits_bitmap != hits_bytes)
+        die2("contains mismatch", 0);
+    printf("  contains, bitmap:       %8.2f ns\n", (t1 - t0) / lookups * 1e9);
+    printf("  contains, bytes:        %8.2f ns\n", (t2 - t1) / lookups * 1e9);
+
+    t0 = now();
+    s = TRY_P(crab_file_add_bitmap_op, (c, &va, &vb, CRAB_BITMAP_OP_AND, CRAB_SCHEMA, CRAB_PURPOSE_BITMAP));
+    TRY_B(crab_bitmap_open, (s, &vboth));
+    count_bitmap = crab_bitmap_count(&vboth);
+    t1 = now();
+    for (i = 0; i < n; ++i)
+        count_bytes += both[i] = a[i] & b[i];
+    t2 = now();
+    if (count_bitmap != count_bytes)
+        die2("and mismatch", 0);
+    printf("  and and count, bitmap:  %8.3f ns/row\n", (t1 - t0) / n * 1e9);
+    printf("  and and count, bytes:   %8.3f ns/row\n", (t2 - t1) / n * 1e9);
+
+    TRY_B(crab_file_close, (c));
+    free(a);
+    free(b);
+    free(both);
+    return 0;
+}
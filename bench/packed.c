@@ -0,0 +1,128 @@
+/*
+    CRAB - Compact Random-Access Binary
+    Copyright © 2018  Ben Longbons
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "crab.h"
+#include "packed.h"
+#include "schema.h"
+#include "util.h"
+
+
+/*
+    Compare reading a bit-packed section against plain arrays of 32-bit
+    integers, both big-endian (as most section data is) and native.
+
+    "random get" is dependent loads at random indices; "decode" is bulk
+    decoding of the whole array in chunks.
+*/
+
+typedef struct __attribute__((scalar_storage_order("big-endian"))) BigEndian32
+{
+    uint32_t v;
+} BigEndian32;
+
+static double now(void)
+{
+    struct timespec ts;
+    TRY(clock_gettime, (CLOCK_MONOTONIC, &ts));
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint64_t xorshift(uint64_t *state)
+{
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
+}
+
+int main(int argc, char **argv)
+{
+    uint64_t n = argc > 1 ? strtoull(argv[1], NULL, 0) : 1 << 22;
+    unsigned bits = argc > 2 ? strtoul(argv[2], NULL, 0) : 17;
+    uint64_t lookups = 1 << 22;
+    size_t chunk = 4096;
+    uint32_t *native = TRY_P(malloc, (n * sizeof(uint32_t)));
+    BigEndian32 *big = (BigEndian32 *)TRY_P(malloc, (n * sizeof(BigEndian32)));
+    uint32_t *out = TRY_P(malloc, (chunk * sizeof(uint32_t)));
+    uint64_t state = 88172645463325252ull, i;
+    uint32_t sum_packed = 0, sum_big = 0, sum_native = 0, x;
+    double t0, t1, t2, t3;
+    CrabFile *c;
+    CrabPackedInts view;
+
+    for (i = 0; i < n; ++i)
+    {
+        native[i] = xorshift(&state) & (bits >= 32 ? 0xffffffff : (1u << bits) - 1);
+        big[i].v = native[i];
+    }
+    c = TRY_P(crab_file_open, ("tmp/bench-packed.crab", CRAB_FILE_FLAG_PERROR | CRAB_FILE_FLAG_NEW));
+    TRY_P(crab_file_add_packed, (c, native, n, CRAB_SCHEMA, CRAB_PURPOSE_PACKED_INTS));
+    TRY_B(crab_packed_open, (crab_file_section(c, 2), &view));
+
+    /* Each index depends on the last value, so loads can't overlap. */
+    t0 = now();
+    for (i = 0, x = 0; i < lookups; ++i)
+        sum_packed += x = crab_packed_get(&view, (x ^ i * 2654435761u) % n);
+    t1 = now();
+    for (i = 0, x = 0; i < lookups; ++i)
+        sum_big += x = big[(x ^ i * 2654435761u) % n].v;
+    t2 = now();
+    for (i = 0, x = 0; i < lookups; ++i)
+        sum_native += x = native[(x ^ i * 2654435761u) % n];
+    t3 = now();
+    if (sum_packed != sum_big || sum_big != sum_native)
+        die2("random get mismatch", 0);
+    printf("%llu values of %u bits; packed is %.1f%% of the plain size\n", (unsigned long long)n, crab_packed_bits(&view), 100.0 * crab_packed_bits(&view) / 32);
+    printf("  random get, packed:       %8.2f ns\n", (t1 - t0) / lookups * 1e9);
+    printf("  random get, big-endian:   %8.2f ns\n", (t2 - t1) / lookups * 1e9);
+    printf("  random get, native:       %8.2f ns\n", (t3 - t2) / lookups * 1e9);
+
+    sum_packed = sum_big = sum_native = 0;
+    t0 = now();
+    for (i = 0; i < n; i += chunk)
+    {
+        size_t k, m = n - i < chunk ? n - i : chunk;
+        TRY_B(crab_packed_decode, (&view, i, m, out));
+        for (k = 0; k < m; ++k)
+            sum_packed += out[k];
+    }
+    t1 = now();
+    for (i = 0; i < n; ++i)
+        sum_big += big[i].v;
+    t2 = now();
+    for (i = 0; i < n; ++i)
+        sum_native += native[i];
+    t3 = now();
+    if (sum_packed != sum_big || sum_big != sum_native)
+        die2("decode mismatch", 0);
+    printf("  decode and sum, packed:   %8.3f ns/value\n", (t1 - t0) / n * 1e9);
+    printf("  sum, big-endian:          %8.3f ns/value\n", (t2 - t1) / n * 1e9);
+    printf("  sum, native:              %8.3f ns/value\n", (t3 - t2) / n * 1e9);
+
+    TRY_B(crab_file_close, (c));
+    free(native);
+    free(big);
+    free(out);
+    return 0;
+}
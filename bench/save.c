@@ -0,0 +1,100 @@
+/*
+    CRAB - Compact Random-Access Binary
+    Copyright © 2018  Ben Longbons
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "crab.h"
+#include "schema.h"
+#include "util.h"
+
+
+/*
+    Time saving a big file after editing one small section.
+
+    Opening with CRAB_FILE_FLAG_WRITE means the library can't trust the
+    mapping to match the file, so that is the "copy everything" baseline.
+*/
+
+static double now(void)
+{
+    struct timespec ts;
+    TRY(clock_gettime, (CLOCK_MONOTONIC, &ts));
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void create(const char *filename, uint32_t num_sections, size_t section_size)
+{
+    CrabFile *c = TRY_P(crab_file_open, (filename, CRAB_FILE_FLAG_PERROR | CRAB_FILE_FLAG_NEW));
+    uint32_t i;
+    for (i = 0; i < num_sections; ++i)
+    {
+        CrabSection *s = TRY_P(crab_file_section_add, (c));
+        char *data = TRY_P(malloc, (section_size));
+        memset(data, 'a' + i % 26, section_size);
+        TRY_B(crab_section_set_data, (s, CRAB_SECTION_FLAG_OWN, (CrabAbstractData *)data, section_size));
+    }
+    TRY_B(crab_file_save, (c, 0));
+    TRY_B(crab_file_close, (c));
+}
+
+static double edit_and_save(const char *filename, int flags, uint32_t section)
+{
+    static char edit[] = "edited";
+    double start, end;
+    CrabFile *c = TRY_P(crab_file_open, (filename, CRAB_FILE_FLAG_PERROR | flags));
+    CrabSection *s = TRY_P(crab_file_section, (c, section));
+    TRY_B(crab_section_set_data, (s, 0, (CrabAbstractData *)edit, sizeof(edit)));
+    start = now();
+    TRY_B(crab_file_save, (c, 0));
+    end = now();
+    TRY_B(crab_file_close, (c));
+    return end - start;
+}
+
+int main(int argc, char **argv)
+{
+    const char *filename = argc > 1 ? argv[1] : "tmp/bench-save.crab";
+    uint32_t num_sections = argc > 2 ? strtoul(argv[2], NULL, 0) : 16;
+    size_t section_mib = argc > 3 ? strtoul(argv[3], NULL, 0) : 16;
+    int reps = 5, r;
+    double best_plain = 1e9, best_lazy = 1e9, best_write = 1e9;
+
+    create(filename, num_sections, section_mib << 20);
+    for (r = 0; r < reps; ++r)
+    {
+        double t;
+        t = edit_and_save(filename, 0, 2 + num_sections / 2);
+        if (t < best_plain)
+            best_plain = t;
+        t = edit_and_save(filename, CRAB_FILE_FLAG_LAZY, 2 + num_sections / 2);
+        if (t < best_lazy)
+            best_lazy = t;
+        t = edit_and_save(filename, CRAB_FILE_FLAG_WRITE, 2 + num_sections / 2);
+        if (t < best_write)
+            best_write = t;
+    }
+    printf("save after editing 1 of %u sections of %zu MiB (best of %d):\n", (unsigned)num_sections, section_mib, reps);
+    printf("  reused sections copied by kernel:       %8.3f ms\n", best_plain * 1e3);
+    printf("  same, lazily opened:                    %8.3f ms\n", best_lazy * 1e3);
+    printf("  every section through stdio (WRITE):    %8.3f ms\n", best_write * 1e3);
+    return 0;
+}
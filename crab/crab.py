@@ -1,5 +1,6 @@
 import enum
 import errno
+import os
 
 from ._crab import ffi as _ffi, lib as _lib
 
@@ -19,16 +20,39 @@ def _make_enum(prefix):
     #  IntEnum by design; there are different "enum"s for each schema.
     globals()[name] = enum.IntEnum(name, values)
 _make_enum('CRAB_PURPOSE_')
+_make_enum('CRAB_ADVICE_')
+_make_enum('CRAB_KEY_TYPE_')
+_make_enum('CRAB_BITMAP_OP_')
+_make_enum('CRAB_CODEC_')
+_make_enum('CRAB_BYTE_ORDER_')
 # don't expose enums for flags since I'm targetting python 3.5
 # and using bool kwargs is cleaner anyway
 
 # This is `#define`d as a string literal, which CFFI can't handle yet.
 CRAB_SCHEMA = 'https://o11c.github.io/crab/schema.html'
 
+def crc32c(data, crc=0):
+    ''' Continue the CRC32C `crc` over `data`, as used for checksums.
+    '''
+    data = _ffi.from_buffer(data)
+    return _lib.crab_crc32c(crc, data, len(data))
+
+def native_byte_order():
+    ''' The `CrabByteOrder` of this CPU.
+    '''
+    return CrabByteOrder(_lib.crab_native_byte_order())
+
 class CrabFile:
-    def __init__(self, filename, *, write=False, new=False, perror=False):
+    def __init__(self, filename, *, write=False, new=False, perror=False, lazy=False,
+            populate=False, random=False, sequential=False, hugepage=False, verify=False):
         ''' Open/create a CRAB file.
 
+            `filename` may instead be an integer file descriptor (which is
+            not closed), or any object supporting the buffer protocol
+            (such as `bytes` or a `mmap`), which is used in place and kept
+            alive for as long as the file is. Files opened either way have
+            no name, so can't be saved.
+
             If `write` is True, the data in the file may be written
             directly.  This is not needed for ordinary section manipulation,
             and should be used with extreme caution.
@@ -39,6 +63,22 @@ class CrabFile:
             If `perror` is True, errors will be sent to stderr as well as
             raising a python exception. Note that unrecoverable errors also
             exist.
+
+            If `lazy` is True, only the header and section table are mapped
+            when opening; each section is mapped the first time it is used.
+            This keeps a file descriptor open until `close()`.
+
+            If `populate` is True, the mapping is faulted in up front.
+
+            If `random` or `sequential` is True, the kernel is told how the
+            file will be accessed. They may not both be True.
+
+            If `hugepage` is True, large mappings are placed so they can
+            use transparent huge pages, and the kernel is asked to do so.
+
+            If `verify` is True and the file has checksums, every section
+            is checked up front, on all CPUs, rather than each the first
+            time it is used.
         '''
         # forced - it exists for our benefit, after all!
         flags = _lib.CRAB_FILE_FLAG_ERROR
@@ -48,16 +88,35 @@ class CrabFile:
             flags |= _lib.CRAB_FILE_FLAG_NEW
         if perror:
             flags |= _lib.CRAB_FILE_FLAG_PERROR
-        raw = _lib.crab_file_open(filename.encode('utf-8'), flags)
+        if lazy:
+            flags |= _lib.CRAB_FILE_FLAG_LAZY
+        if populate:
+            flags |= _lib.CRAB_FILE_FLAG_POPULATE
+        if random:
+            flags |= _lib.CRAB_FILE_FLAG_RANDOM
+        if sequential:
+            flags |= _lib.CRAB_FILE_FLAG_SEQUENTIAL
+        if hugepage:
+            flags |= _lib.CRAB_FILE_FLAG_HUGEPAGE
+        if verify:
+            flags |= _lib.CRAB_FILE_FLAG_VERIFY
+        if isinstance(filename, (str, os.PathLike)):
+            raw = _lib.crab_file_open(os.fsencode(filename), flags)
+        elif isinstance(filename, int):
+            raw = _lib.crab_file_open_fd(filename, flags)
+        else:
+            self._buffer = _ffi.from_buffer(filename)
+            raw = _lib.crab_file_open_memory(self._buffer, len(self._buffer), flags)
         if raw == _ffi.NULL:
-            raise OSError(_ffi.errno, 'malloc: %s' % errno.strerror(_ffi.errno))
+            raise OSError(_ffi.errno, 'malloc: %s' % os.strerror(_ffi.errno))
         self._raw = _ffi.gc(raw, _lib.crab_file_close)
         self.raise_error(always=False)
 
     def close(self):
         ''' Immediately close a CRAB file, instead of relying on the GC.
 
-            Note that CRAB files do not keep an open file descriptor.
+            Note that CRAB files do not keep an open file descriptor,
+            unless they were opened with `lazy=True`.
         '''
         if 1:
             _ffi.gc(self._raw, None)
@@ -85,9 +144,9 @@ class CrabFile:
                 return
             raise TypeError('expected an error to exist!')
         msg = _ffi.string(msg).decode('ascii')
-        raise OSError(no, '%s: %s' % (msg, errno.strerror(no)))
+        raise OSError(no, '%s: %s' % (msg, os.strerror(no)))
 
-    def save(self, *, reopen):
+    def save(self, *, reopen, append=False, align_page=False, align_hugepage=False, checksum=False, dedup=False):
         ''' Save the current sections to the file.
 
             If `reopen` is True, then re-`mmap` the sections from the new
@@ -97,13 +156,79 @@ class CrabFile:
             if they were borrowed there will now be multiple value pointers).
 
             This uses the "exclusive creation + atomic rename" paradigm.
+
+            If `append` is True, new and changed sections are instead
+            appended to the existing file, and its section table is
+            rewritten in place. This is much cheaper for small changes to
+            big files, but is visible to anyone who already has the file
+            open, and leaves dead space behind until a normal save. It
+            always reopens.
+
+            If `align_page` or `align_hugepage` is True, every nonempty
+            section starts on a 4 KiB or 2 MiB boundary respectively, so
+            that it can be mapped and advised on its own. See also
+            `CrabSection.set_alignment()`.
+
+            If `checksum` is True, a CRC32C of every section is stored, and
+            checked when each is first used. Files that already have them
+            keep them up to date regardless.
+
+            If `dedup` is True, sections with the same data share one copy
+            of it in the file. Every section has to be read to find them.
         '''
         flags = 0
         if reopen:
             flags |= _lib.CRAB_SAVE_FLAG_REOPEN
+        if append:
+            flags |= _lib.CRAB_SAVE_FLAG_APPEND
+        if align_page:
+            flags |= _lib.CRAB_SAVE_FLAG_ALIGN_PAGE
+        if align_hugepage:
+            flags |= _lib.CRAB_SAVE_FLAG_ALIGN_HUGEPAGE
+        if checksum:
+            flags |= _lib.CRAB_SAVE_FLAG_CHECKSUM
+        if dedup:
+            flags |= _lib.CRAB_SAVE_FLAG_DEDUP
         if not _lib.crab_file_save(self._raw, flags):
             self.raise_error()
 
+    def verify(self, num_threads=0):
+        ''' Check every section against the file's checksums, on
+            `num_threads` threads (0 for one per CPU).
+
+            Raises OSError with EBADMSG if any don't match, or ENOENT if
+            the file has no checksums.
+        '''
+        if not _lib.crab_file_verify(self._raw, num_threads):
+            self.raise_error()
+
+    def layout(self):
+        ''' Return `(file_size, table_size, moved_table_size)` for the file
+            as last opened: the section table is at the start, unless an
+            appending save moved it to the end.
+
+            All are 0 if the file has never been saved.
+        '''
+        file_size = _ffi.new('uint64_t *')
+        table_size = _ffi.new('uint64_t *')
+        moved_table_size = _ffi.new('uint64_t *')
+        _lib.crab_file_layout(self._raw, file_size, table_size, moved_table_size)
+        return file_size[0], table_size[0], moved_table_size[0]
+
+    def byte_order(self):
+        ''' The `CrabByteOrder` of the file's own data - any section that
+            isn't in one of the library's formats.
+        '''
+        return CrabByteOrder(_lib.crab_file_byte_order(self._raw))
+
+    def set_byte_order(self, order):
+        ''' Record a different `CrabByteOrder` for the file's data, from
+            the next save on. Use `CrabSection.swap_bytes()` to convert
+            the data itself.
+        '''
+        if not _lib.crab_file_set_byte_order(self._raw, order):
+            self.raise_error()
+
     def num_sections(self):
         ''' Number of sections in the file.
         '''
@@ -121,6 +246,232 @@ class CrabFile:
             self.raise_error()
         return CrabSection(self, raw_section)
 
+    def add_sections(self, count, schema, purpose):
+        ''' Add several sections to the file at once.
+
+            They all get the same schema and purpose. This is much cheaper
+            than calling `add_section()` repeatedly.
+        '''
+        raw_section = _lib.crab_file_section_add_many(self._raw, count, schema.encode('ascii'), purpose)
+        if raw_section == _ffi.NULL:
+            self.raise_error()
+        first = _lib.crab_section_number(raw_section)
+        return [self.section(first + i) for i in range(count)]
+
+    def find_sections(self, schema, purpose):
+        ''' Get all the sections with a given schema and purpose.
+
+            This uses an index, built the first time it is needed.
+        '''
+        sections = _ffi.new('const uint32_t **')
+        num_sections = _ffi.new('uint32_t *')
+        if not _lib.crab_file_find_sections(self._raw, schema.encode('ascii'), purpose, sections, num_sections):
+            self.raise_error()
+        numbers = [sections[0][i] for i in range(num_sections[0])]
+        return [self.section(i) for i in numbers]
+
+    def add_strings(self, strings, schema=CRAB_SCHEMA, purpose=None):
+        ''' Add a CFBS string section and its index, and return the index.
+
+            `strings` is a sequence of `bytes` or `str`; string `i` gets
+            ID `i`. Use `CrabSection.strings()` to read it back.
+        '''
+        if purpose is None:
+            purpose = CrabPurpose.Strings
+        strings = [x.encode('utf-8') if isinstance(x, str) else bytes(x) for x in strings]
+        pointers = _ffi.new('const char *[]', [_ffi.from_buffer(x) for x in strings] or 1)
+        lengths = _ffi.new('size_t[]', [len(x) for x in strings] or 1)
+        raw_section = _lib.crab_file_add_strings(self._raw, pointers, lengths, len(strings), schema.encode('ascii'), purpose)
+        if raw_section == _ffi.NULL:
+            self.raise_error()
+        return CrabSection(self, raw_section)
+
+    def add_dict(self, strings, schema=CRAB_SCHEMA, purpose=None):
+        ''' Add a dictionary-encoded column, and its dictionary.
+
+            `strings` is a sequence of `bytes` or `str`, one per row. Use
+            `CrabSection.dict()` to read it back.
+        '''
+        if purpose is None:
+            purpose = CrabPurpose.Dict
+        strings = [x.encode('utf-8') if isinstance(x, str) else bytes(x) for x in strings]
+        pointers = _ffi.new('const char *[]', [_ffi.from_buffer(x) for x in strings] or 1)
+        lengths = _ffi.new('size_t[]', [len(x) for x in strings] or 1)
+        raw_section = _lib.crab_file_add_dict(self._raw, pointers, lengths, len(strings), schema.encode('ascii'), purpose)
+        if raw_section == _ffi.NULL:
+            self.raise_error()
+        return CrabSection(self, raw_section)
+
+    def add_compressed(self, data, codec=CrabCodec.Lz, block_size=0, schema=CRAB_SCHEMA, purpose=None):
+        ''' Add a section holding `data`, compressed in separate blocks.
+
+            `block_size` is a power of 2 from 4 KiB to 16 MiB, or 0 for
+            the default. Use `CrabSection.compressed()` to read it back.
+        '''
+        if purpose is None:
+            purpose = CrabPurpose.Compressed
+        data = bytes(data)
+        raw_section = _lib.crab_file_add_compressed(self._raw, data, len(data), codec, block_size, schema.encode('ascii'), purpose)
+        if raw_section == _ffi.NULL:
+            self.raise_error()
+        return CrabSection(self, raw_section)
+
+    def add_packed(self, values, schema=CRAB_SCHEMA, purpose=None):
+        ''' Add a section of bit-packed unsigned 32-bit integers.
+
+            Every value gets as many bits as the largest one needs. Use
+            `CrabSection.packed()` to read it back.
+        '''
+        if purpose is None:
+            purpose = CrabPurpose.PackedInts
+        values = list(values)
+        array = _ffi.new('uint32_t[]', values or 1)
+        raw_section = _lib.crab_file_add_packed(self._raw, array, len(values), schema.encode('ascii'), purpose)
+        if raw_section == _ffi.NULL:
+            self.raise_error()
+        return CrabSection(self, raw_section)
+
+    def add_for(self, values, schema=CRAB_SCHEMA, purpose=None):
+        ''' Add a section of unsigned 64-bit integers, stored by blocks
+            as a base plus small offsets or deltas.
+
+            Use `CrabSection.for_ints()` to read it back.
+        '''
+        if purpose is None:
+            purpose = CrabPurpose.ForInts
+        values = list(values)
+        array = _ffi.new('uint64_t[]', values or 1)
+        raw_section = _lib.crab_file_add_for(self._raw, array, len(values), schema.encode('ascii'), purpose)
+        if raw_section == _ffi.NULL:
+            self.raise_error()
+        return CrabSection(self, raw_section)
+
+    def add_runs(self, values, schema=CRAB_SCHEMA, purpose=None):
+        ''' Add a section of unsigned 32-bit integers, stored as runs of
+            equal values.
+
+            Use `CrabSection.runs()` to read it back.
+        '''
+        if purpose is None:
+            purpose = CrabPurpose.Runs
+        values = list(values)
+        array = _ffi.new('uint32_t[]', values or 1)
+        raw_section = _lib.crab_file_add_runs(self._raw, array, len(values), schema.encode('ascii'), purpose)
+        if raw_section == _ffi.NULL:
+            self.raise_error()
+        return CrabSection(self, raw_section)
+
+    def add_trie(self, values, *, leaf_bits=0, mid_bits=0, schema=CRAB_SCHEMA, purpose=None):
+        ''' Add a section of unsigned 32-bit integers, as a multi-stage
+            table of deduplicated blocks.
+
+            Leaf blocks hold `2**leaf_bits` values; 0 means to pick the
+            smallest. A nonzero `mid_bits` adds a third stage.
+
+            Use `CrabSection.trie()` to read it back.
+        '''
+        if purpose is None:
+            purpose = CrabPurpose.Trie
+        values = list(values)
+        array = _ffi.new('uint32_t[]', values or 1)
+        raw_section = _lib.crab_file_add_trie(self._raw, array, len(values), leaf_bits, mid_bits, schema.encode('ascii'), purpose)
+        if raw_section == _ffi.NULL:
+            self.raise_error()
+        return CrabSection(self, raw_section)
+
+    def add_intervals(self, intervals, schema=CRAB_SCHEMA, purpose=None):
+        ''' Add an interval map section.
+
+            `intervals` is a sequence of `(first, last, value)`, inclusive,
+            in any order but not overlapping. Touching intervals with the
+            same value are merged. Use `CrabSection.intervals()` to read
+            it back.
+        '''
+        if purpose is None:
+            purpose = CrabPurpose.Intervals
+        intervals = list(intervals)
+        array = _ffi.new('CrabInterval[]', len(intervals) or 1)
+        for i, (first, last, value) in enumerate(intervals):
+            array[i].first = first
+            array[i].last = last
+            array[i].value = value
+        raw_section = _lib.crab_file_add_intervals(self._raw, array, len(intervals), schema.encode('ascii'), purpose)
+        if raw_section == _ffi.NULL:
+            self.raise_error()
+        return CrabSection(self, raw_section)
+
+    def add_keys(self, keys, schema=CRAB_SCHEMA, purpose=None):
+        ''' Add a section of 64-bit integer keys.
+        '''
+        if purpose is None:
+            purpose = CrabPurpose.Keys
+        keys = list(keys)
+        array = _ffi.new('uint64_t[]', keys or 1)
+        raw_section = _lib.crab_file_add_keys(self._raw, array, len(keys), schema.encode('ascii'), purpose)
+        if raw_section == _ffi.NULL:
+            self.raise_error()
+        return CrabSection(self, raw_section)
+
+    def add_hash(self, keys, key_type, schema=CRAB_SCHEMA, purpose=None):
+        ''' Add a minimal perfect hash index over a key section.
+
+            `keys` is a `CrabSection`, either a string index (from
+            `add_strings()`) or a section of 64-bit keys (from
+            `add_keys()`), as given by `key_type`, a `CrabKeyType`. Use
+            `CrabSection.hash()` to read it back.
+        '''
+        if purpose is None:
+            purpose = CrabPurpose.Hash
+        raw_section = _lib.crab_file_add_hash(self._raw, keys._raw, key_type, schema.encode('ascii'), purpose)
+        if raw_section == _ffi.NULL:
+            self.raise_error()
+        return CrabSection(self, raw_section)
+
+    def add_filter(self, keys, key_type, bits_per_key=0, schema=CRAB_SCHEMA, purpose=None):
+        ''' Add a blocked Bloom filter over a key section, as for
+            `add_hash()`, using about `bits_per_key` bits per key (0 for
+            the default). Use `CrabSection.filter()` to read it back.
+        '''
+        if purpose is None:
+            purpose = CrabPurpose.Filter
+        raw_section = _lib.crab_file_add_filter(self._raw, keys._raw, key_type, bits_per_key, schema.encode('ascii'), purpose)
+        if raw_section == _ffi.NULL:
+            self.raise_error()
+        return CrabSection(self, raw_section)
+
+    def add_bitmap(self, values, schema=CRAB_SCHEMA, purpose=None):
+        ''' Add a compressed set of 32-bit integers, in any order.
+        '''
+        if purpose is None:
+            purpose = CrabPurpose.Bitmap
+        values = list(values)
+        array = _ffi.new('uint32_t[]', values or 1)
+        raw_section = _lib.crab_file_add_bitmap(self._raw, array, len(values), schema.encode('ascii'), purpose)
+        if raw_section == _ffi.NULL:
+            self.raise_error()
+        return CrabSection(self, raw_section)
+
+    def add_bitmap_bytes(self, data, schema=CRAB_SCHEMA, purpose=None):
+        ''' Add a bitmap of the indices of the nonzero bytes of `data`.
+        '''
+        if purpose is None:
+            purpose = CrabPurpose.Bitmap
+        raw_section = _lib.crab_file_add_bitmap_bytes(self._raw, bytes(data), len(data), schema.encode('ascii'), purpose)
+        if raw_section == _ffi.NULL:
+            self.raise_error()
+        return CrabSection(self, raw_section)
+
+    def add_bitmap_op(self, a, b, op, schema=CRAB_SCHEMA, purpose=None):
+        ''' Add a bitmap of `a op b`, where `a` and `b` are `CrabBitmap`s
+            (possibly from other files) and `op` is a `CrabBitmapOp`.
+        '''
+        if purpose is None:
+            purpose = CrabPurpose.Bitmap
+        raw_section = _lib.crab_file_add_bitmap_op(self._raw, a._raw, b._raw, op, schema.encode('ascii'), purpose)
+        if raw_section == _ffi.NULL:
+            self.raise_error()
+        return CrabSection(self, raw_section)
+
     def add_section(self):
         ''' Add a section to the file.
         '''
@@ -191,8 +542,120 @@ class CrabSection:
         '''
         sz = _lib.crab_section_data_size(self._raw)
         ptr = _lib.crab_section_data(self._raw)
+        if ptr == _ffi.NULL and sz:
+            self.raise_error()
         return _ffi.buffer(ptr, sz)
 
+    def verify(self):
+        ''' Check this section against the file's checksum for it, if
+            that hasn't been done yet. `data()` does this anyway.
+        '''
+        if not _lib.crab_section_verify(self._raw):
+            self.raise_error()
+
+    def set_alignment(self, alignment):
+        ''' Make this section start on a multiple of `alignment` bytes
+            whenever the file is saved.
+
+            This is not stored in the file itself.
+        '''
+        if not _lib.crab_section_set_alignment(self._raw, alignment):
+            self.raise_error()
+
+    def file_offset(self):
+        ''' Return where this section's data is in the file as last opened.
+
+            Raises for sections that were added or given new data since.
+        '''
+        rv = _ffi.new('uint64_t *')
+        if not _lib.crab_section_file_offset(self._raw, rv):
+            self.raise_error()
+        return rv[0]
+
+    def read_ints(self, width, start=0, count=None):
+        ''' Return a list of the unsigned integers of `width` bytes (2, 4,
+            or 8) in this section, in the file's byte order, starting with
+            integer `start`.
+        '''
+        if count is None:
+            count = max(_lib.crab_section_data_size(self._raw) // width - start, 0)
+        out = _ffi.new('uint%d_t[]' % (width * 8 if width in (2, 4, 8) else 8), count or 1)
+        if not _lib.crab_section_read_ints(self._raw, width, start, count, out):
+            self.raise_error()
+        return list(out[0:count])
+
+    def swap_bytes(self, width):
+        ''' Reverse the bytes of every integer of `width` bytes (2, 4, or
+            8) in this section, such as when changing the file's byte
+            order.
+        '''
+        if not _lib.crab_section_swap_bytes(self._raw, width):
+            self.raise_error()
+
+    def advise(self, advice):
+        ''' Tell the kernel how this section's data is going to be used.
+
+            `advice` is a `CrabAdvice`. This does nothing for data that
+            isn't mapped from the file.
+        '''
+        if not _lib.crab_section_advise(self._raw, advice):
+            self.raise_error()
+
+    def strings(self):
+        ''' View this section as a CFBS string index.
+        '''
+        return CrabStrings(self)
+
+    def dict(self):
+        ''' View this section as a dictionary-encoded column.
+        '''
+        return CrabDict(self)
+
+    def compressed(self):
+        ''' View this section as block-compressed data.
+        '''
+        return CrabCompressed(self)
+
+    def packed(self):
+        ''' View this section as bit-packed integers.
+        '''
+        return CrabPackedInts(self)
+
+    def for_ints(self):
+        ''' View this section as frame-of-reference integers.
+        '''
+        return CrabForInts(self)
+
+    def runs(self):
+        ''' View this section as run-length encoded integers.
+        '''
+        return CrabRuns(self)
+
+    def trie(self):
+        ''' View this section as a multi-stage lookup table.
+        '''
+        return CrabTrie(self)
+
+    def intervals(self):
+        ''' View this section as an interval map.
+        '''
+        return CrabIntervals(self)
+
+    def hash(self):
+        ''' View this section as a minimal perfect hash index.
+        '''
+        return CrabHash(self)
+
+    def filter(self):
+        ''' View this section as a Bloom filter.
+        '''
+        return CrabFilter(self)
+
+    def bitmap(self):
+        ''' View this section as a compressed bitmap.
+        '''
+        return CrabBitmap(self)
+
     def set_data(self, b, *, own=False, borrow=False):
         ''' Set the section's data directly.
 
@@ -239,3 +702,462 @@ class CrabSection:
             flags |= _lib.CRAB_SECTION_FLAG_BORROW
         if not _lib.crab_section_copy(self._raw, flags, other._raw):
             self.raise_error()
+
+
+class CrabStrings:
+    def __init__(self, section):
+        ''' <internal, call `CrabSection.strings` instead>
+
+            Like `CrabSection.data()`, this is invalidated by `.close()`
+            or `.save(reopen=True)`.
+        '''
+        self._section = section
+        self._raw = _ffi.new('CrabStringTable *')
+        if not _lib.crab_strings_open(section._raw, self._raw):
+            section.raise_error()
+
+    def __len__(self):
+        return _lib.crab_strings_count(self._raw)
+
+    def __getitem__(self, i):
+        ''' Get the string with ID `i`, as `bytes`.
+        '''
+        if not 0 <= i < len(self):
+            raise IndexError(i)
+        size = _ffi.new('size_t *')
+        ptr = _lib.crab_strings_get(self._raw, i, size)
+        if ptr == _ffi.NULL:
+            raise OSError(errno.EINVAL, 'corrupt string %d' % i)
+        return _ffi.unpack(ptr, size[0])
+
+    def find(self, s):
+        ''' Return the ID of a `bytes` or `str`, or None.
+        '''
+        if isinstance(s, str):
+            s = s.encode('utf-8')
+        rv = _ffi.new('uint32_t *')
+        if not _lib.crab_strings_find(self._raw, s, len(s), rv):
+            return None
+        return rv[0]
+
+
+class CrabDict:
+    def __init__(self, section):
+        ''' <internal, call `CrabSection.dict` instead>
+
+            Like `CrabSection.data()`, this is invalidated by `.close()`
+            or `.save(reopen=True)`.
+        '''
+        self._section = section
+        self._raw = _ffi.new('CrabDict *')
+        if not _lib.crab_dict_open(section._raw, self._raw):
+            section.raise_error()
+
+    def __len__(self):
+        return _lib.crab_dict_count(self._raw)
+
+    def values(self):
+        ''' Return the distinct values, as `bytes`, in order of code.
+        '''
+        return [self.value(i) for i in range(_lib.crab_dict_num_values(self._raw))]
+
+    def value(self, code):
+        ''' Return the value with the given code, as `bytes`.
+        '''
+        size = _ffi.new('size_t *')
+        ptr = _lib.crab_dict_value(self._raw, code, size)
+        if ptr == _ffi.NULL:
+            raise OSError(errno.EINVAL, 'corrupt code %d' % code)
+        return _ffi.unpack(ptr, size[0])
+
+    def __getitem__(self, row):
+        ''' Get the value of a row, as `bytes`.
+        '''
+        return self.value(self.code(row))
+
+    def code(self, row):
+        if not 0 <= row < len(self):
+            raise IndexError(row)
+        return _lib.crab_dict_code(self._raw, row)
+
+    def find(self, s):
+        ''' Return the code of a `bytes` or `str`, or None.
+        '''
+        if isinstance(s, str):
+            s = s.encode('utf-8')
+        rv = _ffi.new('uint32_t *')
+        if not _lib.crab_dict_find(self._raw, s, len(s), rv):
+            return None
+        return rv[0]
+
+    def codes(self, start=0, count=None):
+        ''' Return the codes of `count` rows starting at `start`.
+        '''
+        if count is None:
+            count = len(self) - start
+        out = _ffi.new('uint32_t[]', count or 1)
+        if count < 0 or not _lib.crab_dict_decode(self._raw, start, count, out):
+            raise IndexError(start + count)
+        return list(out[0:count])
+
+    def decode(self, start=0, count=None):
+        ''' Return the values of `count` rows starting at `start`.
+        '''
+        values = self.values()
+        return [values[code] for code in self.codes(start, count)]
+
+    def rows_where(self, s, start=0, count=None):
+        ''' Return the rows whose value is `s`, a `bytes` or `str`.
+        '''
+        if count is None:
+            count = len(self) - start
+        code = self.find(s)
+        if count < 0 or start + count > len(self):
+            raise IndexError(start + count)
+        if code is None:
+            return []
+        rows = _ffi.new('uint64_t[]', count or 1)
+        num_rows = _ffi.new('size_t *')
+        _lib.crab_dict_scan(self._raw, code, start, count, rows, num_rows)
+        return list(rows[0:num_rows[0]])
+
+
+class CrabPackedInts:
+    def __init__(self, section):
+        ''' <internal, call `CrabSection.packed` instead>
+
+            Like `CrabSection.data()`, this is invalidated by `.close()`
+            or `.save(reopen=True)`.
+        '''
+        self._section = section
+        self._raw = _ffi.new('CrabPackedInts *')
+        if not _lib.crab_packed_open(section._raw, self._raw):
+            section.raise_error()
+
+    def __len__(self):
+        return _lib.crab_packed_count(self._raw)
+
+    def bits(self):
+        ''' Number of bits used for each value.
+        '''
+        return _lib.crab_packed_bits(self._raw)
+
+    def __getitem__(self, i):
+        if not 0 <= i < len(self):
+            raise IndexError(i)
+        return _lib.crab_packed_get(self._raw, i)
+
+    def decode(self, start=0, count=None):
+        ''' Return `count` values starting at `start`, as a list.
+        '''
+        if count is None:
+            count = len(self) - start
+        out = _ffi.new('uint32_t[]', count or 1)
+        if count < 0 or not _lib.crab_packed_decode(self._raw, start, count, out):
+            raise IndexError(start + count)
+        return list(out[0:count])
+
+
+class CrabForInts:
+    def __init__(self, section):
+        ''' <internal, call `CrabSection.for_ints` instead>
+
+            Like `CrabSection.data()`, this is invalidated by `.close()`
+            or `.save(reopen=True)`.
+        '''
+        self._section = section
+        self._raw = _ffi.new('CrabForInts *')
+        if not _lib.crab_for_open(section._raw, self._raw):
+            section.raise_error()
+
+    def __len__(self):
+        return _lib.crab_for_count(self._raw)
+
+    def __getitem__(self, i):
+        if not 0 <= i < len(self):
+            raise IndexError(i)
+        return _lib.crab_for_get(self._raw, i)
+
+    def __iter__(self):
+        return self.iter_from(0)
+
+    def iter_from(self, start):
+        ''' Iterate over the values, starting at `start`, a block at a time.
+        '''
+        it = _ffi.new('CrabForIter *')
+        values = _ffi.new('const uint64_t **')
+        _lib.crab_for_iter_start(self._raw, it, start)
+        while True:
+            n = _lib.crab_for_iter_next(it, values)
+            if not n:
+                return
+            yield from values[0][0:n]
+
+    def decode_block(self, b):
+        ''' Return the values in block `b`, as a list.
+        '''
+        out = _ffi.new('uint64_t[]', _lib.CRAB_FOR_BLOCK_SIZE)
+        n = _lib.crab_for_decode_block(self._raw, b, out)
+        if not n:
+            raise IndexError(b)
+        return list(out[0:n])
+
+
+class CrabRuns:
+    def __init__(self, section):
+        ''' <internal, call `CrabSection.runs` instead>
+
+            Like `CrabSection.data()`, this is invalidated by `.close()`
+            or `.save(reopen=True)`.
+        '''
+        self._section = section
+        self._raw = _ffi.new('CrabRuns *')
+        if not _lib.crab_runs_open(section._raw, self._raw):
+            section.raise_error()
+
+    def __len__(self):
+        return _lib.crab_runs_count(self._raw)
+
+    def num_runs(self):
+        return _lib.crab_runs_num_runs(self._raw)
+
+    def __getitem__(self, i):
+        if not 0 <= i < len(self):
+            raise IndexError(i)
+        return _lib.crab_runs_get(self._raw, i)
+
+    def get_many(self, positions):
+        ''' Look up several positions at once, as a list.
+        '''
+        positions = list(positions)
+        n = len(self)
+        for i in positions:
+            if not 0 <= i < n:
+                raise IndexError(i)
+        array = _ffi.new('uint32_t[]', positions or 1)
+        out = _ffi.new('uint32_t[]', len(positions) or 1)
+        _lib.crab_runs_get_many(self._raw, array, len(positions), out)
+        return list(out[0:len(positions)])
+
+
+class CrabTrie:
+    def __init__(self, section):
+        ''' <internal, call `CrabSection.trie` instead>
+
+            Like `CrabSection.data()`, this is invalidated by `.close()`
+            or `.save(reopen=True)`.
+        '''
+        self._section = section
+        self._raw = _ffi.new('CrabTrie *')
+        if not _lib.crab_trie_open(section._raw, self._raw):
+            section.raise_error()
+
+    def __len__(self):
+        return _lib.crab_trie_count(self._raw)
+
+    def __getitem__(self, i):
+        if not 0 <= i < len(self):
+            raise IndexError(i)
+        return _lib.crab_trie_get(self._raw, i)
+
+
+class CrabIntervals:
+    def __init__(self, section):
+        ''' <internal, call `CrabSection.intervals` instead>
+
+            Like `CrabSection.data()`, this is invalidated by `.close()`
+            or `.save(reopen=True)`.
+        '''
+        self._section = section
+        self._raw = _ffi.new('CrabIntervals *')
+        if not _lib.crab_intervals_open(section._raw, self._raw):
+            section.raise_error()
+
+    def __len__(self):
+        ''' Number of intervals, after merging.
+        '''
+        return _lib.crab_intervals_count(self._raw)
+
+    def get(self, key, default=None):
+        value = _ffi.new('uint32_t *')
+        if not _lib.crab_intervals_get(self._raw, key, value):
+            return default
+        return value[0]
+
+    def get_many(self, keys, missing=0):
+        ''' Look up several keys at once, as a list.
+        '''
+        keys = list(keys)
+        array = _ffi.new('uint64_t[]', keys or 1)
+        out = _ffi.new('uint32_t[]', len(keys) or 1)
+        _lib.crab_intervals_get_many(self._raw, array, len(keys), missing, out)
+        return list(out[0:len(keys)])
+
+
+class CrabHash:
+    def __init__(self, section):
+        ''' <internal, call `CrabSection.hash` instead>
+
+            Like `CrabSection.data()`, this is invalidated by `.close()`
+            or `.save(reopen=True)`.
+        '''
+        self._section = section
+        self._raw = _ffi.new('CrabHash *')
+        if not _lib.crab_hash_open(section._raw, self._raw):
+            section.raise_error()
+
+    def key_type(self):
+        return CrabKeyType(_lib.crab_hash_key_type(self._raw))
+
+    def find(self, key):
+        ''' Return the row of a key (`bytes` or `str` for string keys,
+            `int` for 64-bit keys), or None.
+        '''
+        row = _ffi.new('uint32_t *')
+        if isinstance(key, int):
+            found = _lib.crab_hash_find_u64(self._raw, key, row)
+        else:
+            if isinstance(key, str):
+                key = key.encode('utf-8')
+            found = _lib.crab_hash_find_string(self._raw, key, len(key), row)
+        if not found:
+            return None
+        return row[0]
+
+
+class CrabFilter:
+    def __init__(self, section):
+        ''' <internal, call `CrabSection.filter` instead>
+
+            Like `CrabSection.data()`, this is invalidated by `.close()`
+            or `.save(reopen=True)`.
+        '''
+        self._section = section
+        self._raw = _ffi.new('CrabFilter *')
+        if not _lib.crab_filter_open(section._raw, self._raw):
+            section.raise_error()
+
+    def key_type(self):
+        return CrabKeyType(_lib.crab_filter_key_type(self._raw))
+
+    def __contains__(self, key):
+        ''' Whether a key (as for `CrabHash.find`) might be present.
+            False means it definitely isn't.
+        '''
+        if isinstance(key, int):
+            return _lib.crab_filter_check_u64(self._raw, key)
+        if isinstance(key, str):
+            key = key.encode('utf-8')
+        return _lib.crab_filter_check_string(self._raw, key, len(key))
+
+    def check_many(self, keys):
+        ''' Check several keys of the same type at once, as a list.
+        '''
+        keys = list(keys)
+        out = _ffi.new('bool[]', len(keys) or 1)
+        if keys and isinstance(keys[0], int):
+            array = _ffi.new('uint64_t[]', keys)
+            _lib.crab_filter_check_many_u64(self._raw, array, len(keys), out)
+        else:
+            keys = [k.encode('utf-8') if isinstance(k, str) else k for k in keys]
+            keepalive = [_ffi.new('char[]', k) for k in keys]
+            strs = _ffi.new('char *[]', keepalive or 1)
+            lens = _ffi.new('size_t[]', [len(k) for k in keys] or 1)
+            _lib.crab_filter_check_many_strings(self._raw, strs, lens, len(keys), out)
+        return list(out[0:len(keys)])
+
+
+class CrabBitmap:
+    def __init__(self, section):
+        ''' <internal, call `CrabSection.bitmap` instead>
+
+            Like `CrabSection.data()`, this is invalidated by `.close()`
+            or `.save(reopen=True)`.
+        '''
+        self._section = section
+        self._raw = _ffi.new('CrabBitmap *')
+        if not _lib.crab_bitmap_open(section._raw, self._raw):
+            section.raise_error()
+
+    def __len__(self):
+        return _lib.crab_bitmap_count(self._raw)
+
+    def __contains__(self, x):
+        if not 0 <= x < 2**32:
+            return False
+        return _lib.crab_bitmap_contains(self._raw, x)
+
+    def __iter__(self):
+        return iter(self.tolist())
+
+    def tolist(self):
+        ''' Return all the members, in order.
+        '''
+        out = _ffi.new('uint32_t[]', len(self) or 1)
+        _lib.crab_bitmap_decode(self._raw, out)
+        return list(out[0:len(self)])
+
+    def rank(self, x):
+        ''' Return the number of members that are at most `x`.
+        '''
+        return _lib.crab_bitmap_rank(self._raw, x)
+
+    def select(self, i):
+        ''' Return the member with `i` smaller members.
+        '''
+        x = _ffi.new('uint32_t *')
+        if not 0 <= i < len(self) or not _lib.crab_bitmap_select(self._raw, i, x):
+            raise IndexError(i)
+        return x[0]
+
+
+class CrabCompressed:
+    def __init__(self, section):
+        ''' <internal, call `CrabSection.compressed` instead>
+
+            Like `CrabSection.data()`, this is invalidated by `.close()`
+            or `.save(reopen=True)`.
+        '''
+        self._section = section
+        self._raw = _ffi.new('CrabCompressed *')
+        if not _lib.crab_compressed_open(section._raw, self._raw):
+            section.raise_error()
+
+    def __len__(self):
+        ''' Size of the data before compression.
+        '''
+        return _lib.crab_compressed_size(self._raw)
+
+    def codec(self):
+        return CrabCodec(_lib.crab_compressed_codec(self._raw))
+
+    def read(self, offset, size, cache=None):
+        ''' Decompress `size` bytes starting at `offset`, as `bytes`.
+
+            Only the blocks they overlap are decompressed; pass a
+            `CrabBlockCache` to keep them for next time.
+        '''
+        if offset < 0 or size < 0 or offset + size > len(self):
+            raise IndexError(offset + size)
+        out = _ffi.new('char[]', size or 1)
+        raw_cache = cache._raw if cache is not None else _ffi.NULL
+        if not _lib.crab_compressed_read(self._raw, raw_cache, offset, size, out):
+            raise OSError(errno.EINVAL, 'corrupt compressed block')
+        return _ffi.unpack(out, size)
+
+    def tobytes(self):
+        return self.read(0, len(self))
+
+
+class CrabBlockCache:
+    def __init__(self, capacity):
+        ''' Keep up to `capacity` bytes of decompressed blocks, least
+            recently used first out, for `CrabCompressed.read`.
+
+            One cache may be shared by any number of sections, files and
+            threads, and may outlive them.
+        '''
+        raw = _lib.crab_block_cache_new(capacity)
+        if raw == _ffi.NULL:
+            raise MemoryError()
+        self._raw = _ffi.gc(raw, _lib.crab_block_cache_free)
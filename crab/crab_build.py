@@ -8,6 +8,15 @@ headers = '''
 fwd.h
 crab.h
 schema.h
+format.h
+packed.h
+runs.h
+trie.h
+keys.h
+bitmap.h
+dict.h
+compress.h
+checksum.h
 '''.split()
 
 ffibuilder.set_source('crab._crab',
@@ -1,8 +1,9 @@
 import argparse
+import errno
 import os
 import sys
 
-from .crab import CrabFile, CrabPurpose, CRAB_SCHEMA
+from .crab import CrabFile, CrabByteOrder, CrabCodec, CrabKeyType, CrabPurpose, CRAB_SCHEMA, native_byte_order
 from .table import Table
 
 
@@ -31,12 +32,46 @@ def u32(s):
         return v
     raise TypeError('int out of range')
 
+def swap_spec(s):
+    width, _, section = s.partition(':')
+    return int(width), u32(section)
+
 def read_blob(blob_filename):
     if not blob_filename:
         return b''
     with open(blob_filename, 'rb') as f:
         return f.read()
 
+# name -> (integer width, byteorder, purpose); a width of 0 stores the blob
+# as-is. The purpose also says what to build from the integers.
+ENCODINGS = {
+    'raw': (0, None, CrabPurpose.Raw),
+    'for-le32': (4, 'little', CrabPurpose.ForInts),
+    'for-be32': (4, 'big', CrabPurpose.ForInts),
+    'for-le64': (8, 'little', CrabPurpose.ForInts),
+    'for-be64': (8, 'big', CrabPurpose.ForInts),
+    'keys-le64': (8, 'little', CrabPurpose.Keys),
+    'keys-be64': (8, 'big', CrabPurpose.Keys),
+}
+
+CODECS = {
+    'none': CrabCodec['None'],
+    'lz': CrabCodec.Lz,
+}
+
+TRIE_INPUTS = {
+    'u8': (1, 'little'),
+    'le16': (2, 'little'),
+    'be16': (2, 'big'),
+    'le32': (4, 'little'),
+    'be32': (4, 'big'),
+}
+
+def decode_ints(data, width, byteorder):
+    if len(data) % width:
+        sys.exit('blob size is not a multiple of %d' % width)
+    return [int.from_bytes(data[i:i+width], byteorder) for i in range(0, len(data), width)]
+
 def make_parser():
     exe = os.path.basename(sys.executable)
     main_parser = argparse.ArgumentParser(description='''Perform simple CRAB tasks, for the trivial cases where it's not worth writing a program that uses the library.''',
@@ -48,13 +83,13 @@ def make_parser():
     new_parser.add_argument('filename', help='CRAB file to create', type=str)
 
     list_parser = subparsers.add_parser('list', help='List sections of a CRAB file.')
-    list_parser.add_argument('filename', help='CRAB file to tabulate', type=str)
+    list_parser.add_argument('filename', help='CRAB file to tabulate, or - for stdin', type=str)
 
     add_parser = subparsers.add_parser('add', help='Add a section to a CRAB file.')
     add_parser.add_argument('filename', type=str)
     # this is tricky, we want multi-blob at once with different schemas
     # thus, parse as "remainder" then handle it ourselves
-    add_parser.add_argument('remainder', nargs=argparse.REMAINDER, metavar='--schema=|--purpose=|blob')
+    add_parser.add_argument('remainder', nargs=argparse.REMAINDER, metavar='--schema=|--purpose=|--encode=|--compress[=]|blob')
 
     repurpose_parser = subparsers.add_parser('repurpose', help='Assign schema and purpose to a section to a CRAB file.')
     repurpose_parser.add_argument('filename', type=str)
@@ -72,24 +107,111 @@ def make_parser():
     wipe_parser.add_argument('section', type=u32)
 
     dump_parser = subparsers.add_parser('dump', help='Get contents of a section of a CRAB file.')
-    dump_parser.add_argument('filename', type=str)
+    dump_parser.add_argument('filename', help='CRAB file, or - for stdin', type=str)
     dump_parser.add_argument('section', type=u32)
     dump_parser.add_argument('outfile', type=str)
 
+    trie_parser = subparsers.add_parser('trie', help='Add a multi-stage lookup table built from a flat array.')
+    trie_parser.add_argument('filename', type=str)
+    trie_parser.add_argument('blob', type=str)
+    trie_parser.add_argument('--input', choices=list(TRIE_INPUTS), default='u8')
+    trie_parser.add_argument('--leaf-bits', type=u16, default=0)
+    trie_parser.add_argument('--mid-bits', type=u16, default=0)
+
+    intervals_parser = subparsers.add_parser('intervals', help='Add an interval map built from lines of text.',
+            description='Each line of the text is `<first>[..<last>] [;] <value>`.')
+    intervals_parser.add_argument('filename', type=str)
+    intervals_parser.add_argument('text', help='text file, or - for stdin', type=str)
+    intervals_parser.add_argument('--hex', action='store_true', help='numbers are hex, without 0x')
+
+    filter_parser = subparsers.add_parser('filter', help='Add a Bloom filter over a key section.')
+    filter_parser.add_argument('filename', type=str)
+    filter_parser.add_argument('section', help='key section number', type=u32)
+    filter_parser.add_argument('--key-type', choices=['string', 'u64'])
+    filter_parser.add_argument('--bits-per-key', type=u16, default=0)
+
+    compact_parser = subparsers.add_parser('compact', help='Reclaim space left behind by appending saves.')
+    compact_parser.add_argument('filename', type=str)
+    compact_parser.add_argument('--align', choices=['page', 'hugepage'])
+    compact_parser.add_argument('--checksum', action='store_true', help='store a checksum of every section')
+    compact_parser.add_argument('--dedup', action='store_true', help='store sections with the same data only once')
+
+    verify_parser = subparsers.add_parser('verify', help='Check every section of a CRAB file against its checksums.')
+    verify_parser.add_argument('filename', help='CRAB file, or - for stdin', type=str)
+
+    byteorder_parser = subparsers.add_parser('byteorder', help="Show or change the byte order of a CRAB file's data.",
+            description="With no order, print the file's; otherwise convert it, reversing each integer in the given sections.")
+    byteorder_parser.add_argument('filename', help='CRAB file, or - for stdin', type=str)
+    byteorder_parser.add_argument('order', nargs='?', choices=['big', 'little', 'native'])
+    byteorder_parser.add_argument('--swap', metavar='WIDTH:SECTION', type=swap_spec, action='append', default=[],
+            help='section of integers of WIDTH bytes to convert')
+
     return main_parser
 
 def cmd_new(filename):
     with CrabFile(filename, new=True) as c:
         c.save(reopen=False)
 
+def find_padding(c):
+    # Unused bytes just before each section - either alignment padding, or
+    # dead space left behind by appending saves - and in the whole file.
+    # Also, which earlier section each shares its data with, if any, as
+    # deduplicating saves do.
+    file_size, end, moved_table_size = c.layout()
+    # a moved section table is the last thing in the file
+    file_size -= moved_table_size
+    padding = [0] * c.num_sections()
+    shared = [None] * c.num_sections()
+    extents = []
+    for i in range(c.num_sections()):
+        s = c.section(i)
+        size = len(s.data())
+        if size:
+            extents.append((s.file_offset(), i, size))
+    extents.sort()
+    unused = 0
+    prev = None
+    for offset, i, size in extents:
+        if prev is not None and prev[0] == offset and prev[2] == size:
+            shared[i] = prev[1] if shared[prev[1]] is None else shared[prev[1]]
+            prev = (offset, i, size)
+            continue
+        prev = (offset, i, size)
+        if offset > end:
+            padding[i] = offset - end
+            unused += offset - end
+        end = max(end, offset + size)
+    unused += max(0, file_size - end)
+    return padding, shared, unused
+
+def open_input(filename):
+    if filename == '-':
+        return CrabFile(sys.stdin.buffer.fileno(), lazy=True)
+    return CrabFile(filename, lazy=True)
+
+def compression_ratio(s):
+    # how much a builtin compressed section saves, as raw / stored
+    if s.schema() != CRAB_SCHEMA or s.purpose() != CrabPurpose.Compressed:
+        return ''
+    try:
+        raw = len(s.compressed())
+    except OSError:
+        return '?'
+    stored = len(s.data())
+    return '%.2f' % (raw / stored if stored else 0.0)
+
 def cmd_list(filename):
-    with CrabFile(filename) as c:
+    with open_input(filename) as c:
+        padding, shared, unused = find_padding(c)
         t = Table()
         while t.phase():
             t.emit('#')
             t.emit('Schema')
             t.emit('P')
             t.emit('sz')
+            t.emit('pad')
+            t.emit('ratio')
+            t.emit('same as')
             t.end_row()
             t.divider_row()
 
@@ -100,12 +222,19 @@ def cmd_list(filename):
                 t.emit(s.schema())
                 t.emit(s.purpose())
                 t.emit(len(s.data()))
+                t.emit(padding[i])
+                t.emit(compression_ratio(s))
+                t.emit('' if shared[i] is None else shared[i])
                 t.end_row()
+        file_size = c.layout()[0]
+        print('%d of %d bytes unused (%.1f%%)' % (unused, file_size, 100.0 * unused / file_size if file_size else 0.0))
 
 def cmd_add(filename, remainder):
     # parse the "mixed" remainder
     schema = CRAB_SCHEMA
     purpose = CrabPurpose.Raw
+    encoding = ENCODINGS['raw']
+    codec = CODECS['none']
 
     blobs = []
     for a in remainder:
@@ -116,13 +245,39 @@ def cmd_add(filename, remainder):
         if a.startswith('--purpose='):
             purpose = u16(a[len('--purpose='):])
             continue
-        blobs.append((schema, purpose, a))
+        if a.startswith('--encode='):
+            try:
+                encoding = ENCODINGS[a[len('--encode='):]]
+            except KeyError:
+                sys.exit('unknown encoding: %s' % a)
+            # only guess the purpose for the builtin schema
+            if schema == CRAB_SCHEMA:
+                purpose = encoding[2]
+            continue
+        if a == '--compress' or a.startswith('--compress='):
+            try:
+                codec = CODECS[a[len('--compress='):]] if '=' in a else CrabCodec.Lz
+            except KeyError:
+                sys.exit('unknown codec: %s' % a)
+            if schema == CRAB_SCHEMA:
+                purpose = CrabPurpose.Compressed if codec else encoding[2]
+            continue
+        blobs.append((schema, purpose, encoding, codec, a))
     if not blobs:
         sys.exit('no blobs added!')
 
     keepalive = []
     with CrabFile(filename) as c:
-        for schema, purpose, blob in blobs:
+        for schema, purpose, (width, byteorder, kind), codec, blob in blobs:
+            if kind == CrabPurpose.Keys:
+                c.add_keys(decode_ints(read_blob(blob), width, byteorder), schema, purpose)
+                continue
+            if width:
+                c.add_for(decode_ints(read_blob(blob), width, byteorder), schema, purpose)
+                continue
+            if codec:
+                c.add_compressed(read_blob(blob), codec, 0, schema, purpose)
+                continue
             s = c.add_section()
             s.set_schema_and_purpose(schema, purpose)
             data = read_blob(blob)
@@ -151,12 +306,101 @@ def cmd_wipe(filename, section):
         c.save(reopen=False)
 
 def cmd_dump(filename, section, outfile):
-    with CrabFile(filename) as c, \
+    with open_input(filename) as c, \
             open(outfile, 'wb') as out:
         s = c.section(section)
         data = s.data()
         out.write(data)
 
+def cmd_trie(filename, blob, input, leaf_bits, mid_bits):
+    values = decode_ints(read_blob(blob), *TRIE_INPUTS[input])
+    with CrabFile(filename) as c:
+        c.add_trie(values, leaf_bits=leaf_bits, mid_bits=mid_bits)
+        c.save(reopen=False)
+
+def parse_interval(line, base):
+    ''' Parse `<first>[..<last>] [;] <value>`, ignoring `#` comments.
+
+        Returns None for a blank line.
+    '''
+    line = line.split('#', 1)[0].strip()
+    if not line:
+        return None
+    keys, value = line.replace(';', ' ').split()
+    first, _, last = keys.partition('..')
+    first = int(first, base)
+    last = int(last, base) if last else first
+    return (first, last, int(value, base))
+
+def cmd_intervals(filename, text, hex):
+    base = 16 if hex else 0
+    f = sys.stdin if text == '-' else open(text)
+    with f:
+        intervals = []
+        for i, line in enumerate(f, 1):
+            try:
+                interval = parse_interval(line, base)
+            except ValueError:
+                sys.exit('%s:%d: bad interval' % (text, i))
+            if interval is not None:
+                intervals.append(interval)
+    with CrabFile(filename) as c:
+        c.add_intervals(intervals)
+        c.save(reopen=False)
+
+def cmd_filter(filename, section, key_type, bits_per_key):
+    with CrabFile(filename) as c:
+        keys = c.section(section)
+        if key_type is not None:
+            key_type = CrabKeyType.String if key_type == 'string' else CrabKeyType.U64
+        # only guess the key type for the builtin schema
+        elif keys.schema() == CRAB_SCHEMA and keys.purpose() == CrabPurpose.Strings:
+            key_type = CrabKeyType.String
+        elif keys.schema() == CRAB_SCHEMA and keys.purpose() == CrabPurpose.Keys:
+            key_type = CrabKeyType.U64
+        else:
+            sys.exit("crab filter: can't guess the key type; use --key-type=")
+        c.add_filter(keys, key_type, bits_per_key)
+        c.save(reopen=False)
+
+def cmd_compact(filename, align, checksum, dedup):
+    # A normal save only writes what the section table points to.
+    with CrabFile(filename, lazy=True) as c:
+        c.save(reopen=False, align_page=align == 'page', align_hugepage=align == 'hugepage',
+                checksum=checksum, dedup=dedup)
+
+def cmd_verify(filename):
+    with open_input(filename) as c:
+        try:
+            c.verify()
+        except OSError as e:
+            if e.errno != errno.EBADMSG:
+                sys.exit('%s: %s' % (filename, e))
+            for i in range(c.num_sections()):
+                try:
+                    c.section(i).verify()
+                except OSError:
+                    print('%s: section %d: bad checksum' % (filename, i))
+            sys.exit(1)
+        print('%s: %d sections OK' % (filename, c.num_sections()))
+
+def cmd_byteorder(filename, order, swap):
+    if order is None:
+        if swap:
+            sys.exit('crab byteorder: --swap needs an order')
+        with open_input(filename) as c:
+            print(c.byte_order().name.lower())
+        return
+    order = native_byte_order() if order == 'native' else CrabByteOrder[order.title()]
+    with CrabFile(filename, lazy=True) as c:
+        # only convert if the order really changes, so this can be rerun
+        if c.byte_order() == order:
+            return
+        for width, section in swap:
+            c.section(section).swap_bytes(width)
+        c.set_byte_order(order)
+        c.save(reopen=False)
+
 def main():
     main_parser = make_parser()
     ns = main_parser.parse_args()
@@ -1,6 +1,11 @@
-from crab.crab import CrabFile, CrabPurpose, CRAB_SCHEMA
+from crab.crab import CrabFile, CrabAdvice, CrabBitmapOp, CrabBlockCache, CrabByteOrder, CrabCodec, CrabKeyType, CrabPurpose, CRAB_SCHEMA, crc32c, native_byte_order
 
+import errno
 import gc
+import os
+import shutil
+import struct
+import sys
 import unittest
 
 
@@ -173,3 +178,842 @@ class TestCrabFile(unittest.TestCase):
         c.save(reopen=False)
         c.close()
         self.assertContentsEqual('tmp/hello.crab', 'test-data/hello.crab')
+
+    def test_lazy(self):
+        shutil.copyfile('test-data/hello.crab', 'tmp/lazy.crab')
+        with CrabFile('test-data/hello.crab') as c:
+            expected = [nspd_tuple(c.section(i)) for i in range(c.num_sections())]
+
+        c = CrabFile('tmp/lazy.crab', lazy=True)
+        self.assertEqual(c.num_sections(), len(expected))
+        s4 = c.section(4)
+        self.assertEqual(nspd_tuple(s4), expected[4])
+        c.save(reopen=True)
+        assert s4 == c.section(4)
+        self.assertEqual([nspd_tuple(c.section(i)) for i in range(c.num_sections())], expected)
+        c.close()
+        self.assertContentsEqual('tmp/lazy.crab', 'test-data/hello.crab')
+
+    def test_advise(self):
+        with CrabFile('test-data/hello.crab') as c:
+            expected = [nspd_tuple(c.section(i)) for i in range(c.num_sections())]
+        for kwargs in [dict(populate=True, random=True), dict(lazy=True, sequential=True, hugepage=True)]:
+            with CrabFile('test-data/hello.crab', **kwargs) as c:
+                for advice in CrabAdvice:
+                    for i in range(c.num_sections()):
+                        c.section(i).advise(advice)
+                self.assertEqual([nspd_tuple(c.section(i)) for i in range(c.num_sections())], expected)
+        with self.assertRaises(OSError):
+            CrabFile('test-data/hello.crab', random=True, sequential=True)
+        with CrabFile('test-data/hello.crab', write=True) as c:
+            with self.assertRaises(OSError):
+                c.section(2).advise(CrabAdvice.Dontneed)
+
+    def test_align(self):
+        shutil.copyfile('test-data/hello.crab', 'tmp/align.crab')
+        with CrabFile('test-data/hello.crab') as c:
+            expected = [nspd_tuple(c.section(i)) for i in range(c.num_sections())]
+
+        with CrabFile('tmp/align.crab') as c:
+            c.section(4).set_alignment(1 << 16)
+            c.save(reopen=True, align_page=True)
+            offsets = [c.section(i).file_offset() for i in range(c.num_sections())]
+            self.assertEqual([nspd_tuple(c.section(i)) for i in range(c.num_sections())], expected)
+            # the default is only 8 bytes, but that's remembered per-section
+            c.save(reopen=True)
+            self.assertEqual(c.section(4).file_offset() % (1 << 16), 0)
+        for i, (n, s, p, d) in enumerate(expected):
+            if d:
+                self.assertEqual(offsets[i] % 4096, 0)
+        self.assertEqual(offsets[4] % (1 << 16), 0)
+
+        with CrabFile('tmp/align.crab') as c:
+            self.assertEqual([nspd_tuple(c.section(i)) for i in range(c.num_sections())], expected)
+            c.save(reopen=False)
+        self.assertContentsEqual('tmp/align.crab', 'test-data/hello.crab')
+
+    def test_open_fd_memory(self):
+        with CrabFile('test-data/hello.crab') as c:
+            expected = [nspd_tuple(c.section(i)) for i in range(c.num_sections())]
+        with open('test-data/hello.crab', 'rb') as f:
+            blob = f.read()
+
+        for lazy in [False, True]:
+            with open('test-data/hello.crab', 'rb') as f:
+                c = CrabFile(f.fileno(), lazy=lazy)
+            # the descriptor was duplicated, if it was needed at all
+            self.assertEqual([nspd_tuple(c.section(i)) for i in range(c.num_sections())], expected)
+            with self.assertRaises(OSError):
+                c.save(reopen=False)
+            c.close()
+
+            r, w = os.pipe()
+            os.write(w, blob)
+            os.close(w)
+            with CrabFile(r, lazy=lazy) as c:
+                self.assertEqual([nspd_tuple(c.section(i)) for i in range(c.num_sections())], expected)
+            os.close(r)
+
+            with CrabFile(blob, lazy=lazy) as c:
+                self.assertEqual([nspd_tuple(c.section(i)) for i in range(c.num_sections())], expected)
+                self.assertEqual(c.section(2).file_offset(), blob.index(b'Hello'))
+            with CrabFile(bytearray(blob), lazy=lazy) as c:
+                self.assertEqual([nspd_tuple(c.section(i)) for i in range(c.num_sections())], expected)
+
+        with self.assertRaises(OSError):
+            CrabFile(blob[:-1])
+        with self.assertRaises(OSError):
+            CrabFile(blob, write=True)
+
+    def test_strings(self):
+        words = ['apple', 'banana', '', 'cherry', 'banana', 'a\0b', 'x' * 1000]
+        c = CrabFile('tmp/strings.crab', new=True)
+        index = c.add_strings(words)
+        empty = c.add_strings([])
+        self.assertEqual(index.number(), 3)
+        self.assertEqual(c.section(2).purpose(), CrabPurpose.Supplementary)
+        self.assertEqual(index.purpose(), CrabPurpose.Strings)
+        c.save(reopen=True)
+
+        for c in [c, CrabFile('tmp/strings.crab', lazy=True)]:
+            t = c.section(3).strings()
+            self.assertEqual(len(t), len(words))
+            self.assertEqual([t[i] for i in range(len(t))], [w.encode() for w in words])
+            self.assertEqual([t.find(w) for w in words], [0, 1, 2, 3, 1, 5, 6])
+            self.assertIsNone(t.find('durian'))
+            self.assertIsNone(t.find('a'))
+            # duplicates are only stored once
+            self.assertEqual(len(c.section(2).data()), sum(len(w) + 1 for w in set(words)))
+            t = c.section(5).strings()
+            self.assertEqual(len(t), 0)
+            self.assertIsNone(t.find(''))
+            with self.assertRaises(OSError):
+                c.section(2).strings()
+            c.close()
+
+    def test_packed(self):
+        c = CrabFile('tmp/packed.crab', new=True)
+        columns = [[(i * 2654435761) % (1 << bits) for i in range(1000)] for bits in range(33)]
+        columns[0] = [0] * 1000
+        numbers = [c.add_packed(v).number() for v in columns]
+        empty = c.add_packed([]).number()
+        self.assertEqual(c.section(numbers[0]).purpose(), CrabPurpose.PackedInts)
+        c.save(reopen=True)
+
+        for c in [c, CrabFile('tmp/packed.crab', lazy=True)]:
+            for bits, (values, n) in enumerate(zip(columns, numbers)):
+                p = c.section(n).packed()
+                self.assertEqual(p.bits(), bits)
+                self.assertEqual(len(p), len(values))
+                self.assertEqual(p[0], values[0])
+                self.assertEqual(p[999], values[999])
+                self.assertEqual(p.decode(), values)
+                # unaligned at both ends, to cover the scalar edges
+                self.assertEqual(p.decode(3, 950), values[3:953])
+                self.assertEqual(p.decode(1000, 0), [])
+                with self.assertRaises(IndexError):
+                    p.decode(999, 2)
+            p = c.section(empty).packed()
+            self.assertEqual(len(p), 0)
+            self.assertEqual(p.decode(), [])
+            with self.assertRaises(OSError):
+                c.section(1).packed()
+            c.close()
+
+    def test_for(self):
+        offsets = [i * 37 + (i * i) % 5 for i in range(1000)]
+        clustered = [(1 << 40) + (i * 2654435761) % 1000 for i in range(300)]
+        wide = [(i * 0x9e3779b97f4a7c15) % (1 << 64) for i in range(200)]
+        short = [5, 3, 5]
+        c = CrabFile('tmp/for.crab', new=True)
+        numbers = [c.add_for(v).number() for v in [offsets, clustered, wide, short, []]]
+        self.assertEqual(c.section(numbers[0]).purpose(), CrabPurpose.ForInts)
+        # sorted data takes a few bits per value
+        self.assertLess(len(c.section(numbers[0]).data()), len(offsets) * 2)
+        c.save(reopen=True)
+
+        for c in [c, CrabFile('tmp/for.crab', lazy=True)]:
+            for values, n in zip([offsets, clustered, wide, short, []], numbers):
+                f = c.section(n).for_ints()
+                self.assertEqual(len(f), len(values))
+                self.assertEqual([f[i] for i in range(len(f))], values)
+                self.assertEqual(list(f), values)
+                self.assertEqual(list(f.iter_from(130)), values[130:])
+                if values:
+                    self.assertEqual(f.decode_block(0), values[:128])
+                with self.assertRaises(IndexError):
+                    f.decode_block((len(values) + 127) // 128)
+            with self.assertRaises(OSError):
+                c.section(1).for_ints()
+            c.close()
+
+    def test_runs(self):
+        columns = [
+            [7] * 1000,
+            [i // 37 % 3 for i in range(1000)],
+            [i * 2654435761 % 5 for i in range(100)],
+            [1, 2, 3],
+            [],
+        ]
+        c = CrabFile('tmp/runs.crab', new=True)
+        numbers = [c.add_runs(v).number() for v in columns]
+        self.assertEqual(c.section(numbers[0]).purpose(), CrabPurpose.Runs)
+        c.save(reopen=True)
+
+        for c in [c, CrabFile('tmp/runs.crab', lazy=True)]:
+            for values, n in zip(columns, numbers):
+                r = c.section(n).runs()
+                self.assertEqual(len(r), len(values))
+                self.assertEqual(r.num_runs(), sum(1 for i in range(len(values)) if not i or values[i] != values[i-1]))
+                self.assertEqual([r[i] for i in range(len(r))], values)
+                order = [i * 7919 % len(values) for i in range(len(values))]
+                self.assertEqual(r.get_many(order), [values[i] for i in order])
+            self.assertEqual(c.section(numbers[0]).runs().num_runs(), 1)
+            with self.assertRaises(OSError):
+                c.section(1).runs()
+            c.close()
+
+    def test_trie(self):
+        # something like a Unicode property: mostly 0, with a few blocks
+        # repeated and a few distinct
+        prop = [0] * 0x30000
+        for i in range(0x41, 0x5b):
+            prop[i] = prop[i + 0x20] = 1
+        for i in range(0x4e00, 0xa000):
+            prop[i] = 2
+        for i in range(0x10000, 0x10100):
+            prop[i] = i & 0xff
+        big = [i * 2654435761 % 70000 for i in range(1000)]
+        short = [7, 8, 9]
+        c = CrabFile('tmp/trie.crab', new=True)
+        cases = [
+            (prop, 0, 0),
+            (prop, 5, 0),
+            (prop, 4, 6),
+            (big, 3, 0),
+            (short, 0, 2),
+            ([], 0, 0),
+        ]
+        numbers = [c.add_trie(v, leaf_bits=l, mid_bits=m).number() for v, l, m in cases]
+        self.assertEqual(c.section(numbers[0]).purpose(), CrabPurpose.Trie)
+        # far smaller than one byte per value
+        self.assertLess(len(c.section(numbers[0]).data()), len(prop) // 20)
+        with self.assertRaises(OSError):
+            c.add_trie([1], leaf_bits=99)
+        c.save(reopen=True)
+
+        for c in [c, CrabFile('tmp/trie.crab', lazy=True)]:
+            for (values, _, _), n in zip(cases, numbers):
+                t = c.section(n).trie()
+                self.assertEqual(len(t), len(values))
+                self.assertEqual([t[i] for i in range(len(t))], values)
+            with self.assertRaises(OSError):
+                c.section(1).trie()
+            c.close()
+
+    def test_intervals(self):
+        intervals = [
+            (0x61, 0x7a, 8),
+            (0x0, 0x1f, 1),
+            (0x41, 0x5a, 6),
+            (0x5b, 0x5b, 7),
+            (0x7b, 0x7b, 7),
+            (0x7c, 0x7c, 7),
+            (0x7d, 0x7f, 9),
+            (1 << 40, (1 << 64) - 1, 10),
+        ]
+        many = [(i * 10, i * 10 + 4, i % 3) for i in range(1000)]
+        c = CrabFile('tmp/intervals.crab', new=True)
+        n0 = c.add_intervals(intervals).number()
+        n1 = c.add_intervals(many).number()
+        n2 = c.add_intervals([]).number()
+        self.assertEqual(c.section(n0).purpose(), CrabPurpose.Intervals)
+        with self.assertRaises(OSError):
+            c.add_intervals([(0, 10, 1), (10, 20, 2)])
+        with self.assertRaises(OSError):
+            c.add_intervals([(5, 4, 1)])
+        c.save(reopen=True)
+
+        def expect(intervals, key):
+            for first, last, value in intervals:
+                if first <= key <= last:
+                    return value
+            return None
+
+        for c in [c, CrabFile('tmp/intervals.crab', lazy=True)]:
+            m = c.section(n0).intervals()
+            # 0x7b and 0x7c are merged
+            self.assertEqual(len(m), len(intervals) - 1)
+            keys = list(range(0x90)) + [1 << 40, (1 << 64) - 1, (1 << 40) - 1]
+            self.assertEqual([m.get(k) for k in keys], [expect(intervals, k) for k in keys])
+            self.assertEqual(m.get_many(keys, 99), [m.get(k, 99) for k in keys])
+            m = c.section(n1).intervals()
+            self.assertEqual(len(m), 1000)
+            keys = [i * 7 for i in range(1500)]
+            self.assertEqual(m.get_many(keys, 99), [(k // 10) % 3 if k % 10 < 5 and k < 10000 else 99 for k in keys])
+            m = c.section(n2).intervals()
+            self.assertEqual(len(m), 0)
+            self.assertIsNone(m.get(0))
+            self.assertEqual(m.get_many([0, 1], 5), [5, 5])
+            with self.assertRaises(OSError):
+                c.section(1).intervals()
+            c.close()
+
+    def test_hash(self):
+        words = ['word%d' % i for i in range(3000)] + ['', 'a\0b']
+        numbers = [i * 0x9e3779b97f4a7c15 % (1 << 64) for i in range(5000)]
+        c = CrabFile('tmp/hash.crab', new=True)
+        strings = c.add_strings(words)
+        keys = c.add_keys(numbers)
+        sh = c.add_hash(strings, CrabKeyType.String).number()
+        kh = c.add_hash(keys, CrabKeyType.U64).number()
+        one = c.add_hash(c.add_keys([42]), CrabKeyType.U64).number()
+        empty = c.add_hash(c.add_keys([]), CrabKeyType.U64).number()
+        self.assertEqual(c.section(sh).purpose(), CrabPurpose.Hash)
+        # a little over 5 bytes per key
+        self.assertLess(len(c.section(kh).data()), 6 * len(numbers))
+        with self.assertRaises(OSError):
+            c.add_hash(c.add_keys([1, 2, 1]), CrabKeyType.U64)
+        with self.assertRaises(OSError):
+            c.add_hash(c.add_strings(['x', 'y', 'x']), CrabKeyType.String)
+        with self.assertRaises(OSError):
+            c.add_hash(keys, CrabKeyType.String)
+        c.save(reopen=True)
+
+        for c in [c, CrabFile('tmp/hash.crab', lazy=True)]:
+            h = c.section(sh).hash()
+            self.assertEqual(h.key_type(), CrabKeyType.String)
+            self.assertEqual([h.find(w) for w in words], list(range(len(words))))
+            self.assertIsNone(h.find('word3000'))
+            self.assertIsNone(h.find('a'))
+            self.assertIsNone(h.find(1))
+            h = c.section(kh).hash()
+            self.assertEqual([h.find(k) for k in numbers], list(range(len(numbers))))
+            self.assertIsNone(h.find(12345))
+            self.assertIsNone(h.find('word1'))
+            self.assertEqual(c.section(one).hash().find(42), 0)
+            self.assertIsNone(c.section(one).hash().find(43))
+            self.assertIsNone(c.section(empty).hash().find(0))
+            with self.assertRaises(OSError):
+                c.section(1).hash()
+            c.close()
+
+    def test_filter(self):
+        words = ['word%d' % i for i in range(3000)] + ['', 'a\0b']
+        numbers = [i * 0x9e3779b97f4a7c15 % (1 << 64) for i in range(5000)]
+        others = [i * 0x9e3779b97f4a7c15 % (1 << 64) for i in range(5000, 25000)]
+        c = CrabFile('tmp/filter.crab', new=True)
+        pad = c.add_section()
+        pad.set_data(b'x')
+        pad = pad.number()
+        strings = c.add_strings(words)
+        keys = c.add_keys(numbers)
+        sf = c.add_filter(strings, CrabKeyType.String).number()
+        kf = c.add_filter(keys, CrabKeyType.U64, bits_per_key=8).number()
+        empty = c.add_filter(c.add_keys([]), CrabKeyType.U64).number()
+        self.assertEqual(c.section(sf).purpose(), CrabPurpose.Filter)
+        # 32-byte blocks, after a 32-byte header
+        self.assertEqual(len(c.section(kf).data()), 32 + 157 * 32)
+        with self.assertRaises(OSError):
+            c.add_filter(keys, 3)
+        c.save(reopen=True)
+
+        for c in [c, CrabFile('tmp/filter.crab', lazy=True)]:
+            f = c.section(sf).filter()
+            self.assertEqual(f.key_type(), CrabKeyType.String)
+            self.assertTrue(all(w in f for w in words))
+            self.assertEqual(f.check_many(words), [True] * len(words))
+            misses = ['other%d' % i for i in range(20000)]
+            positives = f.check_many(misses)
+            self.assertEqual(positives, [m in f for m in misses])
+            self.assertLess(sum(positives), 20000 // 200)
+            self.assertNotIn(1, f)
+            f = c.section(kf).filter()
+            self.assertEqual(f.key_type(), CrabKeyType.U64)
+            self.assertEqual(f.check_many(numbers), [True] * len(numbers))
+            positives = f.check_many(others)
+            self.assertEqual(positives, [k in f for k in others])
+            # 8 bits per key is a few percent
+            self.assertLess(sum(positives), 20000 // 20)
+            self.assertNotIn('word1', f)
+            self.assertEqual(f.check_many(['word1']), [False])
+            f = c.section(empty).filter()
+            self.assertNotIn(0, f)
+            self.assertEqual(f.check_many([]), [])
+            with self.assertRaises(OSError):
+                c.section(1).filter()
+            c.close()
+
+        # saves that never asked for it keep the alignment
+        for size in [8, 16, 24]:
+            c = CrabFile('tmp/filter.crab')
+            c.section(pad).set_data(b'x' * size)
+            c.save(reopen=True)
+            self.assertEqual(c.section(sf).file_offset() % 32, 0)
+            self.assertEqual(c.section(kf).file_offset() % 32, 0)
+            self.assertTrue(all(w in c.section(sf).filter() for w in words))
+            c.close()
+
+    def test_bitmap(self):
+        # a sparse array, a dense bitmap, and long runs
+        sparse = [i * 7919 for i in range(3000)]
+        dense = [0x30000 + i for i in range(0, 65536, 3)]
+        runs = [0x50000 + i for i in range(40000)] + [0x60000 + i for i in range(100, 200)] + [2**32 - 1]
+        odd = [i for i in range(0, 0x70000, 5)]
+        members = sorted(set(sparse + dense + runs))
+        flags = bytearray(0x70000)
+        for x in odd:
+            flags[x] = 1
+        c = CrabFile('tmp/bitmap.crab', new=True)
+        a = c.add_bitmap(reversed(sparse + dense + runs + dense)).number()
+        b = c.add_bitmap_bytes(flags).number()
+        empty = c.add_bitmap([]).number()
+        self.assertEqual(c.section(a).purpose(), CrabPurpose.Bitmap)
+        # well under a byte per member, since the runs take a few bytes
+        self.assertLess(len(c.section(a).data()), len(members) // 3)
+        ops = [CrabBitmapOp.And, CrabBitmapOp.Or, CrabBitmapOp.Andnot]
+        ops = [c.add_bitmap_op(c.section(a).bitmap(), c.section(b).bitmap(), op).number() for op in ops]
+        with self.assertRaises(OSError):
+            c.add_bitmap_op(c.section(a).bitmap(), c.section(b).bitmap(), 0)
+        c.save(reopen=True)
+
+        for c in [c, CrabFile('tmp/bitmap.crab', lazy=True)]:
+            bm = c.section(a).bitmap()
+            self.assertEqual(len(bm), len(members))
+            self.assertEqual(bm.tolist(), members)
+            for x in [0, 1, 7919, 7920, 0x30000, 0x30001, 0x30003, 0x4ffff, 0x50000, 0x59c3f, 0x59c40, 0x60063, 0x60064, 0x600c7, 0x600c8, 2**32 - 2, 2**32 - 1]:
+                self.assertEqual(x in bm, x in members, x)
+                self.assertEqual(bm.rank(x), sum(1 for m in members if m <= x), x)
+            for i in [0, 1, 2999, 3000, 3001, 20000, len(members) - 101, len(members) - 1]:
+                self.assertEqual(bm.select(i), members[i])
+            with self.assertRaises(IndexError):
+                bm.select(len(members))
+            self.assertEqual(c.section(b).bitmap().tolist(), odd)
+            self.assertEqual(len(c.section(empty).bitmap()), 0)
+            self.assertNotIn(0, c.section(empty).bitmap())
+            self.assertEqual(c.section(empty).bitmap().rank(5), 0)
+            expected = [
+                sorted(set(members) & set(odd)),
+                sorted(set(members) | set(odd)),
+                sorted(set(members) - set(odd)),
+            ]
+            for op, e in zip(ops, expected):
+                self.assertEqual(c.section(op).bitmap().tolist(), e)
+            with self.assertRaises(OSError):
+                c.section(1).bitmap()
+            c.close()
+
+    def test_dict(self):
+        scripts = ['Latin', 'Greek', 'Cyrillic', 'Han', 'Common', b'\0']
+        rows = [scripts[(i * i) % 7 % len(scripts)] for i in range(2000)]
+        expected = [x.encode('utf-8') if isinstance(x, str) else x for x in rows]
+        c = CrabFile('tmp/dict.crab', new=True)
+        d = c.add_dict(rows)
+        one = c.add_dict(['same'] * 10).number()
+        empty = c.add_dict([]).number()
+        d = d.number()
+        self.assertEqual(c.section(d).purpose(), CrabPurpose.Dict)
+        self.assertEqual(c.section(d - 1).purpose(), CrabPurpose.Strings)
+        c.save(reopen=True)
+
+        for c in [c, CrabFile('tmp/dict.crab', lazy=True)]:
+            v = c.section(d).dict()
+            self.assertEqual(len(v), len(rows))
+            self.assertEqual(sorted(v.values()), sorted(set(expected)))
+            self.assertEqual(v[0], expected[0])
+            self.assertEqual(v.decode(), expected)
+            self.assertEqual(v.decode(100, 300), expected[100:400])
+            for s in scripts:
+                e = s.encode('utf-8') if isinstance(s, str) else s
+                self.assertEqual(v.rows_where(s), [i for i, x in enumerate(expected) if x == e])
+                self.assertEqual(v.rows_where(s, 5, 1000), [i for i, x in enumerate(expected) if x == e and 5 <= i < 1005])
+            self.assertEqual(v.rows_where('Arabic'), [])
+            self.assertEqual(v.find('Arabic'), None)
+            with self.assertRaises(IndexError):
+                v.codes(1999, 2)
+            with self.assertRaises(IndexError):
+                v.rows_where('Latin', 1999, 2)
+            v = c.section(one).dict()
+            self.assertEqual(v.decode(), [b'same'] * 10)
+            self.assertEqual(v.rows_where('same'), list(range(10)))
+            self.assertEqual(len(c.section(empty).dict()), 0)
+            with self.assertRaises(OSError):
+                c.section(1).dict()
+            c.close()
+
+    def test_compressed(self):
+        text = b''.join(b'%d: the quick brown fox\n' % (i * i % 1000) for i in range(20000))
+        noise = bytes((i * 2654435761 >> 13) & 0xff for i in range(10000))
+        c = CrabFile('tmp/compressed.crab', new=True)
+        big = c.add_compressed(text).number()
+        small = c.add_compressed(text[:50000] + noise, block_size=4096).number()
+        empty = c.add_compressed(b'').number()
+        self.assertLess(len(c.section(big).data()), len(text) // 3)
+        with self.assertRaises(OSError):
+            c.add_compressed(text, block_size=5000)
+        with self.assertRaises(OSError):
+            c.add_compressed(text, codec=99)
+        c.save(reopen=True)
+
+        cache = CrabBlockCache(4 << 16)
+        for c in [c, CrabFile('tmp/compressed.crab', lazy=True)]:
+            v = c.section(big).compressed()
+            self.assertEqual(len(v), len(text))
+            self.assertEqual(v.codec(), CrabCodec.Lz)
+            self.assertEqual(v.tobytes(), text)
+            for offset, size in [(0, 1), (65530, 20), (100000, 200000), (len(text) - 7, 7), (len(text), 0)]:
+                self.assertEqual(v.read(offset, size), text[offset:offset+size])
+                self.assertEqual(v.read(offset, size, cache), text[offset:offset+size])
+                self.assertEqual(v.read(offset, size, cache), text[offset:offset+size])
+            with self.assertRaises(IndexError):
+                v.read(len(text) - 1, 2)
+            v = c.section(small).compressed()
+            self.assertEqual(v.tobytes(), text[:50000] + noise)
+            self.assertEqual(v.read(49000, 3000, cache), (text[:50000] + noise)[49000:52000])
+            self.assertEqual(len(c.section(empty).compressed()), 0)
+            self.assertEqual(c.section(empty).compressed().tobytes(), b'')
+            with self.assertRaises(OSError):
+                c.section(1).compressed()
+            c.close()
+
+        # the cache outlives files, and never serves blocks of old data
+        upper = text.upper()
+        c = CrabFile('tmp/compressed.crab', new=True)
+        c.add_compressed(upper)
+        c.save(reopen=False)
+        c = CrabFile('tmp/compressed.crab', lazy=True)
+        v = c.section(big).compressed()
+        self.assertEqual(v.read(100000, 200000, cache), upper[100000:300000])
+        s = c.section(big)
+        other = c.add_compressed(text)
+        s.set_data(other.data()[:])
+        self.assertEqual(s.compressed().read(100000, 200000, cache), text[100000:300000])
+        c.close()
+
+        # a block count that only matches if it overflows
+        c = CrabFile('tmp/compressed.crab', new=True)
+        s = c.add_section()
+        s.set_data(struct.pack('>QII8x', 0xfffffffffffff001, 4096, 0))
+        with self.assertRaises(OSError):
+            s.compressed()
+        c.close()
+
+    def test_checksum(self):
+        self.assertEqual(crc32c(b'123456789'), 0xe3069283)
+        big = bytes(i * 7 & 0xff for i in range(5 << 20 | 12345))
+        self.assertEqual(crc32c(big[100001:], crc32c(big[:100001])), crc32c(big))
+        c = CrabFile('tmp/checksum.crab', new=True)
+        s = c.add_section()
+        s.set_data(b'hello')
+        a = s.number()
+        s = c.add_section()
+        s.set_data(big)
+        b = s.number()
+        c.save(reopen=True, checksum=True)
+        self.assertEqual(c.section(c.num_sections() - 1).purpose(), CrabPurpose.Checksums)
+        c.verify(num_threads=3)
+        c.close()
+
+        # once a file has checksums, every save keeps them up to date
+        c = CrabFile('tmp/checksum.crab', lazy=True)
+        c.section(a).set_data(b'goodbye')
+        c.add_section().set_data(b'new')
+        c.save(reopen=True, append=True)
+        c.close()
+        with CrabFile('tmp/checksum.crab', verify=True) as c:
+            self.assertEqual(c.section(a).data()[:], b'goodbye')
+            self.assertEqual(c.section(b).data()[:], big)
+            offset = c.section(b).file_offset()
+        with open('tmp/checksum.crab', 'rb') as f:
+            data = bytearray(f.read())
+        data[offset + 1234567] ^= 0x10
+        with open('tmp/checksum-bad.crab', 'wb') as f:
+            f.write(data)
+
+        for c in [CrabFile('tmp/checksum-bad.crab'), CrabFile('tmp/checksum-bad.crab', lazy=True)]:
+            self.assertEqual(c.section(a).data()[:], b'goodbye')
+            with self.assertRaises(OSError) as cm:
+                c.section(b).data()
+            self.assertEqual(cm.exception.errno, errno.EBADMSG)
+            with self.assertRaises(OSError):
+                c.verify()
+            with self.assertRaises(OSError):
+                c.section(b).verify()
+            c.section(a).verify()
+            c.close()
+        with self.assertRaises(OSError):
+            CrabFile('tmp/checksum-bad.crab', verify=True)
+        with CrabFile('test-data/hello.crab') as c:
+            with self.assertRaises(OSError) as cm:
+                c.verify()
+            self.assertEqual(cm.exception.errno, errno.ENOENT)
+
+        # a file with nowhere to save to is left alone
+        with open('test-data/hello.crab', 'rb') as f:
+            blob = f.read()
+        with CrabFile(blob) as c:
+            n = c.num_sections()
+            with self.assertRaises(OSError) as cm:
+                c.save(reopen=False, checksum=True)
+            self.assertEqual(cm.exception.errno, errno.EINVAL)
+            self.assertEqual(c.num_sections(), n)
+
+        # a damaged schema that no loaded section uses must not be looked at
+        c = CrabFile('tmp/checksum-schema.crab', new=True)
+        c.add_section().set_schema_and_purpose('bogus:whatever', 5)
+        c.save(reopen=True, checksum=True)
+        schema_offset = c.section(0).file_offset()
+        c.close()
+        with open('tmp/checksum-schema.crab', 'rb') as f:
+            data = bytearray(f.read())
+        num_sections, = struct.unpack_from('>I', data, 20)
+        # make the builtin schema ID 1 instead of 0
+        a, b = data[schema_offset + 8:schema_offset + 16], data[schema_offset + 16:schema_offset + 24]
+        data[schema_offset + 8:schema_offset + 16], data[schema_offset + 16:schema_offset + 24] = b, a
+        for i in range(num_sections):
+            schema, = struct.unpack_from('>H', data, 24 + 16 * i + 12)
+            struct.pack_into('>H', data, 24 + 16 * i + 12, 1 - schema)
+        # then point schema 0 past the end of the strings
+        struct.pack_into('>I', data, schema_offset + 8, 0xffffff00)
+        with open('tmp/checksum-schema.crab', 'wb') as f:
+            f.write(data)
+        with self.assertRaises(OSError) as cm:
+            CrabFile('tmp/checksum-schema.crab', lazy=True)
+        self.assertEqual(cm.exception.errno, errno.EBADMSG)
+
+    def test_dedup(self):
+        body = bytes(range(256)) * 40
+        c = CrabFile('tmp/dedup.crab', new=True)
+        numbers = []
+        for data in [body, b'other', body, body[:-1] + b'!', b'', b'', body]:
+            s = c.add_section()
+            s.set_data(data)
+            numbers.append(s.number())
+        a, other, b, near, e1, e2, d = numbers
+        c.section(d).set_alignment(4096)
+        c.section(b).copy_from(c.section(a), borrow=True)
+        c.save(reopen=True, dedup=True)
+        size = c.layout()[0]
+        # `a` and `b` share; `d` can't, since `a` isn't aligned enough
+        self.assertLess(size, 4 * len(body))
+
+        for c in [c, CrabFile('tmp/dedup.crab', lazy=True)]:
+            self.assertEqual(c.section(b).file_offset(), c.section(a).file_offset())
+            self.assertNotEqual(c.section(near).file_offset(), c.section(a).file_offset())
+            self.assertEqual(c.section(d).file_offset() % 4096, 0)
+            self.assertEqual(c.section(b).data()[:], body)
+            self.assertEqual(c.section(near).data()[:], body[:-1] + b'!')
+            self.assertEqual(c.section(d).data()[:], body)
+            self.assertEqual(len(c.section(e2).data()), 0)
+            c.close()
+
+        # appending only writes a new body if it's really new
+        c = CrabFile('tmp/dedup.crab', lazy=True)
+        s = c.add_section()
+        s.set_data(b'other')
+        f = s.number()
+        c.section(e1).set_data(body)
+        c.save(reopen=True, append=True, dedup=True)
+        # only for what the bigger section table covers
+        self.assertLess(c.layout()[0], size + 256)
+        self.assertEqual(c.section(f).file_offset(), c.section(other).file_offset())
+        self.assertEqual(c.section(e1).file_offset(), c.section(a).file_offset())
+        self.assertEqual(c.section(f).data()[:], b'other')
+        c.close()
+
+    def test_size64(self):
+        c = CrabFile('tmp/size64.crab', new=True)
+        s = c.add_section()
+        s.set_data(b'small')
+        small = s.number()
+        s = c.add_section()
+        s.set_data(b'the end.')
+        big = s.number()
+        c.save(reopen=False)
+        c.close()
+        with open('tmp/size64.crab', 'rb') as f:
+            header = f.read(24 + 16 * (big + 1))
+        # files without a big section keep the old format
+        self.assertEqual(struct.unpack_from('>I', header, 16)[0], 0)
+
+        # grow the last section past 4 GiB, sparsely
+        offset, = struct.unpack_from('>Q', header, 24 + 16 * big)
+        big_size = (1 << 32) + 8
+        with open('tmp/size64.crab', 'r+b') as f:
+            f.seek(offset)
+            f.write(b'\0' * 8)
+            f.seek(offset + big_size - 8)
+            f.write(b'the end.')
+            f.seek(8)
+            f.write(struct.pack('>QI', offset + big_size, 0x02))
+            f.seek(24 + 16 * big)
+            f.write(struct.pack('>QI', offset | 1 << 48, 8))
+
+        for c in [CrabFile('tmp/size64.crab'), CrabFile('tmp/size64.crab', lazy=True)]:
+            data = c.section(big).data()
+            self.assertEqual(len(data), big_size)
+            self.assertEqual(data[-8:], b'the end.')
+            self.assertEqual(c.section(big).file_offset(), offset)
+            self.assertEqual(c.section(small).data()[:], b'small')
+            c.close()
+
+        # appending leaves the big section where it is
+        c = CrabFile('tmp/size64.crab', lazy=True)
+        c.section(small).set_data(b'changed')
+        c.save(reopen=True, append=True)
+        self.assertEqual(c.section(big).file_offset(), offset)
+        self.assertEqual(len(c.section(big).data()), big_size)
+        self.assertEqual(c.section(small).data()[:], b'changed')
+        c.close()
+        with open('tmp/size64.crab', 'rb') as f:
+            header = f.read(40)
+            # the header that's in use is with the moved table
+            self.assertEqual(struct.unpack_from('>I', header, 16)[0], 0x08)
+            f.seek(struct.unpack_from('>Q', header, 24)[0] & ~(1 << 63))
+            self.assertEqual(struct.unpack_from('>I', f.read(24), 16)[0], 0x02)
+        os.remove('tmp/size64.crab')
+
+    def test_byte_order(self):
+        self.assertEqual(native_byte_order(), CrabByteOrder[sys.byteorder.title()])
+        ints = [1, 0x1234, 0xdeadbeef, 0xffffffff]
+        c = CrabFile('tmp/byteorder.crab', new=True)
+        self.assertEqual(c.byte_order(), CrabByteOrder.Big)
+        s = c.add_section()
+        s.set_data(b''.join(i.to_bytes(4, 'big') for i in ints))
+        n = s.number()
+        s = c.add_section()
+        s.set_data(b'odd')
+        odd = s.number()
+        packed = c.add_packed(ints).number()
+        self.assertEqual(c.section(n).read_ints(4), ints)
+        self.assertEqual(c.section(n).read_ints(2, 2, 2), [0, 0x1234])
+        c.save(reopen=True)
+
+        c.section(n).swap_bytes(4)
+        c.set_byte_order(CrabByteOrder.Little)
+        c.save(reopen=True)
+        for c in [c, CrabFile('tmp/byteorder.crab', lazy=True)]:
+            self.assertEqual(c.byte_order(), CrabByteOrder.Little)
+            self.assertEqual(c.section(n).data()[:], b''.join(i.to_bytes(4, 'little') for i in ints))
+            self.assertEqual(c.section(n).read_ints(4), ints)
+            self.assertEqual(c.section(n).read_ints(4, 3), [0xffffffff])
+            self.assertEqual(c.section(n).read_ints(8, 1, 0), [])
+            # the library's own formats don't change
+            self.assertEqual(c.section(packed).packed().decode(), ints)
+            with self.assertRaises(OSError):
+                c.section(n).read_ints(3)
+            with self.assertRaises(OSError):
+                c.section(n).read_ints(4, 3, 2)
+            with self.assertRaises(OSError):
+                c.section(odd).swap_bytes(2)
+            c.close()
+        with self.assertRaises(OSError):
+            CrabFile('tmp/byteorder.crab', new=True).set_byte_order(3)
+
+    def test_append(self):
+        shutil.copyfile('test-data/hello.crab', 'tmp/append.crab')
+        with CrabFile('test-data/hello.crab') as c:
+            expected = [nspd_tuple(c.section(i)) for i in range(c.num_sections())]
+        with open('test-data/hello.crab', 'rb') as f:
+            original = f.read()
+
+        c = CrabFile('tmp/append.crab', lazy=True)
+        s2 = c.section(2)
+        s2.set_data(b'Goodbye, World!\n')
+        expected[2] = (2, CRAB_SCHEMA, CrabPurpose.Raw, b'Goodbye, World!\n')
+        c.save(reopen=False, append=True)
+        self.assertEqual(nspd_tuple(s2), expected[2])
+        with open('tmp/append.crab', 'rb') as f:
+            appended = f.read()
+        # only the first 40 bytes changed, to point at the new table at the end
+        self.assertGreater(len(appended), len(original))
+        self.assertEqual(appended[40:len(original)], original[40:])
+        self.assertEqual(struct.unpack_from('>QII', appended, 8), (len(appended), 0x08, 1))
+        self.assertEqual(c.layout(), (len(appended), 40, 24 + 16 * len(expected)))
+        for c2 in [CrabFile('tmp/append.crab'), CrabFile('tmp/append.crab', lazy=True)]:
+            self.assertEqual([nspd_tuple(c2.section(i)) for i in range(c2.num_sections())], expected)
+            c2.close()
+
+        # the section table can grow, and the old one is left behind
+        s5 = c.add_section()
+        s5.set_data(b'appended')
+        expected.append((5, CRAB_SCHEMA, 0, b'appended'))
+        c.save(reopen=False, append=True)
+        c.close()
+        appended_size = os.path.getsize('tmp/append.crab')
+        self.assertGreater(appended_size, len(appended))
+
+        for c in [CrabFile('tmp/append.crab'), CrabFile('tmp/append.crab', lazy=True)]:
+            self.assertEqual([nspd_tuple(c.section(i)) for i in range(c.num_sections())], expected)
+            c.close()
+        with CrabFile('tmp/append.crab') as c:
+            c.save(reopen=False)
+        self.assertLess(os.path.getsize('tmp/append.crab'), appended_size)
+        with CrabFile('tmp/append.crab') as c:
+            self.assertEqual([nspd_tuple(c.section(i)) for i in range(c.num_sections())], expected)
+            self.assertEqual(c.layout()[1:], (24 + 16 * len(expected), 0))
+
+        # a bad pointer to the table is a format error, not a crash
+        for bad in [1 << 63 | len(appended), 1 << 63 | 44, len(appended) - 24 - 16 * 5]:
+            with open('tmp/append.crab', 'wb') as f:
+                f.write(appended[:24] + struct.pack('>Q', bad) + appended[32:])
+            for lazy in [False, True]:
+                with self.assertRaises(OSError):
+                    CrabFile('tmp/append.crab', lazy=lazy)
+
+    def test_schemas(self):
+        c = CrabFile('tmp/schemas.crab', new=True)
+        for i in range(300):
+            s = c.add_section()
+            s.set_schema_and_purpose('bogus:%d' % (i % 100), 5)
+        # each distinct URL is only added once
+        self.assertEqual(len(c.section(0).data()), 8 + 8 * 101)
+        for i in range(300):
+            self.assertEqual(c.section(2 + i).schema(), 'bogus:%d' % (i % 100))
+
+        s = c.add_section()
+        s.copy_from(c.section(3))
+        self.assertEqual(s.schema(), 'bogus:1')
+        self.assertEqual(s.purpose(), 5)
+        c.save(reopen=True)
+        self.assertEqual(c.section(301).schema(), 'bogus:99')
+        s = c.section(2)
+        s.set_schema_and_purpose('bogus:99', 6)
+        self.assertEqual(len(c.section(0).data()), 8 + 8 * 101)
+        self.assertEqual(s.schema(), 'bogus:99')
+        c.close()
+
+    def test_find_sections(self):
+        with CrabFile('test-data/hello.crab', lazy=True) as c:
+            self.assertEqual([s.number() for s in c.find_sections(CRAB_SCHEMA, CrabPurpose.Raw)], [2])
+            self.assertEqual([s.number() for s in c.find_sections('bogus:whatever', 5)], [4])
+            self.assertEqual(c.find_sections('bogus:whatever', 6), [])
+            self.assertEqual(c.find_sections('bogus:nonexistent', 5), [])
+
+        c = CrabFile('tmp/find.crab', new=True)
+        for i in range(100):
+            s = c.add_section()
+            s.set_schema_and_purpose('bogus:%d' % (i % 3), i % 5)
+        self.assertEqual([s.number() for s in c.find_sections('bogus:1', 2)],
+                [2 + i for i in range(100) if i % 3 == 1 and i % 5 == 2])
+        c.section(3).set_schema_and_purpose('bogus:1', 7)
+        self.assertEqual([s.number() for s in c.find_sections('bogus:1', 7)], [3])
+        c.close()
+
+    def test_add_sections(self):
+        c = CrabFile('tmp/add-many.crab', new=True)
+        first = c.add_sections(1000, 'bogus:many', 7)
+        self.assertEqual(len(first), 1000)
+        self.assertEqual(c.num_sections(), 1002)
+        for i, s in enumerate(first):
+            self.assertEqual(s, c.section(2 + i))
+            self.assertEqual(s.number(), 2 + i)
+            self.assertEqual(s.schema(), 'bogus:many')
+            self.assertEqual(s.purpose(), 7)
+        first[500].set_data(b'five hundred')
+        s = c.add_section()
+        self.assertEqual(s.number(), 1002)
+        self.assertEqual(len(c.find_sections('bogus:many', 7)), 1000)
+        c.save(reopen=True)
+        self.assertEqual(nspd_tuple(first[500]), (502, 'bogus:many', 7, b'five hundred'))
+        c.close()
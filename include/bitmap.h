@@ -0,0 +1,169 @@
+/*
+    CRAB - Compact Random-Access Binary
+    Copyright © 2018  Ben Longbons
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+#include "fwd.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+
+#pragma GCC visibility push(default)
+
+/*
+    Compressed sets of 32-bit integers, in the style of Roaring bitmaps.
+
+    The values are split by their high 16 bits into containers of up to
+    65536. Each container is stored however is smallest: a sorted array
+    of the low 16 bits, a plain 8 KiB bitmap, or a list of runs. Every
+    container also records how many members come before it, so rank and
+    select only have to look inside one.
+
+    Set operations work one container at a time, and write their result
+    straight into a new section, without ever building a whole bitmap.
+*/
+
+enum CrabBitmapKind
+{
+    /* `count` sorted uint16_t low halves */
+    CRAB_BITMAP_KIND_ARRAY = 1,
+    /* 1024 64-bit words; `count` is 1024 */
+    CRAB_BITMAP_KIND_BITS = 2,
+    /* `count` CrabBitmapRuns, sorted and apart */
+    CRAB_BITMAP_KIND_RUNS = 3,
+};
+
+enum CrabBitmapOp
+{
+    CRAB_BITMAP_OP_AND = 1,
+    CRAB_BITMAP_OP_OR = 2,
+    CRAB_BITMAP_OP_ANDNOT = 3,
+};
+
+typedef struct CrabBitmap CrabBitmap;
+typedef struct CrabBitmapContainer CrabBitmapContainer;
+typedef struct CrabBitmapData CrabBitmapData;
+typedef struct CrabBitmapRun CrabBitmapRun;
+
+/*
+    A checked view of a bitmap section.
+
+    This is only valid as long as the section's data is.
+*/
+struct CrabBitmap
+{
+    /* All of these are private. */
+    const CrabBitmapContainer *containers;
+    const unsigned char *payload;
+    uint64_t cardinality;
+    uint32_t num_containers;
+};
+
+/*
+    Add a new bitmap section with the given members, in any order.
+    Duplicates are ignored.
+
+    Use CRAB_SCHEMA and CRAB_PURPOSE_BITMAP if you have no better.
+*/
+CrabSection *crab_file_add_bitmap(CrabFile *c, const uint32_t *values, size_t count, const char *schema, uint16_t purpose);
+/*
+    Add a new bitmap section whose members are the indices of the nonzero
+    bytes, for converting boolean columns stored a byte per row.
+
+    Use CRAB_SCHEMA and CRAB_PURPOSE_BITMAP if you have no better.
+*/
+CrabSection *crab_file_add_bitmap_bytes(CrabFile *c, const unsigned char *bytes, uint64_t count, const char *schema, uint16_t purpose);
+/*
+    Add a new bitmap section holding `a op b`, a CrabBitmapOp. The views
+    may be of sections in any file.
+
+    Bitmap containers are combined with AVX2 where the CPU has it.
+
+    Use CRAB_SCHEMA and CRAB_PURPOSE_BITMAP if you have no better.
+*/
+CrabSection *crab_file_add_bitmap_op(CrabFile *c, const CrabBitmap *a, const CrabBitmap *b, int op, const char *schema, uint16_t purpose);
+/*
+    Check a bitmap section, and get a view of it.
+*/
+bool crab_bitmap_open(CrabSection *s, CrabBitmap *view);
+/*
+    Get the number of members.
+*/
+uint64_t crab_bitmap_count(const CrabBitmap *view);
+/*
+    Check whether `x` is a member.
+*/
+bool crab_bitmap_contains(const CrabBitmap *view, uint32_t x);
+/*
+    Get the number of members that are at most `x`.
+*/
+uint64_t crab_bitmap_rank(const CrabBitmap *view, uint32_t x);
+/*
+    Get the member with `i` smaller members. Returns false if there are
+    not enough members.
+*/
+bool crab_bitmap_select(const CrabBitmap *view, uint64_t i, uint32_t *x);
+/*
+    Write all the members, in order, to `out`, which must have room for
+    crab_bitmap_count() of them.
+*/
+void crab_bitmap_decode(const CrabBitmap *view, uint32_t *out);
+
+/*
+    A bitmap, usually with purpose = CRAB_PURPOSE_BITMAP.
+
+    This is followed by `num_containers` CrabBitmapContainers, sorted by
+    key, then the containers' contents. The 64-bit words of bitmap
+    containers are stored byte-wise, like packed.h, so have no
+    endianness; bit `k` of a container is value `k`.
+*/
+struct __attribute__((scalar_storage_order("big-endian"))) CrabBitmapData
+{
+    uint64_t cardinality;
+    uint32_t num_containers;
+    uint32_t reserved;
+};
+
+/*
+    The members whose high 16 bits are `key`.
+
+    `rank` is the number of members in all previous containers, and
+    `offset` is where the contents start, relative to the end of the
+    container list; it is always a multiple of 8.
+*/
+struct __attribute__((scalar_storage_order("big-endian"))) CrabBitmapContainer
+{
+    uint16_t key;
+    uint8_t kind;
+    uint8_t reserved;
+    uint32_t count;
+    uint32_t rank;
+    uint32_t offset;
+};
+
+/*
+    The low halves `start` through `last`, inclusive.
+*/
+struct __attribute__((scalar_storage_order("big-endian"))) CrabBitmapRun
+{
+    uint16_t start;
+    uint16_t last;
+};
+
+#pragma GCC visibility pop
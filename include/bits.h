@@ -0,0 +1,91 @@
+/*
+    CRAB - Compact Random-Access Binary
+    Copyright © 2018  Ben Longbons
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+
+/*
+    Helpers for bit-packed section data.
+
+    Bit streams are defined byte-wise: bit `k` of the stream is bit `k % 8`
+    of byte `k / 8`, so they have no endianness of their own. Packed
+    sections keep 8 bytes of slack after the stream, so that any value can
+    be read with a single unaligned 64-bit load (plus one more byte for
+    values over 57 bits).
+*/
+
+static __inline__ uint64_t load_le64(const void *p)
+{
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap64(v);
+#endif
+    return v;
+}
+static __inline__ void store_le64(void *p, uint64_t v)
+{
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap64(v);
+#endif
+    memcpy(p, &v, sizeof(v));
+}
+
+/* The number of bits needed to store `v`. */
+static __inline__ unsigned bit_width(uint64_t v)
+{
+    return v ? 64 - __builtin_clzll(v) : 0;
+}
+/* All ones in the low `bits` bits, for `bits` <= 64. */
+static __inline__ uint64_t low_mask(unsigned bits)
+{
+    return bits >= 64 ? ~(uint64_t)0 : ((uint64_t)1 << bits) - 1;
+}
+/* Bytes needed for `n` values of `bits` bits, rounded up to a whole word, plus slack. */
+static __inline__ uint64_t packed_size(uint64_t n, unsigned bits)
+{
+    return (n * bits + 63) / 64 * 8 + 8;
+}
+
+/* Read the `bits`-bit value at bit `bit` of a stream; `bits` <= 57. */
+static __inline__ uint64_t unpack_bits(const unsigned char *stream, uint64_t bit, unsigned bits)
+{
+    return (load_le64(stream + (bit >> 3)) >> (bit & 7)) & low_mask(bits);
+}
+/* Like unpack_bits(), but for any `bits` <= 64; needs one more byte. */
+static __inline__ uint64_t unpack_bits_wide(const unsigned char *stream, uint64_t bit, unsigned bits)
+{
+    const unsigned char *p = stream + (bit >> 3);
+    unsigned shift = bit & 7;
+    uint64_t v = load_le64(p) >> shift;
+    if (shift && bits > 64 - shift)
+        v |= (uint64_t)p[8] << (64 - shift);
+    return v & low_mask(bits);
+}
+/* Write a value into a zeroed stream, like unpack_bits_wide(). */
+static __inline__ void pack_bits(unsigned char *stream, uint64_t bit, unsigned bits, uint64_t v)
+{
+    unsigned char *p = stream + (bit >> 3);
+    unsigned shift = bit & 7;
+    v &= low_mask(bits);
+    store_le64(p, load_le64(p) | v << shift);
+    if (shift && bits > 64 - shift)
+        p[8] |= v >> (64 - shift);
+}
@@ -0,0 +1,70 @@
+/*
+    CRAB - Compact Random-Access Binary
+    Copyright © 2018  Ben Longbons
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+#include "fwd.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+
+#pragma GCC visibility push(default)
+
+/*
+    Per-section CRC32C checksums.
+
+    A file saved with CRAB_SAVE_FLAG_CHECKSUM gets a section holding the
+    checksum of every other section, and a flag in the file header saying
+    so. Each section is then checked the first time its data is asked for,
+    or all at once with CRAB_FILE_FLAG_VERIFY or crab_file_verify().
+
+    The CRC uses SSE4.2 where the CPU has it, on several streams at once.
+*/
+
+typedef struct CrabChecksumData CrabChecksumData;
+
+/*
+    Continue the CRC32C `crc` (0 to start) over `size` more bytes.
+*/
+uint32_t crab_crc32c(uint32_t crc, const void *data, size_t size);
+/*
+    Given the CRC32Cs of two pieces of data, find the CRC32C of both
+    together, where `size2` is the size of the second.
+*/
+uint32_t crab_crc32c_combine(uint32_t crc1, uint32_t crc2, uint64_t size2);
+/*
+    Find the CRC32Cs of `count` buffers, in parallel on `num_threads`
+    threads (0 for one per CPU). Big buffers are split between threads.
+*/
+void crab_crc32c_many(const void *const *data, const size_t *sizes, size_t count, unsigned num_threads, uint32_t *crcs);
+
+/*
+    The checksums of a file, with purpose = CRAB_PURPOSE_CHECKSUMS.
+
+    Entry `i` is the CRC32C of section `i`'s data; the entry for this
+    section itself is 0. Sections from `num_sections` on are not covered.
+*/
+struct __attribute__((scalar_storage_order("big-endian"))) CrabChecksumData
+{
+    uint32_t num_sections;
+    uint32_t reserved;
+    uint32_t crc[0];
+};
+
+#pragma GCC visibility pop
@@ -0,0 +1,138 @@
+/*
+    CRAB - Compact Random-Access Binary
+    Copyright © 2018  Ben Longbons
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+#include "fwd.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+
+#pragma GCC visibility push(default)
+
+/*
+    Block-compressed sections, for cold, bulky data.
+
+    The data is split into blocks of a fixed size, each compressed on its
+    own, with a table of where each block ends. Reading any range only
+    decompresses the blocks it touches, and a CrabBlockCache can keep
+    recently decompressed blocks around.
+*/
+
+enum CrabCodec
+{
+    /* Blocks are stored as-is. */
+    CRAB_CODEC_NONE = 0,
+    /* A simple byte-oriented LZ77, much like LZ4's block format. */
+    CRAB_CODEC_LZ = 1,
+};
+enum
+{
+    CRAB_COMPRESS_BLOCK_SIZE = 64 * 1024,
+};
+
+typedef struct CrabBlockCache CrabBlockCache;
+typedef struct CrabCompressed CrabCompressed;
+typedef struct CrabCompressedData CrabCompressedData;
+
+/*
+    A checked view of a compressed section.
+
+    This is only valid as long as the section's data is.
+*/
+struct CrabCompressed
+{
+    /* All of these are private. */
+    const CrabCompressedData *data;
+    const unsigned char *blocks;
+    uint64_t raw_size;
+    uint32_t block_size;
+    uint32_t num_blocks;
+    int codec;
+    uint64_t generation;
+};
+
+/*
+    Whether a CrabCodec can be used in this build.
+*/
+bool crab_codec_available(int codec);
+/*
+    Add a new section holding `size` bytes of `data`, compressed with
+    `codec` in blocks of `block_size` bytes (a power of two from 4 KiB to
+    16 MiB, or 0 for CRAB_COMPRESS_BLOCK_SIZE). A block that doesn't
+    shrink is stored as-is.
+
+    Use CRAB_SCHEMA and CRAB_PURPOSE_COMPRESSED if you have no better.
+*/
+CrabSection *crab_file_add_compressed(CrabFile *c, const void *data, size_t size, int codec, uint32_t block_size, const char *schema, uint16_t purpose);
+/*
+    Check a compressed section, and get a view of it. Fails with ENOTSUP
+    if the codec isn't available.
+*/
+bool crab_compressed_open(CrabSection *s, CrabCompressed *view);
+/*
+    Size of the data once decompressed.
+*/
+uint64_t crab_compressed_size(const CrabCompressed *view);
+/*
+    Get the CrabCodec of the view.
+*/
+int crab_compressed_codec(const CrabCompressed *view);
+/*
+    Decompress `size` bytes starting at `offset` into `out`, going through
+    `cache` if it's not NULL.
+
+    Returns false if that goes past the end, or a block is corrupt.
+*/
+bool crab_compressed_read(const CrabCompressed *view, CrabBlockCache *cache, uint64_t offset, size_t size, void *out);
+
+/*
+    Create a cache that keeps up to `capacity` bytes of the most recently
+    used decompressed blocks. Returns NULL and sets errno on failure.
+
+    A cache may be shared by any number of views, files, and threads, and
+    may outlive them. Blocks are found by which section's data they came
+    from, so closing or reopening a file, or setting a section's data,
+    just leaves the old blocks to be evicted.
+*/
+CrabBlockCache *crab_block_cache_new(size_t capacity);
+/*
+    Free a cache and all its blocks.
+*/
+void crab_block_cache_free(CrabBlockCache *cache);
+
+/*
+    A compressed section, usually with purpose = CRAB_PURPOSE_COMPRESSED.
+
+    This is followed by `num_blocks` uint32_t offsets, each where a block
+    ends (and the next begins) relative to the end of the offsets, then
+    the blocks themselves. Every block but the last decompresses to
+    `block_size` bytes; a block whose stored size is what it decompresses
+    to is stored as-is.
+*/
+struct __attribute__((scalar_storage_order("big-endian"))) CrabCompressedData
+{
+    uint64_t raw_size;
+    uint32_t block_size;
+    uint32_t num_blocks;
+    uint8_t codec;
+    uint8_t reserved[7];
+};
+
+#pragma GCC visibility pop
@@ -51,6 +51,47 @@ enum CrabFileFlag
         For all operations on this file, print errors.
     */
     CRAB_FILE_FLAG_PERROR = 0x08,
+    /*
+        Only map the header and section table up front. Each section is
+        created the first time `crab_file_section` asks for it, and its
+        data is mapped the first time `crab_section_data` asks for it.
+
+        This keeps a file descriptor open until the file is closed, but
+        opening is constant-time and only the sections you actually use
+        need address space.
+    */
+    CRAB_FILE_FLAG_LAZY = 0x10,
+    /*
+        Fault in the whole mapping up front (with CRAB_FILE_FLAG_LAZY,
+        each section's mapping as it is made), so that the first lookups
+        don't stall on page faults.
+
+        With CRAB_FILE_FLAG_WRITE, this only starts readahead, since
+        prefaulting would make a private copy of every page.
+    */
+    CRAB_FILE_FLAG_POPULATE = 0x20,
+    /*
+        Tell the kernel that access will be random, so it doesn't waste
+        time and page cache on readahead.
+    */
+    CRAB_FILE_FLAG_RANDOM = 0x40,
+    /*
+        Tell the kernel that access will be sequential, and start reading
+        ahead immediately. Can't be combined with CRAB_FILE_FLAG_RANDOM.
+    */
+    CRAB_FILE_FLAG_SEQUENTIAL = 0x80,
+    /*
+        Place mappings of 2 MiB or more so that transparent huge pages can
+        be used for them, and ask for them. Whether they actually are
+        depends on the kernel and the filesystem.
+    */
+    CRAB_FILE_FLAG_HUGEPAGE = 0x100,
+    /*
+        If the file has checksums, check every section up front, on all
+        CPUs, instead of each the first time it is used. With
+        CRAB_FILE_FLAG_LAZY, this maps every section.
+    */
+    CRAB_FILE_FLAG_VERIFY = 0x200,
 };
 
 enum CrabSectionFlag
@@ -78,6 +119,103 @@ enum CrabSaveFlag
         invalidate the data and schema pointers.
     */
     CRAB_SAVE_FLAG_REOPEN = 0x01,
+    /*
+        Instead of writing a new file and renaming it over the old one,
+        append new and changed sections to the end of the existing file,
+        then a new header and section table after them, and finally point
+        the start of the file at that table.
+
+        This costs time proportional to the change rather than the file,
+        but leaves the old data and table behind as dead space (see `crab
+        compact`). Sections may be added, since the table can grow.
+
+        Nothing the old table points to is overwritten. The final write
+        is 40 bytes, within the first disk sector, so a crash leaves the
+        file with either the old sections or the new ones. Processes that
+        already have the file mapped keep using the old ones.
+
+        This implies CRAB_SAVE_FLAG_REOPEN. If the file no longer matches
+        what was opened, this falls back to a normal save.
+    */
+    CRAB_SAVE_FLAG_APPEND = 0x02,
+    /*
+        Start every nonempty section on a 4 KiB boundary, so that each
+        can be mapped, advised, locked, and evicted on its own.
+
+        The padding is left as a hole where the filesystem supports it.
+        With CRAB_SAVE_FLAG_APPEND, this only affects sections that are
+        actually written. See also `crab_section_set_alignment`.
+    */
+    CRAB_SAVE_FLAG_ALIGN_PAGE = 0x04,
+    /*
+        Like CRAB_SAVE_FLAG_ALIGN_PAGE, but on 2 MiB boundaries, so that
+        sections can use huge pages.
+    */
+    CRAB_SAVE_FLAG_ALIGN_HUGEPAGE = 0x08,
+    /*
+        Store a CRC32C of every section in the file, so that corruption
+        is noticed when a section is used (see checksum.h). A file that
+        already has checksums keeps them up to date without this.
+    */
+    CRAB_SAVE_FLAG_CHECKSUM = 0x10,
+    /*
+        Write each distinct section body only once, pointing sections
+        with the same data at the same place in the file. Every section
+        has to be read (and hashed) to find them, even with
+        CRAB_SAVE_FLAG_APPEND.
+
+        A section is only shared if that keeps it aligned as asked.
+    */
+    CRAB_SAVE_FLAG_DEDUP = 0x20,
+};
+
+/*
+    Access hints for a single section, for `crab_section_advise`.
+
+    These only apply to data that is mapped from the file; for anything
+    else they quietly do nothing.
+*/
+enum CrabAdvice
+{
+    /* Undo RANDOM, SEQUENTIAL, and HUGEPAGE. */
+    CRAB_ADVICE_NORMAL,
+    /* Don't read ahead. */
+    CRAB_ADVICE_RANDOM,
+    /* Read ahead aggressively, starting now. */
+    CRAB_ADVICE_SEQUENTIAL,
+    /* Start reading the whole section in the background. */
+    CRAB_ADVICE_WILLNEED,
+    /*
+        Drop the section from this process's memory; it will be read back
+        in if used again. Pages shared with neighboring sections are kept.
+
+        Not allowed with CRAB_FILE_FLAG_WRITE.
+    */
+    CRAB_ADVICE_DONTNEED,
+    /* Ask for transparent huge pages. */
+    CRAB_ADVICE_HUGEPAGE,
+    /*
+        Read in and pin the section in memory (subject to RLIMIT_MEMLOCK).
+        Locks don't nest, so unlocking a neighbor may unlock shared pages.
+    */
+    CRAB_ADVICE_LOCK,
+    /* Undo CRAB_ADVICE_LOCK. */
+    CRAB_ADVICE_UNLOCK,
+};
+
+/*
+    The byte order of the integers in a file's own data: any section that
+    isn't in one of this library's formats, like CRAB_PURPOSE_RAW. The
+    library's formats are always big-endian, or have no byte order at all,
+    whatever this says; on a little-endian CPU, their lookups swap bytes.
+
+    Files are big-endian unless saved otherwise. Saving a file in the
+    CPU's order means its data can be used straight from the mapping.
+*/
+enum CrabByteOrder
+{
+    CRAB_BYTE_ORDER_BIG = 1,
+    CRAB_BYTE_ORDER_LITTLE = 2,
 };
 
 
@@ -85,6 +223,23 @@ enum CrabSaveFlag
     Map a CRAB file from disk.
 */
 CrabFile *crab_file_open(const char *filename, int flags);
+/*
+    Map a CRAB file from an open file descriptor, which is not closed.
+
+    Anything that can't be mapped directly, like a pipe or a socket, is
+    read to the end into an anonymous memory file first.
+
+    Files opened this way have no name, so can't be saved.
+*/
+CrabFile *crab_file_open_fd(int fd, int flags);
+/*
+    Use a CRAB file that is already in memory, such as one embedded in
+    the program, without copying it.
+
+    `data` must be 8-byte aligned, and must outlive the file. Files opened
+    this way can't be saved, and can't use CRAB_FILE_FLAG_WRITE.
+*/
+CrabFile *crab_file_open_memory(const void *data, size_t size, int flags);
 /*
     Release all resources associated with the CRAB file.
 
@@ -93,8 +248,21 @@ CrabFile *crab_file_open(const char *filename, int flags);
 bool crab_file_close(CrabFile *c);
 /*
     Write a CRAB file to disk.
+
+    Sections of 4 GiB or more need a header extension that older versions
+    of this library can't read; it is only used when there is one. Fails
+    with EOVERFLOW if a section is 256 TiB or more.
 */
 bool crab_file_save(CrabFile *c, int flags);
+/*
+    Check every section against the file's checksums, in parallel on
+    `num_threads` threads (0 for one per CPU), except those that have
+    already been checked.
+
+    Fails with EBADMSG if any don't match, or ENOENT if the file has no
+    checksums.
+*/
+bool crab_file_verify(CrabFile *c, unsigned num_threads);
 /*
     Fetch details about the most recent error to occur.
 
@@ -102,6 +270,31 @@ bool crab_file_save(CrabFile *c, int flags);
 */
 void crab_file_error(CrabFile *c, const char **msg, int *no);
 
+/*
+    Get the size of the file as it was opened (or last reopened), how
+    much of its start is the header and section table, and how much of
+    its end is a section table that CRAB_SAVE_FLAG_APPEND moved there
+    (0 if none). All are 0 for a file that has never been saved.
+*/
+void crab_file_layout(CrabFile *c, uint64_t *file_size, uint64_t *table_size, uint64_t *moved_table_size);
+
+/*
+    Get the CrabByteOrder of this CPU.
+*/
+int crab_native_byte_order(void);
+/*
+    Get the CrabByteOrder of the file's own data.
+*/
+int crab_file_byte_order(CrabFile *c);
+/*
+    Record a different CrabByteOrder for the file's data, from the next
+    save on.
+
+    This does not touch the data itself; convert each section that needs
+    it with crab_section_swap_bytes().
+*/
+bool crab_file_set_byte_order(CrabFile *c, int order);
+
 /*
     Current number of valid indices.
 */
@@ -110,14 +303,41 @@ uint32_t crab_file_num_sections(CrabFile *c);
     Get a section by index.
 
     This must not be outlive the file.
+
+    With CRAB_FILE_FLAG_LAZY, this may have to create the section, and thus
+    may fail even for a valid index.
 */
 CrabSection *crab_file_section(CrabFile *c, uint32_t i);
+/*
+    Find all the sections with the given schema and purpose.
+
+    On success, `*sections` points to `*num_sections` section numbers, in
+    increasing order. The array belongs to the file, and is only valid
+    until a section is added or has its schema or purpose changed.
+
+    The first call builds an index; after that this is a binary search.
+*/
+bool crab_file_find_sections(CrabFile *c, const char *schema, uint16_t purpose, const uint32_t **sections, uint32_t *num_sections);
 /*
     Add a new, empty section.
 
     You'll probably want to set its purpose and data.
 */
 CrabSection *crab_file_section_add(CrabFile *c);
+/*
+    Add `count` new, empty sections, all with the same schema and purpose.
+
+    Returns the first one; the rest follow it, both in number and in
+    memory (so `&rv[i]` is section `crab_section_number(rv) + i`).
+
+    This is much cheaper than adding them one at a time.
+*/
+CrabSection *crab_file_section_add_many(CrabFile *c, uint32_t count, const char *schema, uint16_t purpose);
+/*
+    Make room for `num_sections` sections in total, so that adding up to
+    that many doesn't need any more reallocation.
+*/
+bool crab_file_reserve_sections(CrabFile *c, uint32_t num_sections);
 
 /*
     Get the index of this section within the file.
@@ -148,6 +368,12 @@ size_t crab_section_data_size(CrabSection *s);
 /*
     Get an abstract pointer to the section's data.
 
+    With CRAB_FILE_FLAG_LAZY, this may have to map the data, and thus may
+    return NULL even for a nonempty section.
+
+    If the file has checksums, this may fail the first time it is called
+    (see crab_section_verify()).
+
     You should cast this to whatever type is appropriate for the given
     purpose, and verify that the size is big enough.
 
@@ -156,6 +382,50 @@ size_t crab_section_data_size(CrabSection *s);
     other sections, using relative offsets for easy relocation.
 */
 CrabAbstractData *crab_section_data(CrabSection *s);
+/*
+    Check the section against the file's checksum for it now, if that
+    hasn't been done yet. crab_section_data() does this anyway, and fails
+    with EBADMSG if they don't match.
+
+    Sections with no checksum always pass.
+*/
+bool crab_section_verify(CrabSection *s);
+/*
+    Ask for this section to start on a multiple of `alignment` bytes
+    (a power of two, at most 2 MiB) whenever the file is saved. Sections
+    are always aligned to at least 8 bytes.
+
+    This is remembered until the file is closed, but is not stored in the
+    file itself.
+*/
+bool crab_section_set_alignment(CrabSection *s, uint32_t alignment);
+/*
+    Find where this section's data is in the file as it was opened.
+
+    Fails for sections that have been added or given new data since.
+*/
+bool crab_section_file_offset(CrabSection *s, uint64_t *offset);
+/*
+    Tell the kernel how this section's data is going to be used.
+
+    With CRAB_FILE_FLAG_LAZY, this may have to map the data first.
+*/
+bool crab_section_advise(CrabSection *s, int advice);
+/*
+    Copy `count` integers of `width` bytes (2, 4, or 8), starting with
+    integer `start`, from the section into `out`, in the CPU's byte order.
+
+    If the file is already in the CPU's byte order, this is a plain copy,
+    and crab_section_data() can be used directly instead.
+*/
+bool crab_section_read_ints(CrabSection *s, unsigned width, uint64_t start, size_t count, void *out);
+/*
+    Reverse the bytes of every integer of `width` bytes (2, 4, or 8) in
+    the section, such as when changing the file's byte order.
+
+    Data the section doesn't own is copied first.
+*/
+bool crab_section_swap_bytes(CrabSection *s, unsigned width);
 /*
     Copy the data into the section.
 */
@@ -0,0 +1,129 @@
+/*
+    CRAB - Compact Random-Access Binary
+    Copyright © 2018  Ben Longbons
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+#include "fwd.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "format.h"
+
+
+#pragma GCC visibility push(default)
+
+/*
+    Dictionary-encoded string columns.
+
+    Each distinct value is stored once, in a CFBS index (see format.h),
+    and each row is just the value's ID there - its "code" - bit-packed
+    like packed.h. Finding the rows with a given value looks the value up
+    once, then compares codes, never strings.
+*/
+
+typedef struct CrabDict CrabDict;
+typedef struct CrabDictData CrabDictData;
+
+/*
+    A checked view of a dictionary-encoded column and its dictionary.
+
+    This is only valid as long as all three sections' data is.
+*/
+struct CrabDict
+{
+    /* All of these are private. */
+    CrabStringTable strings;
+    const unsigned char *packed;
+    uint64_t num_rows;
+    unsigned bits;
+};
+
+/*
+    Add a dictionary-encoded column holding `strings`, one per row. This
+    adds the dictionary (a CFBS index and its string section) first, then
+    the column, which is returned.
+
+    If `lengths` is NULL, the strings must be NUL-terminated; otherwise
+    they may contain NULs. Codes are given in order of first appearance.
+
+    Use CRAB_SCHEMA and CRAB_PURPOSE_DICT if you have no better.
+*/
+CrabSection *crab_file_add_dict(CrabFile *c, const char *const *strings, const size_t *lengths, uint64_t count, const char *schema, uint16_t purpose);
+/*
+    Check a dictionary-encoded column and its dictionary, and get a view
+    of them.
+*/
+bool crab_dict_open(CrabSection *s, CrabDict *view);
+/*
+    Number of rows.
+*/
+uint64_t crab_dict_count(const CrabDict *view);
+/*
+    Number of distinct values, and so of codes.
+*/
+uint32_t crab_dict_num_values(const CrabDict *view);
+/*
+    Get the code of one row. `row` must be less than the count; this is
+    not checked.
+*/
+uint32_t crab_dict_code(const CrabDict *view, uint64_t row);
+/*
+    Get the value of one row, likewise, and (if `len` is not NULL) its
+    length. Returns NULL if the file is corrupt.
+*/
+const char *crab_dict_get(const CrabDict *view, uint64_t row, size_t *len);
+/*
+    Get the value with the given code, as for crab_strings_get().
+*/
+const char *crab_dict_value(const CrabDict *view, uint32_t code, size_t *len);
+/*
+    Find the code of a value. Returns false if no row has it.
+*/
+bool crab_dict_find(const CrabDict *view, const char *str, size_t len, uint32_t *code);
+/*
+    Decode the codes of `count` rows starting at `start` into `out`.
+
+    Returns false if that goes past the end.
+*/
+bool crab_dict_decode(const CrabDict *view, uint64_t start, size_t count, uint32_t *out);
+/*
+    Find which of `count` rows starting at `start` have the given code.
+    Their numbers go to `rows`, which must have room for `count`, and
+    how many there were to `*num_rows`.
+
+    Returns false if that goes past the end.
+*/
+bool crab_dict_scan(const CrabDict *view, uint32_t code, uint64_t start, size_t count, uint64_t *rows, size_t *num_rows);
+
+/*
+    A dictionary-encoded column, usually with purpose = CRAB_PURPOSE_DICT.
+
+    `dict_section` is the CFBS index of the values, relative to this
+    section. The codes follow, `bits` each, as in CrabPackedIntsData.
+*/
+struct __attribute__((scalar_storage_order("big-endian"))) CrabDictData
+{
+    uint64_t num_rows;
+    uint32_t dict_section;
+    uint8_t bits;
+    uint8_t reserved[3];
+    uint8_t packed[0];
+};
+
+#pragma GCC visibility pop
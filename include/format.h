@@ -17,7 +17,124 @@
 */
 #pragma once
 
+#include "fwd.h"
+
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 
+#pragma GCC visibility push(default)
+
+/*
+    Compact string sections.
+
+    The bytes of a string section are just the strings, each followed by
+    a NUL. Other sections refer to them in one of two ways:
+
+    * Directly, by a 32-bit "string reference": the string's offset within
+      the string section, shifted left by STRING_SIZE_BITS, or'ed with its
+      length. This limits such a string section to 2²⁴-1 (16 MiB) and each
+      string to 254 bytes. The schema table works this way.
+
+    * By ID, through an index section (CrabStringIndexData) that refers to
+      the string section. Looking up an ID is constant-time, and looking up
+      a string is one probe of a hash table that is stored in the index.
+      Strings may be up to 4 GiB each. This is CFBS.
+*/
 #define STRING_SIZE_BITS 8
+
+typedef struct CrabStringTable CrabStringTable;
+typedef struct CrabStringIndexData CrabStringIndexData;
+
+/*
+    A checked view of a CFBS index and its string section, so that lookups
+    don't have to check everything again.
+
+    This is only valid as long as both sections' data is.
+*/
+struct CrabStringTable
+{
+    /* All of these are private. */
+    const CrabStringIndexData *index;
+    const char *data;
+    size_t data_size;
+    uint32_t num_strings;
+    uint32_t hash_mask;
+};
+
+/*
+    The hash function used by CFBS indices (32-bit FNV-1a).
+
+    Since hashes are stored in files, this will never change.
+*/
+uint32_t crab_string_hash(const char *str, size_t len);
+/*
+    Find a string by reference in a string section.
+
+    Returns NULL if the reference is out of bounds or isn't to a
+    NUL-terminated string. Otherwise, `*len` (if not NULL) is its length.
+*/
+const char *crab_string_ref(CrabSection *strings, uint32_t ref, size_t *len);
+/*
+    Append a string to a string section, and return a reference to it.
+
+    This doesn't check whether the string is already there.
+*/
+bool crab_string_ref_add(CrabSection *strings, const char *str, size_t len, uint32_t *ref);
+
+/*
+    Add a CFBS string section and its index as two new sections, and
+    return the index.
+
+    String `i` gets ID `i`. If `lengths` is NULL, the strings must be
+    NUL-terminated; otherwise they may contain NULs. Duplicate strings are
+    only stored once, and looking them up finds the first ID.
+
+    The string section itself gets the builtin schema and the purpose
+    CRAB_PURPOSE_SUPPLEMENTARY; the index gets the given schema and
+    purpose (CRAB_SCHEMA and CRAB_PURPOSE_STRINGS if you have no better).
+*/
+CrabSection *crab_file_add_strings(CrabFile *c, const char *const *strings, const size_t *lengths, uint32_t count, const char *schema, uint16_t purpose);
+/*
+    Check a CFBS index and its string section, and get a view of them.
+*/
+bool crab_strings_open(CrabSection *index, CrabStringTable *table);
+/*
+    Number of IDs in the index.
+*/
+uint32_t crab_strings_count(const CrabStringTable *table);
+/*
+    Get the string with the given ID, and (if `len` is not NULL) its length.
+
+    Returns NULL if the ID is out of range, or the file is corrupt.
+*/
+const char *crab_strings_get(const CrabStringTable *table, uint32_t id, size_t *len);
+/*
+    Find the ID of a string.
+
+    Returns false if it isn't there; this is not an error.
+*/
+bool crab_strings_find(const CrabStringTable *table, const char *str, size_t len, uint32_t *id);
+
+/*
+    CFBS index, usually with purpose = CRAB_PURPOSE_STRINGS.
+
+    This is followed by `hash_mask + 1` buckets, which are each either 0
+    or one more than the ID of a string that hashes to there (or just
+    before there, with linear probing). The table is at most half full.
+*/
+struct __attribute__((scalar_storage_order("big-endian"))) CrabStringIndexData
+{
+    uint32_t string_section;
+    uint32_t num_strings;
+    uint32_t hash_mask;
+    uint32_t reserved;
+    struct __attribute__((scalar_storage_order("big-endian")))
+    {
+        uint32_t offset;
+        uint32_t length;
+    } strings[0];
+};
+
+#pragma GCC visibility pop
@@ -19,26 +19,151 @@
 
 #include "fwd.h"
 
+#include <sys/types.h>
+
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 
 
 #define CRAB_MAGIC "\x83""CRB\r\n\x1a\n"
+/*
+    The biggest section the section table can describe (with
+    CRAB_HEADER_FLAG_SIZE64), so the biggest any builder should make.
+*/
+#define CRAB_MAX_SECTION_SIZE (((uint64_t)1 << 48) - 1)
+/*
+    A filter block is 8 words of 32 bits. Saving aligns filters to this
+    by their purpose, so each block stays within a cache line.
+*/
+#define CRAB_FILTER_BLOCK_SIZE 32
+
+/*
+    Internal section flags, kept clear of the public `CrabSectionFlag`s.
+*/
+enum
+{
+    /*
+        The section's data has not been mapped yet; its location is still
+        the one in `c->file_header->section_info`.
+    */
+    CRAB_SECTION_FLAG_LAZY = 0x100,
+    /*
+        The file has a checksum for the section's data that hasn't been
+        checked yet; crab_section_data() will check it first.
+    */
+    CRAB_SECTION_FLAG_UNVERIFIED = 0x200,
+};
+/*
+    Internal file flags, kept clear of the public `CrabFileFlag`s.
+*/
+enum
+{
+    /*
+        Opened by crab_file_open_memory(); `c->file_header` belongs to the
+        caller, and there is no file to save to.
+    */
+    CRAB_FILE_FLAG_MEMORY = 0x10000,
+    /*
+        The file's own data is little-endian; see crab_file_byte_order().
+        Set from CRAB_HEADER_FLAG_LITTLE_ENDIAN whenever the header is
+        loaded, and saved back to it.
+    */
+    CRAB_FILE_FLAG_LITTLE_ENDIAN = 0x20000,
+};
+/*
+    Flags in `CrabFileHeader.flags`. Readers that predate these ignore
+    them, so each must say what such a reader sees.
+*/
+enum
+{
+    /*
+        One section with CRAB_SCHEMA and CRAB_PURPOSE_CHECKSUMS holds the
+        checksums of the others; see checksum.h. An older reader just
+        doesn't check them.
+    */
+    CRAB_HEADER_FLAG_CHECKSUMS = 0x01,
+    /*
+        Some section is 4 GiB or more. The top 16 bits of every section's
+        `offset` are bits 32-47 of its size, which an older reader sees as
+        an offset past the end of the file, rather than a truncated size.
+        Only set when needed, so other files are unchanged.
+    */
+    CRAB_HEADER_FLAG_SIZE64 = 0x02,
+    /*
+        Sections that aren't in one of the library's own formats hold
+        little-endian data. An older reader can't tell; it only matters to
+        whoever reads those sections, who must already know their layout.
+    */
+    CRAB_HEADER_FLAG_LITTLE_ENDIAN = 0x04,
+    /*
+        The header and section table in use are a copy at the end of the
+        file, written there by an appending save, which then points to it
+        by rewriting only this header and the first section entry. Here,
+        `num_sections` is 1, and that entry's `offset` is where the copy
+        is, plus 2^63; its `size` is 0. An older reader sees an offset
+        past the end of the file. Only this flag is set here; the copy has
+        the file's own flags, and never this one.
+    */
+    CRAB_HEADER_FLAG_TABLE_MOVED = 0x08,
+};
 
 typedef struct CrabFileHeader CrabFileHeader;
 typedef struct CrabSectionHeader CrabSectionHeader;
+typedef struct CrabArenaChunk CrabArenaChunk;
 
 struct CrabFile
 {
     CrabFileHeader *file_header;
+    /* Size of the `file_header` mapping; less than the file if lazy. */
+    size_t file_header_size;
+    /*
+        The header whose section table is in use: `file_header`, unless
+        CRAB_HEADER_FLAG_TABLE_MOVED says it's at the end of the file.
+        Lazy files map that separately, as `table_mapping`.
+    */
+    CrabFileHeader *table;
+    void *table_mapping;
+    size_t table_mapping_size;
+    /* Only kept open with CRAB_FILE_FLAG_LAZY. */
+    int fd;
+    /* Which file was mapped, so saving can tell if it's still there. */
+    dev_t file_dev;
+    ino_t file_ino;
+
+    /*
+        Everything below that's fixed-size or lives as long as the file
+        (the CrabFile itself, the filename, the section pointers, and the
+        sections) is carved out of this arena; see arena_alloc().
+    */
+    CrabArenaChunk *arena;
+    size_t arena_chunk_size;
 
     char *filename;
     size_t filename_len;
     int flags;
 
     uint32_t num_sections;
+    uint32_t sections_capacity;
     CrabSection **sections;
 
+    /*
+        Open-addressed map from schema URL to local schema ID + 1, so that
+        finding or adding a schema doesn't need a scan. Built on first use.
+    */
+    uint32_t *schema_hash;
+    uint32_t schema_hash_mask;
+    /*
+        All section numbers, sorted by (schema, purpose), and the matching
+        keys, for crab_file_find_sections(). Built on first use, and thrown
+        away whenever a section is added or repurposed.
+    */
+    uint32_t *index_keys;
+    uint32_t *index_sections;
+
+    /* The section with the checksums being used, if any. */
+    CrabSection *checksum_section;
+
     const char *error_message;
     int error_number;
 };
@@ -50,14 +175,31 @@ struct CrabSection
     uint32_t section_number;
     uint16_t local_schema_id;
     uint16_t purpose;
-    const char *schema;
 
     CrabAbstractData *data;
     size_t data_size;
+    /* Per-section mapping with CRAB_FILE_FLAG_LAZY; lives until close. */
+    void *mapping;
+    size_t mapping_size;
+    /* Requested by crab_section_set_alignment(); not stored in the file. */
+    uint32_t alignment;
+    /*
+        Unique within the process, and changed whenever `data` is, so a
+        CrabBlockCache can tell blocks apart without trusting addresses.
+    */
+    uint64_t generation;
 
     int flags;
 };
 
+struct CrabArenaChunk
+{
+    CrabArenaChunk *next;
+    size_t used;
+    size_t capacity;
+    char data[0] __attribute__((aligned(16)));
+};
+
 /* because GCC 6 makes life a *lot* easier */
 struct __attribute__((scalar_storage_order("big-endian"))) CrabSectionHeader
 {
@@ -71,7 +213,39 @@ struct __attribute__((scalar_storage_order("big-endian"))) CrabFileHeader
 {
     char magic[8];
     uint64_t size;
-    uint32_t reserved;
+    uint32_t flags;
     uint32_t num_sections;
     CrabSectionHeader section_info[0];
 };
+
+#define maybe_perror crab_maybe_perror
+#define memdup crab_memdup
+#define memdup_plus crab_memdup_plus
+#define append_string crab_append_string
+#define unpack32 crab_unpack32
+#define have_avx2 crab_have_avx2
+#define have_sse42 crab_have_sse42
+
+/*
+    If the file wants errors printed, print the current one.
+*/
+void maybe_perror(CrabFile *c);
+void *memdup(const void *p, size_t len);
+void *memdup_plus(const void *p, size_t len, size_t plus);
+/*
+    crab_string_ref_add(), but leaves printing the error to the caller.
+*/
+bool append_string(CrabSection *strings, const char *str, size_t len, uint32_t *ref);
+/*
+    Decode `count` values of up to 32 bits from a packed stream (see
+    bits.h), starting with value `start`, using SIMD where possible.
+*/
+void unpack32(const unsigned char *packed, unsigned bits, uint64_t start, size_t count, uint32_t *out);
+/*
+    Whether the CPU has AVX2, for code built with `target("avx2")`.
+*/
+bool have_avx2(void);
+/*
+    Whether the CPU has SSE4.2, for code built with `target("sse4.2")`.
+*/
+bool have_sse42(void);
@@ -0,0 +1,224 @@
+/*
+    CRAB - Compact Random-Access Binary
+    Copyright © 2018  Ben Longbons
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+#include "fwd.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "format.h"
+
+
+#pragma GCC visibility push(default)
+
+/*
+    Indices over key sections, for finding the row that has a given key.
+
+    A key section is either a CFBS string index (see format.h), where
+    row `i` has string ID `i`, or a CrabKeysData of 64-bit integers.
+*/
+
+enum CrabKeyType
+{
+    CRAB_KEY_TYPE_STRING = 1,
+    CRAB_KEY_TYPE_U64 = 2,
+};
+
+typedef struct CrabFilter CrabFilter;
+typedef struct CrabFilterData CrabFilterData;
+typedef struct CrabHash CrabHash;
+typedef struct CrabHashData CrabHashData;
+typedef struct CrabKeysData CrabKeysData;
+
+/*
+    A checked view of a hash index and its key section.
+
+    This is only valid as long as both sections' data is.
+*/
+struct CrabHash
+{
+    /* All of these are private. */
+    const CrabHashData *data;
+    CrabStringTable strings;
+    const void *keys;
+    uint64_t seed;
+    uint32_t num_keys;
+    uint32_t num_slots;
+    uint32_t num_buckets;
+    int key_type;
+};
+
+/*
+    A checked view of a filter.
+
+    This is only valid as long as the section's data is. The key section
+    is not needed to probe it.
+*/
+struct CrabFilter
+{
+    /* All of these are private. */
+    const unsigned char *blocks;
+    uint64_t seed;
+    uint32_t num_blocks;
+    int key_type;
+};
+
+/*
+    Add a new section of 64-bit keys.
+
+    Use CRAB_SCHEMA and CRAB_PURPOSE_KEYS if you have no better.
+*/
+CrabSection *crab_file_add_keys(CrabFile *c, const uint64_t *keys, uint32_t count, const char *schema, uint16_t purpose);
+/*
+    Build a minimal perfect hash function over a key section, of the
+    given CrabKeyType, and add it as a new section that refers to it.
+
+    Keys must be distinct. This takes expected linear time, and the
+    result takes a little over 5 bytes per key.
+
+    Use CRAB_SCHEMA and CRAB_PURPOSE_HASH if you have no better.
+*/
+CrabSection *crab_file_add_hash(CrabFile *c, CrabSection *keys, int key_type, const char *schema, uint16_t purpose);
+/*
+    Check a hash index and its key section, and get a view of them.
+*/
+bool crab_hash_open(CrabSection *s, CrabHash *view);
+/*
+    Get the key type of the view.
+*/
+int crab_hash_key_type(const CrabHash *view);
+/*
+    Find the row for a string key: one hash, then one comparison against
+    the key section. Returns false if it isn't there (or the keys aren't
+    strings).
+*/
+bool crab_hash_find_string(const CrabHash *view, const char *str, size_t len, uint32_t *row);
+/*
+    Find the row for a 64-bit key, likewise.
+*/
+bool crab_hash_find_u64(const CrabHash *view, uint64_t key, uint32_t *row);
+
+/*
+    Build a blocked Bloom filter over a key section, of the given
+    CrabKeyType, and add it as a new section that refers to it.
+
+    Use about `bits_per_key` bits per key, or 0 for the default of 16,
+    which gives roughly 1 false positive in 1000. Duplicate keys are
+    fine.
+
+    Checking a key touches a single 32-byte block, so a miss costs one
+    cache line instead of a walk through the real index. To keep each
+    block within a cache line, sections with CRAB_PURPOSE_FILTER are
+    always saved 32-byte aligned; with any other purpose, this only asks
+    for it until the file is closed (see `crab_section_set_alignment`).
+
+    Use CRAB_SCHEMA and CRAB_PURPOSE_FILTER if you have no better.
+*/
+CrabSection *crab_file_add_filter(CrabFile *c, CrabSection *keys, int key_type, unsigned bits_per_key, const char *schema, uint16_t purpose);
+/*
+    Check a filter, and get a view of it.
+*/
+bool crab_filter_open(CrabSection *s, CrabFilter *view);
+/*
+    Get the key type of the view.
+*/
+int crab_filter_key_type(const CrabFilter *view);
+/*
+    Check whether a string key might be in the key section. If this
+    returns false, it definitely isn't, and there's no need to look it
+    up in the real index (nor if the keys aren't strings).
+*/
+bool crab_filter_check_string(const CrabFilter *view, const char *str, size_t len);
+/*
+    Check whether a 64-bit key might be in the key section, likewise.
+*/
+bool crab_filter_check_u64(const CrabFilter *view, uint64_t key);
+/*
+    Check many string keys at once. This prefetches each batch of blocks
+    before checking any, and uses AVX2 where the CPU has it.
+*/
+void crab_filter_check_many_strings(const CrabFilter *view, const char *const *strs, const size_t *lens, size_t count, bool *out);
+/*
+    Check many 64-bit keys at once, likewise.
+*/
+void crab_filter_check_many_u64(const CrabFilter *view, const uint64_t *keys, size_t count, bool *out);
+
+/*
+    64-bit keys, usually with purpose = CRAB_PURPOSE_KEYS.
+
+    The section is nothing but an array of these.
+*/
+struct __attribute__((scalar_storage_order("big-endian"))) CrabKeysData
+{
+    uint64_t key;
+};
+
+/*
+    A minimal perfect hash function, usually with purpose = CRAB_PURPOSE_HASH.
+
+    This is followed by `num_buckets` uint32_t pilots, then `num_keys`
+    uint32_t rows, then `num_slots - num_keys` uint32_t spare slots.
+
+    A key hashes (with `seed`) to 64 bits `h`. Its bucket `b` is the high
+    32 bits of `h` scaled to `num_buckets`, and its slot is
+    `(h ^ mix(pilots[b])) % num_slots`, where each pilot was chosen so that
+    no two keys share a slot. There are about 1% more slots than keys, to
+    keep building fast; a slot at `num_keys` or above is replaced by
+    `spare[slot - num_keys]`, one of the slots below that no key hashed
+    to. `rows[slot]` is then the key's row in the key section, at
+    `key_section` relative to this one. See keys.c for the exact hash
+    functions.
+*/
+struct __attribute__((scalar_storage_order("big-endian"))) CrabHashData
+{
+    uint32_t key_section;
+    uint8_t key_type;
+    uint8_t reserved[7];
+    uint32_t num_keys;
+    uint32_t num_buckets;
+    uint32_t num_slots;
+    uint64_t seed;
+};
+
+/*
+    A blocked Bloom filter, usually with purpose = CRAB_PURPOSE_FILTER.
+
+    This is followed by `num_blocks` blocks of 32 bytes. A block is 8
+    words of 32 bits, where bit `j` of a word is bit `j % 8` of its byte
+    `j / 8` - so, like packed.h, there is no endianness.
+
+    A key hashes (with `seed`, as for CrabHashData) to 64 bits `h`. Its
+    block is the high 32 bits of `h` scaled to `num_blocks`, and each
+    word `i` of that block has bit `(lo * salt[i]) >> 27` set, where
+    `lo` is the low 32 bits of `h`. See keys.c for the salts. The key
+    section, at `key_section` relative to this one, is only recorded for
+    tools; probing doesn't need it.
+*/
+struct __attribute__((scalar_storage_order("big-endian"))) CrabFilterData
+{
+    uint32_t key_section;
+    uint8_t key_type;
+    uint8_t reserved[11];
+    uint32_t num_keys;
+    uint32_t num_blocks;
+    uint64_t seed;
+};
+
+#pragma GCC visibility pop
@@ -0,0 +1,222 @@
+/*
+    CRAB - Compact Random-Access Binary
+    Copyright © 2018  Ben Longbons
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+#include "fwd.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+
+#pragma GCC visibility push(default)
+
+/*
+    Bit-packed integer arrays.
+
+    Each value takes the same number of bits, chosen when the section is
+    built as the fewest that fit the largest value. Any one value can be
+    read in constant time, and ranges are decoded with AVX2 where the CPU
+    has it.
+*/
+
+typedef struct CrabPackedInts CrabPackedInts;
+typedef struct CrabPackedIntsData CrabPackedIntsData;
+typedef struct CrabForInts CrabForInts;
+typedef struct CrabForIter CrabForIter;
+typedef struct CrabForIntsData CrabForIntsData;
+typedef struct CrabForBlock CrabForBlock;
+
+/*
+    A checked view of a packed integer section.
+
+    This is only valid as long as the section's data is.
+*/
+struct CrabPackedInts
+{
+    /* All of these are private. */
+    const unsigned char *packed;
+    uint64_t num_values;
+    unsigned bits;
+};
+
+/*
+    Add a new section holding `values`, packed as tightly as they allow.
+
+    Use CRAB_SCHEMA and CRAB_PURPOSE_PACKED_INTS if you have no better.
+*/
+CrabSection *crab_file_add_packed(CrabFile *c, const uint32_t *values, uint64_t count, const char *schema, uint16_t purpose);
+/*
+    Check a packed integer section, and get a view of it.
+*/
+bool crab_packed_open(CrabSection *s, CrabPackedInts *view);
+/*
+    Number of values.
+*/
+uint64_t crab_packed_count(const CrabPackedInts *view);
+/*
+    Bits per value, from 0 to 32.
+*/
+unsigned crab_packed_bits(const CrabPackedInts *view);
+/*
+    Get one value. `i` must be less than the count; this is not checked.
+*/
+uint32_t crab_packed_get(const CrabPackedInts *view, uint64_t i);
+/*
+    Decode `count` values starting at `start` into `out`.
+
+    Returns false if that goes past the end.
+*/
+bool crab_packed_decode(const CrabPackedInts *view, uint64_t start, size_t count, uint32_t *out);
+
+/*
+    Frame-of-reference integer arrays.
+
+    Values are split into blocks of CRAB_FOR_BLOCK_SIZE. Each block stores
+    a base, and either every value's offset from it, or (if smaller) the
+    difference from the previous value, bit-packed. Sorted or clustered
+    data, like offsets and timestamps, usually takes a few bits per value.
+    Random access decodes at most one block.
+*/
+enum
+{
+    CRAB_FOR_BLOCK_SIZE = 128,
+};
+
+/*
+    A checked view of a frame-of-reference section.
+
+    This is only valid as long as the section's data is.
+*/
+struct CrabForInts
+{
+    /* All of these are private. */
+    const CrabForIntsData *data;
+    const unsigned char *packed;
+    uint64_t num_values;
+    uint64_t num_blocks;
+};
+
+/*
+    Streaming state for reading a frame-of-reference section in order,
+    one block at a time.
+*/
+struct CrabForIter
+{
+    /* All of these are private. */
+    const CrabForInts *view;
+    uint64_t position;
+    uint64_t values[CRAB_FOR_BLOCK_SIZE];
+};
+
+/*
+    Add a new section holding `values`, encoded by blocks.
+
+    Use CRAB_SCHEMA and CRAB_PURPOSE_FOR_INTS if you have no better.
+*/
+CrabSection *crab_file_add_for(CrabFile *c, const uint64_t *values, uint64_t count, const char *schema, uint16_t purpose);
+/*
+    Check a frame-of-reference section, and get a view of it.
+
+    This reads every block header, so later access needs no checks.
+*/
+bool crab_for_open(CrabSection *s, CrabForInts *view);
+/*
+    Number of values.
+*/
+uint64_t crab_for_count(const CrabForInts *view);
+/*
+    Get one value. `i` must be less than the count; this is not checked.
+*/
+uint64_t crab_for_get(const CrabForInts *view, uint64_t i);
+/*
+    Decode all of block `b` (value `b * CRAB_FOR_BLOCK_SIZE` onwards) into
+    `out`, which must have room for CRAB_FOR_BLOCK_SIZE values.
+
+    Returns the number of values in the block, or 0 if there is no such
+    block.
+*/
+size_t crab_for_decode_block(const CrabForInts *view, uint64_t b, uint64_t *out);
+/*
+    Start reading at value `start`.
+*/
+void crab_for_iter_start(const CrabForInts *view, CrabForIter *it, uint64_t start);
+/*
+    Get the next values, up to the end of the current block.
+
+    The values are only valid until the next call. Returns 0 at the end.
+*/
+size_t crab_for_iter_next(CrabForIter *it, const uint64_t **values);
+
+/*
+    Packed integers, usually with purpose = CRAB_PURPOSE_PACKED_INTS.
+
+    Value `i` is bits `[i * bits, (i + 1) * bits)` of `packed`, where bit
+    `k` is bit `k % 8` of byte `k / 8`. The stream is zero-padded to a
+    multiple of 8 bytes, then followed by 8 more zero bytes, so that any
+    value can be read with one unaligned 64-bit load.
+*/
+struct __attribute__((scalar_storage_order("big-endian"))) CrabPackedIntsData
+{
+    uint64_t num_values;
+    uint8_t bits;
+    uint8_t reserved[7];
+    unsigned char packed[0];
+};
+
+enum CrabForBlockFlag
+{
+    /* The packed values are differences from the previous value. */
+    CRAB_FOR_BLOCK_FLAG_DELTA = 0x01,
+};
+
+/*
+    The header for one block of a CrabForIntsData.
+
+    The block's values are packed like CrabPackedIntsData, starting
+    `offset` bytes into the packed area. Without CRAB_FOR_BLOCK_FLAG_DELTA,
+    value `k` is `base + packed[k]`; with it, value `k` is
+    `base + packed[0] + ... + packed[k]`, where `packed[0]` is always 0.
+    Arithmetic wraps.
+*/
+struct __attribute__((scalar_storage_order("big-endian"))) CrabForBlock
+{
+    uint64_t base;
+    uint32_t offset;
+    uint8_t bits;
+    uint8_t flags;
+    uint16_t reserved;
+};
+
+/*
+    Frame-of-reference integers, usually with purpose = CRAB_PURPOSE_FOR_INTS.
+
+    There is one block for every CRAB_FOR_BLOCK_SIZE values (the last one
+    may be short), and the packed area follows the blocks to the end of
+    the section. Each block's stream is a multiple of 8 bytes, and there
+    are 8 bytes of zero slack at the end.
+*/
+struct __attribute__((scalar_storage_order("big-endian"))) CrabForIntsData
+{
+    uint64_t num_values;
+    uint32_t block_size;
+    uint32_t reserved;
+    CrabForBlock blocks[0];
+};
+
+#pragma GCC visibility pop
@@ -0,0 +1,179 @@
+/*
+    CRAB - Compact Random-Access Binary
+    Copyright © 2018  Ben Longbons
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+#include "fwd.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+
+#pragma GCC visibility push(default)
+
+/*
+    Run-length encoded columns.
+
+    A column that is mostly long runs of the same value is stored as just
+    the start of each run and its value. A lookup is a binary search over
+    the starts, laid out in Eytzinger (breadth-first) order so that the
+    first several levels share a few cache lines, and the next ones can be
+    prefetched.
+*/
+
+typedef struct CrabRuns CrabRuns;
+typedef struct CrabRunsData CrabRunsData;
+typedef struct CrabInterval CrabInterval;
+typedef struct CrabIntervals CrabIntervals;
+typedef struct CrabIntervalsData CrabIntervalsData;
+
+/*
+    A checked view of a run-length section.
+
+    This is only valid as long as the section's data is.
+*/
+struct CrabRuns
+{
+    /* All of these are private. */
+    const CrabRunsData *data;
+    uint64_t num_values;
+    uint32_t num_runs;
+};
+
+/*
+    Add a new section holding `values`, which must have fewer than 2**32
+    elements, as runs.
+
+    Use CRAB_SCHEMA and CRAB_PURPOSE_RUNS if you have no better.
+*/
+CrabSection *crab_file_add_runs(CrabFile *c, const uint32_t *values, uint64_t count, const char *schema, uint16_t purpose);
+/*
+    Check a run-length section, and get a view of it.
+*/
+bool crab_runs_open(CrabSection *s, CrabRuns *view);
+/*
+    Number of values (not runs).
+*/
+uint64_t crab_runs_count(const CrabRuns *view);
+/*
+    Number of runs.
+*/
+uint32_t crab_runs_num_runs(const CrabRuns *view);
+/*
+    Get the value at `i`, which must be less than the count; this is not
+    checked.
+*/
+uint32_t crab_runs_get(const CrabRuns *view, uint32_t i);
+/*
+    Get the values at `count` positions at once, all of which must be less
+    than the count.
+
+    The searches are interleaved, so that their cache misses overlap; this
+    is much faster than separate calls for large, cold sections.
+*/
+void crab_runs_get_many(const CrabRuns *view, const uint32_t *positions, size_t count, uint32_t *out);
+
+/*
+    Interval maps.
+
+    Like runs, but keyed by 64-bit ranges that may have gaps between
+    them, such as blocks of code points or of IDs.
+*/
+
+/*
+    One range of keys, `first` to `last` inclusive, and its value.
+*/
+struct CrabInterval
+{
+    uint64_t first;
+    uint64_t last;
+    uint32_t value;
+};
+
+/*
+    A checked view of an interval map section.
+
+    This is only valid as long as the section's data is.
+*/
+struct CrabIntervals
+{
+    /* All of these are private. */
+    const CrabIntervalsData *data;
+    uint32_t num_intervals;
+};
+
+/*
+    Add a new section mapping each of the `intervals`, which may be in
+    any order but must not overlap, to its value. Intervals that touch
+    and have the same value are merged.
+
+    Use CRAB_SCHEMA and CRAB_PURPOSE_INTERVALS if you have no better.
+*/
+CrabSection *crab_file_add_intervals(CrabFile *c, const CrabInterval *intervals, size_t count, const char *schema, uint16_t purpose);
+/*
+    Check an interval map section, and get a view of it.
+*/
+bool crab_intervals_open(CrabSection *s, CrabIntervals *view);
+/*
+    Number of intervals, after merging.
+*/
+uint32_t crab_intervals_count(const CrabIntervals *view);
+/*
+    Find the value for `key`. Returns false if no interval contains it.
+*/
+bool crab_intervals_get(const CrabIntervals *view, uint64_t key, uint32_t *value);
+/*
+    Find the values for `count` keys at once; keys that no interval
+    contains get `missing`.
+
+    Like `crab_runs_get_many()`, the searches are interleaved.
+*/
+void crab_intervals_get_many(const CrabIntervals *view, const uint64_t *keys, size_t count, uint32_t missing, uint32_t *out);
+
+/*
+    Runs, usually with purpose = CRAB_PURPOSE_RUNS.
+
+    This is followed by two arrays of uint32_t, `starts` and `values`,
+    which each have `num_runs + 1` elements. Element 0 is
+    unused (and zero); elements 1 to `num_runs` are the runs in Eytzinger
+    order, so that element `k`'s children are `2k` and `2k + 1`, and an
+    in-order walk gives the runs sorted by start. The first run starts at
+    0, and each run lasts until the next one starts, or `num_values`.
+*/
+struct __attribute__((scalar_storage_order("big-endian"))) CrabRunsData
+{
+    uint64_t num_values;
+    uint32_t num_runs;
+    uint32_t reserved;
+};
+
+/*
+    Interval maps, usually with purpose = CRAB_PURPOSE_INTERVALS.
+
+    This is followed by three arrays with `num_intervals + 1` elements:
+    uint64_t `firsts`, uint64_t `lasts`, and uint32_t `values`. As with
+    CrabRunsData, element 0 is unused and the rest are in Eytzinger
+    order. The intervals don't overlap, and each includes its `last`.
+*/
+struct __attribute__((scalar_storage_order("big-endian"))) CrabIntervalsData
+{
+    uint32_t num_intervals;
+    uint32_t reserved;
+};
+
+#pragma GCC visibility pop
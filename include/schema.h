@@ -53,6 +53,87 @@ enum CrabPurpose
         fact, there may be more than one (e.g. in case of merges).
     */
     CRAB_PURPOSE_PURPOSE = 4,
+    /*
+        CrabStringIndexData (see format.h)
+
+        A general-purpose CFBS index, mapping IDs to strings and back.
+    */
+    CRAB_PURPOSE_STRINGS = 5,
+    /*
+        CrabPackedIntsData (see packed.h)
+
+        An array of unsigned integers, each stored in as few bits as the
+        largest one needs.
+    */
+    CRAB_PURPOSE_PACKED_INTS = 6,
+    /*
+        CrabForIntsData (see packed.h)
+
+        An array of unsigned 64-bit integers, in blocks that each store a
+        base and small offsets or deltas from it.
+    */
+    CRAB_PURPOSE_FOR_INTS = 7,
+    /*
+        CrabRunsData (see runs.h)
+
+        An array of unsigned integers, stored as runs of equal values.
+    */
+    CRAB_PURPOSE_RUNS = 8,
+    /*
+        CrabTrieData (see trie.h)
+
+        An array of unsigned integers, as a multi-stage table of
+        deduplicated blocks.
+    */
+    CRAB_PURPOSE_TRIE = 9,
+    /*
+        CrabIntervalsData (see runs.h)
+
+        A map from ranges of unsigned integers to values.
+    */
+    CRAB_PURPOSE_INTERVALS = 10,
+    /*
+        CrabKeysData (see keys.h)
+
+        An array of 64-bit keys.
+    */
+    CRAB_PURPOSE_KEYS = 11,
+    /*
+        CrabHashData (see keys.h)
+
+        A minimal perfect hash function over a key section.
+    */
+    CRAB_PURPOSE_HASH = 12,
+    /*
+        CrabFilterData (see keys.h)
+
+        A blocked Bloom filter over a key section.
+    */
+    CRAB_PURPOSE_FILTER = 13,
+    /*
+        CrabBitmapData (see bitmap.h)
+
+        A compressed set of 32-bit integers.
+    */
+    CRAB_PURPOSE_BITMAP = 14,
+    /*
+        CrabDictData (see dict.h)
+
+        A string column, stored as bit-packed codes into a CFBS index.
+    */
+    CRAB_PURPOSE_DICT = 15,
+    /*
+        CrabCompressedData (see compress.h)
+
+        Any data, compressed in blocks that can be read on their own.
+    */
+    CRAB_PURPOSE_COMPRESSED = 16,
+    /*
+        CrabChecksumData (see checksum.h)
+
+        The CRC32C of every other section. Maintained by crab_file_save().
+    */
+    CRAB_PURPOSE_CHECKSUMS = 17,
 };
 
 /* purpose = 3 */
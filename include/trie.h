@@ -0,0 +1,144 @@
+/*
+    CRAB - Compact Random-Access Binary
+    Copyright © 2018  Ben Longbons
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+#include "fwd.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+
+#pragma GCC visibility push(default)
+
+/*
+    Multi-stage lookup tables ("tries"), for dense properties such as
+    those of Unicode code points.
+
+    The values are split into blocks, identical blocks are stored once,
+    and a top-level index says where each block is. With three stages,
+    the top-level index is itself split into blocks and deduplicated. A
+    lookup is two or three dependent loads; `crab_trie_get_inline()`
+    below does one without a function call.
+*/
+
+typedef struct CrabTrie CrabTrie;
+typedef struct CrabTrieData CrabTrieData;
+
+/*
+    A checked view of a trie section.
+
+    This is only valid as long as the section's data is. The fields are
+    only public for the sake of `crab_trie_get_inline()`.
+*/
+struct CrabTrie
+{
+    const void *top;
+    const void *mid;
+    const unsigned char *leaf;
+    uint64_t num_values;
+    uint64_t leaf_mask;
+    uint64_t mid_mask;
+    unsigned leaf_bits;
+    unsigned top_shift;
+    unsigned value_bytes;
+};
+
+/*
+    Add a new section holding `values` as a trie.
+
+    Leaf blocks are `2**leaf_bits` values; if `leaf_bits` is 0, the size
+    that gives the smallest section is chosen. If `mid_bits` is nonzero,
+    there are three stages, with middle blocks of `2**mid_bits` entries.
+
+    Each value is stored in 1, 2, or 4 bytes, whichever is enough for
+    the largest.
+
+    Use CRAB_SCHEMA and CRAB_PURPOSE_TRIE if you have no better.
+*/
+CrabSection *crab_file_add_trie(CrabFile *c, const uint32_t *values, uint64_t count, unsigned leaf_bits, unsigned mid_bits, const char *schema, uint16_t purpose);
+/*
+    Check a trie section, and get a view of it.
+
+    This checks every index entry, so lookups need no checks.
+*/
+bool crab_trie_open(CrabSection *s, CrabTrie *view);
+/*
+    Number of values.
+*/
+uint64_t crab_trie_count(const CrabTrie *view);
+/*
+    Get the value at `i`, which must be less than the count; this is not
+    checked. This is `crab_trie_get_inline()`, out of line.
+*/
+uint32_t crab_trie_get(const CrabTrie *view, uint64_t i);
+
+/*
+    Tries, usually with purpose = CRAB_PURPOSE_TRIE.
+
+    This is followed by `top_size` uint32_t, then `mid_size` uint32_t,
+    then `leaf_size` values of `value_bytes` bytes each.
+
+    Each top entry is the index of a block in the next stage (the middle
+    one if there is one, else the leaf one), and each middle entry is the
+    index of a block in the leaf stage. Indices are in entries, not
+    blocks, and every block must fit. The last block is padded with 0.
+*/
+struct __attribute__((scalar_storage_order("big-endian"))) CrabTrieData
+{
+    uint64_t num_values;
+    uint8_t num_stages;
+    uint8_t value_bytes;
+    uint8_t leaf_bits;
+    uint8_t mid_bits;
+    uint32_t top_size;
+    uint32_t mid_size;
+    uint32_t leaf_size;
+};
+
+typedef struct __attribute__((scalar_storage_order("big-endian"))) CrabTrieWord
+{
+    uint32_t v;
+} CrabTrieWord;
+typedef struct __attribute__((scalar_storage_order("big-endian"))) CrabTrieHalf
+{
+    uint16_t v;
+} CrabTrieHalf;
+
+/*
+    Get the value at `i`, which must be less than the count; this is not
+    checked.
+*/
+static __inline__ uint32_t crab_trie_get_inline(const CrabTrie *view, uint64_t i)
+{
+    uint64_t j = ((const CrabTrieWord *)view->top)[i >> view->top_shift].v;
+    if (view->mid)
+        j = ((const CrabTrieWord *)view->mid)[j + ((i >> view->leaf_bits) & view->mid_mask)].v;
+    j += i & view->leaf_mask;
+    switch (view->value_bytes)
+    {
+    case 1:
+        return view->leaf[j];
+    case 2:
+        return ((const CrabTrieHalf *)view->leaf)[j].v;
+    default:
+        return ((const CrabTrieWord *)view->leaf)[j].v;
+    }
+}
+
+#pragma GCC visibility pop
@@ -0,0 +1,741 @@
+/*
+    CRAB - Compact Random-Access Binary
+    Copyright © 2018  Ben Longbons
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "bitmap.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_AVX2_OPS 1
+#else
+#define HAVE_AVX2_OPS 0
+#endif
+
+#include "bits.h"
+#include "crab.h"
+#include "internal.h"
+#include "util.h"
+
+
+/* This macro captures `c` implicitly. */
+#undef ERROR
+#define ERROR(f)        ERROR2(f, errno)
+#define ERROR2(f, e)            \
+({                              \
+    c->error_message = (f);     \
+    c->error_number = (e);      \
+    goto err;                   \
+})
+
+#define CONTAINER_WORDS 1024
+#define CONTAINER_BYTES (CONTAINER_WORDS * 8)
+/* Past this many members, an array is bigger than a bitmap. */
+#define ARRAY_MAX 4096
+/* Runs are apart, so there can be no more than this many. */
+#define RUNS_MAX 32768
+
+typedef struct __attribute__((scalar_storage_order("big-endian"))) CrabBitmapHalf
+{
+    uint16_t v;
+} CrabBitmapHalf;
+
+/*
+    Containers are appended here one at a time, then copied into place
+    once there are no more.
+*/
+typedef struct BitmapBuilder BitmapBuilder;
+struct BitmapBuilder
+{
+    CrabBitmapContainer *containers;
+    uint32_t num_containers;
+    uint32_t containers_capacity;
+    unsigned char *payload;
+    uint64_t payload_size;
+    uint64_t payload_capacity;
+    uint64_t cardinality;
+};
+
+static void builder_free(BitmapBuilder *b)
+{
+    free(b->containers);
+    free(b->payload);
+    memset(b, 0, sizeof(*b));
+}
+
+static uint64_t container_size(const CrabBitmapContainer *k)
+{
+    switch (k->kind)
+    {
+    case CRAB_BITMAP_KIND_ARRAY:
+        return (uint64_t)k->count * sizeof(CrabBitmapHalf);
+    case CRAB_BITMAP_KIND_BITS:
+        return CONTAINER_BYTES;
+    case CRAB_BITMAP_KIND_RUNS:
+        return (uint64_t)k->count * sizeof(CrabBitmapRun);
+    }
+    return 0;
+}
+
+/*
+    Start a container of `cardinality` members, and return where its
+    contents go, zeroed. Sets errno and returns NULL on failure.
+*/
+static unsigned char *builder_add(BitmapBuilder *b, uint16_t key, uint8_t kind, uint32_t count, uint32_t cardinality)
+{
+    CrabBitmapContainer *k;
+    unsigned char *p;
+    uint64_t size;
+
+    if (b->num_containers == b->containers_capacity)
+    {
+        uint32_t capacity = b->containers_capacity ? b->containers_capacity * 2 : 16;
+        CrabBitmapContainer *containers = (CrabBitmapContainer *)realloc(b->containers, capacity * sizeof(*containers));
+        if (!containers)
+            return NULL;
+        b->containers = containers;
+        b->containers_capacity = capacity;
+    }
+    k = &b->containers[b->num_containers];
+    k->key = key;
+    k->kind = kind;
+    k->reserved = 0;
+    k->count = count;
+    size = (container_size(k) + 7) / 8 * 8;
+    /* Container offsets are only 32 bits. */
+    if (b->payload_size + size > UINT32_MAX)
+    {
+        errno = EOVERFLOW;
+        return NULL;
+    }
+    if (b->payload_size + size > b->payload_capacity)
+    {
+        uint64_t capacity = b->payload_capacity ? b->payload_capacity * 2 : CONTAINER_BYTES;
+        unsigned char *payload;
+        if (capacity < b->payload_size + size)
+            capacity = b->payload_size + size;
+        payload = (unsigned char *)realloc(b->payload, capacity);
+        if (!payload)
+            return NULL;
+        b->payload = payload;
+        b->payload_capacity = capacity;
+    }
+    k->rank = b->cardinality;
+    k->offset = b->payload_size;
+    p = b->payload + b->payload_size;
+    memset(p, 0, size);
+    b->payload_size += size;
+    b->cardinality += cardinality;
+    ++b->num_containers;
+    return p;
+}
+
+static CrabSection *builder_finish(CrabFile *c, BitmapBuilder *b, const char *schema, uint16_t purpose)
+{
+    CrabBitmapData *data = NULL;
+    CrabSection *s;
+    uint64_t list_size = (uint64_t)b->num_containers * sizeof(CrabBitmapContainer);
+    uint64_t size = sizeof(*data) + list_size + b->payload_size;
+
+    /* The payload was kept under 4 GiB as it grew. */
+    if (size != (size_t)size)
+        ERROR2("<num values>", EOVERFLOW);
+    data = (CrabBitmapData *)TRY_P(calloc, (1, size));
+    data->cardinality = b->cardinality;
+    data->num_containers = b->num_containers;
+    if (list_size)
+        memcpy(data + 1, b->containers, list_size);
+    if (b->payload_size)
+        memcpy((unsigned char *)(data + 1) + list_size, b->payload, b->payload_size);
+    builder_free(b);
+
+    s = TRY_P(crab_file_section_add_many, (c, 1, schema, purpose));
+    TRY_B(crab_section_set_data, (s, CRAB_SECTION_FLAG_OWN, (CrabAbstractData *)data, size));
+    return s;
+
+err:
+    builder_free(b);
+    free(data);
+    maybe_perror(c);
+    return NULL;
+}
+
+/*
+    Add the members in `words` as a container, in whichever form is
+    smallest, or nothing if there are none.
+*/
+static bool encode_words(BitmapBuilder *b, uint16_t key, const uint64_t *words)
+{
+    uint32_t cardinality = 0, num_runs = 0, n, i;
+    uint64_t carry = 0, array_size, runs_size;
+    unsigned char *p;
+
+    for (i = 0; i < CONTAINER_WORDS; ++i)
+    {
+        uint64_t w = words[i];
+        cardinality += __builtin_popcountll(w);
+        /* a run starts at each member whose predecessor isn't one */
+        num_runs += __builtin_popcountll(w & ~(w << 1 | carry));
+        carry = w >> 63;
+    }
+    if (!cardinality)
+        return true;
+
+    array_size = cardinality <= ARRAY_MAX ? cardinality * sizeof(CrabBitmapHalf) : UINT64_MAX;
+    runs_size = num_runs * sizeof(CrabBitmapRun);
+    if (array_size <= runs_size && array_size <= CONTAINER_BYTES)
+    {
+        CrabBitmapHalf *halves;
+        p = builder_add(b, key, CRAB_BITMAP_KIND_ARRAY, cardinality, cardinality);
+        if (!p)
+            return false;
+        halves = (CrabBitmapHalf *)p;
+        for (i = 0, n = 0; i < CONTAINER_WORDS; ++i)
+        {
+            uint64_t w;
+            for (w = words[i]; w; w &= w - 1)
+                halves[n++].v = i * 64 + __builtin_ctzll(w);
+        }
+    }
+    else if (runs_size < CONTAINER_BYTES)
+    {
+        CrabBitmapRun *runs;
+        p = builder_add(b, key, CRAB_BITMAP_KIND_RUNS, num_runs, cardinality);
+        if (!p)
+            return false;
+        runs = (CrabBitmapRun *)p;
+        for (i = 0, n = 0; i < CONTAINER_WORDS; ++i)
+        {
+            uint64_t w;
+            for (w = words[i]; w; w &= w - 1)
+            {
+                uint32_t v = i * 64 + __builtin_ctzll(w);
+                if (n && runs[n - 1].last + 1u == v)
+                    runs[n - 1].last = v;
+                else
+                {
+                    runs[n].start = runs[n].last = v;
+                    ++n;
+                }
+            }
+        }
+    }
+    else
+    {
+        p = builder_add(b, key, CRAB_BITMAP_KIND_BITS, CONTAINER_WORDS, cardinality);
+        if (!p)
+            return false;
+        for (i = 0; i < CONTAINER_WORDS; ++i)
+            store_le64(p + 8 * i, words[i]);
+    }
+    return true;
+}
+
+static const unsigned char *container_data(const CrabBitmap *view, uint32_t i)
+{
+    return view->payload + view->containers[i].offset;
+}
+static uint32_t container_cardinality(const CrabBitmap *view, uint32_t i)
+{
+    uint64_t next = i + 1 < view->num_containers ? view->containers[i + 1].rank : view->cardinality;
+    return next - view->containers[i].rank;
+}
+
+static void set_range(uint64_t *words, uint32_t start, uint32_t last)
+{
+    uint32_t w;
+    for (w = start / 64; w <= last / 64; ++w)
+    {
+        uint64_t mask = ~(uint64_t)0;
+        if (w == start / 64)
+            mask &= ~(uint64_t)0 << (start % 64);
+        if (w == last / 64)
+            mask &= ~(uint64_t)0 >> (63 - last % 64);
+        words[w] |= mask;
+    }
+}
+
+/* Expand container `i` into a plain bitmap. */
+static void expand(const CrabBitmap *view, uint32_t i, uint64_t *words)
+{
+    const CrabBitmapContainer *k = &view->containers[i];
+    const unsigned char *p = container_data(view, i);
+    uint32_t j, n = k->count;
+
+    memset(words, 0, CONTAINER_BYTES);
+    switch (k->kind)
+    {
+    case CRAB_BITMAP_KIND_ARRAY:
+        for (j = 0; j < n; ++j)
+        {
+            uint16_t v = ((const CrabBitmapHalf *)p)[j].v;
+            words[v / 64] |= (uint64_t)1 << (v % 64);
+        }
+        break;
+    case CRAB_BITMAP_KIND_BITS:
+        for (j = 0; j < CONTAINER_WORDS; ++j)
+            words[j] = load_le64(p + 8 * j);
+        break;
+    case CRAB_BITMAP_KIND_RUNS:
+        for (j = 0; j < n; ++j)
+            set_range(words, ((const CrabBitmapRun *)p)[j].start, ((const CrabBitmapRun *)p)[j].last);
+        break;
+    }
+}
+
+/* Copy container `i` as-is, for members that only one side has. */
+static bool copy_container(BitmapBuilder *b, const CrabBitmap *view, uint32_t i)
+{
+    const CrabBitmapContainer *k = &view->containers[i];
+    unsigned char *p = builder_add(b, k->key, k->kind, k->count, container_cardinality(view, i));
+    if (!p)
+        return false;
+    memcpy(p, container_data(view, i), container_size(k));
+    return true;
+}
+
+static void combine_scalar(int op, uint64_t *x, const uint64_t *y)
+{
+    size_t i;
+    switch (op)
+    {
+    case CRAB_BITMAP_OP_AND:
+        for (i = 0; i < CONTAINER_WORDS; ++i)
+            x[i] &= y[i];
+        break;
+    case CRAB_BITMAP_OP_OR:
+        for (i = 0; i < CONTAINER_WORDS; ++i)
+            x[i] |= y[i];
+        break;
+    case CRAB_BITMAP_OP_ANDNOT:
+        for (i = 0; i < CONTAINER_WORDS; ++i)
+            x[i] &= ~y[i];
+        break;
+    }
+}
+
+#if HAVE_AVX2_OPS
+__attribute__((target("avx2")))
+static void combine_avx2(int op, uint64_t *x, const uint64_t *y)
+{
+    size_t i;
+    for (i = 0; i < CONTAINER_WORDS; i += 4)
+    {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(x + i));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(y + i));
+        if (op == CRAB_BITMAP_OP_AND)
+            a = _mm256_and_si256(a, b);
+        else if (op == CRAB_BITMAP_OP_OR)
+            a = _mm256_or_si256(a, b);
+        else
+            a = _mm256_andnot_si256(b, a);
+        _mm256_storeu_si256((__m256i *)(x + i), a);
+    }
+}
+#endif
+
+/* x = x op y, over a whole container. */
+static void combine(int op, uint64_t *x, const uint64_t *y)
+{
+#if HAVE_AVX2_OPS
+    if (have_avx2())
+    {
+        combine_avx2(op, x, y);
+        return;
+    }
+#endif
+    combine_scalar(op, x, y);
+}
+
+static int compare_u32(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+
+CrabSection *crab_file_add_bitmap(CrabFile *c, const uint32_t *values, size_t count, const char *schema, uint16_t purpose)
+{
+    BitmapBuilder b;
+    uint32_t *sorted = NULL;
+    uint64_t *words = NULL;
+    size_t i, j;
+
+    memset(&b, 0, sizeof(b));
+    sorted = TRY_P(memdup_plus, (values, count * sizeof(*values), 1));
+    words = TRY_P(malloc, (CONTAINER_BYTES));
+    qsort(sorted, count, sizeof(*sorted), compare_u32);
+    for (i = 0; i < count; i = j)
+    {
+        uint16_t key = sorted[i] >> 16;
+        memset(words, 0, CONTAINER_BYTES);
+        for (j = i; j < count && sorted[j] >> 16 == key; ++j)
+            words[(sorted[j] & 0xffff) / 64] |= (uint64_t)1 << (sorted[j] % 64);
+        if (!encode_words(&b, key, words))
+            ERROR("<num values>");
+    }
+    free(sorted);
+    free(words);
+    return builder_finish(c, &b, schema, purpose);
+
+err:
+    builder_free(&b);
+    free(sorted);
+    free(words);
+    maybe_perror(c);
+    return NULL;
+}
+
+CrabSection *crab_file_add_bitmap_bytes(CrabFile *c, const unsigned char *bytes, uint64_t count, const char *schema, uint16_t purpose)
+{
+    BitmapBuilder b;
+    uint64_t *words = NULL;
+    uint64_t i, j;
+
+    memset(&b, 0, sizeof(b));
+    /* Members are only 32 bits. */
+    if (count > (uint64_t)UINT32_MAX + 1)
+        ERROR2("<num values>", EOVERFLOW);
+    words = TRY_P(malloc, (CONTAINER_BYTES));
+    for (i = 0; i < count; i += CONTAINER_BYTES * 8)
+    {
+        uint64_t n = count - i < CONTAINER_BYTES * 8 ? count - i : CONTAINER_BYTES * 8;
+        memset(words, 0, CONTAINER_BYTES);
+        for (j = 0; j < n; ++j)
+            words[j / 64] |= (uint64_t)(bytes[i + j] != 0) << (j % 64);
+        if (!encode_words(&b, i >> 16, words))
+            ERROR("<num values>");
+    }
+    free(words);
+    return builder_finish(c, &b, schema, purpose);
+
+err:
+    builder_free(&b);
+    free(words);
+    maybe_perror(c);
+    return NULL;
+}
+
+CrabSection *crab_file_add_bitmap_op(CrabFile *c, const CrabBitmap *a, const CrabBitmap *b, int op, const char *schema, uint16_t purpose)
+{
+    BitmapBuilder out;
+    uint64_t *x = NULL, *y = NULL;
+    uint32_t i = 0, j = 0;
+
+    memset(&out, 0, sizeof(out));
+    if (op != CRAB_BITMAP_OP_AND && op != CRAB_BITMAP_OP_OR && op != CRAB_BITMAP_OP_ANDNOT)
+        ERROR2("<bitmap op>", EINVAL);
+    x = TRY_P(malloc, (CONTAINER_BYTES));
+    y = TRY_P(malloc, (CONTAINER_BYTES));
+    while (i < a->num_containers || j < b->num_containers)
+    {
+        uint32_t ka = i < a->num_containers ? a->containers[i].key : 0x10000;
+        uint32_t kb = j < b->num_containers ? b->containers[j].key : 0x10000;
+        if (ka < kb)
+        {
+            if (op != CRAB_BITMAP_OP_AND && !copy_container(&out, a, i))
+                ERROR("<num values>");
+            ++i;
+        }
+        else if (kb < ka)
+        {
+            if (op == CRAB_BITMAP_OP_OR && !copy_container(&out, b, j))
+                ERROR("<num values>");
+            ++j;
+        }
+        else
+        {
+            expand(a, i++, x);
+            expand(b, j++, y);
+            combine(op, x, y);
+            if (!encode_words(&out, ka, x))
+                ERROR("<num values>");
+        }
+    }
+    free(x);
+    free(y);
+    return builder_finish(c, &out, schema, purpose);
+
+err:
+    builder_free(&out);
+    free(x);
+    free(y);
+    maybe_perror(c);
+    return NULL;
+}
+
+bool crab_bitmap_open(CrabSection *s, CrabBitmap *view)
+{
+    CrabFile *c = s->c;
+    const CrabBitmapData *data = (const CrabBitmapData *)crab_section_data(s);
+    uint64_t size = crab_section_data_size(s);
+    uint64_t payload_size, expected_rank = 0;
+    const CrabBitmapContainer *containers;
+    const unsigned char *payload;
+    uint32_t n, i, j;
+
+    if (!data && size)
+        goto err;
+    if (size < sizeof(CrabBitmapData))
+        goto fmt_err;
+    n = data->num_containers;
+    if (n > 0x10000 || size - sizeof(CrabBitmapData) < (uint64_t)n * sizeof(CrabBitmapContainer))
+        goto fmt_err;
+    containers = (const CrabBitmapContainer *)(data + 1);
+    payload = (const unsigned char *)(containers + n);
+    payload_size = size - sizeof(CrabBitmapData) - (uint64_t)n * sizeof(CrabBitmapContainer);
+
+    /*
+        Check that every container is in bounds and has as many members
+        as the ranks say, so that select can't run off the end.
+    */
+    for (i = 0; i < n; ++i)
+    {
+        const CrabBitmapContainer *k = &containers[i];
+        const unsigned char *p = payload + k->offset;
+        uint64_t cardinality = 0;
+        if (i && k->key <= containers[i - 1].key)
+            goto fmt_err;
+        if (k->rank != expected_rank || k->offset % 8)
+            goto fmt_err;
+        if (k->offset > payload_size || container_size(k) > payload_size - k->offset)
+            goto fmt_err;
+        switch (k->kind)
+        {
+        case CRAB_BITMAP_KIND_ARRAY:
+            if (!k->count || k->count > ARRAY_MAX)
+                goto fmt_err;
+            cardinality = k->count;
+            break;
+        case CRAB_BITMAP_KIND_BITS:
+            if (k->count != CONTAINER_WORDS)
+                goto fmt_err;
+            for (j = 0; j < CONTAINER_WORDS; ++j)
+                cardinality += __builtin_popcountll(load_le64(p + 8 * j));
+            break;
+        case CRAB_BITMAP_KIND_RUNS:
+            if (!k->count || k->count > RUNS_MAX)
+                goto fmt_err;
+            for (j = 0; j < k->count; ++j)
+            {
+                const CrabBitmapRun *run = &((const CrabBitmapRun *)p)[j];
+                if (run->start > run->last || (j && run->start <= run[-1].last))
+                    goto fmt_err;
+                cardinality += run->last - run->start + 1;
+            }
+            break;
+        default:
+            goto fmt_err;
+        }
+        if (!cardinality)
+            goto fmt_err;
+        expected_rank += cardinality;
+    }
+    if (data->cardinality != expected_rank)
+        goto fmt_err;
+
+    view->containers = containers;
+    view->payload = payload;
+    view->cardinality = expected_rank;
+    view->num_containers = n;
+    return true;
+
+fmt_err:
+    c->error_message = "<file format>";
+    c->error_number = EINVAL;
+err:
+    maybe_perror(c);
+    return false;
+}
+
+uint64_t crab_bitmap_count(const CrabBitmap *view)
+{
+    return view->cardinality;
+}
+
+/* The number of containers whose key is at most `key`. */
+static uint32_t containers_upto(const CrabBitmap *view, uint16_t key)
+{
+    uint32_t lo = 0, hi = view->num_containers;
+    while (lo < hi)
+    {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (view->containers[mid].key <= key)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/* The number of members of container `i` that are at most `low`. */
+static uint32_t container_rank(const CrabBitmap *view, uint32_t i, uint16_t low)
+{
+    const CrabBitmapContainer *k = &view->containers[i];
+    const unsigned char *p = container_data(view, i);
+    uint32_t rv = 0, lo, hi, j;
+
+    switch (k->kind)
+    {
+    case CRAB_BITMAP_KIND_ARRAY:
+        lo = 0;
+        hi = k->count;
+        while (lo < hi)
+        {
+            uint32_t mid = lo + (hi - lo) / 2;
+            if (((const CrabBitmapHalf *)p)[mid].v <= low)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        return lo;
+    case CRAB_BITMAP_KIND_BITS:
+        for (j = 0; j < low / 64u; ++j)
+            rv += __builtin_popcountll(load_le64(p + 8 * j));
+        return rv + __builtin_popcountll(load_le64(p + 8 * j) & ~(uint64_t)0 >> (63 - low % 64));
+    case CRAB_BITMAP_KIND_RUNS:
+        for (j = 0; j < k->count; ++j)
+        {
+            const CrabBitmapRun *run = &((const CrabBitmapRun *)p)[j];
+            if (run->start > low)
+                break;
+            rv += (run->last < low ? run->last : low) - run->start + 1;
+        }
+        return rv;
+    }
+    return 0;
+}
+
+bool crab_bitmap_contains(const CrabBitmap *view, uint32_t x)
+{
+    uint32_t i = containers_upto(view, x >> 16);
+    uint16_t low = x;
+
+    if (!i || view->containers[i - 1].key != x >> 16)
+        return false;
+    --i;
+    if (view->containers[i].kind == CRAB_BITMAP_KIND_BITS)
+        return container_data(view, i)[low / 8] >> (low % 8) & 1;
+    /* one more than a non-member, or one more than its predecessor */
+    return container_rank(view, i, low) != (low ? container_rank(view, i, low - 1) : 0);
+}
+
+uint64_t crab_bitmap_rank(const CrabBitmap *view, uint32_t x)
+{
+    uint32_t i = containers_upto(view, x >> 16);
+
+    if (!i)
+        return 0;
+    --i;
+    if (view->containers[i].key < x >> 16)
+        return view->containers[i].rank + (uint64_t)container_cardinality(view, i);
+    return view->containers[i].rank + (uint64_t)container_rank(view, i, x);
+}
+
+bool crab_bitmap_select(const CrabBitmap *view, uint64_t rank, uint32_t *x)
+{
+    const CrabBitmapContainer *k;
+    const unsigned char *p;
+    uint32_t lo = 0, hi = view->num_containers, i, j;
+    uint64_t w;
+
+    if (rank >= view->cardinality)
+        return false;
+    /* the last container that starts at or before `rank` */
+    while (hi - lo > 1)
+    {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (view->containers[mid].rank <= rank)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    i = lo;
+    k = &view->containers[i];
+    p = container_data(view, i);
+    j = rank - k->rank;
+    switch (k->kind)
+    {
+    case CRAB_BITMAP_KIND_ARRAY:
+        *x = (uint32_t)k->key << 16 | ((const CrabBitmapHalf *)p)[j].v;
+        return true;
+    case CRAB_BITMAP_KIND_BITS:
+        for (i = 0; ; ++i)
+        {
+            uint32_t count;
+            w = load_le64(p + 8 * i);
+            count = __builtin_popcountll(w);
+            if (j < count)
+                break;
+            j -= count;
+        }
+        for (; j; --j)
+            w &= w - 1;
+        *x = (uint32_t)k->key << 16 | (i * 64 + __builtin_ctzll(w));
+        return true;
+    case CRAB_BITMAP_KIND_RUNS:
+        for (i = 0; ; ++i)
+        {
+            const CrabBitmapRun *run = &((const CrabBitmapRun *)p)[i];
+            uint32_t length = run->last - run->start + 1;
+            if (j < length)
+            {
+                *x = (uint32_t)k->key << 16 | (run->start + j);
+                return true;
+            }
+            j -= length;
+        }
+    }
+    return false;
+}
+
+void crab_bitmap_decode(const CrabBitmap *view, uint32_t *out)
+{
+    uint32_t i, j, v;
+    uint64_t w;
+
+    for (i = 0; i < view->num_containers; ++i)
+    {
+        const CrabBitmapContainer *k = &view->containers[i];
+        const unsigned char *p = container_data(view, i);
+        uint32_t high = (uint32_t)k->key << 16;
+        switch (k->kind)
+        {
+        case CRAB_BITMAP_KIND_ARRAY:
+            for (j = 0; j < k->count; ++j)
+                *out++ = high | ((const CrabBitmapHalf *)p)[j].v;
+            break;
+        case CRAB_BITMAP_KIND_BITS:
+            for (j = 0; j < CONTAINER_WORDS; ++j)
+            {
+                for (w = load_le64(p + 8 * j); w; w &= w - 1)
+                    *out++ = high | (j * 64 + __builtin_ctzll(w));
+            }
+            break;
+        case CRAB_BITMAP_KIND_RUNS:
+            for (j = 0; j < k->count; ++j)
+            {
+                const CrabBitmapRun *run = &((const CrabBitmapRun *)p)[j];
+                for (v = run->start; v <= run->last; ++v)
+                    *out++ = high | v;
+            }
+            break;
+        }
+    }
+}
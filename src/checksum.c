@@ -0,0 +1,347 @@
+/*
+    CRAB - Compact Random-Access Binary
+    Copyright © 2018  Ben Longbons
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#define _GNU_SOURCE
+#include "checksum.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define HAVE_SSE42_CRC 1
+#else
+#define HAVE_SSE42_CRC 0
+#endif
+
+#include "internal.h"
+
+
+/* Castagnoli, bit-reflected */
+#define CRC32C_POLY 0x82f63b78
+/*
+    The hardware CRC has a latency of 3 cycles but a throughput of 1, so
+    three streams of this many bytes each are run at once, then combined.
+*/
+#define LANE_SIZE 8192
+/* How big buffers are split between threads. */
+#define CHUNK_SIZE ((size_t)1 << 20)
+
+/*
+    A linear map on CRC registers, as a table per byte of the input.
+    These are used to append a fixed number of zero bytes, which is how
+    CRCs of neighboring pieces are combined.
+*/
+typedef struct CrcShift CrcShift;
+struct CrcShift
+{
+    uint32_t t[4][256];
+};
+
+static uint32_t crc_table[8][256];
+static CrcShift lane_shift, chunk_shift;
+static pthread_once_t tables_once = PTHREAD_ONCE_INIT;
+
+static uint32_t gf2_times(const uint32_t *mat, uint32_t vec)
+{
+    uint32_t sum = 0;
+    while (vec)
+    {
+        if (vec & 1)
+            sum ^= *mat;
+        vec >>= 1;
+        ++mat;
+    }
+    return sum;
+}
+static void gf2_square(uint32_t *square, const uint32_t *mat)
+{
+    int n;
+    for (n = 0; n < 32; ++n)
+        square[n] = gf2_times(mat, mat[n]);
+}
+
+uint32_t crab_crc32c_combine(uint32_t crc1, uint32_t crc2, uint64_t size2)
+{
+    uint32_t even[32], odd[32], row = 1;
+    int n;
+
+    if (!size2)
+        return crc1 ^ crc2;
+    /* the operator for one zero bit */
+    odd[0] = CRC32C_POLY;
+    for (n = 1; n < 32; ++n)
+    {
+        odd[n] = row;
+        row <<= 1;
+    }
+    gf2_square(even, odd);
+    gf2_square(odd, even);
+    /* now odd is for 4 zero bits; square up to each bit of the size */
+    while (true)
+    {
+        gf2_square(even, odd);
+        if (size2 & 1)
+            crc1 = gf2_times(even, crc1);
+        size2 >>= 1;
+        if (!size2)
+            break;
+        gf2_square(odd, even);
+        if (size2 & 1)
+            crc1 = gf2_times(odd, crc1);
+        size2 >>= 1;
+        if (!size2)
+            break;
+    }
+    return crc1 ^ crc2;
+}
+
+static void make_shift(CrcShift *shift, uint64_t size)
+{
+    uint32_t cols[32];
+    int i, b;
+    for (i = 0; i < 32; ++i)
+        cols[i] = crab_crc32c_combine((uint32_t)1 << i, 0, size);
+    for (i = 0; i < 4; ++i)
+    {
+        for (b = 0; b < 256; ++b)
+        {
+            uint32_t v = 0;
+            int bit;
+            for (bit = 0; bit < 8; ++bit)
+            {
+                if (b & (1 << bit))
+                    v ^= cols[8 * i + bit];
+            }
+            shift->t[i][b] = v;
+        }
+    }
+}
+static uint32_t apply_shift(const CrcShift *shift, uint32_t crc)
+{
+    return shift->t[0][crc & 0xff] ^ shift->t[1][(crc >> 8) & 0xff] ^ shift->t[2][(crc >> 16) & 0xff] ^ shift->t[3][crc >> 24];
+}
+
+static void init_tables(void)
+{
+    uint32_t i;
+    int k;
+    for (i = 0; i < 256; ++i)
+    {
+        uint32_t crc = i;
+        for (k = 0; k < 8; ++k)
+            crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+        crc_table[0][i] = crc;
+    }
+    for (i = 0; i < 256; ++i)
+    {
+        for (k = 1; k < 8; ++k)
+            crc_table[k][i] = (crc_table[k - 1][i] >> 8) ^ crc_table[0][crc_table[k - 1][i] & 0xff];
+    }
+    make_shift(&lane_shift, LANE_SIZE);
+    make_shift(&chunk_shift, CHUNK_SIZE);
+}
+
+static uint32_t load32le(const unsigned char *p)
+{
+    return p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+/*
+    These work on the raw register, without the inversions at each end.
+*/
+static uint32_t crc_sw(uint32_t crc, const unsigned char *p, size_t size)
+{
+    while (size && ((uintptr_t)p & 7))
+    {
+        crc = crc_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+        --size;
+    }
+    /* slicing-by-8 */
+    while (size >= 8)
+    {
+        uint32_t lo = crc ^ load32le(p);
+        uint32_t hi = load32le(p + 4);
+        crc = crc_table[7][lo & 0xff] ^ crc_table[6][(lo >> 8) & 0xff]
+            ^ crc_table[5][(lo >> 16) & 0xff] ^ crc_table[4][lo >> 24]
+            ^ crc_table[3][hi & 0xff] ^ crc_table[2][(hi >> 8) & 0xff]
+            ^ crc_table[1][(hi >> 16) & 0xff] ^ crc_table[0][hi >> 24];
+        p += 8;
+        size -= 8;
+    }
+    while (size--)
+        crc = crc_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return crc;
+}
+
+#if HAVE_SSE42_CRC
+static uint64_t load64(const unsigned char *p)
+{
+    uint64_t v;
+    memcpy(&v, p, 8);
+    return v;
+}
+
+__attribute__((target("sse4.2")))
+static uint32_t crc_sse42(uint32_t crc, const unsigned char *p, size_t size)
+{
+    while (size && ((uintptr_t)p & 7))
+    {
+        crc = _mm_crc32_u8(crc, *p++);
+        --size;
+    }
+    while (size >= 3 * LANE_SIZE)
+    {
+        uint32_t crc1 = 0, crc2 = 0;
+        size_t i;
+        for (i = 0; i < LANE_SIZE; i += 8)
+        {
+            crc = (uint32_t)_mm_crc32_u64(crc, load64(p + i));
+            crc1 = (uint32_t)_mm_crc32_u64(crc1, load64(p + LANE_SIZE + i));
+            crc2 = (uint32_t)_mm_crc32_u64(crc2, load64(p + 2 * LANE_SIZE + i));
+        }
+        /* the later lanes started from 0, so only need the earlier shifted */
+        crc = apply_shift(&lane_shift, apply_shift(&lane_shift, crc) ^ crc1) ^ crc2;
+        p += 3 * LANE_SIZE;
+        size -= 3 * LANE_SIZE;
+    }
+    while (size >= 8)
+    {
+        crc = (uint32_t)_mm_crc32_u64(crc, load64(p));
+        p += 8;
+        size -= 8;
+    }
+    while (size--)
+        crc = _mm_crc32_u8(crc, *p++);
+    return crc;
+}
+#endif
+
+uint32_t crab_crc32c(uint32_t crc, const void *data, size_t size)
+{
+    pthread_once(&tables_once, init_tables);
+#if HAVE_SSE42_CRC
+    if (have_sse42())
+        return ~crc_sse42(~crc, (const unsigned char *)data, size);
+#endif
+    return ~crc_sw(~crc, (const unsigned char *)data, size);
+}
+
+typedef struct CrcWork CrcWork;
+struct CrcWork
+{
+    const void *const *data;
+    const size_t *sizes;
+    /* buffer `i` is chunks `first_chunk[i]` up to `first_chunk[i + 1]` */
+    const size_t *first_chunk;
+    size_t num_chunks;
+    uint32_t *chunk_crcs;
+    /* the next chunk that nobody has claimed yet */
+    size_t next;
+};
+
+static void *crc_worker(void *arg)
+{
+    CrcWork *w = (CrcWork *)arg;
+    size_t i = 0, u;
+    /* each thread claims chunks in increasing order */
+    while ((u = __sync_fetch_and_add(&w->next, 1)) < w->num_chunks)
+    {
+        size_t offset, size;
+        while (w->first_chunk[i + 1] <= u)
+            ++i;
+        offset = (u - w->first_chunk[i]) * CHUNK_SIZE;
+        size = w->sizes[i] - offset < CHUNK_SIZE ? w->sizes[i] - offset : CHUNK_SIZE;
+        w->chunk_crcs[u] = crab_crc32c(0, (const char *)w->data[i] + offset, size);
+    }
+    return NULL;
+}
+
+void crab_crc32c_many(const void *const *data, const size_t *sizes, size_t count, unsigned num_threads, uint32_t *crcs)
+{
+    CrcWork work;
+    size_t *first_chunk = NULL;
+    uint32_t *chunk_crcs = NULL;
+    pthread_t *threads = NULL;
+    unsigned num_started = 0, t;
+    size_t i, u;
+
+    pthread_once(&tables_once, init_tables);
+    first_chunk = (size_t *)malloc((count + 1) * sizeof(*first_chunk));
+    if (!first_chunk)
+        goto serial;
+    first_chunk[0] = 0;
+    for (i = 0; i < count; ++i)
+        first_chunk[i + 1] = first_chunk[i] + (sizes[i] + CHUNK_SIZE - 1) / CHUNK_SIZE;
+    chunk_crcs = (uint32_t *)malloc((first_chunk[count] + 1) * sizeof(*chunk_crcs));
+    if (!chunk_crcs)
+        goto serial;
+
+    if (!num_threads)
+    {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        num_threads = cpus > 0 ? cpus : 1;
+    }
+    if (num_threads > first_chunk[count])
+        num_threads = first_chunk[count] ? first_chunk[count] : 1;
+    if (num_threads > 1)
+        threads = (pthread_t *)malloc((num_threads - 1) * sizeof(*threads));
+
+    work.data = data;
+    work.sizes = sizes;
+    work.first_chunk = first_chunk;
+    work.num_chunks = first_chunk[count];
+    work.chunk_crcs = chunk_crcs;
+    work.next = 0;
+    /* if a thread can't be started, the rest just do more */
+    for (t = 0; threads && t < num_threads - 1; ++t)
+    {
+        if (pthread_create(&threads[num_started], NULL, crc_worker, &work))
+            break;
+        ++num_started;
+    }
+    crc_worker(&work);
+    for (t = 0; t < num_started; ++t)
+        pthread_join(threads[t], NULL);
+
+    for (i = 0; i < count; ++i)
+    {
+        uint32_t crc = 0;
+        for (u = first_chunk[i]; u < first_chunk[i + 1]; ++u)
+        {
+            size_t size = sizes[i] - (u - first_chunk[i]) * CHUNK_SIZE;
+            if (u == first_chunk[i])
+                crc = chunk_crcs[u];
+            else if (size >= CHUNK_SIZE)
+                crc = apply_shift(&chunk_shift, crc) ^ chunk_crcs[u];
+            else
+                crc = crab_crc32c_combine(crc, chunk_crcs[u], size);
+        }
+        crcs[i] = crc;
+    }
+    goto out;
+
+serial:
+    for (i = 0; i < count; ++i)
+        crcs[i] = crab_crc32c(0, data[i], sizes[i]);
+out:
+    free(threads);
+    free(chunk_crcs);
+    free(first_chunk);
+}
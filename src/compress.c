@@ -0,0 +1,598 @@
+/*
+    CRAB - Compact Random-Access Binary
+    Copyright © 2018  Ben Longbons
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#define _GNU_SOURCE
+#include "compress.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "crab.h"
+#include "internal.h"
+#include "util.h"
+
+
+/* This macro captures `c` implicitly. */
+#undef ERROR
+#define ERROR(f)        ERROR2(f, errno)
+#define ERROR2(f, e)            \
+({                              \
+    c->error_message = (f);     \
+    c->error_number = (e);      \
+    goto err;                   \
+})
+
+#define MIN_BLOCK_SIZE (4 * 1024)
+#define MAX_BLOCK_SIZE (16 * 1024 * 1024)
+
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+#define LZ_HASH_BITS 14
+
+typedef struct __attribute__((scalar_storage_order("big-endian"))) CrabCompressedEnd
+{
+    uint32_t v;
+} CrabCompressedEnd;
+
+static uint32_t load32(const unsigned char *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+/*
+    The built-in codec is a series of sequences, each some literal bytes
+    and then a match: a token byte (literal length in the high nibble,
+    match length - LZ_MIN_MATCH in the low), more length bytes if the
+    literal nibble is 15 (each added on, until one isn't 255), the
+    literals, the match offset as 2 little-endian bytes, then more length
+    bytes if the match nibble is 15. The last sequence stops after its
+    literals, at the end of the input.
+*/
+static size_t lz_bound(size_t n)
+{
+    return n + n / 255 + 16;
+}
+static unsigned char *lz_put_length(unsigned char *op, size_t n)
+{
+    for (; n >= 255; n -= 255)
+        *op++ = 255;
+    *op++ = n;
+    return op;
+}
+static unsigned char *lz_put_literals(unsigned char *op, const unsigned char *p, size_t n, unsigned match_nibble)
+{
+    *op++ = (n < 15 ? n : 15) << 4 | match_nibble;
+    if (n >= 15)
+        op = lz_put_length(op, n - 15);
+    memcpy(op, p, n);
+    return op + n;
+}
+/* `out` must have room for lz_bound(size); `table` for 1 << LZ_HASH_BITS. */
+static size_t lz_compress(const unsigned char *in, size_t size, unsigned char *out, uint32_t *table)
+{
+    const unsigned char *ip = in, *anchor = in, *end = in + size;
+    unsigned char *op = out;
+
+    memset(table, 0, sizeof(*table) << LZ_HASH_BITS);
+    while ((size_t)(end - ip) >= LZ_MIN_MATCH)
+    {
+        uint32_t seq = load32(ip), h = (seq * 2654435761u) >> (32 - LZ_HASH_BITS);
+        uint32_t prev = table[h];
+        const unsigned char *ref;
+        size_t len = LZ_MIN_MATCH, offset;
+
+        /* positions are stored plus one, so that 0 is empty */
+        table[h] = ip - in + 1;
+        ref = in + (prev ? prev - 1 : 0);
+        if (!prev || ip - ref > LZ_MAX_OFFSET || load32(ref) != seq)
+        {
+            ++ip;
+            continue;
+        }
+        while (ip + len < end && ref[len] == ip[len])
+            ++len;
+        len -= LZ_MIN_MATCH;
+        offset = ip - ref;
+        op = lz_put_literals(op, anchor, ip - anchor, len < 15 ? len : 15);
+        *op++ = offset;
+        *op++ = offset >> 8;
+        if (len >= 15)
+            op = lz_put_length(op, len - 15);
+        ip += len + LZ_MIN_MATCH;
+        anchor = ip;
+    }
+    op = lz_put_literals(op, anchor, end - anchor, 0);
+    return op - out;
+}
+/* Every length and offset is checked, since the input may be corrupt. */
+static bool lz_get_length(const unsigned char **ip, const unsigned char *end, size_t *n)
+{
+    unsigned b;
+    do
+    {
+        if (*ip == end)
+            return false;
+        b = *(*ip)++;
+        *n += b;
+    }
+    while (b == 255);
+    return true;
+}
+static bool lz_decompress(const unsigned char *in, size_t in_size, unsigned char *out, size_t out_size)
+{
+    const unsigned char *ip = in, *end = in + in_size, *ref;
+    unsigned char *op = out, *out_end = out + out_size;
+    size_t n, offset;
+    unsigned token;
+
+    for (;;)
+    {
+        if (ip == end)
+            return false;
+        token = *ip++;
+        n = token >> 4;
+        if (n == 15 && !lz_get_length(&ip, end, &n))
+            return false;
+        if (n > (size_t)(end - ip) || n > (size_t)(out_end - op))
+            return false;
+        memcpy(op, ip, n);
+        op += n;
+        ip += n;
+        if (ip == end)
+            return op == out_end;
+
+        if (end - ip < 2)
+            return false;
+        offset = ip[0] | ip[1] << 8;
+        ip += 2;
+        if (!offset || offset > (size_t)(op - out))
+            return false;
+        n = token & 15;
+        if (n == 15 && !lz_get_length(&ip, end, &n))
+            return false;
+        n += LZ_MIN_MATCH;
+        if (n > (size_t)(out_end - op))
+            return false;
+        /* byte by byte, since the match may overlap what it writes */
+        for (ref = op - offset; n; --n)
+            *op++ = *ref++;
+    }
+}
+
+bool crab_codec_available(int codec)
+{
+    switch (codec)
+    {
+    case CRAB_CODEC_NONE:
+    case CRAB_CODEC_LZ:
+        return true;
+    }
+    return false;
+}
+
+/* Returns the compressed size, or 0 to store the block as-is. */
+static size_t compress_block(int codec, const unsigned char *in, size_t n, unsigned char *out, uint32_t *table)
+{
+    switch (codec)
+    {
+    case CRAB_CODEC_LZ:
+        return lz_compress(in, n, out, table);
+    }
+    return 0;
+}
+
+static const CrabCompressedEnd *block_ends(const CrabCompressedData *data)
+{
+    return (const CrabCompressedEnd *)(data + 1);
+}
+static uint32_t block_start(const CrabCompressed *view, uint32_t b)
+{
+    return b ? block_ends(view->data)[b - 1].v : 0;
+}
+static uint32_t block_raw_size(const CrabCompressed *view, uint32_t b)
+{
+    if (b + 1 < view->num_blocks)
+        return view->block_size;
+    return view->raw_size - (uint64_t)b * view->block_size;
+}
+
+static bool decode_block(const CrabCompressed *view, uint32_t b, unsigned char *out)
+{
+    uint32_t start = block_start(view, b);
+    const unsigned char *in = view->blocks + start;
+    size_t in_size = block_ends(view->data)[b].v - start, out_size = block_raw_size(view, b);
+
+    if (in_size == out_size)
+    {
+        memcpy(out, in, out_size);
+        return true;
+    }
+    switch (view->codec)
+    {
+    case CRAB_CODEC_LZ:
+        return lz_decompress(in, in_size, out, out_size);
+    }
+    return false;
+}
+
+
+CrabSection *crab_file_add_compressed(CrabFile *c, const void *data, size_t size, int codec, uint32_t block_size, const char *schema, uint16_t purpose)
+{
+    const unsigned char *in = (const unsigned char *)data;
+    CrabCompressedData *out = NULL;
+    CrabCompressedEnd *ends;
+    unsigned char *blocks, *scratch = NULL;
+    uint32_t *table = NULL;
+    uint64_t num_blocks, max_size, pos = 0, b;
+    size_t scratch_size;
+    CrabSection *s;
+
+    if (!block_size)
+        block_size = CRAB_COMPRESS_BLOCK_SIZE;
+    if (block_size < MIN_BLOCK_SIZE || block_size > MAX_BLOCK_SIZE || block_size & (block_size - 1))
+        ERROR2("<block size>", EINVAL);
+    if (!crab_codec_available(codec))
+        ERROR2("<codec>", ENOTSUP);
+    num_blocks = (size + (uint64_t)block_size - 1) / block_size;
+    /* Blocks never grow, so this is the most it can take. */
+    max_size = sizeof(CrabCompressedData) + num_blocks * sizeof(CrabCompressedEnd) + size;
+    if (max_size != (size_t)max_size)
+        ERROR2("<data size>", EOVERFLOW);
+
+    scratch_size = lz_bound(block_size);
+    scratch = TRY_P(malloc, (scratch_size));
+    table = TRY_P(malloc, (sizeof(*table) << LZ_HASH_BITS));
+    out = (CrabCompressedData *)TRY_P(calloc, (1, max_size));
+    ends = (CrabCompressedEnd *)(out + 1);
+    blocks = (unsigned char *)(ends + num_blocks);
+    for (b = 0; b < num_blocks; ++b)
+    {
+        size_t n = size - b * block_size < block_size ? size - b * block_size : block_size;
+        size_t packed = compress_block(codec, in + b * block_size, n, scratch, table);
+        if (packed && packed < n)
+            memcpy(blocks + pos, scratch, packed);
+        else
+        {
+            memcpy(blocks + pos, in + b * block_size, n);
+            packed = n;
+        }
+        pos += packed;
+        /* Block ends are only 32 bits. */
+        if (pos > UINT32_MAX)
+            ERROR2("<data size>", EOVERFLOW);
+        ends[b].v = pos;
+    }
+    free(scratch);
+    free(table);
+    scratch = NULL;
+    table = NULL;
+
+    out->raw_size = size;
+    out->block_size = block_size;
+    out->num_blocks = num_blocks;
+    out->codec = codec;
+    max_size = sizeof(CrabCompressedData) + num_blocks * sizeof(CrabCompressedEnd) + pos;
+    if (max_size > UINT32_MAX)
+        ERROR2("<data size>", EOVERFLOW);
+
+    s = TRY_P(crab_file_section_add_many, (c, 1, schema, purpose));
+    TRY_B(crab_section_set_data, (s, CRAB_SECTION_FLAG_OWN, (CrabAbstractData *)out, max_size));
+    return s;
+
+err:
+    free(scratch);
+    free(table);
+    free(out);
+    maybe_perror(c);
+    return NULL;
+}
+
+bool crab_compressed_open(CrabSection *s, CrabCompressed *view)
+{
+    CrabFile *c = s->c;
+    const CrabCompressedData *data = (const CrabCompressedData *)crab_section_data(s);
+    uint64_t size = crab_section_data_size(s);
+    uint64_t raw_size, blocks_size, prev = 0;
+    uint32_t block_size, num_blocks, b;
+    const CrabCompressedEnd *ends;
+
+    if (!data && size)
+        goto err;
+    if (size < sizeof(CrabCompressedData))
+        goto fmt_err;
+    raw_size = data->raw_size;
+    block_size = data->block_size;
+    num_blocks = data->num_blocks;
+    if (block_size < MIN_BLOCK_SIZE || block_size > MAX_BLOCK_SIZE || block_size & (block_size - 1))
+        goto fmt_err;
+    /* without overflow, for sizes near 2^64 */
+    if (num_blocks != raw_size / block_size + (raw_size % block_size != 0))
+        goto fmt_err;
+    if (size - sizeof(CrabCompressedData) < (uint64_t)num_blocks * sizeof(CrabCompressedEnd))
+        goto fmt_err;
+    blocks_size = size - sizeof(CrabCompressedData) - (uint64_t)num_blocks * sizeof(CrabCompressedEnd);
+    ends = block_ends(data);
+    for (b = 0; b < num_blocks; ++b)
+    {
+        if (ends[b].v < prev)
+            goto fmt_err;
+        prev = ends[b].v;
+    }
+    if (prev != blocks_size)
+        goto fmt_err;
+    if (!crab_codec_available(data->codec))
+    {
+        c->error_message = "<codec>";
+        c->error_number = ENOTSUP;
+        goto err;
+    }
+
+    view->data = data;
+    view->blocks = (const unsigned char *)(ends + num_blocks);
+    view->raw_size = raw_size;
+    view->block_size = block_size;
+    view->num_blocks = num_blocks;
+    view->codec = data->codec;
+    view->generation = s->generation;
+    return true;
+
+fmt_err:
+    c->error_message = "<file format>";
+    c->error_number = EINVAL;
+err:
+    maybe_perror(c);
+    return false;
+}
+
+uint64_t crab_compressed_size(const CrabCompressed *view)
+{
+    return view->raw_size;
+}
+
+int crab_compressed_codec(const CrabCompressed *view)
+{
+    return view->codec;
+}
+
+
+/*
+    Cached blocks are kept in a hash table by their section's generation
+    and block number, and in a list from newest to oldest use.
+
+    Generations are never reused, so blocks of sections that are gone
+    (or whose data was replaced) are never found again, and just wait
+    to be evicted.
+*/
+typedef struct CacheEntry CacheEntry;
+struct CacheEntry
+{
+    uint64_t generation;
+    uint32_t block;
+    size_t size;
+    CacheEntry *next_in_bucket;
+    CacheEntry *newer;
+    CacheEntry *older;
+    unsigned char data[0] __attribute__((aligned(16)));
+};
+
+struct CrabBlockCache
+{
+    pthread_mutex_t lock;
+    CacheEntry **buckets;
+    size_t mask;
+    CacheEntry *newest;
+    CacheEntry *oldest;
+    size_t used;
+    size_t capacity;
+};
+
+CrabBlockCache *crab_block_cache_new(size_t capacity)
+{
+    CrabBlockCache *cache = (CrabBlockCache *)calloc(1, sizeof(*cache));
+    size_t num_buckets = 16;
+    int e;
+
+    if (!cache)
+        return NULL;
+    /* about one bucket per smallest block that fits */
+    while (num_buckets < capacity / MIN_BLOCK_SIZE && num_buckets < 65536)
+        num_buckets *= 2;
+    cache->buckets = (CacheEntry **)calloc(num_buckets, sizeof(*cache->buckets));
+    if (!cache->buckets)
+    {
+        free(cache);
+        return NULL;
+    }
+    if ((e = pthread_mutex_init(&cache->lock, NULL)))
+    {
+        free(cache->buckets);
+        free(cache);
+        errno = e;
+        return NULL;
+    }
+    cache->mask = num_buckets - 1;
+    cache->capacity = capacity;
+    return cache;
+}
+
+void crab_block_cache_free(CrabBlockCache *cache)
+{
+    CacheEntry *e, *next;
+
+    if (!cache)
+        return;
+    for (e = cache->newest; e; e = next)
+    {
+        next = e->older;
+        free(e);
+    }
+    pthread_mutex_destroy(&cache->lock);
+    free(cache->buckets);
+    free(cache);
+}
+
+static CacheEntry **cache_bucket(CrabBlockCache *cache, uint64_t generation, uint32_t block)
+{
+    uint64_t h = (generation * 0x9e3779b97f4a7c15ull + block) * 0x9e3779b97f4a7c15ull;
+    return &cache->buckets[(h >> 32) & cache->mask];
+}
+static CacheEntry *cache_find(CrabBlockCache *cache, uint64_t generation, uint32_t block)
+{
+    CacheEntry *e;
+    for (e = *cache_bucket(cache, generation, block); e; e = e->next_in_bucket)
+    {
+        if (e->generation == generation && e->block == block)
+            return e;
+    }
+    return NULL;
+}
+static void cache_unlink(CrabBlockCache *cache, CacheEntry *e)
+{
+    if (e->newer)
+        e->newer->older = e->older;
+    else
+        cache->newest = e->older;
+    if (e->older)
+        e->older->newer = e->newer;
+    else
+        cache->oldest = e->newer;
+}
+static void cache_push(CrabBlockCache *cache, CacheEntry *e)
+{
+    e->newer = NULL;
+    e->older = cache->newest;
+    if (cache->newest)
+        cache->newest->newer = e;
+    else
+        cache->oldest = e;
+    cache->newest = e;
+}
+static void cache_evict_oldest(CrabBlockCache *cache)
+{
+    CacheEntry *e = cache->oldest, **p;
+    for (p = cache_bucket(cache, e->generation, e->block); *p != e; p = &(*p)->next_in_bucket)
+    {
+    }
+    *p = e->next_in_bucket;
+    cache_unlink(cache, e);
+    cache->used -= e->size;
+    free(e);
+}
+
+/*
+    Copy part of block `b` out of the cache, decompressing it first if
+    it's not there. Decompression happens without the lock held, so two
+    threads may race to do it; the loser throws its copy away.
+*/
+static bool cache_read(CrabBlockCache *cache, const CrabCompressed *view, uint32_t b, size_t skip, size_t n, unsigned char *out)
+{
+    size_t size = block_raw_size(view, b);
+    CacheEntry *e, *other;
+
+    pthread_mutex_lock(&cache->lock);
+    e = cache_find(cache, view->generation, b);
+    if (e)
+    {
+        cache_unlink(cache, e);
+        cache_push(cache, e);
+        memcpy(out, e->data + skip, n);
+        pthread_mutex_unlock(&cache->lock);
+        return true;
+    }
+    pthread_mutex_unlock(&cache->lock);
+
+    e = (CacheEntry *)malloc(offsetof(CacheEntry, data) + size);
+    if (!e)
+        return false;
+    if (!decode_block(view, b, e->data))
+    {
+        free(e);
+        return false;
+    }
+    memcpy(out, e->data + skip, n);
+    if (size > cache->capacity)
+    {
+        free(e);
+        return true;
+    }
+    e->generation = view->generation;
+    e->block = b;
+    e->size = size;
+
+    pthread_mutex_lock(&cache->lock);
+    other = cache_find(cache, view->generation, b);
+    if (other)
+    {
+        cache_unlink(cache, other);
+        cache_push(cache, other);
+        pthread_mutex_unlock(&cache->lock);
+        free(e);
+        return true;
+    }
+    e->next_in_bucket = *cache_bucket(cache, view->generation, b);
+    *cache_bucket(cache, view->generation, b) = e;
+    cache_push(cache, e);
+    cache->used += size;
+    while (cache->used > cache->capacity)
+        cache_evict_oldest(cache);
+    pthread_mutex_unlock(&cache->lock);
+    return true;
+}
+
+bool crab_compressed_read(const CrabCompressed *view, CrabBlockCache *cache, uint64_t offset, size_t size, void *out)
+{
+    unsigned char *op = (unsigned char *)out, *buffer = NULL;
+    bool rv = false;
+
+    if (offset > view->raw_size || size > view->raw_size - offset)
+        return false;
+    while (size)
+    {
+        uint32_t b = offset / view->block_size;
+        size_t skip = offset % view->block_size, block_size = block_raw_size(view, b);
+        size_t n = block_size - skip < size ? block_size - skip : size;
+        if (cache)
+        {
+            if (!cache_read(cache, view, b, skip, n, op))
+                goto out;
+        }
+        else if (n == block_size)
+        {
+            if (!decode_block(view, b, op))
+                goto out;
+        }
+        else
+        {
+            if (!buffer && !(buffer = (unsigned char *)malloc(view->block_size)))
+                goto out;
+            if (!decode_block(view, b, buffer))
+                goto out;
+            memcpy(op, buffer + skip, n);
+        }
+        op += n;
+        offset += n;
+        size -= n;
+    }
+    rv = true;
+out:
+    free(buffer);
+    return rv;
+}
@@ -15,7 +15,7 @@
     You should have received a copy of the GNU Lesser General Public License
     along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
-#define _XOPEN_SOURCE 500
+#define _GNU_SOURCE
 #include "crab.h"
 
 #include <sys/mman.h>
@@ -29,6 +29,7 @@
 #include <string.h>
 #include <unistd.h>
 
+#include "checksum.h"
 #include "format.h"
 #include "internal.h"
 #include "schema.h"
@@ -45,39 +46,30 @@
     goto err;                   \
 })
 
-static void maybe_perror(CrabFile *c)
-{
-    if (c->flags & CRAB_FILE_FLAG_PERROR)
-    {
-        errno = c->error_number;
-        perror(c->error_message);
-    }
-}
+/*
+    Find the URL for a schema ID.
 
-static void *memdup(const void *p, size_t len)
-{
-    void *rv = malloc(len);
-    if (rv)
-        memcpy(rv, p, len);
-    return rv;
-}
-static void *memdup_plus(const void *p, size_t len, size_t plus)
+    The schema table itself must have already been checked by the caller.
+*/
+static const char *lookup_schema(CrabFile *c, uint16_t schema_id)
 {
-    void *rv = malloc(len + plus);
-    if (rv)
-        memcpy(rv, p, len);
-    return rv;
+    CrabSection *schema_section = c->sections[0];
+    CrabSchemaData *schema_data = (CrabSchemaData *)schema_section->data;
+    CrabSection *string_section = c->sections[schema_section->section_number + schema_data->string_section];
+
+    if (schema_id >= schema_data->num_schemas)
+        return NULL;
+    return crab_string_ref(string_section, schema_data->schemas[schema_id].url, NULL);
 }
 
-static bool update_schemas(CrabFile *c)
+/*
+    Check the schema table, and that every existing section refers to it.
+*/
+static bool check_schemas(CrabFile *c)
 {
-    bool okay = true;
     uint32_t i;
     CrabSection *schema_section = c->sections[0];
     CrabSchemaData *schema_data = (CrabSchemaData *)schema_section->data;
-    CrabSection *string_section = c->sections[schema_section->section_number + schema_data->string_section];
-    char *string_data = (char *)string_section->data;
-    size_t string_data_size = string_section->data_size;
 
     const uint64_t fixed_size = offsetof(CrabSchemaData, schemas);
     const uint64_t unit_size = sizeof(schema_data->schemas[0]);
@@ -85,257 +77,1535 @@ static bool update_schemas(CrabFile *c)
     uint32_t num_sections = c->num_sections;
 
     if (schema_section->data_size != fixed_size + num_schemas * unit_size)
-        okay = false;
+        return false;
     for (i = 0; i < num_sections; ++i)
     {
         CrabSection *s = c->sections[i];
-        uint16_t schema_id = s->local_schema_id;
-        uint32_t url, url_start, url_len, url_end;
-        if (!okay)
-            goto err;
-        if (schema_id >= num_schemas)
-            goto set_err;
-        url = schema_data->schemas[schema_id].url;
-        url_start = url >> STRING_SIZE_BITS;
-        url_len = url % (1 << STRING_SIZE_BITS);
-        /* No overflow, since inputs only have 32 bits *between* them. */
-        url_end = url_start + url_len;
-        if (url_end >= string_data_size)
-            goto set_err;
-        if (string_data[url_end])
-            goto set_err;
-        s->schema = string_data + url_start;
-        continue;
-
-    set_err:
-        okay = false;
-    err:
+        /* Lazy files check the schema when the section is created. */
+        if (!s)
+            continue;
         /* no printing; handled by caller */
-        s->schema = NULL;
+        if (!lookup_schema(c, s->local_schema_id))
+            return false;
     }
-    return okay;
+    return true;
 }
 
-static void crab_file_open_partial(CrabFile *c, bool all)
+/*
+    Find the slot for a schema URL in `c->schema_hash`: either the one
+    holding its ID, or the empty one where it belongs.
+*/
+static uint32_t *schema_hash_slot(CrabFile *c, const char *schema_url)
 {
-    int fd = -1;
+    uint32_t mask = c->schema_hash_mask;
+    uint32_t i = crab_string_hash(schema_url, strlen(schema_url)) & mask;
+    while (true)
+    {
+        uint32_t *slot = &c->schema_hash[i];
+        if (!*slot)
+            return slot;
+        if (strcmp(lookup_schema(c, *slot - 1), schema_url) == 0)
+            return slot;
+        i = (i + 1) & mask;
+    }
+}
+/*
+    Make room in `c->schema_hash` for `num_schemas`, keeping it at most
+    half full.
 
-    if (!c->filename)
-        ERROR("strdup");
-    if (c->flags & CRAB_FILE_FLAG_NEW)
+    If the same URL appears more than once, the first ID wins.
+*/
+static bool grow_schema_hash(CrabFile *c, uint32_t num_schemas)
+{
+    CrabSchemaData *schema_data = (CrabSchemaData *)c->sections[0]->data;
+    uint32_t capacity = 16;
+    uint32_t i;
+    while (capacity < 2 * num_schemas)
+        capacity *= 2;
+    free(c->schema_hash);
+    c->schema_hash = TRY_P(calloc, (capacity, sizeof(c->schema_hash[0])));
+    c->schema_hash_mask = capacity - 1;
+    for (i = 0; i < schema_data->num_schemas; ++i)
     {
-        CrabSection *schema_section;
-        CrabSection *string_section;
+        const char *schema_url = lookup_schema(c, i);
+        uint32_t *slot;
+        /* Can't be found by URL, so can't be found again by add_schema. */
+        if (!schema_url)
+            continue;
+        slot = schema_hash_slot(c, schema_url);
+        if (!*slot)
+            *slot = i + 1;
+    }
+    return true;
+err:
+    c->schema_hash_mask = 0;
+    return false;
+}
+static bool reserve_schema_hash(CrabFile *c, uint32_t num_schemas)
+{
+    if (2 * num_schemas > c->schema_hash_mask + 1)
+        return grow_schema_hash(c, num_schemas);
+    return true;
+}
 
-        if (!all)
-            die2("CRAB_FILE_FLAG_NEW", EINVAL);
-        c->flags &= ~CRAB_FILE_FLAG_NEW;
+#define SIZE64_SHIFT 48
+#define SIZE64_MAX CRAB_MAX_SECTION_SIZE
 
-        c->sections = TRY_P(calloc, (2, sizeof(*c->sections)));
-        c->num_sections = 2;
+/*
+    Where section `i` of `header` is, undoing CRAB_HEADER_FLAG_SIZE64.
+*/
+static uint64_t header_section_offset(const CrabFileHeader *header, uint32_t i)
+{
+    uint64_t offset = header->section_info[i].offset;
+    if (header->flags & CRAB_HEADER_FLAG_SIZE64)
+        offset &= SIZE64_MAX;
+    return offset;
+}
+static uint64_t header_section_size(const CrabFileHeader *header, uint32_t i)
+{
+    uint64_t size = header->section_info[i].size;
+    if (header->flags & CRAB_HEADER_FLAG_SIZE64)
+        size |= header->section_info[i].offset >> SIZE64_SHIFT << 32;
+    return size;
+}
+/*
+    The inverse, for a header with `header_flags`. The caller must already
+    have checked that both fit.
+*/
+static void set_section_location(CrabSectionHeader *sh, uint32_t header_flags, uint64_t offset, uint64_t size)
+{
+    sh->size = size;
+    if (header_flags & CRAB_HEADER_FLAG_SIZE64)
+        offset |= size >> 32 << SIZE64_SHIFT;
+    sh->offset = offset;
+}
 
-        string_section = c->sections[1] = TRY_P(calloc, (1, sizeof(*c->sections[1])));
-        string_section->c = c;
-        string_section->section_number = 1;
-        string_section->data = (CrabAbstractData *)strdup(CRAB_SCHEMA);
-        string_section->data_size = strlen(CRAB_SCHEMA) + 1;
-        string_section->schema = (char *)string_section->data;
-        string_section->local_schema_id = 0;
-        string_section->purpose = CRAB_PURPOSE_SUPPLEMENTARY;
-        string_section->flags = CRAB_SECTION_FLAG_OWN;
+/*
+    If the file has a checksum for the section, it needs checking before
+    the data is used.
+*/
+static void mark_unverified(CrabFile *c, CrabSection *s)
+{
+    CrabSection *checksum_section = c->checksum_section;
+    s->flags &= ~CRAB_SECTION_FLAG_UNVERIFIED;
+    if (!checksum_section || s->section_number == checksum_section->section_number)
+        return;
+    if (s->section_number < ((const CrabChecksumData *)checksum_section->data)->num_sections)
+        s->flags |= CRAB_SECTION_FLAG_UNVERIFIED;
+}
+static void new_generation(CrabSection *s)
+{
+    static uint64_t last_generation;
+    s->generation = __sync_add_and_fetch(&last_generation, 1);
+}
 
-        schema_section = c->sections[0] = TRY_P(calloc, (1, sizeof(*c->sections[0])));
-        schema_section->c = c;
-        schema_section->section_number = 0;
-        {
-            CrabSchemaData *sd;
-            size_t fixed_size = offsetof(CrabSchemaData, schemas);
-            size_t var_size = 1 * sizeof(sd->schemas[0]);
-            sd = TRY_P(calloc, (1, fixed_size + var_size));
-            sd->string_section = 1 - 0;
-            sd->num_schemas = 1;
-            sd->schemas[0].url = (0 << STRING_SIZE_BITS) | strlen(CRAB_SCHEMA);
-            schema_section->data = (CrabAbstractData *)sd;
-            schema_section->data_size = fixed_size + var_size;
-        }
-        schema_section->schema = (char *)string_section->data;
-        schema_section->local_schema_id = 0;
-        schema_section->purpose = CRAB_PURPOSE_SCHEMA;
-        schema_section->flags = CRAB_SECTION_FLAG_OWN;
+/*
+    Fill in a section from the section table.
 
-        goto out;
-    }
+    Everything except the schema, which needs section 0 to already exist.
+*/
+static bool load_section(CrabFile *c, CrabSection *s, uint32_t i)
+{
+    CrabFileHeader *header = c->table;
+    uint64_t section_offset = header_section_offset(header, i);
+    uint64_t section_size = header_section_size(header, i);
+    /* with overflow check */
+    uint64_t section_end = section_offset + section_size;
+    if (section_end < section_offset)
+        return false;
+    if (section_end > header->size)
+        return false;
+    /* only possible on 32-bit, where it couldn't be mapped anyway */
+    if (section_size != (size_t)section_size)
+        return false;
 
+    s->c = c;
+    s->section_number = i;
+    s->local_schema_id = header->section_info[i].schema;
+    s->purpose = header->section_info[i].purpose;
+    s->data_size = section_size;
+    if ((c->flags & CRAB_FILE_FLAG_LAZY) && section_end > c->file_header_size)
     {
-        uint32_t i;
-        struct stat stat_buf;
-        uint64_t file_size; /* logically size_t */
-        CrabFileHeader *header;
-        const uint64_t first_sectioninfo_offset = offsetof(CrabFileHeader, section_info);
-        const uint64_t sectioninfo_size = sizeof(header->section_info[0]);
-        uint64_t num_sections; /* logically uint32_t */
+        /* mapped on first use, by map_section() */
+        s->data = NULL;
+        if (section_size)
+            s->flags |= CRAB_SECTION_FLAG_LAZY;
+    }
+    else
+        s->data = (CrabAbstractData *)((char *)c->file_header + section_offset);
+    new_generation(s);
+    mark_unverified(c, s);
+    /* s->flags are otherwise inherited */
+    return true;
+}
 
-        fd = TRY(open, (c->filename, c->flags & CRAB_FILE_FLAG_WRITE ? O_RDWR : O_RDONLY));
-        TRY(fstat, (fd, &stat_buf));
-        file_size = (uint64_t)stat_buf.st_size;
-        if (file_size != (size_t)file_size)
-            ERROR2("<file size>", EOVERFLOW);
-        if (file_size < first_sectioninfo_offset + 1 * sectioninfo_size)
-            goto fmt_err;
+#define HUGEPAGE_SIZE ((size_t)2 << 20)
+
+/*
+    Apply the file-wide access hints to a new mapping. These are only
+    hints, so failure (e.g. a kernel without THP) is not an error.
+*/
+static void advise_mapping(CrabFile *c, void *map, size_t size)
+{
+    if (c->flags & CRAB_FILE_FLAG_RANDOM)
+        madvise(map, size, MADV_RANDOM);
+    if (c->flags & CRAB_FILE_FLAG_SEQUENTIAL)
+        madvise(map, size, MADV_SEQUENTIAL);
+    /* Prefaulting a writable private mapping would copy every page. */
+    if ((c->flags & CRAB_FILE_FLAG_SEQUENTIAL) || ((c->flags & CRAB_FILE_FLAG_POPULATE) && (c->flags & CRAB_FILE_FLAG_WRITE)))
+        madvise(map, size, MADV_WILLNEED);
+    if (c->flags & CRAB_FILE_FLAG_HUGEPAGE)
+        madvise(map, size, MADV_HUGEPAGE);
+}
+/*
+    Map `size` bytes of the file starting at `offset` (page-aligned),
+    according to the file's flags.
 
-        header = TRY2(MAP_FAILED, mmap, (NULL, file_size, (c->flags & CRAB_FILE_FLAG_WRITE ? PROT_WRITE : 0) | PROT_READ, MAP_PRIVATE, fd, 0));
-        if (header->size != file_size)
+    With CRAB_FILE_FLAG_HUGEPAGE, the mapping is placed so that file
+    offsets that are multiples of the huge page size land on huge page
+    boundaries, since that's the only way the kernel can use them.
+*/
+static void *map_range(CrabFile *c, int fd, size_t size, uint64_t offset)
+{
+    int prot = (c->flags & CRAB_FILE_FLAG_WRITE ? PROT_WRITE : 0) | PROT_READ;
+    int map_flags = MAP_PRIVATE;
+    char *map;
+    if ((c->flags & CRAB_FILE_FLAG_POPULATE) && !(c->flags & CRAB_FILE_FLAG_WRITE))
+        map_flags |= MAP_POPULATE;
+    if ((c->flags & CRAB_FILE_FLAG_HUGEPAGE) && size >= HUGEPAGE_SIZE && size <= SIZE_MAX - HUGEPAGE_SIZE)
+    {
+        size_t skew = offset & (HUGEPAGE_SIZE - 1);
+        size_t reserve_size = size + HUGEPAGE_SIZE;
+        size_t page_mask = sysconf(_SC_PAGESIZE) - 1;
+        char *reserve = TRY2(MAP_FAILED, mmap, (NULL, reserve_size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0));
+        char *reserve_end = reserve + reserve_size;
+        char *map_end;
+        map = (char *)((((uintptr_t)reserve - skew + HUGEPAGE_SIZE - 1) & ~(uintptr_t)(HUGEPAGE_SIZE - 1)) + skew);
+        if (MAP_FAILED == mmap(map, size, prot, map_flags | MAP_FIXED, fd, offset))
         {
-            TRY(munmap, (c->file_header, file_size));
-            goto fmt_err;
+            int e = errno;
+            munmap(reserve, reserve_size);
+            errno = e;
+            ERROR("mmap");
         }
-        c->file_header = header;
-        if (memcmp(header->magic, CRAB_MAGIC, 8) != 0)
-            goto fmt_err;
-        num_sections = header->num_sections;
-        if (header->num_sections < 1)
-            goto fmt_err;
-        /* due to having 32-bit inputs, this cannot overflow */
-        if (file_size < first_sectioninfo_offset + num_sections * sectioninfo_size)
-            goto fmt_err;
+        map_end = (char *)(((uintptr_t)map + size + page_mask) & ~(uintptr_t)page_mask);
+        if (map != reserve)
+            TRY(munmap, (reserve, map - reserve));
+        if (map_end != reserve_end)
+            TRY(munmap, (map_end, reserve_end - map_end));
+    }
+    else
+        map = TRY2(MAP_FAILED, mmap, (NULL, size, prot, map_flags, fd, offset));
+    advise_mapping(c, map, size);
+    return map;
+err:
+    return NULL;
+}
+
+static bool map_section(CrabSection *s)
+{
+    CrabFile *c = s->c;
+    uint64_t offset = header_section_offset(c->table, s->section_number);
+    uint64_t page_mask = sysconf(_SC_PAGESIZE) - 1;
+    uint64_t map_offset = offset & ~page_mask;
+    size_t map_size = offset - map_offset + s->data_size;
+    char *map = map_range(c, c->fd, map_size, map_offset);
+    if (!map)
+        goto err;
+    s->mapping = map;
+    s->mapping_size = map_size;
+    s->data = (CrabAbstractData *)(map + (offset - map_offset));
+    s->flags &= ~CRAB_SECTION_FLAG_LAZY;
+    return true;
+err:
+    return false;
+}
+/*
+    Check a section that is marked CRAB_SECTION_FLAG_UNVERIFIED.
+*/
+static bool verify_section(CrabSection *s)
+{
+    CrabFile *c = s->c;
+    const CrabChecksumData *table = (const CrabChecksumData *)c->checksum_section->data;
+    if ((s->flags & CRAB_SECTION_FLAG_LAZY) && !map_section(s))
+        goto err;
+    if (crab_crc32c(0, s->data, s->data_size) != table->crc[s->section_number])
+        ERROR2("<checksum>", EBADMSG);
+    s->flags &= ~CRAB_SECTION_FLAG_UNVERIFIED;
+    return true;
+err:
+    return false;
+}
 
-        if (all)
+/*
+    All of a file's metadata is carved out of its arena, which is only
+    freed along with the file, so opening and closing take O(1) calls to
+    the allocator no matter how many sections there are. Chunk sizes grow
+    geometrically, up to a point; bigger requests get a chunk of their own.
+    Memory comes back zeroed.
+*/
+#define ARENA_ALIGN ((size_t)__alignof__(((CrabArenaChunk *)NULL)->data))
+#define ARENA_FIRST_CHUNK (4096 - offsetof(CrabArenaChunk, data))
+#define ARENA_MAX_CHUNK ((size_t)1 << 20)
+
+static size_t arena_round(size_t size)
+{
+    return (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+}
+static void *arena_alloc(CrabFile *c, size_t size)
+{
+    CrabArenaChunk *chunk = c->arena;
+    void *rv;
+    if (size > SIZE_MAX - offsetof(CrabArenaChunk, data) - ARENA_ALIGN)
+        ERROR2("<arena>", EOVERFLOW);
+    size = arena_round(size);
+    if (chunk->capacity - chunk->used < size)
+    {
+        size_t capacity = c->arena_chunk_size;
+        if (capacity < ARENA_MAX_CHUNK)
+            capacity *= 2;
+        c->arena_chunk_size = capacity;
+        if (capacity <= size)
         {
-            c->sections = TRY_P(calloc, (num_sections, sizeof(c->sections[0])));
-            c->num_sections = num_sections;
+            /* keep using what's left of the current chunk */
+            chunk = TRY_P(calloc, (1, offsetof(CrabArenaChunk, data) + size));
+            chunk->capacity = size;
+            chunk->used = size;
+            chunk->next = c->arena->next;
+            c->arena->next = chunk;
+            return chunk->data;
         }
+        chunk = TRY_P(calloc, (1, offsetof(CrabArenaChunk, data) + capacity));
+        chunk->capacity = capacity;
+        chunk->next = c->arena;
+        c->arena = chunk;
+    }
+    rv = chunk->data + chunk->used;
+    chunk->used += size;
+    return rv;
+err:
+    return NULL;
+}
+/*
+    The CrabFile itself lives at the start of the first chunk, so this
+    must be the last thing to touch it.
+*/
+static void arena_free(CrabArenaChunk *chunk)
+{
+    while (chunk)
+    {
+        CrabArenaChunk *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+}
+
+static CrabSection *alloc_sections(CrabFile *c, uint32_t count)
+{
+    CrabSection *s;
+    uint32_t i;
+    if ((size_t)count * sizeof(CrabSection) / sizeof(CrabSection) != count)
+        ERROR2("<num sections>", EOVERFLOW);
+    s = arena_alloc(c, (size_t)count * sizeof(CrabSection));
+    if (!s)
+        goto err;
+    for (i = 0; i < count; ++i)
+        new_generation(&s[i]);
+    return s;
+err:
+    return NULL;
+}
+/*
+    Make room in `c->sections` for at least `num_sections`, growing
+    geometrically so adding one at a time isn't quadratic. The old array
+    is left in the arena, which at worst doubles its footprint.
+*/
+static bool reserve_sections(CrabFile *c, uint32_t num_sections)
+{
+    uint64_t capacity = c->sections_capacity;
+    CrabSection **sections;
+    if (num_sections <= capacity)
+        return true;
+    capacity = capacity < 8 ? 16 : capacity * 2;
+    if (capacity < num_sections)
+        capacity = num_sections;
+    if (capacity > UINT32_MAX)
+        capacity = UINT32_MAX;
+    if ((size_t)capacity * sizeof(*sections) / sizeof(*sections) != capacity)
+        ERROR2("<num sections>", EOVERFLOW);
+    sections = TRY_P(arena_alloc, (c, capacity * sizeof(*sections)));
+    if (c->num_sections)
+        memcpy(sections, c->sections, c->num_sections * sizeof(*sections));
+    c->sections = sections;
+    c->sections_capacity = capacity;
+    return true;
+err:
+    return false;
+}
+
+/*
+    Get a section, creating it first if the file is lazy.
+*/
+static CrabSection *get_section(CrabFile *c, uint32_t i)
+{
+    CrabSection tmp;
+    CrabSection *s = c->sections[i];
+    if (s)
+        return s;
+    memset(&tmp, 0, sizeof(tmp));
+    if (!load_section(c, &tmp, i))
+        goto fmt_err;
+    /* Section 0 is never lazy, so this is safe. */
+    if (!lookup_schema(c, tmp.local_schema_id))
+        goto fmt_err;
+    s = TRY_P(alloc_sections, (c, 1));
+    *s = tmp;
+    c->sections[i] = s;
+    return s;
+
+fmt_err:
+    c->error_message = "<file format>";
+    c->error_number = EINVAL;
+err:
+    return NULL;
+}
+/*
+    Check every section that hasn't been yet, on `num_threads` threads.
+    Sections that fail stay unverified, so will fail again when used.
+*/
+static bool verify_all(CrabFile *c, unsigned num_threads)
+{
+    const CrabChecksumData *table = (const CrabChecksumData *)c->checksum_section->data;
+    uint32_t num_checked = table->num_sections, n = 0, i;
+    const void **data = NULL;
+    size_t *sizes = NULL;
+    uint32_t *crcs = NULL, *numbers = NULL;
+    bool ok = true;
+
+    data = TRY_P(calloc, (num_checked + 1, sizeof(*data)));
+    sizes = TRY_P(calloc, (num_checked + 1, sizeof(*sizes)));
+    crcs = TRY_P(calloc, (num_checked + 1, sizeof(*crcs)));
+    numbers = TRY_P(calloc, (num_checked + 1, sizeof(*numbers)));
+    /* Creating and mapping sections isn't thread-safe, so is done first. */
+    for (i = 0; i < num_checked; ++i)
+    {
+        CrabSection *s = TRY_P(get_section, (c, i));
+        if (!(s->flags & CRAB_SECTION_FLAG_UNVERIFIED))
+            continue;
+        if ((s->flags & CRAB_SECTION_FLAG_LAZY) && !map_section(s))
+            goto err;
+        data[n] = s->data;
+        sizes[n] = s->data_size;
+        numbers[n] = i;
+        ++n;
+    }
+    crab_crc32c_many(data, sizes, n, num_threads, crcs);
+    for (i = 0; i < n; ++i)
+    {
+        if (crcs[i] == table->crc[numbers[i]])
+            c->sections[numbers[i]]->flags &= ~CRAB_SECTION_FLAG_UNVERIFIED;
         else
-        {
-            if (c->num_sections != num_sections)
-                die2("<num_sections mismatch>", EINVAL);
-            for (i = 0; i < num_sections; ++i)
-            {
-                c->sections[i]->flags &= ~CRAB_SECTION_FLAG_OWN;
-            }
-        }
-        for (i = 0; i < num_sections; ++i)
-        {
-            CrabSection *s;
-            uint64_t section_offset = header->section_info[i].offset;
-            uint64_t section_size = header->section_info[i].size;
-            /* with overflow check */
-            uint64_t section_end = section_offset + section_size;
-            if (section_end < section_offset)
-                goto fmt_err;
+            ok = false;
+    }
+    if (!ok)
+        ERROR2("<checksum>", EBADMSG);
+    goto out;
+err:
+    ok = false;
+out:
+    free(data);
+    free(sizes);
+    free(crcs);
+    free(numbers);
+    return ok;
+}
 
-            if (section_end > file_size)
-                goto fmt_err;
+/*
+    Find the section holding the checksums, which is usually the last,
+    and check the sections that loading the file has already used.
+*/
+static bool load_checksums(CrabFile *c, uint32_t string_section_number)
+{
+    CrabFileHeader *header = c->table;
+    CrabSchemaData *schema_data = (CrabSchemaData *)c->sections[0]->data;
+    const CrabChecksumData *table;
+    CrabSection *s;
+    uint32_t i = header->num_sections;
+    uint16_t schema_id = c->sections[0]->local_schema_id;
 
-            if (all)
-                c->sections[i] = TRY_P(calloc, (1, sizeof(*c->sections[i])));
-            s = c->sections[i];
-            s->c = c;
-            s->section_number = i;
-            s->local_schema_id = header->section_info[i].schema;
-            s->purpose = header->section_info[i].purpose;
-            /* s->schema = ...; set in update_schemas */
-            s->data = (CrabAbstractData *)((char *)header + header->section_info[i].offset);
-            s->data_size = header->section_info[i].size;
-            /* s->flags = 0; inherited */
+    /*
+        Section 0 is almost always in the builtin schema, and its schema
+        has already been checked. Any other may be damaged, which is what
+        the checksums are for, so bad ones are skipped rather than used.
+    */
+    if (strcmp(lookup_schema(c, schema_id), CRAB_SCHEMA) != 0)
+    {
+        for (schema_id = 0; schema_id < schema_data->num_schemas; ++schema_id)
+        {
+            const char *url = lookup_schema(c, schema_id);
+            if (url && strcmp(url, CRAB_SCHEMA) == 0)
+                break;
         }
-        if (0 + ((CrabSchemaData *)c->sections[0]->data)->string_section >= num_sections)
-            goto fmt_err;
-        if (!update_schemas(c))
+        if (schema_id == schema_data->num_schemas)
             goto fmt_err;
+    }
+    while (i--)
+    {
+        if (header->section_info[i].schema == schema_id && header->section_info[i].purpose == CRAB_PURPOSE_CHECKSUMS)
+            break;
+    }
+    if (i == UINT32_MAX)
+        goto fmt_err;
+    s = TRY_P(get_section, (c, i));
+    if ((s->flags & CRAB_SECTION_FLAG_LAZY) && !map_section(s))
+        goto err;
+    table = (const CrabChecksumData *)s->data;
+    if (s->data_size < offsetof(CrabChecksumData, crc))
+        goto fmt_err;
+    if (table->num_sections > header->num_sections)
+        goto fmt_err;
+    if (s->data_size < offsetof(CrabChecksumData, crc) + (uint64_t)table->num_sections * sizeof(table->crc[0]))
+        goto fmt_err;
+    c->checksum_section = s;
 
-        goto out;
+    for (i = 0; i < header->num_sections; ++i)
+    {
+        if (c->sections[i])
+            mark_unverified(c, c->sections[i]);
     }
+    /* These have been used already, and are small. */
+    if ((c->sections[0]->flags & CRAB_SECTION_FLAG_UNVERIFIED) && !verify_section(c->sections[0]))
+        goto err;
+    s = c->sections[string_section_number];
+    if ((s->flags & CRAB_SECTION_FLAG_UNVERIFIED) && !verify_section(s))
+        goto err;
+    return true;
 
 fmt_err:
     c->error_message = "<file format>";
     c->error_number = EINVAL;
 err:
-    maybe_perror(c);
-out:
-    if (fd != -1)
+    for (i = 0; i < header->num_sections; ++i)
     {
-        if (-1 == close(fd))
-            die("close");
+        if (c->sections[i])
+            c->sections[i]->flags &= ~CRAB_SECTION_FLAG_UNVERIFIED;
     }
-    return;
+    c->checksum_section = NULL;
+    return false;
 }
-CrabFile *crab_file_open(const char *filename, int flags)
+#define TABLE_MOVED_BIT ((uint64_t)1 << 63)
+
+/*
+    Set `c->table`, following CRAB_HEADER_FLAG_TABLE_MOVED if need be.
+    The header at `c->file_header` has already been checked.
+*/
+static bool find_table(CrabFile *c, uint64_t file_size)
 {
-    CrabFile *c = calloc(1, sizeof(*c));
-    if (!c)
-        return NULL;
-    c->flags = flags;
-    if (filename)
-    {
-        c->filename = strdup(filename);
-        c->filename_len = strlen(filename);
-    }
+    CrabFileHeader *header = c->file_header;
+    const uint64_t first_sectioninfo_offset = offsetof(CrabFileHeader, section_info);
+    const uint64_t sectioninfo_size = sizeof(header->section_info[0]);
+    CrabFileHeader fixed;
+    CrabFileHeader *table;
+    uint64_t offset, table_size;
+
+    c->table = header;
+    if (!(header->flags & CRAB_HEADER_FLAG_TABLE_MOVED))
+        return true;
+    offset = header->section_info[0].offset;
+    if (header->flags != CRAB_HEADER_FLAG_TABLE_MOVED || header->num_sections != 1
+            || header->section_info[0].size || !(offset & TABLE_MOVED_BIT))
+        goto fmt_err;
+    offset &= ~TABLE_MOVED_BIT;
+    if ((offset & 7) || offset < first_sectioninfo_offset + sectioninfo_size || offset > file_size - first_sectioninfo_offset)
+        goto fmt_err;
+    if (offset + first_sectioninfo_offset <= c->file_header_size)
+        memcpy(&fixed, (char *)header + offset, first_sectioninfo_offset);
+    else if ((uint64_t)TRY(pread, (c->fd, &fixed, first_sectioninfo_offset, offset)) != first_sectioninfo_offset)
+        goto fmt_err;
+    /* due to having 32-bit inputs, this cannot overflow */
+    table_size = first_sectioninfo_offset + fixed.num_sections * sectioninfo_size;
+    /* The copy is always the last thing in the file. */
+    if (fixed.num_sections < 1 || table_size != file_size - offset)
+        goto fmt_err;
+    if (file_size <= c->file_header_size)
+        table = (CrabFileHeader *)((char *)header + offset);
     else
-        errno = EINVAL;
-    crab_file_open_partial(c, true);
-    if (c->error_message)
     {
-        if (!(c->flags & CRAB_FILE_FLAG_ERROR))
-        {
-            crab_file_close(c);
-            c = NULL;
-        }
+        uint64_t page_mask = sysconf(_SC_PAGESIZE) - 1;
+        uint64_t map_offset = offset & ~page_mask;
+        uint64_t map_size = offset - map_offset + table_size;
+        char *map;
+        if (map_size != (size_t)map_size)
+            ERROR2("<num sections>", EOVERFLOW);
+        map = map_range(c, c->fd, map_size, map_offset);
+        if (!map)
+            goto err;
+        c->table_mapping = map;
+        c->table_mapping_size = map_size;
+        table = (CrabFileHeader *)(map + (offset - map_offset));
     }
-    return c;
-}
+    if (memcmp(table->magic, CRAB_MAGIC, 8) != 0 || table->size != file_size
+            || (table->flags & CRAB_HEADER_FLAG_TABLE_MOVED))
+        goto fmt_err;
+    c->table = table;
+    return true;
 
-static bool crab_file_close_partial(CrabFile *c, bool all)
+fmt_err:
+    c->error_message = "<file format>";
+    c->error_number = EINVAL;
+err:
+    return false;
+}
+/*
+    Check the header at `c->file_header`, and load the sections from the
+    section table it leads to.
+*/
+static bool load_file(CrabFile *c, uint64_t file_size, bool all)
 {
     uint32_t i;
-    for (i = 0; i < c->num_sections; ++i)
+    CrabFileHeader *header = c->file_header;
+    const uint64_t first_sectioninfo_offset = offsetof(CrabFileHeader, section_info);
+    const uint64_t sectioninfo_size = sizeof(header->section_info[0]);
+    uint64_t num_sections; /* logically uint32_t */
+    bool lazy = c->flags & CRAB_FILE_FLAG_LAZY;
+    uint32_t string_section_number;
+
+    c->checksum_section = NULL;
+    if (c->file_header_size < first_sectioninfo_offset + 1 * sectioninfo_size)
+        goto fmt_err;
+    if (header->size != file_size)
+        goto fmt_err;
+    if (memcmp(header->magic, CRAB_MAGIC, 8) != 0)
+        goto fmt_err;
+    num_sections = header->num_sections;
+    if (header->num_sections < 1)
+        goto fmt_err;
+    /* due to having 32-bit inputs, this cannot overflow */
+    if (c->file_header_size < first_sectioninfo_offset + num_sections * sectioninfo_size)
+        goto fmt_err;
+    if (!find_table(c, file_size))
+        goto err;
+    header = c->table;
+    num_sections = header->num_sections;
+
+    if (all)
+    {
+        TRY_B(reserve_sections, (c, num_sections));
+        if (lazy)
+            memset(c->sections, 0, num_sections * sizeof(c->sections[0]));
+        else
+        {
+            CrabSection *block = TRY_P(alloc_sections, (c, num_sections));
+            for (i = 0; i < num_sections; ++i)
+                c->sections[i] = &block[i];
+        }
+        c->num_sections = num_sections;
+    }
+    else
+    {
+        if (c->num_sections != num_sections)
+            die2("<num_sections mismatch>", EINVAL);
+        for (i = 0; i < num_sections; ++i)
+        {
+            if (c->sections[i])
+                c->sections[i]->flags &= ~CRAB_SECTION_FLAG_OWN;
+        }
+    }
+    for (i = 0; i < num_sections; ++i)
+    {
+        /* lazy files only reload the sections that have been used */
+        if (!c->sections[i])
+            continue;
+        if (!load_section(c, c->sections[i], i))
+            goto fmt_err;
+    }
+
+    /* Schemas are needed by every other section, so are never lazy. */
+    if (!c->sections[0])
+    {
+        c->sections[0] = TRY_P(alloc_sections, (c, 1));
+        if (!load_section(c, c->sections[0], 0))
+            goto fmt_err;
+    }
+    if (c->sections[0]->data_size < offsetof(CrabSchemaData, schemas))
+        goto fmt_err;
+    if ((c->sections[0]->flags & CRAB_SECTION_FLAG_LAZY) && !map_section(c->sections[0]))
+        goto err;
+    string_section_number = 0 + ((CrabSchemaData *)c->sections[0]->data)->string_section;
+    if (string_section_number >= num_sections)
+        goto fmt_err;
+    if (!c->sections[string_section_number])
+    {
+        c->sections[string_section_number] = TRY_P(alloc_sections, (c, 1));
+        if (!load_section(c, c->sections[string_section_number], string_section_number))
+            goto fmt_err;
+    }
+    if ((c->sections[string_section_number]->flags & CRAB_SECTION_FLAG_LAZY) && !map_section(c->sections[string_section_number]))
+        goto err;
+    if (!check_schemas(c))
+        goto fmt_err;
+    if (header->flags & CRAB_HEADER_FLAG_LITTLE_ENDIAN)
+        c->flags |= CRAB_FILE_FLAG_LITTLE_ENDIAN;
+    else
+        c->flags &= ~CRAB_FILE_FLAG_LITTLE_ENDIAN;
+    /* This sets its own error, e.g. EBADMSG. */
+    if ((header->flags & CRAB_HEADER_FLAG_CHECKSUMS) && !load_checksums(c, string_section_number))
+        goto err;
+    return true;
+
+fmt_err:
+    c->error_message = "<file format>";
+    c->error_number = EINVAL;
+err:
+    return false;
+}
+/*
+    Map and load the CRAB file open on `fd`. If lazy, only the header and
+    section table are mapped, and `c` takes ownership of `fd`.
+*/
+static bool map_file(CrabFile *c, int fd, bool all)
+{
+    struct stat stat_buf;
+    uint64_t file_size; /* logically size_t */
+    uint64_t map_size; /* logically size_t */
+    CrabFileHeader *header;
+    const uint64_t first_sectioninfo_offset = offsetof(CrabFileHeader, section_info);
+    const uint64_t sectioninfo_size = sizeof(header->section_info[0]);
+    bool lazy = c->flags & CRAB_FILE_FLAG_LAZY;
+
+    TRY(fstat, (fd, &stat_buf));
+    file_size = (uint64_t)stat_buf.st_size;
+    c->file_dev = stat_buf.st_dev;
+    c->file_ino = stat_buf.st_ino;
+    if (file_size < first_sectioninfo_offset + 1 * sectioninfo_size)
+        goto fmt_err;
+
+    map_size = file_size;
+    if (lazy)
+    {
+        CrabFileHeader fixed;
+        ssize_t got = TRY(pread, (fd, &fixed, first_sectioninfo_offset, 0));
+        if ((uint64_t)got != first_sectioninfo_offset)
+            goto fmt_err;
+        /* due to having 32-bit inputs, this cannot overflow */
+        map_size = first_sectioninfo_offset + fixed.num_sections * sectioninfo_size;
+        if (map_size > file_size)
+            goto fmt_err;
+    }
+    if (map_size != (size_t)map_size)
+        ERROR2("<file size>", EOVERFLOW);
+
+    header = (CrabFileHeader *)map_range(c, fd, map_size, 0);
+    if (!header)
+        goto err;
+    c->file_header = header;
+    c->file_header_size = map_size;
+    if (lazy)
+        c->fd = fd;
+    return load_file(c, file_size, all);
+
+fmt_err:
+    c->error_message = "<file format>";
+    c->error_number = EINVAL;
+err:
+    return false;
+}
+
+static void crab_file_open_partial(CrabFile *c, bool all)
+{
+    int fd = -1;
+
+    if (!c->filename)
+        ERROR2("<filename>", EINVAL);
+    if (c->flags & CRAB_FILE_FLAG_NEW)
+    {
+        CrabSection *schema_section;
+        CrabSection *string_section;
+
+        if (!all)
+            die2("CRAB_FILE_FLAG_NEW", EINVAL);
+        c->flags &= ~CRAB_FILE_FLAG_NEW;
+
+        TRY_B(reserve_sections, (c, 2));
+        schema_section = TRY_P(alloc_sections, (c, 2));
+        string_section = schema_section + 1;
+        c->sections[0] = schema_section;
+        c->sections[1] = string_section;
+        c->num_sections = 2;
+
+        string_section->c = c;
+        string_section->section_number = 1;
+        string_section->data = (CrabAbstractData *)strdup(CRAB_SCHEMA);
+        string_section->data_size = strlen(CRAB_SCHEMA) + 1;
+        string_section->local_schema_id = 0;
+        string_section->purpose = CRAB_PURPOSE_SUPPLEMENTARY;
+        string_section->flags = CRAB_SECTION_FLAG_OWN;
+
+        schema_section->c = c;
+        schema_section->section_number = 0;
+        {
+            CrabSchemaData *sd;
+            size_t fixed_size = offsetof(CrabSchemaData, schemas);
+            size_t var_size = 1 * sizeof(sd->schemas[0]);
+            sd = TRY_P(calloc, (1, fixed_size + var_size));
+            sd->string_section = 1 - 0;
+            sd->num_schemas = 1;
+            sd->schemas[0].url = (0 << STRING_SIZE_BITS) | strlen(CRAB_SCHEMA);
+            schema_section->data = (CrabAbstractData *)sd;
+            schema_section->data_size = fixed_size + var_size;
+        }
+        schema_section->local_schema_id = 0;
+        schema_section->purpose = CRAB_PURPOSE_SCHEMA;
+        schema_section->flags = CRAB_SECTION_FLAG_OWN;
+
+        goto out;
+    }
+
+    fd = TRY(open, (c->filename, c->flags & CRAB_FILE_FLAG_WRITE ? O_RDWR : O_RDONLY));
+    if (!map_file(c, fd, all))
+    {
+        if (c->fd == fd)
+            fd = -1;
+        goto err;
+    }
+    if (c->fd == fd)
+        fd = -1;
+    goto out;
+
+err:
+    maybe_perror(c);
+out:
+    if (fd != -1)
+    {
+        if (-1 == close(fd))
+            die("close");
+    }
+    return;
+}
+/*
+    Pipes and sockets can't be mapped, so copy their contents into a
+    memfd, which can.
+*/
+static int slurp_fd(CrabFile *c, int fd)
+{
+    char buf[65536];
+    int memfd = -1;
+    memfd = TRY(memfd_create, ("crab", MFD_CLOEXEC));
+    while (true)
+    {
+        char *p = buf;
+        ssize_t got = read(fd, buf, sizeof(buf));
+        if (got == 0)
+            break;
+        if (got == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            ERROR("read");
+        }
+        while (got)
+        {
+            ssize_t put = write(memfd, p, got);
+            if (put == -1)
+            {
+                if (errno == EINTR)
+                    continue;
+                ERROR("write");
+            }
+            p += put;
+            got -= put;
+        }
+    }
+    return memfd;
+err:
+    if (memfd != -1)
+        close(memfd);
+    return -1;
+}
+
+/*
+    Everything about a CrabFile that doesn't depend on where it comes from.
+*/
+static CrabFile *new_file(const char *filename, int flags)
+{
+    size_t filename_len = filename ? strlen(filename) : 0;
+    size_t capacity = ARENA_FIRST_CHUNK;
+    size_t used = arena_round(sizeof(CrabFile));
+    CrabArenaChunk *chunk;
+    CrabFile *c;
+
+    if (capacity < used + filename_len + 1)
+        capacity = used + filename_len + 1;
+    chunk = calloc(1, offsetof(CrabArenaChunk, data) + capacity);
+    if (!chunk)
+        return NULL;
+    chunk->capacity = capacity;
+    chunk->used = used;
+    c = (CrabFile *)chunk->data;
+    c->arena = chunk;
+    c->arena_chunk_size = capacity;
+    c->flags = flags;
+    c->fd = -1;
+    if (filename)
+    {
+        /* there is always room for this in the first chunk */
+        c->filename = arena_alloc(c, filename_len + 1);
+        memcpy(c->filename, filename, filename_len + 1);
+        c->filename_len = filename_len;
+    }
+    if ((c->flags & CRAB_FILE_FLAG_RANDOM) && (c->flags & CRAB_FILE_FLAG_SEQUENTIAL))
+    {
+        c->error_message = "<flags>";
+        c->error_number = EINVAL;
+        maybe_perror(c);
+    }
+    return c;
+}
+static CrabFile *finish_open(CrabFile *c)
+{
+    if (!c->error_message && (c->flags & CRAB_FILE_FLAG_VERIFY) && c->checksum_section)
+    {
+        if (!verify_all(c, 0))
+            maybe_perror(c);
+    }
+    if (c->error_message)
+    {
+        if (!(c->flags & CRAB_FILE_FLAG_ERROR))
+        {
+            crab_file_close(c);
+            c = NULL;
+        }
+    }
+    return c;
+}
+
+CrabFile *crab_file_open(const char *filename, int flags)
+{
+    CrabFile *c = new_file(filename, flags);
+    if (!c)
+        return NULL;
+    if (!c->error_message)
+        crab_file_open_partial(c, true);
+    return finish_open(c);
+}
+
+CrabFile *crab_file_open_fd(int fd, int flags)
+{
+    CrabFile *c = new_file(NULL, flags);
+    struct stat stat_buf;
+    int own_fd = -1;
+    if (!c)
+        return NULL;
+    if (c->error_message)
+        goto out;
+    if (c->flags & CRAB_FILE_FLAG_NEW)
+        ERROR2("<flags>", EINVAL);
+
+    TRY(fstat, (fd, &stat_buf));
+    if (S_ISREG(stat_buf.st_mode) || S_ISBLK(stat_buf.st_mode))
+        own_fd = TRY(fcntl, (fd, F_DUPFD_CLOEXEC, 0));
+    else
+    {
+        own_fd = slurp_fd(c, fd);
+        if (own_fd == -1)
+            goto err;
+    }
+    if (!map_file(c, own_fd, true))
+    {
+        if (c->fd == own_fd)
+            own_fd = -1;
+        goto err;
+    }
+    if (c->fd == own_fd)
+        own_fd = -1;
+    goto out;
+
+err:
+    maybe_perror(c);
+out:
+    if (own_fd != -1)
+    {
+        if (-1 == close(own_fd))
+            die("close");
+    }
+    return finish_open(c);
+}
+
+CrabFile *crab_file_open_memory(const void *data, size_t size, int flags)
+{
+    CrabFile *c = new_file(NULL, flags | CRAB_FILE_FLAG_MEMORY);
+    if (!c)
+        return NULL;
+    if (c->error_message)
+        goto out;
+    if (c->flags & (CRAB_FILE_FLAG_NEW | CRAB_FILE_FLAG_WRITE))
+        ERROR2("<flags>", EINVAL);
+    /* The headers are read directly. */
+    if ((uintptr_t)data & 7)
+        ERROR2("<alignment>", EINVAL);
+
+    c->file_header = (CrabFileHeader *)data;
+    c->file_header_size = size;
+    if (!load_file(c, size, true))
+        goto err;
+    goto out;
+
+err:
+    maybe_perror(c);
+out:
+    return finish_open(c);
+}
+
+static bool crab_file_close_partial(CrabFile *c, bool all)
+{
+    uint32_t i;
+    for (i = 0; i < c->num_sections; ++i)
     {
         CrabSection *s = c->sections[i];
         if (s)
         {
-            if (s->flags & CRAB_SECTION_FLAG_OWN)
-                free(s->data);
-            if (all)
+            if (s->flags & CRAB_SECTION_FLAG_OWN)
+                free(s->data);
+            if (s->mapping)
+            {
+                TRY(munmap, (s->mapping, s->mapping_size));
+                s->mapping = NULL;
+                s->mapping_size = 0;
+            }
+            if (all)
+                c->sections[i] = NULL;
+        }
+    }
+    if (c->table_mapping)
+    {
+        TRY(munmap, (c->table_mapping, c->table_mapping_size));
+        c->table_mapping = NULL;
+        c->table_mapping_size = 0;
+    }
+    c->table = NULL;
+    if (c->file_header)
+    {
+        if (!(c->flags & CRAB_FILE_FLAG_MEMORY))
+            TRY(munmap, (c->file_header, c->file_header_size));
+        c->file_header = NULL;
+    }
+    if (c->fd != -1)
+    {
+        TRY(close, (c->fd));
+        c->fd = -1;
+    }
+    if (all)
+    {
+        free(c->schema_hash);
+        free(c->index_keys);
+        free(c->index_sections);
+        arena_free(c->arena);
+    }
+    return true;
+
+err:
+    errno = c->error_number;
+    die(c->error_message);
+}
+
+bool crab_file_close(CrabFile *c)
+{
+    return crab_file_close_partial(c, true);
+}
+
+static bool fwrite_harder(FILE *fp, const void *ptr, size_t sz)
+{
+    const char *c = ptr;
+    while (sz)
+    {
+        size_t rv = fwrite(c, 1, sz, fp);
+        if (!rv)
+            return false;
+        c += rv;
+        sz -= rv;
+    }
+    return true;
+}
+/*
+    Copy a section that a lazy file has not mapped, straight from the file.
+*/
+static bool fwrite_from_fd(FILE *fp, int fd, uint64_t offset, uint64_t sz)
+{
+    char buf[65536];
+    while (sz)
+    {
+        size_t want = sz < sizeof(buf) ? sz : sizeof(buf);
+        ssize_t got = pread(fd, buf, want, offset);
+        if (got <= 0)
+        {
+            if (!got)
+                errno = EIO;
+            return false;
+        }
+        if (!fwrite_harder(fp, buf, got))
+            return false;
+        offset += got;
+        sz -= got;
+    }
+    return true;
+}
+/*
+    Like `c->sections[i]->data_size`, but doesn't create lazy sections.
+*/
+static uint64_t section_data_size(CrabFile *c, uint32_t i)
+{
+    if (c->sections[i])
+        return c->sections[i]->data_size;
+    return header_section_size(c->table, i);
+}
+/*
+    If a section's data still comes from the file, find where.
+*/
+static bool section_stored_offset(CrabFile *c, uint32_t i, uint64_t *offset)
+{
+    CrabSection *s = c->sections[i];
+    char *data, *map;
+    if (!c->file_header)
+        return false;
+    if (!s || (s->flags & CRAB_SECTION_FLAG_LAZY))
+    {
+        *offset = header_section_offset(c->table, i);
+        return true;
+    }
+    data = (char *)s->data;
+    map = (char *)c->file_header;
+    if (data >= map && data + s->data_size <= map + c->file_header_size)
+    {
+        *offset = data - map;
+        return true;
+    }
+    map = (char *)s->mapping;
+    if (data >= map && data + s->data_size <= map + s->mapping_size)
+    {
+        uint64_t page_mask = sysconf(_SC_PAGESIZE) - 1;
+        *offset = (header_section_offset(c->table, i) & ~page_mask) + (data - map);
+        return true;
+    }
+    return false;
+}
+/*
+    If a section's data is still exactly what's in the file, find where.
+*/
+static bool section_file_offset(CrabFile *c, uint32_t i, uint64_t *offset)
+{
+    /* Private mappings may have been written to. */
+    if (c->flags & CRAB_FILE_FLAG_WRITE)
+        return false;
+    return section_stored_offset(c, i, offset);
+}
+/*
+    How a section's purpose says it must be aligned, beyond 8 bytes.
+    Unlike crab_section_set_alignment(), this holds for whoever saves it.
+*/
+static uint64_t purpose_alignment(CrabFile *c, uint32_t i)
+{
+    CrabSection *s = c->sections[i];
+    uint16_t schema_id = s ? s->local_schema_id : c->table->section_info[i].schema;
+    uint16_t purpose = s ? s->purpose : c->table->section_info[i].purpose;
+    const char *url;
+    if (purpose != CRAB_PURPOSE_FILTER)
+        return 8;
+    url = lookup_schema(c, schema_id);
+    if (!url || strcmp(url, CRAB_SCHEMA) != 0)
+        return 8;
+    return CRAB_FILTER_BLOCK_SIZE;
+}
+/*
+    Where a section of the given number would go, if written at `offset`.
+    Empty sections don't need to be aligned.
+*/
+static uint64_t align_section(CrabFile *c, uint32_t i, int flags, uint64_t offset)
+{
+    CrabSection *s = c->sections[i];
+    uint64_t alignment;
+    if (!section_data_size(c, i))
+        return offset;
+    alignment = purpose_alignment(c, i);
+    if (flags & CRAB_SAVE_FLAG_ALIGN_HUGEPAGE)
+        alignment = HUGEPAGE_SIZE;
+    else if (flags & CRAB_SAVE_FLAG_ALIGN_PAGE)
+        alignment = 4096;
+    if (s && s->alignment > alignment)
+        alignment = s->alignment;
+    return (offset + alignment - 1) & ~(alignment - 1);
+}
+/*
+    Copy part of the old file to the new one, letting the kernel do it
+    (and maybe share the blocks) if it can.
+*/
+static bool fcopy_harder(FILE *fp, int fd, uint64_t offset, uint64_t sz, bool *try_kernel)
+{
+    loff_t in_off = offset;
+    loff_t out_off;
+    if (*try_kernel)
+    {
+        if (fflush(fp))
+            return false;
+        out_off = ftello(fp);
+        if (out_off == -1)
+            return false;
+        while (sz)
+        {
+            ssize_t rv = copy_file_range(fd, &in_off, fileno(fp), &out_off, sz, 0);
+            if (rv == -1)
+            {
+                if (errno != ENOSYS && errno != EXDEV && errno != EINVAL && errno != EOPNOTSUPP)
+                    return false;
+                *try_kernel = false;
+                break;
+            }
+            if (!rv)
+            {
+                errno = EIO;
+                return false;
+            }
+            sz -= rv;
+        }
+        if (fseeko(fp, out_off, SEEK_SET))
+            return false;
+    }
+    return fwrite_from_fd(fp, fd, in_off, sz);
+}
+/*
+    Open the file we mapped again, by name, but only if it's still the
+    same file and hasn't changed size.
+*/
+static int reopen_same_file(CrabFile *c, int oflags)
+{
+    struct stat stat_buf;
+    int fd = open(c->filename, oflags);
+    if (fd == -1)
+        return -1;
+    if (fstat(fd, &stat_buf) == -1
+            || stat_buf.st_dev != c->file_dev
+            || stat_buf.st_ino != c->file_ino
+            || (uint64_t)stat_buf.st_size != c->file_header->size)
+    {
+        if (-1 == close(fd))
+            die("close");
+        return -1;
+    }
+    return fd;
+}
+static bool pwrite_harder(int fd, const void *ptr, size_t sz, uint64_t offset)
+{
+    const char *c = ptr;
+    while (sz)
+    {
+        ssize_t rv = pwrite(fd, c, sz, offset);
+        if (rv <= 0)
+        {
+            if (!rv)
+                errno = EIO;
+            return false;
+        }
+        c += rv;
+        sz -= rv;
+        offset += rv;
+    }
+    return true;
+}
+/*
+    Bring the checksum section up to date before saving, adding one if
+    asked to. Sections that are unchanged since the file was opened keep
+    their old checksums, so they don't have to be read.
+*/
+static bool update_checksums(CrabFile *c, int flags)
+{
+    CrabSection *checksum_section = c->checksum_section;
+    const CrabChecksumData *old_table = NULL;
+    CrabChecksumData *table = NULL;
+    uint32_t num_sections, num_old = 0, n = 0, i;
+    const void **data = NULL;
+    size_t *sizes = NULL;
+    uint32_t *crcs = NULL, *numbers = NULL;
+    size_t table_size;
+
+    if (checksum_section)
+    {
+        old_table = (const CrabChecksumData *)checksum_section->data;
+        num_old = old_table->num_sections;
+    }
+    else if (flags & CRAB_SAVE_FLAG_CHECKSUM)
+    {
+        const uint32_t *found;
+        uint32_t num_found;
+        TRY_B(crab_file_find_sections, (c, CRAB_SCHEMA, CRAB_PURPOSE_CHECKSUMS, &found, &num_found));
+        if (num_found)
+            checksum_section = TRY_P(get_section, (c, found[num_found - 1]));
+        else
+            checksum_section = TRY_P(crab_file_section_add_many, (c, 1, CRAB_SCHEMA, CRAB_PURPOSE_CHECKSUMS));
+    }
+    else
+        return true;
+
+    num_sections = c->num_sections;
+    table_size = offsetof(CrabChecksumData, crc) + (size_t)num_sections * sizeof(table->crc[0]);
+    table = (CrabChecksumData *)TRY_P(calloc, (1, table_size));
+    data = TRY_P(calloc, (num_sections, sizeof(*data)));
+    sizes = TRY_P(calloc, (num_sections, sizeof(*sizes)));
+    crcs = TRY_P(calloc, (num_sections, sizeof(*crcs)));
+    numbers = TRY_P(calloc, (num_sections, sizeof(*numbers)));
+    table->num_sections = num_sections;
+    for (i = 0; i < num_sections; ++i)
+    {
+        CrabSection *s;
+        uint64_t offset;
+        if (i == checksum_section->section_number)
+            continue;
+        if (i < num_old && i != c->checksum_section->section_number
+                && section_file_offset(c, i, &offset)
+                && offset == header_section_offset(c->table, i)
+                && section_data_size(c, i) == header_section_size(c->table, i))
+        {
+            table->crc[i] = old_table->crc[i];
+            continue;
+        }
+        s = TRY_P(get_section, (c, i));
+        if ((s->flags & CRAB_SECTION_FLAG_LAZY) && !map_section(s))
+            goto err;
+        data[n] = s->data;
+        sizes[n] = s->data_size;
+        numbers[n] = i;
+        ++n;
+    }
+    crab_crc32c_many(data, sizes, n, 0, crcs);
+    for (i = 0; i < n; ++i)
+        table->crc[numbers[i]] = crcs[i];
+    /* `old_table` may be the data that this replaces */
+    TRY_B(crab_section_set_data, (checksum_section, CRAB_SECTION_FLAG_OWN, (CrabAbstractData *)table, table_size));
+    table = NULL;
+    c->checksum_section = checksum_section;
+    free(data);
+    free(sizes);
+    free(crcs);
+    free(numbers);
+    return true;
+err:
+    free(table);
+    free(data);
+    free(sizes);
+    free(crcs);
+    free(numbers);
+    return false;
+}
+typedef struct Body Body;
+struct Body
+{
+    uint64_t size;
+    uint32_t crc;
+    uint32_t section;
+};
+static int compare_bodies(const void *a, const void *b)
+{
+    const Body *ba = a, *bb = b;
+    if (ba->size != bb->size)
+        return ba->size < bb->size ? -1 : 1;
+    if (ba->crc != bb->crc)
+        return ba->crc < bb->crc ? -1 : 1;
+    return (ba->section > bb->section) - (ba->section < bb->section);
+}
+/*
+    For CRAB_SAVE_FLAG_DEDUP, set `same_as[i]` to the first section with
+    the same data as section `i` (which is `i` itself if there is none).
+    Empty sections are never shared.
+
+    Bodies are grouped by size and CRC32C, then compared in full.
+*/
+static bool find_duplicates(CrabFile *c, uint32_t *same_as)
+{
+    uint32_t num_sections = c->num_sections, n = 0, i, j, k;
+    const void **data = NULL;
+    size_t *sizes = NULL;
+    uint32_t *crcs = NULL;
+    Body *bodies = NULL;
+    bool ok = true;
+
+    data = TRY_P(calloc, (num_sections, sizeof(*data)));
+    sizes = TRY_P(calloc, (num_sections, sizeof(*sizes)));
+    crcs = TRY_P(calloc, (num_sections, sizeof(*crcs)));
+    bodies = TRY_P(calloc, (num_sections, sizeof(*bodies)));
+    for (i = 0; i < num_sections; ++i)
+    {
+        CrabSection *s;
+        same_as[i] = i;
+        if (!section_data_size(c, i))
+            continue;
+        s = TRY_P(get_section, (c, i));
+        if ((s->flags & CRAB_SECTION_FLAG_LAZY) && !map_section(s))
+            goto err;
+        data[n] = s->data;
+        sizes[n] = s->data_size;
+        bodies[n].size = s->data_size;
+        bodies[n].section = i;
+        ++n;
+    }
+    crab_crc32c_many(data, sizes, n, 0, crcs);
+    for (i = 0; i < n; ++i)
+        bodies[i].crc = crcs[i];
+    qsort(bodies, n, sizeof(*bodies), compare_bodies);
+    for (i = 0; i < n; i = j)
+    {
+        for (j = i + 1; j < n && bodies[j].size == bodies[i].size && bodies[j].crc == bodies[i].crc; ++j)
+        {
+            const void *body = c->sections[bodies[j].section]->data;
+            /* Usually the first matches; more only on a CRC collision. */
+            for (k = i; k < j; ++k)
+            {
+                const void *other = c->sections[bodies[k].section]->data;
+                if (same_as[bodies[k].section] != bodies[k].section)
+                    continue;
+                if (body == other || memcmp(body, other, bodies[j].size) == 0)
+                {
+                    same_as[bodies[j].section] = bodies[k].section;
+                    break;
+                }
+            }
+        }
+    }
+    goto out;
+err:
+    ok = false;
+out:
+    free(data);
+    free(sizes);
+    free(crcs);
+    free(bodies);
+    return ok;
+}
+/*
+    The `CrabFileHeader.flags` for saving `c`. Sizes that don't fit in the
+    section table are an error, not truncated.
+*/
+static bool save_header_flags(CrabFile *c, uint32_t *header_flags)
+{
+    uint32_t i;
+    *header_flags = c->checksum_section ? CRAB_HEADER_FLAG_CHECKSUMS : 0;
+    if (c->flags & CRAB_FILE_FLAG_LITTLE_ENDIAN)
+        *header_flags |= CRAB_HEADER_FLAG_LITTLE_ENDIAN;
+    for (i = 0; i < c->num_sections; ++i)
+    {
+        uint64_t size = section_data_size(c, i);
+        if (size > SIZE64_MAX)
+            ERROR2("<section size>", EOVERFLOW);
+        if (size > UINT32_MAX)
+            *header_flags |= CRAB_HEADER_FLAG_SIZE64;
+    }
+    return true;
+err:
+    return false;
+}
+/*
+    Write new and changed sections after the end of the existing file,
+    then a new header and section table after them, and only then point
+    the start of the file at that (see CRAB_HEADER_FLAG_TABLE_MOVED).
+
+    Sections that are unchanged stay where they are, and nothing the old
+    table points to is overwritten. The only write to existing data is
+    the 40 bytes at the start, which are within one disk sector, so a
+    crash leaves either the old table or the new one in use.
+*/
+static bool save_append(CrabFile *c, int fd, int flags, const uint32_t *same_as)
+{
+    static char zeros[8] = "";
+
+    bool ok = true;
+    CrabFileHeader *fh = NULL;
+    CrabFileHeader *moved = NULL;
+    uint32_t i;
+    uint32_t num_sections = c->num_sections;
+    uint32_t header_flags;
+    size_t table_size = offsetof(CrabFileHeader, section_info);
+    uint64_t file_size = c->file_header->size;
+    uint64_t table_offset;
+    TRY_B(save_header_flags, (c, &header_flags));
+    table_size += num_sections * sizeof(CrabSectionHeader);
+    if (table_size != (uint64_t)offsetof(CrabFileHeader, section_info) + (uint64_t)num_sections * sizeof(CrabSectionHeader))
+        ERROR2("<num sections>", EOVERFLOW);
+    if (file_size & 7)
+    {
+        TRY_B(pwrite_harder, (fd, zeros, 8 - (file_size & 7), file_size));
+        file_size += 8 - (file_size & 7);
+    }
+
+    fh = TRY_P(calloc, (1, table_size));
+    memcpy(fh->magic, CRAB_MAGIC, 8);
+    fh->flags = header_flags;
+    fh->num_sections = num_sections;
+    for (i = 0; i < num_sections; ++i)
+    {
+        CrabSection *s = c->sections[i];
+        CrabSectionHeader *sh = &fh->section_info[i];
+        uint64_t data_size = section_data_size(c, i);
+        uint64_t file_offset;
+        bool stored = section_file_offset(c, i, &file_offset);
+        if (s)
+        {
+            sh->schema = s->local_schema_id;
+            sh->purpose = s->purpose;
+        }
+        else
+        {
+            sh->schema = c->table->section_info[i].schema;
+            sh->purpose = c->table->section_info[i].purpose;
+        }
+        if (stored)
+        {
+            set_section_location(sh, header_flags, file_offset, data_size);
+            continue;
+        }
+        /* Only data that would be written again is worth sharing. */
+        if (same_as && same_as[i] != i)
+        {
+            uint64_t shared = header_section_offset(fh, same_as[i]);
+            if (align_section(c, i, flags, shared) == shared)
             {
-                free(s);
-                c->sections[i] = NULL;
+                set_section_location(sh, header_flags, shared, data_size);
+                continue;
             }
         }
+        /* Alignment padding is left as a hole. */
+        file_size = align_section(c, i, flags, file_size);
+        TRY_B(pwrite_harder, (fd, s->data, data_size, file_size));
+        set_section_location(sh, header_flags, file_size, data_size);
+        file_size += data_size;
+        if (data_size & 7)
+        {
+            TRY_B(pwrite_harder, (fd, zeros, 8 - (data_size & 7), file_size));
+            file_size += 8 - (data_size & 7);
+        }
     }
-    if (c->file_header)
-    {
-        TRY(munmap, (c->file_header, c->file_header->size));
-        c->file_header = NULL;
-    }
-    if (all)
-    {
-        free(c->sections);
-        free(c->filename);
-        free(c);
-    }
-    return true;
-
-err:
-    errno = c->error_number;
-    die(c->error_message);
-}
+    table_offset = file_size;
+    file_size += table_size;
+    /* The old header is still intact, so nothing is lost. */
+    if ((header_flags & CRAB_HEADER_FLAG_SIZE64) && file_size > SIZE64_MAX)
+        ERROR2("<file size>", EOVERFLOW);
+    fh->size = file_size;
+    TRY_B(pwrite_harder, (fd, fh, table_size, table_offset));
 
-bool crab_file_close(CrabFile *c)
-{
-    return crab_file_close_partial(c, true);
-}
+    moved = TRY_P(calloc, (1, offsetof(CrabFileHeader, section_info) + sizeof(CrabSectionHeader)));
+    memcpy(moved->magic, CRAB_MAGIC, 8);
+    moved->size = file_size;
+    moved->flags = CRAB_HEADER_FLAG_TABLE_MOVED;
+    moved->num_sections = 1;
+    moved->section_info[0].offset = table_offset | TABLE_MOVED_BIT;
 
-static bool fwrite_harder(FILE *fp, const void *ptr, size_t sz)
-{
-    const char *c = ptr;
-    while (sz)
-    {
-        size_t rv = fwrite(c, 1, sz, fp);
-        if (!rv)
-            return false;
-        ptr += rv;
-        sz -= rv;
-    }
-    return true;
+    /* The data must be there before anything points to it. */
+    TRY(fdatasync, (fd));
+    TRY_B(pwrite_harder, (fd, moved, offsetof(CrabFileHeader, section_info) + sizeof(CrabSectionHeader), 0));
+    TRY(fdatasync, (fd));
+    goto out;
+err:
+    ok = false;
+out:
+    free(fh);
+    free(moved);
+    return ok;
 }
 bool crab_file_save(CrabFile *c, int flags)
 {
@@ -343,23 +1613,77 @@ bool crab_file_save(CrabFile *c, int flags)
 
     bool ok = true;
     FILE *fp = NULL;
+    int in_fd = c->fd;
+    bool try_kernel = true;
     char *filename_tmp = NULL;
     CrabFileHeader fh;
     CrabSectionHeader sh;
     uint32_t i;
-    uint32_t num_sections = c->num_sections;
+    uint32_t num_sections;
+    uint32_t header_flags;
+    uint32_t *same_as = NULL;
+    uint64_t *offsets = NULL;
     size_t section_offset;
     size_t file_size = offsetof(CrabFileHeader, section_info);
+
+    /* Opened from an fd or memory. Check before anything changes. */
+    if (!c->filename)
+        ERROR2("<filename>", EINVAL);
+
+    /* This may add a section. */
+    TRY_B(update_checksums, (c, flags));
+    num_sections = c->num_sections;
+    TRY_B(save_header_flags, (c, &header_flags));
+    if (flags & CRAB_SAVE_FLAG_DEDUP)
+    {
+        same_as = TRY_P(calloc, (num_sections, sizeof(*same_as)));
+        TRY_B(find_duplicates, (c, same_as));
+    }
+    offsets = TRY_P(calloc, (num_sections, sizeof(*offsets)));
     file_size += num_sections * sizeof(CrabSectionHeader);
-    section_offset = file_size;
     for (i = 0; i < num_sections; ++i)
     {
         if (file_size & 7)
             abort();
-        file_size += c->sections[i]->data_size;
+        if (same_as && same_as[i] != i)
+        {
+            uint64_t shared = offsets[same_as[i]];
+            if (align_section(c, i, flags, shared) == shared)
+            {
+                offsets[i] = shared;
+                continue;
+            }
+            same_as[i] = i;
+        }
+        file_size = align_section(c, i, flags, file_size);
+        offsets[i] = file_size;
+        file_size += section_data_size(c, i);
         if (file_size & 7)
             file_size += 8 - (file_size & 7);
     }
+    if ((header_flags & CRAB_HEADER_FLAG_SIZE64) && file_size > SIZE64_MAX)
+        ERROR2("<file size>", EOVERFLOW);
+
+    if ((flags & CRAB_SAVE_FLAG_APPEND) && c->file_header)
+    {
+        int fd = reopen_same_file(c, O_RDWR);
+        if (fd != -1)
+        {
+            ok = save_append(c, fd, flags, same_as);
+            if (-1 == close(fd))
+                die("close");
+            if (!ok)
+                goto err;
+            flags |= CRAB_SAVE_FLAG_REOPEN;
+            in_fd = -1;
+            goto reopen;
+        }
+        /* Otherwise, there's nothing to append to. */
+    }
+
+    /* Unchanged sections can be copied from the old file. */
+    if (in_fd == -1 && c->file_header)
+        in_fd = reopen_same_file(c, O_RDONLY);
 
     {
         filename_tmp = TRY_P(memdup_plus, (c->filename, c->filename_len + 1, strlen(".new")));
@@ -368,31 +1692,53 @@ bool crab_file_save(CrabFile *c, int flags)
 
         memcpy(fh.magic, CRAB_MAGIC, 8);
         fh.size = file_size;
-        fh.reserved = 0;
+        fh.flags = header_flags;
         fh.num_sections = num_sections;
         TRY_B(fwrite_harder, (fp, &fh, offsetof(CrabFileHeader, section_info)));
 
         for (i = 0; i < num_sections; ++i)
         {
             CrabSection *s = c->sections[i];
-            if (section_offset & 7)
-                abort();
-            sh.offset = section_offset;
-            sh.size = s->data_size;
-            sh.schema = s->local_schema_id;
-            sh.purpose = s->purpose;
+            if (s)
+            {
+                sh.schema = s->local_schema_id;
+                sh.purpose = s->purpose;
+            }
+            else
+            {
+                sh.schema = c->table->section_info[i].schema;
+                sh.purpose = c->table->section_info[i].purpose;
+            }
+            set_section_location(&sh, header_flags, offsets[i], section_data_size(c, i));
             TRY_B(fwrite_harder, (fp, &sh, sizeof(sh)));
-            section_offset += c->sections[i]->data_size;
-            if (section_offset & 7)
-                section_offset += 8 - (section_offset & 7);
         }
 
+        section_offset = offsetof(CrabFileHeader, section_info) + num_sections * sizeof(CrabSectionHeader);
         for (i = 0; i < num_sections; ++i)
         {
             CrabSection *s = c->sections[i];
-            TRY_B(fwrite_harder, (fp, s->data, s->data_size));
-            if (s->data_size & 7)
-                TRY_B(fwrite_harder, (fp, zeros, 8 - (s->data_size & 7)));
+            uint64_t data_size = section_data_size(c, i);
+            uint64_t file_offset;
+            uint64_t padding;
+            /* Shared data has already been written. */
+            if (same_as && same_as[i] != i)
+                continue;
+            if (section_offset & 7)
+                abort();
+            padding = offsets[i] - section_offset;
+            /* Alignment padding is left as a hole. */
+            if (padding)
+                TRY(fseeko, (fp, padding, SEEK_CUR));
+            section_offset += padding + data_size;
+            if (section_offset & 7)
+                section_offset += 8 - (section_offset & 7);
+            /* Only sections that were changed have to go through stdio. */
+            if (in_fd != -1 && section_file_offset(c, i, &file_offset))
+                TRY_B(fcopy_harder, (fp, in_fd, file_offset, data_size, &try_kernel));
+            else
+                TRY_B(fwrite_harder, (fp, s->data, data_size));
+            if (data_size & 7)
+                TRY_B(fwrite_harder, (fp, zeros, 8 - (data_size & 7)));
         }
 
         TRY(fflush, (fp));
@@ -402,6 +1748,13 @@ bool crab_file_save(CrabFile *c, int flags)
         TRY(rename, (filename_tmp, c->filename));
     }
 
+    if (in_fd != -1 && in_fd != c->fd)
+    {
+        if (-1 == close(in_fd))
+            die("close");
+    }
+    in_fd = -1;
+reopen:
     if (flags & CRAB_SAVE_FLAG_REOPEN)
     {
         crab_file_close_partial(c, false);
@@ -412,6 +1765,13 @@ err:
     ok = false;
     maybe_perror(c);
 out:
+    if (in_fd != -1 && in_fd != c->fd)
+    {
+        if (-1 == close(in_fd))
+            die("close");
+    }
+    free(same_as);
+    free(offsets);
     if (filename_tmp)
         free(filename_tmp);
     if (fp != NULL)
@@ -422,6 +1782,17 @@ out:
     return ok;
 }
 
+bool crab_file_verify(CrabFile *c, unsigned num_threads)
+{
+    if (!c->checksum_section)
+        ERROR2("<checksums>", ENOENT);
+    TRY_B(verify_all, (c, num_threads));
+    return true;
+err:
+    maybe_perror(c);
+    return false;
+}
+
 void crab_file_error(CrabFile *c, const char **msg, int *no)
 {
     *msg = c->error_message;
@@ -429,6 +1800,48 @@ void crab_file_error(CrabFile *c, const char **msg, int *no)
 }
 
 
+void crab_file_layout(CrabFile *c, uint64_t *file_size, uint64_t *table_size, uint64_t *moved_table_size)
+{
+    *file_size = 0;
+    *table_size = 0;
+    *moved_table_size = 0;
+    if (c->file_header)
+    {
+        *file_size = c->file_header->size;
+        *table_size = offsetof(CrabFileHeader, section_info) + (uint64_t)c->file_header->num_sections * sizeof(CrabSectionHeader);
+        if (c->table != c->file_header)
+            *moved_table_size = offsetof(CrabFileHeader, section_info) + (uint64_t)c->table->num_sections * sizeof(CrabSectionHeader);
+    }
+}
+
+int crab_native_byte_order(void)
+{
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    return CRAB_BYTE_ORDER_LITTLE;
+#else
+    return CRAB_BYTE_ORDER_BIG;
+#endif
+}
+
+int crab_file_byte_order(CrabFile *c)
+{
+    return c->flags & CRAB_FILE_FLAG_LITTLE_ENDIAN ? CRAB_BYTE_ORDER_LITTLE : CRAB_BYTE_ORDER_BIG;
+}
+
+bool crab_file_set_byte_order(CrabFile *c, int order)
+{
+    if (order == CRAB_BYTE_ORDER_LITTLE)
+        c->flags |= CRAB_FILE_FLAG_LITTLE_ENDIAN;
+    else if (order == CRAB_BYTE_ORDER_BIG)
+        c->flags &= ~CRAB_FILE_FLAG_LITTLE_ENDIAN;
+    else
+        ERROR2("<byte order>", EINVAL);
+    return true;
+err:
+    maybe_perror(c);
+    return false;
+}
+
 uint32_t crab_file_num_sections(CrabFile *c)
 {
     return c->num_sections;
@@ -436,45 +1849,42 @@ uint32_t crab_file_num_sections(CrabFile *c)
 
 CrabSection *crab_file_section(CrabFile *c, uint32_t i)
 {
-    if (i < c->num_sections)
-        return c->sections[i];
-    c->error_message = "<section index>";
-    c->error_number = EINVAL;
+    CrabSection *s;
+    if (i >= c->num_sections)
+        ERROR2("<section index>", EINVAL);
+    s = get_section(c, i);
+    if (!s)
+        goto err;
+    return s;
+err:
     maybe_perror(c);
     return NULL;
 }
 
-static char *add_schema(CrabFile *c, const char *schema_url, uint16_t *schema_id)
+static bool add_schema(CrabFile *c, const char *schema_url, uint16_t *schema_id)
 {
-    size_t schema_url_len1 = strlen(schema_url) + 1;
+    size_t schema_url_len = strlen(schema_url);
     CrabSection *schema_section = c->sections[0];
     CrabSchemaData *schema_data = (CrabSchemaData *)schema_section->data;
     CrabSection *string_section = c->sections[schema_section->section_number + schema_data->string_section];
-    char *string_data = (char *)string_section->data;
-    size_t string_data_size = string_section->data_size;
     uint16_t num_schemas = schema_data->num_schemas;
-    uint16_t i;
-    /* We can afford less checking because update_schemas() has succeeded. */
-    for (i = 0; i < num_schemas; ++i)
+    uint32_t *slot;
+    uint32_t url;
+
+    TRY_B(reserve_schema_hash, (c, num_schemas + 1));
+    slot = schema_hash_slot(c, schema_url);
+    if (*slot)
     {
-        uint32_t url, url_start;
-        char *url_string;
-        url = schema_data->schemas[i].url;
-        url_start = url >> STRING_SIZE_BITS;
-        /* No overflow, since inputs only have 32 bits *between* them. */
-        url_string = string_data + url_start;
-        if (strcmp(schema_url, url_string) == 0)
-        {
-            *schema_id = i;
-            return url_string;
-        }
+        *schema_id = *slot - 1;
+        return true;
     }
 
-    /* we have to add a new one */
-    *schema_id = num_schemas;
+    /* we have to add a new one; a stray string is harmless */
+    if (!(uint16_t)(num_schemas + 1))
+        ERROR2("<num schemas>", EOVERFLOW);
+    if (!append_string(string_section, schema_url, schema_url_len, &url))
+        goto err;
     {
-        if (!(uint16_t)(num_schemas + 1))
-            ERROR2("<num schemas>", EOVERFLOW);
         size_t new_size = schema_section->data_size + sizeof(schema_data->schemas[0]);
         if (schema_section->flags & CRAB_SECTION_FLAG_OWN)
         {
@@ -487,59 +1897,173 @@ static char *add_schema(CrabFile *c, const char *schema_url, uint16_t *schema_id
         }
         schema_section->data = (CrabAbstractData *)schema_data;
         schema_section->data_size = new_size;
+        new_generation(schema_section);
     }
     {
-        size_t new_size = string_section->data_size + schema_url_len1;
-        if (schema_url_len1 >= (1 << STRING_SIZE_BITS))
-            ERROR2("<string bytes>", EOVERFLOW);
-        if (new_size >= (1 << (32 - STRING_SIZE_BITS)))
-            ERROR2("<string bytes>", EOVERFLOW);
-        if (string_section->flags & CRAB_SECTION_FLAG_OWN)
-        {
-            string_data = TRY_P(realloc, (string_data, new_size));
-        }
-        else
-        {
-            string_data = TRY_P(memdup_plus, (string_data, string_section->data_size, schema_url_len1));
-            string_section->flags |= CRAB_SECTION_FLAG_OWN;
-        }
-        string_section->data = (CrabAbstractData *)string_data;
-        string_section->data_size = new_size;
-    }
-    {
-        uint32_t url = (string_data_size << STRING_SIZE_BITS) | (schema_url_len1 - 1);
-        uint16_t num_schemas = schema_data->num_schemas;
-        memcpy(string_data + string_data_size, schema_url, schema_url_len1);
         schema_data->schemas[num_schemas].url = url;
         schema_data->schemas[num_schemas].reserved = 0;
         schema_data->num_schemas = num_schemas + 1;
     }
-    update_schemas(c);
-    return string_data + string_data_size;
+    /* Only IDs are stored, so nothing else needs updating. */
+    *slot = num_schemas + 1;
+    *schema_id = num_schemas;
+    return true;
 err:
-    return NULL;
+    return false;
+}
+static void invalidate_index(CrabFile *c)
+{
+    free(c->index_keys);
+    free(c->index_sections);
+    c->index_keys = NULL;
+    c->index_sections = NULL;
+}
+static int compare_u64(const void *a, const void *b)
+{
+    uint64_t l = *(const uint64_t *)a;
+    uint64_t r = *(const uint64_t *)b;
+    return (l > r) - (l < r);
+}
+/*
+    Sort all the sections by (schema, purpose, number).
+
+    Schemas are keyed by the first ID with the same URL, in case a merge
+    left duplicates. This doesn't create lazy sections.
+*/
+static bool build_index(CrabFile *c)
+{
+    uint32_t num_sections = c->num_sections;
+    uint16_t num_schemas = ((CrabSchemaData *)c->sections[0]->data)->num_schemas;
+    uint16_t *canonical = NULL;
+    uint64_t *entries = NULL;
+    uint32_t i;
+
+    TRY_B(reserve_schema_hash, (c, num_schemas));
+    canonical = TRY_P(calloc, (num_schemas, sizeof(*canonical)));
+    for (i = 0; i < num_schemas; ++i)
+    {
+        const char *schema_url = lookup_schema(c, i);
+        /* Never a valid ID, since there are at most 0xFFFF schemas. */
+        canonical[i] = 0xFFFF;
+        if (schema_url)
+            canonical[i] = *schema_hash_slot(c, schema_url) - 1;
+    }
+    entries = TRY_P(calloc, (num_sections, sizeof(*entries)));
+    for (i = 0; i < num_sections; ++i)
+    {
+        CrabSection *s = c->sections[i];
+        uint16_t schema_id = s ? s->local_schema_id : c->table->section_info[i].schema;
+        uint16_t purpose = s ? s->purpose : c->table->section_info[i].purpose;
+        uint32_t key = (uint32_t)(schema_id < num_schemas ? canonical[schema_id] : 0xFFFF) << 16 | purpose;
+        entries[i] = (uint64_t)key << 32 | i;
+    }
+    qsort(entries, num_sections, sizeof(*entries), compare_u64);
+
+    c->index_keys = TRY_P(calloc, (num_sections, sizeof(*c->index_keys)));
+    c->index_sections = TRY_P(calloc, (num_sections, sizeof(*c->index_sections)));
+    for (i = 0; i < num_sections; ++i)
+    {
+        c->index_keys[i] = entries[i] >> 32;
+        c->index_sections[i] = (uint32_t)entries[i];
+    }
+    free(entries);
+    free(canonical);
+    return true;
+err:
+    invalidate_index(c);
+    free(entries);
+    free(canonical);
+    return false;
+}
+bool crab_file_find_sections(CrabFile *c, const char *schema, uint16_t purpose, const uint32_t **sections, uint32_t *num_sections)
+{
+    uint32_t *slot;
+    uint32_t key, lo, hi, mid, first;
+
+    if (!c->index_keys)
+        TRY_B(build_index, (c));
+    slot = schema_hash_slot(c, schema);
+    *sections = c->index_sections;
+    *num_sections = 0;
+    if (!*slot)
+        return true;
+    key = (*slot - 1) << 16 | purpose;
+
+    /* lower bound */
+    lo = 0;
+    hi = c->num_sections;
+    while (lo < hi)
+    {
+        mid = lo + (hi - lo) / 2;
+        if (c->index_keys[mid] < key)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    first = lo;
+    /* upper bound */
+    hi = c->num_sections;
+    while (lo < hi)
+    {
+        mid = lo + (hi - lo) / 2;
+        if (c->index_keys[mid] <= key)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    *sections = c->index_sections + first;
+    *num_sections = lo - first;
+    return true;
+err:
+    maybe_perror(c);
+    return false;
 }
+
 CrabSection *crab_file_section_add(CrabFile *c)
 {
-    CrabSection *s = NULL;
+    return crab_file_section_add_many(c, 1, CRAB_SCHEMA, CRAB_PURPOSE_ERROR);
+}
+
+CrabSection *crab_file_section_add_many(CrabFile *c, uint32_t count, const char *schema, uint16_t purpose)
+{
+    CrabSection *s;
     uint32_t si = c->num_sections;
-    uint32_t new_num_sections = si + 1;
-    if (!new_num_sections)
+    uint32_t new_num_sections = si + count;
+    uint16_t schema_id;
+    uint32_t i;
+    if (!count)
+        ERROR2("<num sections>", EINVAL);
+    if (new_num_sections < si)
         ERROR2("<num sections>", EOVERFLOW);
-    c->sections = TRY_P(realloc, (c->sections, new_num_sections * sizeof(c->sections[0])));
-    s = c->sections[si] = TRY_P(calloc, (1, sizeof(*c->sections[si])));
-    s->c = c;
-    s->section_number = si;
-    s->schema = TRY_P(add_schema, (c, CRAB_SCHEMA, &s->local_schema_id));
+    TRY_B(add_schema, (c, schema, &schema_id));
+    TRY_B(reserve_sections, (c, new_num_sections));
+    s = TRY_P(alloc_sections, (c, count));
+    for (i = 0; i < count; ++i)
+    {
+        s[i].c = c;
+        s[i].section_number = si + i;
+        s[i].local_schema_id = schema_id;
+        s[i].purpose = purpose;
+        c->sections[si + i] = &s[i];
+    }
 
     c->num_sections = new_num_sections;
+    invalidate_index(c);
     return s;
 err:
-    free(s);
     maybe_perror(c);
     return NULL;
 }
 
+bool crab_file_reserve_sections(CrabFile *c, uint32_t num_sections)
+{
+    TRY_B(reserve_sections, (c, num_sections));
+    return true;
+err:
+    maybe_perror(c);
+    return false;
+}
+
 
 uint32_t crab_section_number(CrabSection *s)
 {
@@ -548,7 +2072,7 @@ uint32_t crab_section_number(CrabSection *s)
 
 const char *crab_section_schema(CrabSection *s)
 {
-    return s->schema;
+    return lookup_schema(s->c, s->local_schema_id);
 }
 
 uint16_t crab_section_purpose(CrabSection *s)
@@ -560,8 +2084,9 @@ bool crab_section_set_schema_and_purpose(CrabSection *s, const char *schema, uin
 {
     CrabFile *c = s->c;
 
-    s->schema = TRY_P(add_schema, (c, schema, &s->local_schema_id));
+    TRY_B(add_schema, (c, schema, &s->local_schema_id));
     s->purpose = purpose;
+    invalidate_index(c);
     return true;
 err:
     maybe_perror(c);
@@ -575,9 +2100,231 @@ size_t crab_section_data_size(CrabSection *s)
 
 CrabAbstractData *crab_section_data(CrabSection *s)
 {
+    if ((s->flags & CRAB_SECTION_FLAG_LAZY) && !map_section(s))
+    {
+        maybe_perror(s->c);
+        return NULL;
+    }
+    if ((s->flags & CRAB_SECTION_FLAG_UNVERIFIED) && !verify_section(s))
+    {
+        maybe_perror(s->c);
+        return NULL;
+    }
     return s->data;
 }
 
+bool crab_section_verify(CrabSection *s)
+{
+    if ((s->flags & CRAB_SECTION_FLAG_UNVERIFIED) && !verify_section(s))
+    {
+        maybe_perror(s->c);
+        return false;
+    }
+    return true;
+}
+
+bool crab_section_set_alignment(CrabSection *s, uint32_t alignment)
+{
+    CrabFile *c = s->c;
+    if (alignment & (alignment - 1) || alignment > HUGEPAGE_SIZE)
+        ERROR2("<alignment>", EINVAL);
+    s->alignment = alignment;
+    return true;
+err:
+    maybe_perror(c);
+    return false;
+}
+
+bool crab_section_file_offset(CrabSection *s, uint64_t *offset)
+{
+    CrabFile *c = s->c;
+    if (s->section_number >= (c->table ? c->table->num_sections : 0))
+        ERROR2("<file offset>", ENOENT);
+    if (!section_stored_offset(c, s->section_number, offset))
+        ERROR2("<file offset>", ENOENT);
+    return true;
+err:
+    maybe_perror(c);
+    return false;
+}
+
+bool crab_section_advise(CrabSection *s, int advice)
+{
+    CrabFile *c = s->c;
+    uintptr_t page_mask = sysconf(_SC_PAGESIZE) - 1;
+    uintptr_t begin, end, header;
+    bool inward = advice == CRAB_ADVICE_DONTNEED;
+
+    if (advice < CRAB_ADVICE_NORMAL || advice > CRAB_ADVICE_UNLOCK)
+        ERROR2("<advice>", EINVAL);
+    /* That would throw away any changes to the data. */
+    if (inward && (c->flags & CRAB_FILE_FLAG_WRITE))
+        ERROR2("<advice>", EINVAL);
+    if (!s->data_size)
+        return true;
+    if (s->flags & CRAB_SECTION_FLAG_LAZY)
+    {
+        if (inward || advice == CRAB_ADVICE_UNLOCK)
+            return true;
+        if (!map_section(s))
+            goto err;
+    }
+
+    begin = (uintptr_t)s->data;
+    end = begin + s->data_size;
+    header = (uintptr_t)c->file_header;
+    /* Data that isn't from the file is none of our business. */
+    if (c->flags & CRAB_FILE_FLAG_MEMORY)
+        return true;
+    if (!(begin >= header && end <= header + c->file_header_size)
+            && !(begin >= (uintptr_t)s->mapping && end <= (uintptr_t)s->mapping + s->mapping_size))
+        return true;
+    /* Don't throw away pages that are shared with a neighbor. */
+    if (inward)
+    {
+        begin = (begin + page_mask) & ~page_mask;
+        end &= ~page_mask;
+        if (begin >= end)
+            return true;
+    }
+    else
+    {
+        begin &= ~page_mask;
+        end = (end + page_mask) & ~page_mask;
+    }
+
+    switch (advice)
+    {
+    case CRAB_ADVICE_NORMAL:
+        TRY(madvise, ((void *)begin, end - begin, MADV_NORMAL));
+        break;
+    case CRAB_ADVICE_RANDOM:
+        TRY(madvise, ((void *)begin, end - begin, MADV_RANDOM));
+        break;
+    case CRAB_ADVICE_SEQUENTIAL:
+        TRY(madvise, ((void *)begin, end - begin, MADV_SEQUENTIAL));
+        TRY(madvise, ((void *)begin, end - begin, MADV_WILLNEED));
+        break;
+    case CRAB_ADVICE_WILLNEED:
+        TRY(madvise, ((void *)begin, end - begin, MADV_WILLNEED));
+        break;
+    case CRAB_ADVICE_DONTNEED:
+        TRY(madvise, ((void *)begin, end - begin, MADV_DONTNEED));
+        break;
+    case CRAB_ADVICE_HUGEPAGE:
+        TRY(madvise, ((void *)begin, end - begin, MADV_HUGEPAGE));
+        break;
+    case CRAB_ADVICE_LOCK:
+        TRY(mlock, ((void *)begin, end - begin));
+        break;
+    case CRAB_ADVICE_UNLOCK:
+        TRY(munlock, ((void *)begin, end - begin));
+        break;
+    }
+    return true;
+err:
+    maybe_perror(c);
+    return false;
+}
+
+/*
+    Copy `count` integers of `width` bytes from `src` to `dst`, reversing
+    the bytes of each. They may be the same.
+*/
+static void swap_ints(void *dst, const void *src, unsigned width, size_t count)
+{
+    char *d = (char *)dst;
+    const char *p = (const char *)src;
+    size_t i;
+    switch (width)
+    {
+    case 2:
+        for (i = 0; i < count; ++i)
+        {
+            uint16_t v;
+            memcpy(&v, p + i * 2, 2);
+            v = __builtin_bswap16(v);
+            memcpy(d + i * 2, &v, 2);
+        }
+        break;
+    case 4:
+        for (i = 0; i < count; ++i)
+        {
+            uint32_t v;
+            memcpy(&v, p + i * 4, 4);
+            v = __builtin_bswap32(v);
+            memcpy(d + i * 4, &v, 4);
+        }
+        break;
+    case 8:
+        for (i = 0; i < count; ++i)
+        {
+            uint64_t v;
+            memcpy(&v, p + i * 8, 8);
+            v = __builtin_bswap64(v);
+            memcpy(d + i * 8, &v, 8);
+        }
+        break;
+    default:
+        abort();
+    }
+}
+
+bool crab_section_read_ints(CrabSection *s, unsigned width, uint64_t start, size_t count, void *out)
+{
+    CrabFile *c = s->c;
+    size_t num_ints;
+    const char *data;
+    if (width != 2 && width != 4 && width != 8)
+        ERROR2("<width>", EINVAL);
+    num_ints = s->data_size / width;
+    if (start > num_ints || count > num_ints - start)
+        ERROR2("<integer index>", EINVAL);
+    if (!count)
+        return true;
+    if ((s->flags & CRAB_SECTION_FLAG_LAZY) && !map_section(s))
+        goto err;
+    if ((s->flags & CRAB_SECTION_FLAG_UNVERIFIED) && !verify_section(s))
+        goto err;
+    data = (const char *)s->data + start * width;
+    if (crab_file_byte_order(c) == crab_native_byte_order())
+        memcpy(out, data, count * width);
+    else
+        swap_ints(out, data, width, count);
+    return true;
+err:
+    maybe_perror(c);
+    return false;
+}
+
+bool crab_section_swap_bytes(CrabSection *s, unsigned width)
+{
+    CrabFile *c = s->c;
+    size_t size = s->data_size;
+    void *data;
+    if (width != 2 && width != 4 && width != 8)
+        ERROR2("<width>", EINVAL);
+    if (size % width)
+        ERROR2("<data size>", EINVAL);
+    if (!size)
+        return true;
+    if (s->flags & CRAB_SECTION_FLAG_OWN)
+    {
+        swap_ints(s->data, s->data, width, size / width);
+        return true;
+    }
+    if ((s->flags & CRAB_SECTION_FLAG_LAZY) && !map_section(s))
+        goto err;
+    if ((s->flags & CRAB_SECTION_FLAG_UNVERIFIED) && !verify_section(s))
+        goto err;
+    data = TRY_P(malloc, (size));
+    swap_ints(data, s->data, width, size / width);
+    return crab_section_set_data(s, CRAB_SECTION_FLAG_OWN, (CrabAbstractData *)data, size);
+err:
+    maybe_perror(c);
+    return false;
+}
+
 bool crab_section_set_data(CrabSection *s, int flags, CrabAbstractData *data, size_t size)
 {
     CrabFile *c = s->c;
@@ -602,6 +2349,7 @@ bool crab_section_set_data(CrabSection *s, int flags, CrabAbstractData *data, si
     }
     s->data_size = size;
     s->flags = flags;
+    new_generation(s);
     return true;
 err:
     maybe_perror(c);
@@ -612,8 +2360,12 @@ bool crab_section_copy(CrabSection *s, int flags, CrabSection *other)
 {
     CrabFile *c = s->c;
     uint16_t new_schema_id;
-    char *new_schema = TRY_P(add_schema, (c, CRAB_SCHEMA, &new_schema_id));
     uint16_t new_purpose = other->purpose;
+    TRY_B(add_schema, (c, crab_section_schema(other), &new_schema_id));
+    if ((other->flags & CRAB_SECTION_FLAG_LAZY) && !map_section(other))
+        ERROR2(other->c->error_message, other->c->error_number);
+    if ((other->flags & CRAB_SECTION_FLAG_UNVERIFIED) && !verify_section(other))
+        ERROR2(other->c->error_message, other->c->error_number);
     if (flags & CRAB_SECTION_FLAG_OWN)
     {
         if (s->flags & CRAB_SECTION_FLAG_OWN)
@@ -636,17 +2388,19 @@ bool crab_section_copy(CrabSection *s, int flags, CrabSection *other)
     else
     {
         size_t data_size = other->data_size;
-        CrabAbstractData *new_data = TRY_P(malloc, (data_size));
-        memcpy(new_data, other->data, data_size);
+        CrabAbstractData *new_data = NULL;
+        if (data_size)
+            new_data = TRY_P(memdup, (other->data, data_size));
         if (s->flags & CRAB_SECTION_FLAG_OWN)
             free(s->data);
-        s->flags = 0;
+        s->flags = new_data ? CRAB_SECTION_FLAG_OWN : 0;
         s->data = new_data;
         s->data_size = data_size;
     }
-    s->schema = new_schema;
     s->local_schema_id = new_schema_id;
     s->purpose = new_purpose;
+    new_generation(s);
+    invalidate_index(c);
     return true;
 err:
     maybe_perror(c);
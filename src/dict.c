@@ -0,0 +1,291 @@
+/*
+    CRAB - Compact Random-Access Binary
+    Copyright © 2018  Ben Longbons
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "dict.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bits.h"
+#include "crab.h"
+#include "internal.h"
+#include "schema.h"
+#include "util.h"
+
+
+/* This macro captures `c` implicitly. */
+#undef ERROR
+#define ERROR(f)        ERROR2(f, errno)
+#define ERROR2(f, e)            \
+({                              \
+    c->error_message = (f);     \
+    c->error_number = (e);      \
+    goto err;                   \
+})
+
+/* Codes decoded at once while scanning. */
+#define SCAN_CHUNK 256
+
+/*
+    The distinct values seen so far, and an open-addressed table of
+    (index into them) + 1, kept at most half full.
+*/
+typedef struct DictBuilder DictBuilder;
+struct DictBuilder
+{
+    const char **values;
+    size_t *lengths;
+    uint32_t num_values;
+    uint32_t capacity;
+    uint32_t *table;
+    uint32_t mask;
+};
+
+static bool builder_grow_table(DictBuilder *b)
+{
+    uint32_t mask = b->mask * 2 + 1, i, h;
+    uint32_t *table = (uint32_t *)calloc((size_t)mask + 1, sizeof(*table));
+    if (!table)
+        return false;
+    for (i = 0; i < b->num_values; ++i)
+    {
+        for (h = crab_string_hash(b->values[i], b->lengths[i]) & mask; table[h]; h = (h + 1) & mask)
+        {
+        }
+        table[h] = i + 1;
+    }
+    free(b->table);
+    b->table = table;
+    b->mask = mask;
+    return true;
+}
+
+/*
+    Get the code for a value, adding it if it's new. Sets errno and
+    returns false on failure.
+*/
+static bool builder_code(DictBuilder *b, const char *str, size_t len, uint32_t *code)
+{
+    uint32_t h;
+
+    for (h = crab_string_hash(str, len) & b->mask; b->table[h]; h = (h + 1) & b->mask)
+    {
+        uint32_t other = b->table[h] - 1;
+        if (b->lengths[other] == len && memcmp(b->values[other], str, len) == 0)
+        {
+            *code = other;
+            return true;
+        }
+    }
+    if (b->num_values == b->capacity)
+    {
+        uint32_t capacity = b->capacity * 2;
+        const char **values = (const char **)realloc(b->values, capacity * sizeof(*values));
+        size_t *lengths;
+        if (!values)
+            return false;
+        b->values = values;
+        lengths = (size_t *)realloc(b->lengths, capacity * sizeof(*lengths));
+        if (!lengths)
+            return false;
+        b->lengths = lengths;
+        b->capacity = capacity;
+    }
+    b->values[b->num_values] = str;
+    b->lengths[b->num_values] = len;
+    *code = b->num_values;
+    b->table[h] = ++b->num_values;
+    if (b->num_values > b->mask / 2)
+        return builder_grow_table(b);
+    return true;
+}
+
+
+CrabSection *crab_file_add_dict(CrabFile *c, const char *const *strings, const size_t *lengths, uint64_t count, const char *schema, uint16_t purpose)
+{
+    CrabDictData *data = NULL;
+    DictBuilder b;
+    uint32_t *codes = NULL;
+    uint64_t i, size;
+    unsigned bits;
+    CrabSection *dict, *s;
+
+    memset(&b, 0, sizeof(b));
+    b.capacity = 16;
+    b.mask = 31;
+    b.values = (const char **)TRY_P(malloc, (b.capacity * sizeof(*b.values)));
+    b.lengths = TRY_P(malloc, (b.capacity * sizeof(*b.lengths)));
+    b.table = TRY_P(calloc, (b.mask + 1, sizeof(*b.table)));
+    if (count != (size_t)count)
+        ERROR2("<num values>", EOVERFLOW);
+    codes = TRY_P(malloc, (count * sizeof(*codes) + 1));
+    for (i = 0; i < count; ++i)
+    {
+        const char *str = strings[i];
+        if (!builder_code(&b, str, lengths ? lengths[i] : strlen(str), &codes[i]))
+            ERROR("<num values>");
+    }
+    bits = b.num_values ? bit_width(b.num_values - 1) : 0;
+    /* Also keeps packed_size() from overflowing. */
+    if (bits && count > CRAB_MAX_SECTION_SIZE * 8 / bits)
+        ERROR2("<num values>", EOVERFLOW);
+    size = offsetof(CrabDictData, packed) + packed_size(count, bits);
+    if (size > CRAB_MAX_SECTION_SIZE || size != (size_t)size)
+        ERROR2("<num values>", EOVERFLOW);
+
+    data = (CrabDictData *)TRY_P(calloc, (1, size));
+    data->num_rows = count;
+    data->bits = bits;
+    if (bits)
+    {
+        for (i = 0; i < count; ++i)
+            pack_bits(data->packed, i * bits, bits, codes[i]);
+    }
+    free(codes);
+    codes = NULL;
+
+    dict = crab_file_add_strings(c, b.values, b.lengths, b.num_values, CRAB_SCHEMA, CRAB_PURPOSE_STRINGS);
+    if (!dict)
+        goto err;
+    free(b.values);
+    free(b.lengths);
+    free(b.table);
+    memset(&b, 0, sizeof(b));
+
+    s = TRY_P(crab_file_section_add_many, (c, 1, schema, purpose));
+    data->dict_section = crab_section_number(dict) - crab_section_number(s);
+    TRY_B(crab_section_set_data, (s, CRAB_SECTION_FLAG_OWN, (CrabAbstractData *)data, size));
+    return s;
+
+err:
+    free(b.values);
+    free(b.lengths);
+    free(b.table);
+    free(codes);
+    free(data);
+    maybe_perror(c);
+    return NULL;
+}
+
+bool crab_dict_open(CrabSection *s, CrabDict *view)
+{
+    CrabFile *c = s->c;
+    const CrabDictData *data = (const CrabDictData *)crab_section_data(s);
+    uint64_t size = crab_section_data_size(s);
+    uint64_t num_rows;
+    uint32_t dict_section_number;
+    unsigned bits;
+    CrabSection *dict;
+
+    if (!data && size)
+        goto err;
+    if (size < offsetof(CrabDictData, packed))
+        goto fmt_err;
+    num_rows = data->num_rows;
+    bits = data->bits;
+    if (bits > 32)
+        goto fmt_err;
+    if (bits && num_rows > CRAB_MAX_SECTION_SIZE * 8 / bits)
+        goto fmt_err;
+    if (size != offsetof(CrabDictData, packed) + packed_size(num_rows, bits))
+        goto fmt_err;
+
+    dict_section_number = s->section_number + data->dict_section;
+    if (dict_section_number >= crab_file_num_sections(c))
+        goto fmt_err;
+    dict = crab_file_section(c, dict_section_number);
+    if (!dict)
+        return false;
+    if (!crab_strings_open(dict, &view->strings))
+        return false;
+    /* no wider than any code could need */
+    if (bit_width(crab_strings_count(&view->strings)) < bits)
+        goto fmt_err;
+
+    view->packed = data->packed;
+    view->num_rows = num_rows;
+    view->bits = bits;
+    return true;
+
+fmt_err:
+    c->error_message = "<file format>";
+    c->error_number = EINVAL;
+err:
+    maybe_perror(c);
+    return false;
+}
+
+uint64_t crab_dict_count(const CrabDict *view)
+{
+    return view->num_rows;
+}
+
+uint32_t crab_dict_num_values(const CrabDict *view)
+{
+    return crab_strings_count(&view->strings);
+}
+
+uint32_t crab_dict_code(const CrabDict *view, uint64_t row)
+{
+    return unpack_bits(view->packed, row * view->bits, view->bits);
+}
+
+const char *crab_dict_get(const CrabDict *view, uint64_t row, size_t *len)
+{
+    return crab_strings_get(&view->strings, crab_dict_code(view, row), len);
+}
+
+const char *crab_dict_value(const CrabDict *view, uint32_t code, size_t *len)
+{
+    return crab_strings_get(&view->strings, code, len);
+}
+
+bool crab_dict_find(const CrabDict *view, const char *str, size_t len, uint32_t *code)
+{
+    return crab_strings_find(&view->strings, str, len, code);
+}
+
+bool crab_dict_decode(const CrabDict *view, uint64_t start, size_t count, uint32_t *out)
+{
+    if (start > view->num_rows || count > view->num_rows - start)
+        return false;
+    unpack32(view->packed, view->bits, start, count, out);
+    return true;
+}
+
+bool crab_dict_scan(const CrabDict *view, uint32_t code, uint64_t start, size_t count, uint64_t *rows, size_t *num_rows)
+{
+    uint32_t codes[SCAN_CHUNK];
+    size_t n = 0, i, j, m;
+
+    if (start > view->num_rows || count > view->num_rows - start)
+        return false;
+    for (i = 0; i < count; i += m)
+    {
+        m = count - i < SCAN_CHUNK ? count - i : SCAN_CHUNK;
+        unpack32(view->packed, view->bits, start + i, m, codes);
+        /* always store, but only keep the matches */
+        for (j = 0; j < m; ++j)
+        {
+            rows[n] = start + i + j;
+            n += codes[j] == code;
+        }
+    }
+    *num_rows = n;
+    return true;
+}
@@ -1 +1,293 @@
+/*
+    CRAB - Compact Random-Access Binary
+    Copyright © 2018  Ben Longbons
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
 #include "format.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "crab.h"
+#include "internal.h"
+#include "schema.h"
+#include "util.h"
+
+
+/* This macro captures `c` implicitly. */
+#undef ERROR
+#define ERROR(f)        ERROR2(f, errno)
+#define ERROR2(f, e)            \
+({                              \
+    c->error_message = (f);     \
+    c->error_number = (e);      \
+    goto err;                   \
+})
+
+/* The hash table that follows the strings in a CrabStringIndexData. */
+typedef struct __attribute__((scalar_storage_order("big-endian"))) CrabStringBucket
+{
+    uint32_t id_plus_1;
+} CrabStringBucket;
+
+static CrabStringBucket *index_buckets(const CrabStringIndexData *index)
+{
+    return (CrabStringBucket *)&index->strings[index->num_strings];
+}
+
+
+uint32_t crab_string_hash(const char *str, size_t len)
+{
+    /* FNV-1a */
+    uint32_t h = 2166136261u;
+    while (len--)
+    {
+        h ^= (unsigned char)*str++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+const char *crab_string_ref(CrabSection *strings, uint32_t ref, size_t *len)
+{
+    const char *data = (const char *)crab_section_data(strings);
+    size_t data_size = crab_section_data_size(strings);
+    uint32_t start = ref >> STRING_SIZE_BITS;
+    uint32_t length = ref % (1 << STRING_SIZE_BITS);
+    /* No overflow, since inputs only have 32 bits *between* them. */
+    uint32_t end = start + length;
+    if (!data || end >= data_size)
+        return NULL;
+    if (data[end])
+        return NULL;
+    if (len)
+        *len = length;
+    return data + start;
+}
+
+bool append_string(CrabSection *strings, const char *str, size_t len, uint32_t *ref)
+{
+    CrabFile *c = strings->c;
+    char *data = (char *)crab_section_data(strings);
+    size_t old_size = strings->data_size;
+    size_t new_size = old_size + len + 1;
+
+    if (!data && old_size)
+        goto err;
+    if (len + 1 >= (1 << STRING_SIZE_BITS))
+        ERROR2("<string bytes>", EOVERFLOW);
+    if (new_size >= (1 << (32 - STRING_SIZE_BITS)))
+        ERROR2("<string bytes>", EOVERFLOW);
+    if ((strings->flags & CRAB_SECTION_FLAG_OWN) || !data)
+    {
+        data = TRY_P(realloc, (data, new_size));
+    }
+    else
+    {
+        data = TRY_P(memdup_plus, (data, old_size, len + 1));
+    }
+    strings->flags |= CRAB_SECTION_FLAG_OWN;
+    strings->data = (CrabAbstractData *)data;
+    strings->data_size = new_size;
+
+    memcpy(data + old_size, str, len);
+    data[old_size + len] = '\0';
+    *ref = (old_size << STRING_SIZE_BITS) | len;
+    return true;
+err:
+    return false;
+}
+bool crab_string_ref_add(CrabSection *strings, const char *str, size_t len, uint32_t *ref)
+{
+    if (!append_string(strings, str, len, ref))
+    {
+        maybe_perror(strings->c);
+        return false;
+    }
+    return true;
+}
+
+CrabSection *crab_file_add_strings(CrabFile *c, const char *const *strings, const size_t *lengths, uint32_t count, const char *schema, uint16_t purpose)
+{
+    char *data = NULL;
+    CrabStringIndexData *index = NULL;
+    CrabStringBucket *buckets;
+    CrabSection *sections;
+    uint64_t max_data_size = 0, data_size = 0, num_buckets = 1, index_size;
+    uint32_t i;
+
+    for (i = 0; i < count; ++i)
+        max_data_size += (lengths ? lengths[i] : strlen(strings[i])) + 1;
+    while (num_buckets < 2 * (uint64_t)count)
+        num_buckets *= 2;
+    index_size = offsetof(CrabStringIndexData, strings) + count * sizeof(index->strings[0]) + num_buckets * sizeof(*buckets);
+    /* `hash_mask` is only 32 bits. */
+    if (num_buckets - 1 > UINT32_MAX)
+        ERROR2("<num strings>", EOVERFLOW);
+    if (index_size != (size_t)index_size)
+        ERROR2("<num strings>", EOVERFLOW);
+    if (max_data_size != (size_t)max_data_size)
+        ERROR2("<string bytes>", EOVERFLOW);
+
+    if (max_data_size)
+        data = TRY_P(malloc, (max_data_size));
+    index = TRY_P(calloc, (1, index_size));
+    index->string_section = -1;
+    index->num_strings = count;
+    index->hash_mask = num_buckets - 1;
+    buckets = index_buckets(index);
+
+    for (i = 0; i < count; ++i)
+    {
+        const char *str = strings[i];
+        size_t len = lengths ? lengths[i] : strlen(str);
+        uint32_t b = crab_string_hash(str, len) & index->hash_mask;
+        while (buckets[b].id_plus_1)
+        {
+            uint32_t other = buckets[b].id_plus_1 - 1;
+            if (index->strings[other].length == len && memcmp(data + index->strings[other].offset, str, len) == 0)
+                break;
+            b = (b + 1) & index->hash_mask;
+        }
+        if (buckets[b].id_plus_1)
+        {
+            /* Same bytes, different ID. */
+            index->strings[i] = index->strings[buckets[b].id_plus_1 - 1];
+            continue;
+        }
+        if (data_size + len > UINT32_MAX)
+            ERROR2("<string bytes>", EOVERFLOW);
+        index->strings[i].offset = data_size;
+        index->strings[i].length = len;
+        memcpy(data + data_size, str, len);
+        data[data_size + len] = '\0';
+        data_size += len + 1;
+        buckets[b].id_plus_1 = i + 1;
+    }
+
+    sections = TRY_P(crab_file_section_add_many, (c, 2, schema, purpose));
+    if (!crab_section_set_schema_and_purpose(&sections[0], CRAB_SCHEMA, CRAB_PURPOSE_SUPPLEMENTARY))
+        goto err;
+    if (data_size)
+        TRY_B(crab_section_set_data, (&sections[0], CRAB_SECTION_FLAG_OWN, (CrabAbstractData *)data, data_size));
+    else
+        free(data);
+    data = NULL;
+    TRY_B(crab_section_set_data, (&sections[1], CRAB_SECTION_FLAG_OWN, (CrabAbstractData *)index, index_size));
+    return &sections[1];
+
+err:
+    free(data);
+    free(index);
+    maybe_perror(c);
+    return NULL;
+}
+
+bool crab_strings_open(CrabSection *index_section, CrabStringTable *table)
+{
+    CrabFile *c = index_section->c;
+    const CrabStringIndexData *index = (const CrabStringIndexData *)crab_section_data(index_section);
+    uint64_t size = crab_section_data_size(index_section);
+    uint64_t num_strings, num_buckets;
+    uint32_t string_section_number;
+    CrabSection *strings;
+    const char *data;
+
+    if (!index && size)
+        goto err;
+    if (size < offsetof(CrabStringIndexData, strings))
+        goto fmt_err;
+    num_strings = index->num_strings;
+    num_buckets = (uint64_t)index->hash_mask + 1;
+    if (num_buckets & (num_buckets - 1))
+        goto fmt_err;
+    if (num_strings >= num_buckets)
+        goto fmt_err;
+    /* due to having 32-bit inputs, this cannot overflow */
+    if (size != offsetof(CrabStringIndexData, strings) + num_strings * sizeof(index->strings[0]) + num_buckets * sizeof(CrabStringBucket))
+        goto fmt_err;
+
+    string_section_number = index_section->section_number + index->string_section;
+    if (string_section_number >= crab_file_num_sections(c))
+        goto fmt_err;
+    strings = crab_file_section(c, string_section_number);
+    if (!strings)
+        return false;
+    data = (const char *)crab_section_data(strings);
+    if (!data && crab_section_data_size(strings))
+        return false;
+
+    table->index = index;
+    table->data = data;
+    table->data_size = crab_section_data_size(strings);
+    table->num_strings = num_strings;
+    table->hash_mask = num_buckets - 1;
+    return true;
+
+fmt_err:
+    c->error_message = "<file format>";
+    c->error_number = EINVAL;
+err:
+    maybe_perror(c);
+    return false;
+}
+
+uint32_t crab_strings_count(const CrabStringTable *table)
+{
+    return table->num_strings;
+}
+
+const char *crab_strings_get(const CrabStringTable *table, uint32_t id, size_t *len)
+{
+    uint64_t offset, length;
+    if (id >= table->num_strings)
+        return NULL;
+    offset = table->index->strings[id].offset;
+    length = table->index->strings[id].length;
+    /* due to having 32-bit inputs, this cannot overflow */
+    if (offset + length >= table->data_size)
+        return NULL;
+    if (table->data[offset + length])
+        return NULL;
+    if (len)
+        *len = length;
+    return table->data + offset;
+}
+
+bool crab_strings_find(const CrabStringTable *table, const char *str, size_t len, uint32_t *id)
+{
+    const CrabStringBucket *buckets = index_buckets(table->index);
+    uint32_t mask = table->hash_mask;
+    uint32_t b = crab_string_hash(str, len) & mask;
+    uint64_t probes;
+    /* A corrupt table might not have any empty buckets. */
+    for (probes = 0; probes <= mask; ++probes)
+    {
+        uint32_t id_plus_1 = buckets[b].id_plus_1;
+        const char *other;
+        size_t other_len;
+        if (!id_plus_1)
+            return false;
+        other = crab_strings_get(table, id_plus_1 - 1, &other_len);
+        if (other && other_len == len && memcmp(other, str, len) == 0)
+        {
+            *id = id_plus_1 - 1;
+            return true;
+        }
+        b = (b + 1) & mask;
+    }
+    return false;
+}
@@ -1 +1,79 @@
+/*
+    CRAB - Compact Random-Access Binary
+    Copyright © 2018  Ben Longbons
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
 #include "internal.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "crab.h"
+
+
+void maybe_perror(CrabFile *c)
+{
+    if (c->flags & CRAB_FILE_FLAG_PERROR)
+    {
+        errno = c->error_number;
+        perror(c->error_message);
+    }
+}
+
+void *memdup(const void *p, size_t len)
+{
+    void *rv = malloc(len);
+    if (rv)
+        memcpy(rv, p, len);
+    return rv;
+}
+void *memdup_plus(const void *p, size_t len, size_t plus)
+{
+    void *rv = malloc(len + plus);
+    if (rv)
+        memcpy(rv, p, len);
+    return rv;
+}
+
+bool have_avx2(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    static int cached = -1;
+    if (cached < 0)
+    {
+        __builtin_cpu_init();
+        cached = __builtin_cpu_supports("avx2") != 0;
+    }
+    return cached;
+#else
+    return false;
+#endif
+}
+bool have_sse42(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    static int cached = -1;
+    if (cached < 0)
+    {
+        __builtin_cpu_init();
+        cached = __builtin_cpu_supports("sse4.2") != 0;
+    }
+    return cached;
+#else
+    return false;
+#endif
+}
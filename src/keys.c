@@ -0,0 +1,766 @@
+/*
+    CRAB - Compact Random-Access Binary
+    Copyright © 2018  Ben Longbons
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "keys.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_AVX2_PROBE 1
+#else
+#define HAVE_AVX2_PROBE 0
+#endif
+
+#include "crab.h"
+#include "internal.h"
+#include "util.h"
+
+
+/* This macro captures `c` implicitly. */
+#undef ERROR
+#define ERROR(f)        ERROR2(f, errno)
+#define ERROR2(f, e)            \
+({                              \
+    c->error_message = (f);     \
+    c->error_number = (e);      \
+    goto err;                   \
+})
+
+/* Average keys per bucket; more is smaller but slower to build. */
+#define KEYS_PER_BUCKET 4
+/*
+    Slots per 100 keys. A few spare slots keep the last buckets from
+    needing about as many tries as there are keys.
+*/
+#define SLOTS_PER_100_KEYS 101
+/* Pilots tried per bucket before giving up on a seed. */
+#define MAX_PILOT (1 << 16)
+/* Distinct keys only collide on all 64 bits by bad luck. */
+#define MAX_SEEDS 8
+#define FILTER_BITS_PER_KEY 16
+/* Stored in the file, so can change freely. */
+#define FILTER_SEED 0x9e3779b97f4a7c15ull
+/* Keys checked at once; all their blocks are prefetched first. */
+#define FILTER_BATCH 16
+
+typedef struct __attribute__((scalar_storage_order("big-endian"))) CrabHashWord
+{
+    uint32_t v;
+} CrabHashWord;
+
+/*
+    These are stored in files, so must never change.
+*/
+static uint64_t mix64(uint64_t x)
+{
+    /* the splitmix64 finalizer */
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ull;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebull;
+    x ^= x >> 31;
+    return x;
+}
+static uint64_t hash_string(const char *str, size_t len, uint64_t seed)
+{
+    /* 64-bit FNV-1a, then mixed, since FNV's high bits are poor */
+    uint64_t h = 0xcbf29ce484222325ull ^ seed;
+    size_t i;
+    for (i = 0; i < len; ++i)
+    {
+        h ^= (unsigned char)str[i];
+        h *= 0x100000001b3ull;
+    }
+    return mix64(h ^ len);
+}
+static uint64_t hash_u64(uint64_t key, uint64_t seed)
+{
+    return mix64(key ^ seed);
+}
+static uint32_t hash_bucket(uint64_t h, uint32_t num_buckets)
+{
+    return ((h >> 32) * num_buckets) >> 32;
+}
+static uint32_t hash_slot(uint64_t h, uint32_t pilot, uint32_t num_slots)
+{
+    return (h ^ mix64(pilot)) % num_slots;
+}
+
+/*
+    Odd constants, one per word of a filter block; also stored.
+*/
+static const uint32_t filter_salts[8] =
+{
+    0x47b6137b, 0x44974d91, 0x8824ad5b, 0xa2b7289d,
+    0x705495c7, 0x2df1424b, 0x9efc4947, 0x5c6bfb31,
+};
+static unsigned filter_bit(uint32_t lo, unsigned word)
+{
+    return (uint32_t)(lo * filter_salts[word]) >> 27;
+}
+
+static const CrabHashWord *hash_pilots(const CrabHashData *data)
+{
+    return (const CrabHashWord *)(data + 1);
+}
+static const CrabHashWord *hash_rows(const CrabHashData *data, uint32_t num_buckets)
+{
+    return hash_pilots(data) + num_buckets;
+}
+static const CrabHashWord *hash_spare(const CrabHashData *data, uint32_t num_buckets, uint32_t num_keys)
+{
+    return hash_rows(data, num_buckets) + num_keys;
+}
+
+/*
+    The keys of a key section, of either type, for building over.
+*/
+typedef struct KeySource KeySource;
+struct KeySource
+{
+    int key_type;
+    uint32_t num_keys;
+    CrabStringTable strings;
+    const CrabKeysData *u64_keys;
+};
+
+/*
+    Sets the error (but doesn't print it) on failure.
+*/
+static bool open_key_source(CrabSection *keys, int key_type, KeySource *src)
+{
+    CrabFile *c = keys->c;
+    uint64_t size;
+
+    src->key_type = key_type;
+    if (key_type == CRAB_KEY_TYPE_STRING)
+    {
+        if (!crab_strings_open(keys, &src->strings))
+            return false;
+        src->num_keys = crab_strings_count(&src->strings);
+    }
+    else if (key_type == CRAB_KEY_TYPE_U64)
+    {
+        src->u64_keys = (const CrabKeysData *)crab_section_data(keys);
+        size = crab_section_data_size(keys);
+        if (!src->u64_keys && size)
+            return false;
+        if (size % sizeof(CrabKeysData))
+            ERROR2("<key section>", EINVAL);
+        /* Rows are only 32 bits. */
+        if (size / sizeof(CrabKeysData) > UINT32_MAX)
+            ERROR2("<key section>", EOVERFLOW);
+        src->num_keys = size / sizeof(CrabKeysData);
+    }
+    else
+        ERROR2("<key type>", EINVAL);
+    return true;
+
+err:
+    return false;
+}
+
+/*
+    Hash every key with `seed`. Returns false if a string is bad.
+*/
+static bool hash_keys(const KeySource *src, uint64_t seed, uint64_t *hashes)
+{
+    uint32_t i;
+    for (i = 0; i < src->num_keys; ++i)
+    {
+        if (src->key_type == CRAB_KEY_TYPE_STRING)
+        {
+            size_t len;
+            const char *str = crab_strings_get(&src->strings, i, &len);
+            if (!str)
+                return false;
+            hashes[i] = hash_string(str, len, seed);
+        }
+        else
+            hashes[i] = hash_u64(src->u64_keys[i].key, seed);
+    }
+    return true;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+/*
+    Choose pilots so that every key gets its own slot, biggest buckets
+    first, while there's the most room, then send the keys that landed
+    in spare slots (at `n` and up) to the slots below `n` left free.
+    Returns false if some bucket is too big or can't be placed within
+    MAX_PILOT tries; another seed will do.
+*/
+static bool place_keys(const uint64_t *hashes, uint32_t n, uint32_t num_slots, uint32_t num_buckets, CrabHashWord *pilots, CrabHashWord *rows, CrabHashWord *spare, uint32_t *scratch, unsigned char *taken)
+{
+    /* `scratch` has room for n + 2 * num_buckets + 1 */
+    uint32_t *start = scratch, *by_bucket = scratch + num_buckets + 1, *order = by_bucket + n;
+    uint32_t max_size = 0, num_used = 0, i, b, size;
+    uint32_t slots[64];
+
+    memset(start, 0, (num_buckets + 1) * sizeof(*start));
+    for (i = 0; i < n; ++i)
+        ++start[hash_bucket(hashes[i], num_buckets) + 1];
+    for (b = 0; b < num_buckets; ++b)
+    {
+        if (start[b + 1] > max_size)
+            max_size = start[b + 1];
+        start[b + 1] += start[b];
+    }
+    /* by_bucket[start[b]...] are the keys in bucket b */
+    for (i = 0; i < n; ++i)
+    {
+        b = hash_bucket(hashes[i], num_buckets);
+        by_bucket[start[b]++] = i;
+    }
+    for (b = num_buckets; b > 0; --b)
+        start[b] = start[b - 1];
+    start[0] = 0;
+    if (max_size > sizeof(slots) / sizeof(slots[0]))
+        return false;
+
+    /* order the nonempty buckets by size, biggest first */
+    for (size = max_size; size > 0; --size)
+    {
+        for (b = 0; b < num_buckets; ++b)
+        {
+            if (start[b + 1] - start[b] == size)
+                order[num_used++] = b;
+        }
+    }
+
+    memset(taken, 0, num_slots);
+    for (i = 0; i < num_used; ++i)
+    {
+        uint32_t first = start[order[i]], count = start[order[i] + 1] - first, pilot, j, k;
+        for (pilot = 0; ; ++pilot)
+        {
+            if (pilot == MAX_PILOT)
+                return false;
+            for (j = 0; j < count; ++j)
+            {
+                slots[j] = hash_slot(hashes[by_bucket[first + j]], pilot, num_slots);
+                if (taken[slots[j]])
+                    break;
+                for (k = 0; k < j; ++k)
+                {
+                    if (slots[k] == slots[j])
+                        break;
+                }
+                if (k < j)
+                    break;
+            }
+            if (j == count)
+                break;
+        }
+        pilots[order[i]].v = pilot;
+        for (j = 0; j < count; ++j)
+        {
+            taken[slots[j]] = 1;
+            if (slots[j] < n)
+                rows[slots[j]].v = by_bucket[first + j];
+            else
+                spare[slots[j] - n].v = by_bucket[first + j];
+        }
+    }
+
+    /* as many slots below n are free as keys are above it */
+    for (i = n, b = 0; i < num_slots; ++i)
+    {
+        if (!taken[i])
+        {
+            spare[i - n].v = 0;
+            continue;
+        }
+        while (taken[b])
+            ++b;
+        rows[b].v = spare[i - n].v;
+        spare[i - n].v = b++;
+    }
+    return true;
+}
+
+
+CrabSection *crab_file_add_keys(CrabFile *c, const uint64_t *keys, uint32_t count, const char *schema, uint16_t purpose)
+{
+    CrabKeysData *data = NULL;
+    CrabSection *s;
+    uint64_t size = (uint64_t)count * sizeof(*data);
+    uint32_t i;
+
+    /* At most 32 GiB, since `count` is only 32 bits. */
+    if (size != (size_t)size)
+        ERROR2("<num keys>", EOVERFLOW);
+    data = (CrabKeysData *)TRY_P(malloc, (size + 1));
+    for (i = 0; i < count; ++i)
+        data[i].key = keys[i];
+    s = TRY_P(crab_file_section_add_many, (c, 1, schema, purpose));
+    TRY_B(crab_section_set_data, (s, CRAB_SECTION_FLAG_OWN, (CrabAbstractData *)data, size));
+    return s;
+
+err:
+    free(data);
+    maybe_perror(c);
+    return NULL;
+}
+
+CrabSection *crab_file_add_hash(CrabFile *c, CrabSection *keys, int key_type, const char *schema, uint16_t purpose)
+{
+    CrabHashData *data = NULL;
+    KeySource src;
+    uint64_t *hashes = NULL, *sorted = NULL, seed, size;
+    uint32_t *scratch = NULL;
+    unsigned char *taken = NULL;
+    uint32_t n, num_slots, num_buckets, i, attempt;
+    const char *why = NULL;
+    CrabSection *s;
+
+    if (keys->c != c)
+        ERROR2("<key section>", EXDEV);
+    if (!open_key_source(keys, key_type, &src))
+        goto err;
+    n = src.num_keys;
+    size = ((uint64_t)n * SLOTS_PER_100_KEYS + 99) / 100 + 1;
+    if (size > UINT32_MAX)
+        ERROR2("<num keys>", EOVERFLOW);
+    num_slots = size;
+    num_buckets = n / KEYS_PER_BUCKET + 1;
+    /* At most 20 GiB, since there are fewer than 2^32 keys. */
+    size = sizeof(CrabHashData) + ((uint64_t)num_buckets + num_slots) * sizeof(CrabHashWord);
+    if (size != (size_t)size)
+        ERROR2("<num keys>", EOVERFLOW);
+
+    hashes = TRY_P(malloc, (n * sizeof(*hashes) + 1));
+    sorted = TRY_P(malloc, (n * sizeof(*sorted) + 1));
+    scratch = TRY_P(malloc, (((uint64_t)n + 2 * num_buckets + 1) * sizeof(*scratch)));
+    taken = TRY_P(malloc, (num_slots));
+    data = (CrabHashData *)TRY_P(calloc, (1, size));
+
+    for (attempt = 0, seed = 0; ; ++attempt)
+    {
+        bool distinct = true;
+        if (attempt == MAX_SEEDS)
+            ERROR2(why, EINVAL);
+        seed = mix64(seed + attempt + 1);
+        if (!hash_keys(&src, seed, hashes))
+            ERROR2("<file format>", EINVAL);
+        memcpy(sorted, hashes, n * sizeof(*sorted));
+        qsort(sorted, n, sizeof(*sorted), compare_u64);
+        for (i = 1; i < n; ++i)
+        {
+            if (sorted[i] == sorted[i - 1])
+                distinct = false;
+        }
+        why = "<duplicate keys>";
+        if (!distinct)
+            continue;
+        why = "<hash placement>";
+        if (place_keys(hashes, n, num_slots, num_buckets, (CrabHashWord *)hash_pilots(data), (CrabHashWord *)hash_rows(data, num_buckets), (CrabHashWord *)hash_spare(data, num_buckets, n), scratch, taken))
+            break;
+    }
+
+    data->key_type = key_type;
+    data->num_keys = n;
+    data->num_buckets = num_buckets;
+    data->num_slots = num_slots;
+    data->seed = seed;
+    free(hashes);
+    free(sorted);
+    free(scratch);
+    free(taken);
+    hashes = sorted = NULL;
+    scratch = NULL;
+    taken = NULL;
+
+    s = TRY_P(crab_file_section_add_many, (c, 1, schema, purpose));
+    data->key_section = crab_section_number(keys) - crab_section_number(s);
+    TRY_B(crab_section_set_data, (s, CRAB_SECTION_FLAG_OWN, (CrabAbstractData *)data, size));
+    return s;
+
+err:
+    free(hashes);
+    free(sorted);
+    free(scratch);
+    free(taken);
+    free(data);
+    maybe_perror(c);
+    return NULL;
+}
+
+bool crab_hash_open(CrabSection *s, CrabHash *view)
+{
+    CrabFile *c = s->c;
+    const CrabHashData *data = (const CrabHashData *)crab_section_data(s);
+    uint64_t size = crab_section_data_size(s);
+    uint32_t key_section_number, n, num_slots, num_buckets, i;
+    const CrabHashWord *rows, *spare;
+    CrabSection *keys;
+
+    if (!data && size)
+        goto err;
+    if (size < sizeof(CrabHashData))
+        goto fmt_err;
+    n = data->num_keys;
+    num_slots = data->num_slots;
+    num_buckets = data->num_buckets;
+    if (!num_buckets || num_slots <= n)
+        goto fmt_err;
+    if (size != sizeof(CrabHashData) + ((uint64_t)num_buckets + num_slots) * sizeof(CrabHashWord))
+        goto fmt_err;
+    rows = hash_rows(data, num_buckets);
+    for (i = 0; i < n; ++i)
+    {
+        if (rows[i].v >= n)
+            goto fmt_err;
+    }
+    /* spare slots that no key hashed to hold 0, even with no keys */
+    spare = hash_spare(data, num_buckets, n);
+    for (i = 0; i < num_slots - n; ++i)
+    {
+        if (spare[i].v && spare[i].v >= n)
+            goto fmt_err;
+    }
+
+    key_section_number = s->section_number + data->key_section;
+    if (key_section_number >= crab_file_num_sections(c))
+        goto fmt_err;
+    keys = crab_file_section(c, key_section_number);
+    if (!keys)
+        return false;
+    memset(view, 0, sizeof(*view));
+    if (data->key_type == CRAB_KEY_TYPE_STRING)
+    {
+        if (!crab_strings_open(keys, &view->strings))
+            return false;
+        if (crab_strings_count(&view->strings) != n)
+            goto fmt_err;
+    }
+    else if (data->key_type == CRAB_KEY_TYPE_U64)
+    {
+        view->keys = crab_section_data(keys);
+        if (!view->keys && crab_section_data_size(keys))
+            return false;
+        if (crab_section_data_size(keys) != (uint64_t)n * sizeof(CrabKeysData))
+            goto fmt_err;
+    }
+    else
+        goto fmt_err;
+
+    view->data = data;
+    view->seed = data->seed;
+    view->num_keys = n;
+    view->num_slots = num_slots;
+    view->num_buckets = num_buckets;
+    view->key_type = data->key_type;
+    return true;
+
+fmt_err:
+    c->error_message = "<file format>";
+    c->error_number = EINVAL;
+err:
+    maybe_perror(c);
+    return false;
+}
+
+int crab_hash_key_type(const CrabHash *view)
+{
+    return view->key_type;
+}
+
+/* The row that `h` would be at, if it's anywhere. */
+static uint32_t hash_find(const CrabHash *view, uint64_t h)
+{
+    uint32_t pilot = hash_pilots(view->data)[hash_bucket(h, view->num_buckets)].v;
+    uint32_t slot = hash_slot(h, pilot, view->num_slots);
+    if (slot >= view->num_keys)
+        slot = hash_spare(view->data, view->num_buckets, view->num_keys)[slot - view->num_keys].v;
+    return hash_rows(view->data, view->num_buckets)[slot].v;
+}
+
+bool crab_hash_find_string(const CrabHash *view, const char *str, size_t len, uint32_t *row)
+{
+    const char *other;
+    size_t other_len;
+    uint32_t r;
+
+    if (view->key_type != CRAB_KEY_TYPE_STRING || !view->num_keys)
+        return false;
+    r = hash_find(view, hash_string(str, len, view->seed));
+    other = crab_strings_get(&view->strings, r, &other_len);
+    if (!other || other_len != len || memcmp(other, str, len) != 0)
+        return false;
+    *row = r;
+    return true;
+}
+
+bool crab_hash_find_u64(const CrabHash *view, uint64_t key, uint32_t *row)
+{
+    uint32_t r;
+
+    if (view->key_type != CRAB_KEY_TYPE_U64 || !view->num_keys)
+        return false;
+    r = hash_find(view, hash_u64(key, view->seed));
+    if (((const CrabKeysData *)view->keys)[r].key != key)
+        return false;
+    *row = r;
+    return true;
+}
+
+
+/*
+    Set or test one bit in each word. Bits are numbered byte by byte, so
+    this works the same on any host.
+*/
+static void filter_insert(unsigned char *block, uint32_t lo)
+{
+    unsigned i, b;
+    for (i = 0; i < 8; ++i)
+    {
+        b = filter_bit(lo, i);
+        block[4 * i + b / 8] |= 1 << (b % 8);
+    }
+}
+static bool filter_check_scalar(const unsigned char *block, uint32_t lo)
+{
+    unsigned i, b;
+    for (i = 0; i < 8; ++i)
+    {
+        b = filter_bit(lo, i);
+        if (!(block[4 * i + b / 8] >> (b % 8) & 1))
+            return false;
+    }
+    return true;
+}
+
+#if HAVE_AVX2_PROBE
+/*
+    x86 is little-endian, so loading a block gives exactly the words the
+    scalar code numbers byte by byte. All 8 bit positions come from one
+    multiply, one shift, and one variable shift; the block matches if it
+    has every bit of the mask.
+*/
+__attribute__((target("avx2")))
+static void filter_check_avx2(const unsigned char *const *blocks, const uint32_t *lo, size_t count, bool *out)
+{
+    __m256i salts = _mm256_loadu_si256((const __m256i *)filter_salts);
+    __m256i one = _mm256_set1_epi32(1);
+    size_t i;
+    for (i = 0; i < count; ++i)
+    {
+        __m256i shift = _mm256_srli_epi32(_mm256_mullo_epi32(_mm256_set1_epi32(lo[i]), salts), 27);
+        __m256i mask = _mm256_sllv_epi32(one, shift);
+        __m256i block = _mm256_loadu_si256((const __m256i *)blocks[i]);
+        out[i] = _mm256_testc_si256(block, mask);
+    }
+}
+#endif
+
+static const unsigned char *filter_block(const CrabFilter *view, uint64_t h)
+{
+    return view->blocks + (size_t)hash_bucket(h, view->num_blocks) * CRAB_FILTER_BLOCK_SIZE;
+}
+
+/*
+    Check up to FILTER_BATCH hashes. The blocks are all prefetched
+    before any is needed, so the misses overlap.
+*/
+static void filter_check_hashes(const CrabFilter *view, const uint64_t *hashes, size_t count, bool *out)
+{
+    const unsigned char *blocks[FILTER_BATCH];
+    uint32_t lo[FILTER_BATCH];
+    size_t i;
+
+    for (i = 0; i < count; ++i)
+    {
+        blocks[i] = filter_block(view, hashes[i]);
+        lo[i] = hashes[i];
+        __builtin_prefetch(blocks[i]);
+    }
+#if HAVE_AVX2_PROBE
+    if (have_avx2())
+    {
+        filter_check_avx2(blocks, lo, count, out);
+        return;
+    }
+#endif
+    for (i = 0; i < count; ++i)
+        out[i] = filter_check_scalar(blocks[i], lo[i]);
+}
+
+
+CrabSection *crab_file_add_filter(CrabFile *c, CrabSection *keys, int key_type, unsigned bits_per_key, const char *schema, uint16_t purpose)
+{
+    CrabFilterData *data = NULL;
+    KeySource src;
+    uint64_t *hashes = NULL, num_blocks, size;
+    unsigned char *blocks;
+    uint32_t i;
+    CrabSection *s;
+
+    if (keys->c != c)
+        ERROR2("<key section>", EXDEV);
+    if (!open_key_source(keys, key_type, &src))
+        goto err;
+    if (!bits_per_key)
+        bits_per_key = FILTER_BITS_PER_KEY;
+    num_blocks = ((uint64_t)src.num_keys * bits_per_key + CRAB_FILTER_BLOCK_SIZE * 8 - 1) / (CRAB_FILTER_BLOCK_SIZE * 8);
+    /* Even with no keys, so that checks need no special case. */
+    if (!num_blocks)
+        num_blocks = 1;
+    /* `num_blocks` is only 32 bits. */
+    if (num_blocks > UINT32_MAX)
+        ERROR2("<num keys>", EOVERFLOW);
+    size = sizeof(CrabFilterData) + num_blocks * CRAB_FILTER_BLOCK_SIZE;
+    if (size != (size_t)size)
+        ERROR2("<num keys>", EOVERFLOW);
+
+    hashes = TRY_P(malloc, (src.num_keys * sizeof(*hashes) + 1));
+    data = (CrabFilterData *)TRY_P(calloc, (1, size));
+    if (!hash_keys(&src, FILTER_SEED, hashes))
+        ERROR2("<file format>", EINVAL);
+    blocks = (unsigned char *)(data + 1);
+    for (i = 0; i < src.num_keys; ++i)
+        filter_insert(blocks + (size_t)hash_bucket(hashes[i], num_blocks) * CRAB_FILTER_BLOCK_SIZE, hashes[i]);
+    free(hashes);
+    hashes = NULL;
+
+    data->key_type = key_type;
+    data->num_keys = src.num_keys;
+    data->num_blocks = num_blocks;
+    data->seed = FILTER_SEED;
+
+    s = TRY_P(crab_file_section_add_many, (c, 1, schema, purpose));
+    data->key_section = crab_section_number(keys) - crab_section_number(s);
+    /*
+        The header is one block, so the rest line up too. Saving does
+        this by itself for CRAB_PURPOSE_FILTER, but not other purposes.
+    */
+    TRY_B(crab_section_set_alignment, (s, CRAB_FILTER_BLOCK_SIZE));
+    TRY_B(crab_section_set_data, (s, CRAB_SECTION_FLAG_OWN, (CrabAbstractData *)data, size));
+    return s;
+
+err:
+    free(hashes);
+    free(data);
+    maybe_perror(c);
+    return NULL;
+}
+
+bool crab_filter_open(CrabSection *s, CrabFilter *view)
+{
+    CrabFile *c = s->c;
+    const CrabFilterData *data = (const CrabFilterData *)crab_section_data(s);
+    uint64_t size = crab_section_data_size(s);
+    uint32_t num_blocks;
+
+    if (!data && size)
+        goto err;
+    if (size < sizeof(CrabFilterData))
+        goto fmt_err;
+    num_blocks = data->num_blocks;
+    if (!num_blocks)
+        goto fmt_err;
+    if (size != sizeof(CrabFilterData) + (uint64_t)num_blocks * CRAB_FILTER_BLOCK_SIZE)
+        goto fmt_err;
+    if (data->key_type != CRAB_KEY_TYPE_STRING && data->key_type != CRAB_KEY_TYPE_U64)
+        goto fmt_err;
+    if (s->section_number + data->key_section >= crab_file_num_sections(c))
+        goto fmt_err;
+
+    view->blocks = (const unsigned char *)(data + 1);
+    view->seed = data->seed;
+    view->num_blocks = num_blocks;
+    view->key_type = data->key_type;
+    return true;
+
+fmt_err:
+    c->error_message = "<file format>";
+    c->error_number = EINVAL;
+err:
+    maybe_perror(c);
+    return false;
+}
+
+int crab_filter_key_type(const CrabFilter *view)
+{
+    return view->key_type;
+}
+
+bool crab_filter_check_string(const CrabFilter *view, const char *str, size_t len)
+{
+    uint64_t h;
+
+    if (view->key_type != CRAB_KEY_TYPE_STRING)
+        return false;
+    h = hash_string(str, len, view->seed);
+    return filter_check_scalar(filter_block(view, h), h);
+}
+
+bool crab_filter_check_u64(const CrabFilter *view, uint64_t key)
+{
+    uint64_t h;
+
+    if (view->key_type != CRAB_KEY_TYPE_U64)
+        return false;
+    h = hash_u64(key, view->seed);
+    return filter_check_scalar(filter_block(view, h), h);
+}
+
+void crab_filter_check_many_strings(const CrabFilter *view, const char *const *strs, const size_t *lens, size_t count, bool *out)
+{
+    uint64_t hashes[FILTER_BATCH];
+    size_t i, j, n;
+
+    if (view->key_type != CRAB_KEY_TYPE_STRING)
+    {
+        memset(out, 0, count * sizeof(*out));
+        return;
+    }
+    for (i = 0; i < count; i += n)
+    {
+        n = count - i < FILTER_BATCH ? count - i : FILTER_BATCH;
+        for (j = 0; j < n; ++j)
+            hashes[j] = hash_string(strs[i + j], lens[i + j], view->seed);
+        filter_check_hashes(view, hashes, n, out + i);
+    }
+}
+
+void crab_filter_check_many_u64(const CrabFilter *view, const uint64_t *keys, size_t count, bool *out)
+{
+    uint64_t hashes[FILTER_BATCH];
+    size_t i, j, n;
+
+    if (view->key_type != CRAB_KEY_TYPE_U64)
+    {
+        memset(out, 0, count * sizeof(*out));
+        return;
+    }
+    for (i = 0; i < count; i += n)
+    {
+        n = count - i < FILTER_BATCH ? count - i : FILTER_BATCH;
+        for (j = 0; j < n; ++j)
+            hashes[j] = hash_u64(keys[i + j], view->seed);
+        filter_check_hashes(view, hashes, n, out + i);
+    }
+}
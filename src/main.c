@@ -15,6 +15,8 @@
     You should have received a copy of the GNU Lesser General Public License
     along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
+#define _POSIX_C_SOURCE 200809L
+
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -27,9 +29,14 @@
 #include <string.h>
 #include <unistd.h>
 
+#include "compress.h"
 #include "crab.h"
+#include "keys.h"
+#include "packed.h"
+#include "runs.h"
 #include "schema.h"
 #include "table.h"
+#include "trie.h"
 #include "util.h"
 
 
@@ -69,6 +76,105 @@ static CrabAbstractData *mmap_file(const char *fn, size_t *rv_size)
     return rv;
 }
 
+/*
+    How `crab add` turns a blob into section data.
+*/
+typedef struct Encoding Encoding;
+struct Encoding
+{
+    const char *name;
+    /* Width of each integer in the blob, or 0 to store it as-is. */
+    unsigned width;
+    bool big_endian;
+    /* What to build from the integers, and its builtin purpose. */
+    uint16_t purpose;
+};
+static const Encoding encodings[] =
+{
+    {"raw", 0, false, CRAB_PURPOSE_RAW},
+    {"for-le32", 4, false, CRAB_PURPOSE_FOR_INTS},
+    {"for-be32", 4, true, CRAB_PURPOSE_FOR_INTS},
+    {"for-le64", 8, false, CRAB_PURPOSE_FOR_INTS},
+    {"for-be64", 8, true, CRAB_PURPOSE_FOR_INTS},
+    {"keys-le64", 8, false, CRAB_PURPOSE_KEYS},
+    {"keys-be64", 8, true, CRAB_PURPOSE_KEYS},
+};
+static const Encoding *parse_encoding(const char *arg)
+{
+    size_t i;
+    for (i = 0; i < sizeof(encodings) / sizeof(encodings[0]); ++i)
+    {
+        if (strcmp(arg, encodings[i].name) == 0)
+            return &encodings[i];
+    }
+    errno = EINVAL;
+    die("--encode");
+}
+/*
+    Split a blob into fixed-width integers. The result must be freed.
+*/
+static uint64_t *read_ints(const unsigned char *blob, size_t blob_size, unsigned width, bool big_endian, size_t *count)
+{
+    uint64_t *values;
+    size_t i;
+    unsigned k;
+    errno = EINVAL;
+    if (blob_size % width)
+        die("<blob size>");
+    *count = blob_size / width;
+    values = TRY_P(malloc, (*count * sizeof(*values) + 1));
+    for (i = 0; i < *count; ++i)
+    {
+        const unsigned char *p = blob + i * width;
+        uint64_t v = 0;
+        for (k = 0; k < width; ++k)
+            v |= (uint64_t)p[big_endian ? width - 1 - k : k] << (8 * k);
+        values[i] = v;
+    }
+    return values;
+}
+/*
+    Add a frame-of-reference or key section from a blob of fixed-width
+    integers.
+*/
+static CrabSection *add_encoded(CrabFile *c, const Encoding *e, const unsigned char *blob, size_t blob_size, const char *schema, uint16_t purpose)
+{
+    size_t count;
+    uint64_t *values = read_ints(blob, blob_size, e->width, e->big_endian, &count);
+    CrabSection *s;
+    if (e->purpose == CRAB_PURPOSE_KEYS)
+    {
+        errno = EOVERFLOW;
+        if (count > UINT32_MAX)
+            die("<num keys>");
+        s = crab_file_add_keys(c, values, count, schema, purpose);
+    }
+    else
+        s = crab_file_add_for(c, values, count, schema, purpose);
+    free(values);
+    return s;
+}
+
+static int parse_codec(const char *arg)
+{
+    if (strcmp(arg, "none") == 0)
+        return CRAB_CODEC_NONE;
+    if (strcmp(arg, "lz") == 0)
+        return CRAB_CODEC_LZ;
+    errno = EINVAL;
+    die("--compress");
+}
+static int parse_byte_order(const char *arg)
+{
+    if (strcmp(arg, "big") == 0)
+        return CRAB_BYTE_ORDER_BIG;
+    if (strcmp(arg, "little") == 0)
+        return CRAB_BYTE_ORDER_LITTLE;
+    if (strcmp(arg, "native") == 0)
+        return crab_native_byte_order();
+    return 0;
+}
+
 typedef int (*Cmd)(int argc, char **argv);
 
 static int cmd_help(int argc, char **argv);
@@ -92,18 +198,127 @@ static int cmd_new(int argc, char **argv)
         return 1;
     return 0;
 }
+/*
+    Open a file for reading, where `-` means standard input.
+*/
+static CrabFile *open_input(const char *filename, int flags)
+{
+    if (strcmp(filename, "-") == 0)
+        return crab_file_open_fd(STDIN_FILENO, flags);
+    return crab_file_open(filename, flags);
+}
+
+typedef struct Extent Extent;
+struct Extent
+{
+    uint64_t offset;
+    uint64_t size;
+    uint32_t section;
+};
+static int compare_extents(const void *a, const void *b)
+{
+    const Extent *ea = a, *eb = b;
+    if (ea->offset != eb->offset)
+        return ea->offset < eb->offset ? -1 : 1;
+    return (ea->section > eb->section) - (ea->section < eb->section);
+}
+/*
+    Find how many unused bytes there are just before each section - either
+    alignment padding, or dead space left behind by appending saves - and
+    in the file as a whole.
+
+    Also find which sections share their data with an earlier one, as
+    deduplicating saves do: `shared[i]` is that section's number plus 1,
+    or 0.
+*/
+static bool find_padding(CrabFile *c, uint64_t *padding, uint32_t *shared, uint64_t *unused)
+{
+    uint32_t num_sections = crab_file_num_sections(c), num_extents = 0, i;
+    uint64_t file_size, end, moved_table_size;
+    Extent *extents = TRY_P(calloc, (num_sections ? num_sections : 1, sizeof(*extents)));
+
+    crab_file_layout(c, &file_size, &end, &moved_table_size);
+    /* A moved section table is the last thing in the file. */
+    file_size -= moved_table_size;
+    for (i = 0; i < num_sections; ++i)
+    {
+        CrabSection *s = crab_file_section(c, i);
+        if (!s)
+        {
+            free(extents);
+            return false;
+        }
+        padding[i] = 0;
+        shared[i] = 0;
+        extents[num_extents].size = crab_section_data_size(s);
+        extents[num_extents].section = i;
+        if (extents[num_extents].size && crab_section_file_offset(s, &extents[num_extents].offset))
+            ++num_extents;
+    }
+    qsort(extents, num_extents, sizeof(*extents), compare_extents);
+    *unused = 0;
+    for (i = 0; i < num_extents; ++i)
+    {
+        if (i && extents[i].offset == extents[i - 1].offset && extents[i].size == extents[i - 1].size)
+        {
+            shared[extents[i].section] = shared[extents[i - 1].section] ? shared[extents[i - 1].section] : extents[i - 1].section + 1;
+            continue;
+        }
+        if (extents[i].offset > end)
+        {
+            padding[extents[i].section] = extents[i].offset - end;
+            *unused += extents[i].offset - end;
+        }
+        if (extents[i].offset + extents[i].size > end)
+            end = extents[i].offset + extents[i].size;
+    }
+    if (file_size > end)
+        *unused += file_size - end;
+    free(extents);
+    return true;
+}
+
+/*
+    Format how much a builtin compressed section saves, as raw / stored;
+    empty for any other section.
+*/
+static const char *compression_ratio(CrabSection *s, char *buf, size_t size)
+{
+    CrabCompressed view;
+    size_t stored = crab_section_data_size(s);
+    if (strcmp(crab_section_schema(s), CRAB_SCHEMA) != 0 || crab_section_purpose(s) != CRAB_PURPOSE_COMPRESSED)
+        return "";
+    if (!crab_compressed_open(s, &view))
+        return "?";
+    snprintf(buf, size, "%.2f", stored ? (double)crab_compressed_size(&view) / stored : 0.0);
+    return buf;
+}
+
 static int cmd_list(int argc, char **argv)
 {
     CrabFile *c;
     uint32_t num_sections, i;
+    uint64_t *padding, unused, file_size, table_size, moved_table_size;
+    uint32_t *shared;
+    char ratio[32];
     if (argc != 1)
     {
-        puts("Usage: `crab list <filename.crab>`");
+        puts("Usage: `crab list <filename.crab | ->`");
         return 1;
     }
-    c = crab_file_open(argv[0], CRAB_FILE_FLAG_PERROR);
+    c = open_input(argv[0], CRAB_FILE_FLAG_PERROR | CRAB_FILE_FLAG_LAZY);
     if (!c)
         return 1;
+    num_sections = crab_file_num_sections(c);
+    padding = TRY_P(calloc, (num_sections, sizeof(*padding)));
+    shared = TRY_P(calloc, (num_sections ? num_sections : 1, sizeof(*shared)));
+    if (!find_padding(c, padding, shared, &unused))
+    {
+        free(padding);
+        free(shared);
+        (void)crab_file_close(c);
+        return 1;
+    }
     table_new(stdout);
     while (table_phase())
     {
@@ -111,10 +326,12 @@ static int cmd_list(int argc, char **argv)
         table_emits("Schema");
         table_emits("P");
         table_emits("sz");
+        table_emits("pad");
+        table_emits("ratio");
+        table_emits("same as");
         table_end_row();
         table_divider_row();
 
-        num_sections = crab_file_num_sections(c);
         for (i = 0; i < num_sections; ++i)
         {
             CrabSection *s = crab_file_section(c, i);
@@ -122,9 +339,19 @@ static int cmd_list(int argc, char **argv)
             table_emits(crab_section_schema(s));
             table_emitu(crab_section_purpose(s));
             table_emitu(crab_section_data_size(s));
+            table_emitu(padding[i]);
+            table_emits(compression_ratio(s, ratio, sizeof(ratio)));
+            if (shared[i])
+                table_emitu(shared[i] - 1);
+            else
+                table_emits("");
             table_end_row();
         }
     }
+    crab_file_layout(c, &file_size, &table_size, &moved_table_size);
+    printf("%ju of %ju bytes unused (%.1f%%)\n", (uintmax_t)unused, (uintmax_t)file_size, file_size ? 100.0 * unused / file_size : 0.0);
+    free(padding);
+    free(shared);
 
     if (!crab_file_close(c))
         return 1;
@@ -136,6 +363,8 @@ static int cmd_add(int argc, char **argv)
     CrabSection *s;
     const char *schema = CRAB_SCHEMA;
     uint16_t purpose = CRAB_PURPOSE_RAW;
+    const Encoding *encoding = &encodings[0];
+    int codec = CRAB_CODEC_NONE;
     int sections_added = 0, i;
     CrabAbstractData *blob = 0;
     size_t blob_size = 0;
@@ -144,6 +373,8 @@ static int cmd_add(int argc, char **argv)
     c = crab_file_open(argv[0], CRAB_FILE_FLAG_PERROR);
     if (!c)
         return 1;
+    /* at most one section per argument */
+    TRY_B(crab_file_reserve_sections, (c, crab_file_num_sections(c) + argc - 1));
     for (i = 1; i < argc; ++i)
     {
         if (strncmp(argv[i], "--schema=", strlen("--schema=")) == 0)
@@ -157,12 +388,45 @@ static int cmd_add(int argc, char **argv)
             purpose = parse_u16(argv[i] + strlen("--purpose="));
             continue;
         }
+        if (strncmp(argv[i], "--encode=", strlen("--encode=")) == 0)
+        {
+            encoding = parse_encoding(argv[i] + strlen("--encode="));
+            /* Only guess the purpose for the builtin schema. */
+            if (strcmp(schema, CRAB_SCHEMA) == 0)
+                purpose = encoding->purpose;
+            continue;
+        }
+        if (strcmp(argv[i], "--compress") == 0 || strncmp(argv[i], "--compress=", strlen("--compress=")) == 0)
+        {
+            codec = argv[i][strlen("--compress")] ? parse_codec(argv[i] + strlen("--compress=")) : CRAB_CODEC_LZ;
+            if (strcmp(schema, CRAB_SCHEMA) == 0)
+                purpose = codec ? CRAB_PURPOSE_COMPRESSED : encoding->purpose;
+            continue;
+        }
         ++sections_added;
         if (*argv[i])
         {
             blob = TRY_P(mmap_file, (argv[i], &blob_size));
         }
 
+        if (encoding->width)
+        {
+            TRY_P(add_encoded, (c, encoding, (const unsigned char *)blob, blob_size, schema, purpose));
+            if (blob)
+                TRY(munmap, (blob, blob_size));
+            blob = NULL;
+            blob_size = 0;
+            continue;
+        }
+        if (codec)
+        {
+            TRY_P(crab_file_add_compressed, (c, blob, blob_size, codec, 0, schema, purpose));
+            if (blob)
+                TRY(munmap, (blob, blob_size));
+            blob = NULL;
+            blob_size = 0;
+            continue;
+        }
         s = TRY_P(crab_file_section_add, (c));
         TRY_B(crab_section_set_schema_and_purpose, (s, schema, purpose));
         if (blob)
@@ -182,7 +446,7 @@ static int cmd_add(int argc, char **argv)
     return 0;
 
 usage:
-    puts("Usage: crab add <filename.crab> [--schema=<url>] [--purpose=<number>] {<blob> | ''}...");
+    puts("Usage: crab add <filename.crab> [--schema=<url>] [--purpose=<number>] [--encode=raw|for-le32|for-be32|for-le64|for-be64|keys-le64|keys-be64] [--compress[=none|lz]] {<blob> | ''}...");
     if (c)
         TRY_B(crab_file_close, (c));
     if (blob)
@@ -310,10 +574,10 @@ static int cmd_dump(int argc, char **argv)
     FILE *out = NULL;
     if (argc != 3)
     {
-        puts("Usage: crab dump <filename.crab> <section-number> <out-file>");
+        puts("Usage: crab dump <filename.crab | -> <section-number> <out-file>");
         return 1;
     }
-    c = crab_file_open(argv[0], CRAB_FILE_FLAG_PERROR);
+    c = open_input(argv[0], CRAB_FILE_FLAG_PERROR | CRAB_FILE_FLAG_LAZY);
     if (!c)
         return 1;
 
@@ -326,6 +590,8 @@ static int cmd_dump(int argc, char **argv)
         goto fail;
     data = (char *)crab_section_data(s);
     data_size = crab_section_data_size(s);
+    if (!data && data_size)
+        goto fail;
     while (data_size)
     {
         size_t tmp = fwrite(data, 1, data_size, out);
@@ -346,6 +612,388 @@ fail:
     (void)crab_file_close(c);
     return 1;
 }
+static int cmd_trie(int argc, char **argv)
+{
+    static const Encoding inputs[] =
+    {
+        {"u8", 1, false, CRAB_PURPOSE_TRIE},
+        {"le16", 2, false, CRAB_PURPOSE_TRIE},
+        {"be16", 2, true, CRAB_PURPOSE_TRIE},
+        {"le32", 4, false, CRAB_PURPOSE_TRIE},
+        {"be32", 4, true, CRAB_PURPOSE_TRIE},
+    };
+    const Encoding *input = &inputs[0];
+    unsigned leaf_bits = 0, mid_bits = 0;
+    const char *filename = NULL, *blob_filename = NULL;
+    CrabFile *c = NULL;
+    CrabAbstractData *blob;
+    uint64_t *wide;
+    uint32_t *values;
+    size_t blob_size, count, i, j;
+    for (i = 0; i < (size_t)argc; ++i)
+    {
+        if (strncmp(argv[i], "--input=", strlen("--input=")) == 0)
+        {
+            for (j = 0; j < sizeof(inputs) / sizeof(inputs[0]); ++j)
+            {
+                if (strcmp(argv[i] + strlen("--input="), inputs[j].name) == 0)
+                    break;
+            }
+            if (j == sizeof(inputs) / sizeof(inputs[0]))
+                goto usage;
+            input = &inputs[j];
+        }
+        else if (strncmp(argv[i], "--leaf-bits=", strlen("--leaf-bits=")) == 0)
+            leaf_bits = parse_u16(argv[i] + strlen("--leaf-bits="));
+        else if (strncmp(argv[i], "--mid-bits=", strlen("--mid-bits=")) == 0)
+            mid_bits = parse_u16(argv[i] + strlen("--mid-bits="));
+        else if (!filename)
+            filename = argv[i];
+        else if (!blob_filename)
+            blob_filename = argv[i];
+        else
+            goto usage;
+    }
+    if (!blob_filename)
+        goto usage;
+
+    c = crab_file_open(filename, CRAB_FILE_FLAG_PERROR);
+    if (!c)
+        return 1;
+    blob = TRY_P(mmap_file, (blob_filename, &blob_size));
+    wide = read_ints((const unsigned char *)blob, blob_size, input->width, input->big_endian, &count);
+    TRY(munmap, (blob, blob_size));
+    values = TRY_P(malloc, (count * sizeof(*values) + 1));
+    for (i = 0; i < count; ++i)
+        values[i] = wide[i];
+    free(wide);
+    if (!crab_file_add_trie(c, values, count, leaf_bits, mid_bits, CRAB_SCHEMA, CRAB_PURPOSE_TRIE))
+    {
+        free(values);
+        (void)crab_file_close(c);
+        return 1;
+    }
+    free(values);
+    TRY_B(crab_file_save, (c, 0));
+    TRY_B(crab_file_close, (c));
+    return 0;
+
+usage:
+    puts("Usage: crab trie <filename.crab> [--input=u8|le16|be16|le32|be32] [--leaf-bits=<n>] [--mid-bits=<n>] <blob>");
+    return 1;
+}
+/*
+    Parse `<first>[..<last>] [;] <value>`, ignoring `#` comments.
+
+    Returns 0 for a blank line, 1 for an interval, and -1 if it's bad.
+*/
+static int parse_interval(char *line, int base, CrabInterval *out)
+{
+    char *p, *end;
+    if ((p = strchr(line, '#')))
+        *p = '\0';
+    p = line;
+    while (isspace((unsigned char)*p))
+        ++p;
+    if (!*p)
+        return 0;
+    if (!isxdigit((unsigned char)*p))
+        return -1;
+    out->first = out->last = strtoull(p, &end, base);
+    if (end == p)
+        return -1;
+    p = end;
+    if (p[0] == '.' && p[1] == '.')
+    {
+        p += 2;
+        if (!isxdigit((unsigned char)*p))
+            return -1;
+        out->last = strtoull(p, &end, base);
+        if (end == p)
+            return -1;
+        p = end;
+    }
+    while (isspace((unsigned char)*p) || *p == ';')
+        ++p;
+    if (!isxdigit((unsigned char)*p))
+        return -1;
+    out->value = strtoul(p, &end, base);
+    if (end == p)
+        return -1;
+    p = end;
+    while (isspace((unsigned char)*p))
+        ++p;
+    return *p ? -1 : 1;
+}
+static int cmd_intervals(int argc, char **argv)
+{
+    const char *filename = NULL, *text_filename = NULL;
+    CrabInterval *intervals = NULL;
+    size_t num_intervals = 0, capacity = 0, line_capacity = 0;
+    unsigned long line_number = 0;
+    char *line = NULL;
+    CrabFile *c = NULL;
+    FILE *in = NULL;
+    int base = 0, i;
+    for (i = 0; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "--hex") == 0)
+            base = 16;
+        else if (!filename)
+            filename = argv[i];
+        else if (!text_filename)
+            text_filename = argv[i];
+        else
+        {
+            text_filename = NULL;
+            break;
+        }
+    }
+    if (!filename || !text_filename)
+    {
+        puts("Usage: crab intervals <filename.crab> <text-file | -> [--hex]");
+        puts("Each line of the text is `<first>[..<last>] [;] <value>`.");
+        return 1;
+    }
+
+    in = strcmp(text_filename, "-") == 0 ? stdin : TRY_P(fopen, (text_filename, "r"));
+    while (getline(&line, &line_capacity, in) != -1)
+    {
+        int rv;
+        ++line_number;
+        if (num_intervals == capacity)
+        {
+            capacity = capacity ? 2 * capacity : 64;
+            intervals = TRY_P(realloc, (intervals, capacity * sizeof(*intervals)));
+        }
+        rv = parse_interval(line, base, &intervals[num_intervals]);
+        if (rv < 0)
+        {
+            fprintf(stderr, "%s:%lu: bad interval\n", text_filename, line_number);
+            goto fail;
+        }
+        num_intervals += rv;
+    }
+    if (ferror(in))
+        die("getline");
+
+    c = crab_file_open(filename, CRAB_FILE_FLAG_PERROR);
+    if (!c)
+        goto fail;
+    if (!crab_file_add_intervals(c, intervals, num_intervals, CRAB_SCHEMA, CRAB_PURPOSE_INTERVALS))
+        goto fail;
+    if (!crab_file_save(c, 0))
+        goto fail;
+    TRY_B(crab_file_close, (c));
+    free(intervals);
+    free(line);
+    if (in != stdin)
+        TRY(fclose, (in));
+    return 0;
+
+fail:
+    if (c)
+        (void)crab_file_close(c);
+    free(intervals);
+    free(line);
+    if (in != stdin)
+        TRY(fclose, (in));
+    return 1;
+}
+
+static int cmd_filter(int argc, char **argv)
+{
+    const char *filename = NULL, *section_arg = NULL;
+    int key_type = 0;
+    unsigned bits_per_key = 0;
+    CrabFile *c;
+    CrabSection *keys;
+    int i;
+    for (i = 0; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "--key-type=string") == 0)
+            key_type = CRAB_KEY_TYPE_STRING;
+        else if (strcmp(argv[i], "--key-type=u64") == 0)
+            key_type = CRAB_KEY_TYPE_U64;
+        else if (strncmp(argv[i], "--bits-per-key=", strlen("--bits-per-key=")) == 0)
+            bits_per_key = parse_u16(argv[i] + strlen("--bits-per-key="));
+        else if (!filename)
+            filename = argv[i];
+        else if (!section_arg)
+            section_arg = argv[i];
+        else
+            goto usage;
+    }
+    if (!section_arg)
+        goto usage;
+
+    c = crab_file_open(filename, CRAB_FILE_FLAG_PERROR);
+    if (!c)
+        return 1;
+    keys = TRY_P(crab_file_section, (c, parse_u32(section_arg)));
+    /* Only guess the key type for the builtin schema. */
+    if (!key_type && strcmp(crab_section_schema(keys), CRAB_SCHEMA) == 0)
+    {
+        if (crab_section_purpose(keys) == CRAB_PURPOSE_STRINGS)
+            key_type = CRAB_KEY_TYPE_STRING;
+        if (crab_section_purpose(keys) == CRAB_PURPOSE_KEYS)
+            key_type = CRAB_KEY_TYPE_U64;
+    }
+    if (!key_type)
+    {
+        puts("crab filter: can't guess the key type; use --key-type=");
+        (void)crab_file_close(c);
+        return 1;
+    }
+    if (!crab_file_add_filter(c, keys, key_type, bits_per_key, CRAB_SCHEMA, CRAB_PURPOSE_FILTER))
+    {
+        (void)crab_file_close(c);
+        return 1;
+    }
+    TRY_B(crab_file_save, (c, 0));
+    TRY_B(crab_file_close, (c));
+    return 0;
+
+usage:
+    puts("Usage: crab filter <filename.crab> [--key-type=string|u64] [--bits-per-key=<n>] <key-section-number>");
+    return 1;
+}
+
+static int cmd_compact(int argc, char **argv)
+{
+    CrabFile *c;
+    int flags = 0, i;
+    for (i = 1; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "--align=page") == 0)
+            flags |= CRAB_SAVE_FLAG_ALIGN_PAGE;
+        else if (strcmp(argv[i], "--align=hugepage") == 0)
+            flags |= CRAB_SAVE_FLAG_ALIGN_HUGEPAGE;
+        else if (strcmp(argv[i], "--checksum") == 0)
+            flags |= CRAB_SAVE_FLAG_CHECKSUM;
+        else if (strcmp(argv[i], "--dedup") == 0)
+            flags |= CRAB_SAVE_FLAG_DEDUP;
+        else
+            break;
+    }
+    if (argc < 1 || i != argc)
+    {
+        puts("Usage: `crab compact <filename.crab> [--align=page|--align=hugepage] [--checksum] [--dedup]`");
+        return 1;
+    }
+    /* A normal save only writes what the section table points to. */
+    c = crab_file_open(argv[0], CRAB_FILE_FLAG_PERROR | CRAB_FILE_FLAG_LAZY);
+    if (!c)
+        return 1;
+    if (!crab_file_save(c, flags))
+    {
+        (void)crab_file_close(c);
+        return 1;
+    }
+    if (!crab_file_close(c))
+        return 1;
+    return 0;
+}
+static int cmd_verify(int argc, char **argv)
+{
+    CrabFile *c;
+    const char *msg;
+    int e;
+    uint32_t num_sections, i;
+    if (argc != 1)
+    {
+        puts("Usage: `crab verify <filename.crab | ->`");
+        return 1;
+    }
+    /* Errors are printed here, so that each bad section is named. */
+    c = open_input(argv[0], CRAB_FILE_FLAG_ERROR | CRAB_FILE_FLAG_LAZY);
+    if (!c)
+        die("<open>");
+    crab_file_error(c, &msg, &e);
+    if (msg)
+        goto fail;
+    num_sections = crab_file_num_sections(c);
+    if (crab_file_verify(c, 0))
+    {
+        printf("%s: %ju sections OK\n", argv[0], (uintmax_t)num_sections);
+        if (!crab_file_close(c))
+            return 1;
+        return 0;
+    }
+    crab_file_error(c, &msg, &e);
+    if (e != EBADMSG)
+        goto fail;
+    for (i = 0; i < num_sections; ++i)
+    {
+        CrabSection *s = crab_file_section(c, i);
+        if (s && !crab_section_verify(s))
+            printf("%s: section %ju: bad checksum\n", argv[0], (uintmax_t)i);
+    }
+    (void)crab_file_close(c);
+    return 1;
+fail:
+    errno = e;
+    perror(msg);
+    (void)crab_file_close(c);
+    return 1;
+}
+static int cmd_byteorder(int argc, char **argv)
+{
+    CrabFile *c;
+    int order = 0, i;
+    if (argc >= 2)
+        order = parse_byte_order(argv[1]);
+    if (argc < 1 || (argc >= 2 && !order))
+        goto usage;
+    for (i = 2; i < argc; ++i)
+    {
+        char *end;
+        if (strncmp(argv[i], "--swap=", strlen("--swap=")) != 0)
+            goto usage;
+        if (strtoul(argv[i] + strlen("--swap="), &end, 10) > 8 || *end != ':')
+            goto usage;
+    }
+
+    if (!order)
+    {
+        c = open_input(argv[0], CRAB_FILE_FLAG_PERROR | CRAB_FILE_FLAG_LAZY);
+        if (!c)
+            return 1;
+        puts(crab_file_byte_order(c) == CRAB_BYTE_ORDER_LITTLE ? "little" : "big");
+        if (!crab_file_close(c))
+            return 1;
+        return 0;
+    }
+    c = crab_file_open(argv[0], CRAB_FILE_FLAG_PERROR | CRAB_FILE_FLAG_LAZY);
+    if (!c)
+        return 1;
+    /* Only convert if the order really changes, so this can be rerun. */
+    if (order != crab_file_byte_order(c))
+    {
+        for (i = 2; i < argc; ++i)
+        {
+            char *end;
+            unsigned width = strtoul(argv[i] + strlen("--swap="), &end, 10);
+            CrabSection *s = crab_file_section(c, parse_u32(end + 1));
+            if (!s || !crab_section_swap_bytes(s, width))
+                goto fail;
+        }
+        TRY_B(crab_file_set_byte_order, (c, order));
+        if (!crab_file_save(c, 0))
+            goto fail;
+    }
+    if (!crab_file_close(c))
+        return 1;
+    return 0;
+
+fail:
+    (void)crab_file_close(c);
+    return 1;
+usage:
+    puts("Usage: `crab byteorder <filename.crab | -> [big|little|native [--swap=<width>:<section-number>]...]`");
+    puts("With no order, print the file's; otherwise convert it, reversing each integer in the given sections.");
+    return 1;
+}
 
 struct
 {
@@ -362,6 +1010,12 @@ struct
     {"store", cmd_store, "Assign data to a section to a CRAB file."},
     {"wipe", cmd_wipe, "Remove data from a section to a CRAB file."},
     {"dump", cmd_dump, "Get contents of a section of a CRAB file."},
+    {"trie", cmd_trie, "Add a multi-stage lookup table built from a flat array."},
+    {"intervals", cmd_intervals, "Add an interval map built from lines of text."},
+    {"filter", cmd_filter, "Add a Bloom filter over a key section."},
+    {"compact", cmd_compact, "Reclaim space left behind by appending saves."},
+    {"verify", cmd_verify, "Check every section of a CRAB file against its checksums."},
+    {"byteorder", cmd_byteorder, "Show or change the byte order of a CRAB file's data."},
 };
 #define NUM_COMMANDS (sizeof(commands)/sizeof(commands[0]))
 
@@ -0,0 +1,466 @@
+/*
+    CRAB - Compact Random-Access Binary
+    Copyright © 2018  Ben Longbons
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "packed.h"
+
+#include <errno.h>
+#include <stdlib.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_AVX2_DECODE 1
+#else
+#define HAVE_AVX2_DECODE 0
+#endif
+
+#include "bits.h"
+#include "crab.h"
+#include "internal.h"
+#include "util.h"
+
+
+/* This macro captures `c` implicitly. */
+#undef ERROR
+#define ERROR(f)        ERROR2(f, errno)
+#define ERROR2(f, e)            \
+({                              \
+    c->error_message = (f);     \
+    c->error_number = (e);      \
+    goto err;                   \
+})
+
+
+static void decode_scalar(const unsigned char *packed, unsigned bits, uint64_t start, size_t count, uint32_t *out)
+{
+    uint64_t bit = start * bits;
+    size_t i;
+    for (i = 0; i < count; ++i, bit += bits)
+        out[i] = unpack_bits(packed, bit, bits);
+}
+
+#if HAVE_AVX2_DECODE
+/*
+    Every block of 8 values is exactly `bits` bytes, so within a block
+    the byte offset and shift of each lane never change. Gathering from
+    those offsets and shifting each lane by its own amount decodes a whole
+    block at once. SSE has no per-lane variable shift, so there's no
+    point going below AVX2.
+
+    Up to 25 bits, a value plus its shift fits in a 32-bit gather;
+    wider ones need 64-bit gathers, which only do 4 lanes at a time.
+
+    Returns how many values were decoded; the caller does the rest.
+*/
+__attribute__((target("avx2")))
+static size_t decode_avx2(const unsigned char *packed, unsigned bits, uint64_t start, size_t count, uint32_t *out)
+{
+    uint64_t first_block = (start + 7) / 8;
+    uint64_t end_block = (start + count) / 8;
+    const unsigned char *p;
+    __m256i index, shift, mask;
+    size_t done, k;
+    int32_t lane_index[8], lane_shift[8];
+
+    if (end_block <= first_block)
+        return 0;
+    done = first_block * 8 - start;
+    decode_scalar(packed, bits, start, done, out);
+
+    for (k = 0; k < 8; ++k)
+    {
+        lane_index[k] = k * bits / 8;
+        lane_shift[k] = k * bits % 8;
+    }
+    index = _mm256_loadu_si256((const __m256i *)lane_index);
+    shift = _mm256_loadu_si256((const __m256i *)lane_shift);
+    mask = _mm256_set1_epi32(low_mask(bits));
+    p = packed + first_block * bits;
+
+    if (bits <= 25)
+    {
+        for (k = first_block; k < end_block; ++k, p += bits, done += 8)
+        {
+            __m256i v = _mm256_i32gather_epi32((const int *)p, index, 1);
+            v = _mm256_and_si256(_mm256_srlv_epi32(v, shift), mask);
+            _mm256_storeu_si256((__m256i *)(out + done), v);
+        }
+    }
+    else
+    {
+        __m128i index_lo = _mm256_castsi256_si128(index);
+        __m128i index_hi = _mm256_extracti128_si256(index, 1);
+        __m256i shift_lo = _mm256_cvtepu32_epi64(_mm256_castsi256_si128(shift));
+        __m256i shift_hi = _mm256_cvtepu32_epi64(_mm256_extracti128_si256(shift, 1));
+        __m256i evens = _mm256_setr_epi32(0, 2, 4, 6, 0, 2, 4, 6);
+        for (k = first_block; k < end_block; ++k, p += bits, done += 8)
+        {
+            __m256i lo = _mm256_i32gather_epi64((const long long *)p, index_lo, 1);
+            __m256i hi = _mm256_i32gather_epi64((const long long *)p, index_hi, 1);
+            __m256i v;
+            lo = _mm256_permutevar8x32_epi32(_mm256_srlv_epi64(lo, shift_lo), evens);
+            hi = _mm256_permutevar8x32_epi32(_mm256_srlv_epi64(hi, shift_hi), evens);
+            v = _mm256_and_si256(_mm256_permute2x128_si256(lo, hi, 0x20), mask);
+            _mm256_storeu_si256((__m256i *)(out + done), v);
+        }
+    }
+    return done;
+}
+
+#endif
+
+void unpack32(const unsigned char *packed, unsigned bits, uint64_t start, size_t count, uint32_t *out)
+{
+    size_t done = 0;
+#if HAVE_AVX2_DECODE
+    if (bits && have_avx2())
+        done = decode_avx2(packed, bits, start, count, out);
+#endif
+    decode_scalar(packed, bits, start + done, count - done, out + done);
+}
+
+
+CrabSection *crab_file_add_packed(CrabFile *c, const uint32_t *values, uint64_t count, const char *schema, uint16_t purpose)
+{
+    CrabPackedIntsData *data = NULL;
+    CrabSection *s;
+    uint32_t max = 0;
+    uint64_t i, size;
+    unsigned bits;
+
+    for (i = 0; i < count; ++i)
+        max |= values[i];
+    bits = bit_width(max);
+    /* Also keeps packed_size() from overflowing. */
+    if (bits && count > CRAB_MAX_SECTION_SIZE * 8 / bits)
+        ERROR2("<num values>", EOVERFLOW);
+    size = offsetof(CrabPackedIntsData, packed) + packed_size(count, bits);
+    if (size > CRAB_MAX_SECTION_SIZE || size != (size_t)size)
+        ERROR2("<num values>", EOVERFLOW);
+
+    data = (CrabPackedIntsData *)TRY_P(calloc, (1, size));
+    data->num_values = count;
+    data->bits = bits;
+    if (bits)
+    {
+        for (i = 0; i < count; ++i)
+            pack_bits(data->packed, i * bits, bits, values[i]);
+    }
+
+    s = TRY_P(crab_file_section_add_many, (c, 1, schema, purpose));
+    TRY_B(crab_section_set_data, (s, CRAB_SECTION_FLAG_OWN, (CrabAbstractData *)data, size));
+    return s;
+
+err:
+    free(data);
+    maybe_perror(c);
+    return NULL;
+}
+
+bool crab_packed_open(CrabSection *s, CrabPackedInts *view)
+{
+    CrabFile *c = s->c;
+    const CrabPackedIntsData *data = (const CrabPackedIntsData *)crab_section_data(s);
+    uint64_t size = crab_section_data_size(s);
+    uint64_t num_values;
+    unsigned bits;
+
+    if (!data && size)
+        goto err;
+    if (size < offsetof(CrabPackedIntsData, packed))
+        goto fmt_err;
+    num_values = data->num_values;
+    bits = data->bits;
+    if (bits > 32)
+        goto fmt_err;
+    if (bits && num_values > CRAB_MAX_SECTION_SIZE * 8 / bits)
+        goto fmt_err;
+    if (size != offsetof(CrabPackedIntsData, packed) + packed_size(num_values, bits))
+        goto fmt_err;
+
+    view->packed = data->packed;
+    view->num_values = num_values;
+    view->bits = bits;
+    return true;
+
+fmt_err:
+    c->error_message = "<file format>";
+    c->error_number = EINVAL;
+err:
+    maybe_perror(c);
+    return false;
+}
+
+uint64_t crab_packed_count(const CrabPackedInts *view)
+{
+    return view->num_values;
+}
+
+unsigned crab_packed_bits(const CrabPackedInts *view)
+{
+    return view->bits;
+}
+
+uint32_t crab_packed_get(const CrabPackedInts *view, uint64_t i)
+{
+    return unpack_bits(view->packed, i * view->bits, view->bits);
+}
+
+bool crab_packed_decode(const CrabPackedInts *view, uint64_t start, size_t count, uint32_t *out)
+{
+    if (start > view->num_values || count > view->num_values - start)
+        return false;
+    unpack32(view->packed, view->bits, start, count, out);
+    return true;
+}
+
+
+/* Pick the smaller of plain offsets and deltas for one block. */
+static void choose_encoding(const uint64_t *values, size_t n, uint64_t *base, unsigned *bits, unsigned *flags)
+{
+    uint64_t min = values[0], max = values[0], max_delta = 0;
+    size_t k;
+    unsigned delta_bits;
+    for (k = 1; k < n; ++k)
+    {
+        uint64_t delta = values[k] - values[k - 1];
+        if (values[k] < min)
+            min = values[k];
+        if (values[k] > max)
+            max = values[k];
+        if (delta > max_delta)
+            max_delta = delta;
+    }
+    *bits = bit_width(max - min);
+    delta_bits = bit_width(max_delta);
+    if (delta_bits < *bits)
+    {
+        *base = values[0];
+        *bits = delta_bits;
+        *flags = CRAB_FOR_BLOCK_FLAG_DELTA;
+    }
+    else
+    {
+        *base = min;
+        *flags = 0;
+    }
+}
+
+static uint64_t block_stream_size(size_t n, unsigned bits)
+{
+    return (n * bits + 63) / 64 * 8;
+}
+
+static size_t block_count(uint64_t num_values, uint64_t b)
+{
+    uint64_t left = num_values - b * CRAB_FOR_BLOCK_SIZE;
+    return left < CRAB_FOR_BLOCK_SIZE ? left : CRAB_FOR_BLOCK_SIZE;
+}
+
+CrabSection *crab_file_add_for(CrabFile *c, const uint64_t *values, uint64_t count, const char *schema, uint16_t purpose)
+{
+    CrabForIntsData *data = NULL;
+    unsigned char *packed;
+    CrabSection *s;
+    uint64_t num_blocks = (count + CRAB_FOR_BLOCK_SIZE - 1) / CRAB_FOR_BLOCK_SIZE;
+    uint64_t b, size, offset = 0, base;
+    unsigned bits, flags;
+    size_t k;
+
+    if (num_blocks > CRAB_MAX_SECTION_SIZE / sizeof(CrabForBlock))
+        ERROR2("<num values>", EOVERFLOW);
+    for (b = 0; b < num_blocks; ++b)
+    {
+        size_t n = block_count(count, b);
+        choose_encoding(values + b * CRAB_FOR_BLOCK_SIZE, n, &base, &bits, &flags);
+        offset += block_stream_size(n, bits);
+    }
+    /* Block offsets are only 32 bits. */
+    if (offset > UINT32_MAX)
+        ERROR2("<num values>", EOVERFLOW);
+    size = offsetof(CrabForIntsData, blocks) + num_blocks * sizeof(CrabForBlock) + offset + 8;
+    if (size > CRAB_MAX_SECTION_SIZE || size != (size_t)size)
+        ERROR2("<num values>", EOVERFLOW);
+
+    data = (CrabForIntsData *)TRY_P(calloc, (1, size));
+    data->num_values = count;
+    data->block_size = CRAB_FOR_BLOCK_SIZE;
+    packed = (unsigned char *)&data->blocks[num_blocks];
+    offset = 0;
+    for (b = 0; b < num_blocks; ++b)
+    {
+        const uint64_t *block_values = values + b * CRAB_FOR_BLOCK_SIZE;
+        size_t n = block_count(count, b);
+        choose_encoding(block_values, n, &base, &bits, &flags);
+        data->blocks[b].base = base;
+        data->blocks[b].offset = offset;
+        data->blocks[b].bits = bits;
+        data->blocks[b].flags = flags;
+        if (bits)
+        {
+            for (k = 0; k < n; ++k)
+            {
+                uint64_t v = flags & CRAB_FOR_BLOCK_FLAG_DELTA
+                    ? (k ? block_values[k] - block_values[k - 1] : 0)
+                    : block_values[k] - base;
+                pack_bits(packed + offset, k * bits, bits, v);
+            }
+        }
+        offset += block_stream_size(n, bits);
+    }
+
+    s = TRY_P(crab_file_section_add_many, (c, 1, schema, purpose));
+    TRY_B(crab_section_set_data, (s, CRAB_SECTION_FLAG_OWN, (CrabAbstractData *)data, size));
+    return s;
+
+err:
+    free(data);
+    maybe_perror(c);
+    return NULL;
+}
+
+bool crab_for_open(CrabSection *s, CrabForInts *view)
+{
+    CrabFile *c = s->c;
+    const CrabForIntsData *data = (const CrabForIntsData *)crab_section_data(s);
+    uint64_t size = crab_section_data_size(s);
+    uint64_t num_values, num_blocks, packed_size, b;
+
+    if (!data && size)
+        goto err;
+    if (size < offsetof(CrabForIntsData, blocks))
+        goto fmt_err;
+    if (data->block_size != CRAB_FOR_BLOCK_SIZE)
+        goto fmt_err;
+    num_values = data->num_values;
+    num_blocks = num_values / CRAB_FOR_BLOCK_SIZE + (num_values % CRAB_FOR_BLOCK_SIZE != 0);
+    if (num_blocks > (size - offsetof(CrabForIntsData, blocks)) / sizeof(CrabForBlock))
+        goto fmt_err;
+    packed_size = size - offsetof(CrabForIntsData, blocks) - num_blocks * sizeof(CrabForBlock);
+    if (packed_size < 8)
+        goto fmt_err;
+    for (b = 0; b < num_blocks; ++b)
+    {
+        const CrabForBlock *block = &data->blocks[b];
+        if (block->bits > 64 || block->flags & ~CRAB_FOR_BLOCK_FLAG_DELTA)
+            goto fmt_err;
+        /* due to having 32-bit inputs, this cannot overflow */
+        if (block->offset + block_stream_size(block_count(num_values, b), block->bits) > packed_size - 8)
+            goto fmt_err;
+    }
+
+    view->data = data;
+    view->packed = (const unsigned char *)&data->blocks[num_blocks];
+    view->num_values = num_values;
+    view->num_blocks = num_blocks;
+    return true;
+
+fmt_err:
+    c->error_message = "<file format>";
+    c->error_number = EINVAL;
+err:
+    maybe_perror(c);
+    return false;
+}
+
+uint64_t crab_for_count(const CrabForInts *view)
+{
+    return view->num_values;
+}
+
+uint64_t crab_for_get(const CrabForInts *view, uint64_t i)
+{
+    const CrabForBlock *block = &view->data->blocks[i / CRAB_FOR_BLOCK_SIZE];
+    const unsigned char *stream = view->packed + block->offset;
+    unsigned bits = block->bits;
+    uint64_t v = block->base;
+    size_t k = i % CRAB_FOR_BLOCK_SIZE, j;
+
+    if (!(block->flags & CRAB_FOR_BLOCK_FLAG_DELTA))
+        return v + unpack_bits_wide(stream, k * bits, bits);
+    for (j = 1; j <= k; ++j)
+        v += unpack_bits_wide(stream, j * bits, bits);
+    return v;
+}
+
+size_t crab_for_decode_block(const CrabForInts *view, uint64_t b, uint64_t *out)
+{
+    const CrabForBlock *block;
+    const unsigned char *stream;
+    uint64_t base;
+    unsigned bits;
+    size_t n, k;
+
+    if (b >= view->num_blocks)
+        return 0;
+    block = &view->data->blocks[b];
+    stream = view->packed + block->offset;
+    base = block->base;
+    bits = block->bits;
+    n = block_count(view->num_values, b);
+
+    if (bits <= 32)
+    {
+        uint32_t tmp[CRAB_FOR_BLOCK_SIZE];
+        unpack32(stream, bits, 0, n, tmp);
+        if (block->flags & CRAB_FOR_BLOCK_FLAG_DELTA)
+        {
+            for (k = 0; k < n; ++k)
+                out[k] = base += tmp[k];
+        }
+        else
+        {
+            for (k = 0; k < n; ++k)
+                out[k] = base + tmp[k];
+        }
+    }
+    else
+    {
+        for (k = 0; k < n; ++k)
+            out[k] = unpack_bits_wide(stream, k * bits, bits);
+        if (block->flags & CRAB_FOR_BLOCK_FLAG_DELTA)
+        {
+            for (k = 0; k < n; ++k)
+                out[k] = base += out[k];
+        }
+        else
+        {
+            for (k = 0; k < n; ++k)
+                out[k] += base;
+        }
+    }
+    return n;
+}
+
+void crab_for_iter_start(const CrabForInts *view, CrabForIter *it, uint64_t start)
+{
+    it->view = view;
+    it->position = start;
+}
+
+size_t crab_for_iter_next(CrabForIter *it, const uint64_t **values)
+{
+    uint64_t b = it->position / CRAB_FOR_BLOCK_SIZE;
+    size_t skip = it->position % CRAB_FOR_BLOCK_SIZE;
+    size_t n;
+
+    if (it->position >= it->view->num_values)
+        return 0;
+    n = crab_for_decode_block(it->view, b, it->values);
+    *values = it->values + skip;
+    it->position += n - skip;
+    return n - skip;
+}
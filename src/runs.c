@@ -0,0 +1,405 @@
+/*
+    CRAB - Compact Random-Access Binary
+    Copyright © 2018  Ben Longbons
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "runs.h"
+
+#include <errno.h>
+#include <stdlib.h>
+
+#include "crab.h"
+#include "internal.h"
+#include "util.h"
+
+
+/* This macro captures `c` implicitly. */
+#undef ERROR
+#define ERROR(f)        ERROR2(f, errno)
+#define ERROR2(f, e)            \
+({                              \
+    c->error_message = (f);     \
+    c->error_number = (e);      \
+    goto err;                   \
+})
+
+/* How many searches the *_get_many() functions keep in flight. */
+#define BATCH 16
+
+typedef struct __attribute__((scalar_storage_order("big-endian"))) CrabRunValue
+{
+    uint32_t v;
+} CrabRunValue;
+
+typedef struct __attribute__((scalar_storage_order("big-endian"))) CrabRunKey
+{
+    uint64_t v;
+} CrabRunKey;
+
+static const CrabRunValue *run_starts(const CrabRunsData *data)
+{
+    return (const CrabRunValue *)(data + 1);
+}
+static const CrabRunValue *run_values(const CrabRunsData *data, uint32_t num_runs)
+{
+    return run_starts(data) + num_runs + 1;
+}
+
+static const CrabRunKey *interval_firsts(const CrabIntervalsData *data)
+{
+    return (const CrabRunKey *)(data + 1);
+}
+static const CrabRunKey *interval_lasts(const CrabIntervalsData *data, uint32_t n)
+{
+    return interval_firsts(data) + n + 1;
+}
+static const CrabRunValue *interval_values(const CrabIntervalsData *data, uint32_t n)
+{
+    return (const CrabRunValue *)(interval_lasts(data, n) + n + 1);
+}
+
+static int compare_intervals(const void *a, const void *b)
+{
+    const CrabInterval *ia = (const CrabInterval *)a;
+    const CrabInterval *ib = (const CrabInterval *)b;
+    return (ia->first > ib->first) - (ia->first < ib->first);
+}
+
+/*
+    Number slots `k` and below of an Eytzinger array with the sorted
+    positions that belong there, in order; returns the next position.
+*/
+static uint32_t eytzinger_order(uint32_t *order, uint32_t n, uint64_t k, uint32_t next)
+{
+    if (k > n)
+        return next;
+    next = eytzinger_order(order, n, 2 * k, next);
+    order[k] = next++;
+    return eytzinger_order(order, n, 2 * k + 1, next);
+}
+
+/*
+    After walking off the bottom of the tree, the last node where the path
+    went right is the last run that starts at or before the key. Slot 0 if
+    none.
+*/
+static uint64_t eytzinger_result(uint64_t k)
+{
+    return k >> __builtin_ffsll(k);
+}
+
+
+CrabSection *crab_file_add_runs(CrabFile *c, const uint32_t *values, uint64_t count, const char *schema, uint16_t purpose)
+{
+    CrabRunsData *data = NULL;
+    uint32_t *sorted_starts = NULL, *sorted_values = NULL, *order = NULL;
+    CrabRunValue *starts, *out_values;
+    uint32_t num_runs = 0, k;
+    uint64_t i, size;
+    CrabSection *s;
+
+    /* Run starts are only 32 bits. */
+    if (count > UINT32_MAX)
+        ERROR2("<num values>", EOVERFLOW);
+    for (i = 0; i < count; ++i)
+    {
+        if (!i || values[i] != values[i - 1])
+            ++num_runs;
+    }
+    /* At most 32 GiB, since there are fewer than 2^32 runs. */
+    size = sizeof(CrabRunsData) + 2 * ((uint64_t)num_runs + 1) * sizeof(uint32_t);
+    if (size != (size_t)size)
+        ERROR2("<num runs>", EOVERFLOW);
+
+    sorted_starts = TRY_P(malloc, ((num_runs + 1) * sizeof(*sorted_starts)));
+    sorted_values = TRY_P(malloc, ((num_runs + 1) * sizeof(*sorted_values)));
+    num_runs = 0;
+    for (i = 0; i < count; ++i)
+    {
+        if (!i || values[i] != values[i - 1])
+        {
+            sorted_starts[num_runs] = i;
+            sorted_values[num_runs] = values[i];
+            ++num_runs;
+        }
+    }
+
+    data = (CrabRunsData *)TRY_P(calloc, (1, size));
+    data->num_values = count;
+    data->num_runs = num_runs;
+    order = TRY_P(malloc, ((num_runs + 1) * sizeof(*order)));
+    eytzinger_order(order, num_runs, 1, 0);
+    starts = (CrabRunValue *)run_starts(data);
+    out_values = (CrabRunValue *)run_values(data, num_runs);
+    for (k = 1; k <= num_runs; ++k)
+    {
+        starts[k].v = sorted_starts[order[k]];
+        out_values[k].v = sorted_values[order[k]];
+    }
+    free(order);
+    order = NULL;
+    free(sorted_starts);
+    sorted_starts = NULL;
+    free(sorted_values);
+    sorted_values = NULL;
+
+    s = TRY_P(crab_file_section_add_many, (c, 1, schema, purpose));
+    TRY_B(crab_section_set_data, (s, CRAB_SECTION_FLAG_OWN, (CrabAbstractData *)data, size));
+    return s;
+
+err:
+    free(sorted_starts);
+    free(sorted_values);
+    free(order);
+    free(data);
+    maybe_perror(c);
+    return NULL;
+}
+
+bool crab_runs_open(CrabSection *s, CrabRuns *view)
+{
+    CrabFile *c = s->c;
+    const CrabRunsData *data = (const CrabRunsData *)crab_section_data(s);
+    uint64_t size = crab_section_data_size(s);
+    uint64_t num_values, num_runs;
+
+    if (!data && size)
+        goto err;
+    if (size < sizeof(CrabRunsData))
+        goto fmt_err;
+    num_values = data->num_values;
+    num_runs = data->num_runs;
+    if (num_values > UINT32_MAX || num_runs > num_values || (num_values && !num_runs))
+        goto fmt_err;
+    if (size != sizeof(CrabRunsData) + 2 * (num_runs + 1) * sizeof(uint32_t))
+        goto fmt_err;
+
+    view->data = data;
+    view->num_values = num_values;
+    view->num_runs = num_runs;
+    return true;
+
+fmt_err:
+    c->error_message = "<file format>";
+    c->error_number = EINVAL;
+err:
+    maybe_perror(c);
+    return false;
+}
+
+uint64_t crab_runs_count(const CrabRuns *view)
+{
+    return view->num_values;
+}
+
+uint32_t crab_runs_num_runs(const CrabRuns *view)
+{
+    return view->num_runs;
+}
+
+uint32_t crab_runs_get(const CrabRuns *view, uint32_t i)
+{
+    const CrabRunValue *starts = run_starts(view->data);
+    uint64_t n = view->num_runs, k = 1;
+    while (k <= n)
+        k = 2 * k + (starts[k].v <= i);
+    return run_values(view->data, n)[eytzinger_result(k)].v;
+}
+
+void crab_runs_get_many(const CrabRuns *view, const uint32_t *positions, size_t count, uint32_t *out)
+{
+    const CrabRunValue *starts = run_starts(view->data);
+    const CrabRunValue *values = run_values(view->data, view->num_runs);
+    uint64_t n = view->num_runs;
+    uint64_t k[BATCH];
+    size_t base, j, m;
+    bool active;
+
+    for (base = 0; base < count; base += m)
+    {
+        m = count - base < BATCH ? count - base : BATCH;
+        for (j = 0; j < m; ++j)
+            k[j] = 1;
+        /*
+            Every search takes one step per round. Sixteen 4-byte starts
+            fill a cache line, so the line holding all of a node's
+            great-great-grandchildren can be prefetched 4 levels early.
+        */
+        do
+        {
+            active = false;
+            for (j = 0; j < m; ++j)
+            {
+                if (k[j] > n)
+                    continue;
+                active = true;
+                if (16 * k[j] <= n)
+                    __builtin_prefetch(&starts[16 * k[j]]);
+                k[j] = 2 * k[j] + (starts[k[j]].v <= positions[base + j]);
+            }
+        }
+        while (active);
+        for (j = 0; j < m; ++j)
+            out[base + j] = values[eytzinger_result(k[j])].v;
+    }
+}
+
+
+CrabSection *crab_file_add_intervals(CrabFile *c, const CrabInterval *intervals, size_t count, const char *schema, uint16_t purpose)
+{
+    CrabIntervalsData *data = NULL;
+    CrabInterval *sorted = NULL;
+    uint32_t *order = NULL;
+    CrabRunKey *firsts, *lasts;
+    CrabRunValue *values;
+    uint64_t size;
+    size_t i, n = 0;
+    uint32_t k;
+    CrabSection *s;
+
+    sorted = TRY_P(memdup_plus, (intervals, count * sizeof(*intervals), 1));
+    qsort(sorted, count, sizeof(*sorted), compare_intervals);
+    for (i = 0; i < count; ++i)
+    {
+        if (sorted[i].first > sorted[i].last)
+            ERROR2("<interval>", EINVAL);
+        if (n && sorted[i].first <= sorted[n - 1].last)
+            ERROR2("<overlapping intervals>", EINVAL);
+        if (n && sorted[i].first == sorted[n - 1].last + 1 && sorted[i].value == sorted[n - 1].value)
+        {
+            sorted[n - 1].last = sorted[i].last;
+            continue;
+        }
+        sorted[n++] = sorted[i];
+    }
+    /* `num_intervals` is only 32 bits, and there's one more of each. */
+    if (n >= UINT32_MAX)
+        ERROR2("<num intervals>", EOVERFLOW);
+    size = sizeof(CrabIntervalsData) + ((uint64_t)n + 1) * (2 * sizeof(CrabRunKey) + sizeof(CrabRunValue));
+    if (size != (size_t)size)
+        ERROR2("<num intervals>", EOVERFLOW);
+
+    data = (CrabIntervalsData *)TRY_P(calloc, (1, size));
+    data->num_intervals = n;
+    order = TRY_P(malloc, ((n + 1) * sizeof(*order)));
+    eytzinger_order(order, n, 1, 0);
+    firsts = (CrabRunKey *)interval_firsts(data);
+    lasts = (CrabRunKey *)interval_lasts(data, n);
+    values = (CrabRunValue *)interval_values(data, n);
+    for (k = 1; k <= n; ++k)
+    {
+        firsts[k].v = sorted[order[k]].first;
+        lasts[k].v = sorted[order[k]].last;
+        values[k].v = sorted[order[k]].value;
+    }
+    free(order);
+    order = NULL;
+    free(sorted);
+    sorted = NULL;
+
+    s = TRY_P(crab_file_section_add_many, (c, 1, schema, purpose));
+    TRY_B(crab_section_set_data, (s, CRAB_SECTION_FLAG_OWN, (CrabAbstractData *)data, size));
+    return s;
+
+err:
+    free(sorted);
+    free(order);
+    free(data);
+    maybe_perror(c);
+    return NULL;
+}
+
+bool crab_intervals_open(CrabSection *s, CrabIntervals *view)
+{
+    CrabFile *c = s->c;
+    const CrabIntervalsData *data = (const CrabIntervalsData *)crab_section_data(s);
+    uint64_t size = crab_section_data_size(s);
+    uint64_t n;
+
+    if (!data && size)
+        goto err;
+    if (size < sizeof(CrabIntervalsData))
+        goto fmt_err;
+    n = data->num_intervals;
+    if (size != sizeof(CrabIntervalsData) + (n + 1) * (2 * sizeof(CrabRunKey) + sizeof(CrabRunValue)))
+        goto fmt_err;
+
+    view->data = data;
+    view->num_intervals = n;
+    return true;
+
+fmt_err:
+    c->error_message = "<file format>";
+    c->error_number = EINVAL;
+err:
+    maybe_perror(c);
+    return false;
+}
+
+uint32_t crab_intervals_count(const CrabIntervals *view)
+{
+    return view->num_intervals;
+}
+
+bool crab_intervals_get(const CrabIntervals *view, uint64_t key, uint32_t *value)
+{
+    const CrabRunKey *firsts = interval_firsts(view->data);
+    uint64_t n = view->num_intervals, k = 1;
+    while (k <= n)
+        k = 2 * k + (firsts[k].v <= key);
+    k = eytzinger_result(k);
+    if (!k || key > interval_lasts(view->data, n)[k].v)
+        return false;
+    *value = interval_values(view->data, n)[k].v;
+    return true;
+}
+
+void crab_intervals_get_many(const CrabIntervals *view, const uint64_t *keys, size_t count, uint32_t missing, uint32_t *out)
+{
+    uint64_t n = view->num_intervals;
+    const CrabRunKey *firsts = interval_firsts(view->data);
+    const CrabRunKey *lasts = interval_lasts(view->data, n);
+    const CrabRunValue *values = interval_values(view->data, n);
+    uint64_t k[BATCH];
+    size_t base, j, m;
+    bool active;
+
+    for (base = 0; base < count; base += m)
+    {
+        m = count - base < BATCH ? count - base : BATCH;
+        for (j = 0; j < m; ++j)
+            k[j] = 1;
+        /* Eight 8-byte keys fill a cache line, so prefetch 3 levels early. */
+        do
+        {
+            active = false;
+            for (j = 0; j < m; ++j)
+            {
+                if (k[j] > n)
+                    continue;
+                active = true;
+                if (8 * k[j] <= n)
+                    __builtin_prefetch(&firsts[8 * k[j]]);
+                k[j] = 2 * k[j] + (firsts[k[j]].v <= keys[base + j]);
+            }
+        }
+        while (active);
+        for (j = 0; j < m; ++j)
+        {
+            uint64_t r = eytzinger_result(k[j]);
+            out[base + j] = r && keys[base + j] <= lasts[r].v ? values[r].v : missing;
+        }
+    }
+}
@@ -0,0 +1,330 @@
+/*
+    CRAB - Compact Random-Access Binary
+    Copyright © 2018  Ben Longbons
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "trie.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "crab.h"
+#include "format.h"
+#include "internal.h"
+#include "util.h"
+
+
+/* This macro captures `c` implicitly. */
+#undef ERROR
+#define ERROR(f)        ERROR2(f, errno)
+#define ERROR2(f, e)            \
+({                              \
+    c->error_message = (f);     \
+    c->error_number = (e);      \
+    goto err;                   \
+})
+
+/* Block sizes tried when the caller leaves it to us. */
+#define MIN_AUTO_LEAF_BITS 2
+#define MAX_AUTO_LEAF_BITS 12
+/* Anything bigger is surely a mistake. */
+#define MAX_BLOCK_BITS 24
+
+typedef struct Stage Stage;
+struct Stage
+{
+    /* For each input block, the index of its first entry in `blocks`. */
+    uint32_t *index;
+    uint64_t index_size;
+    /* The distinct blocks. */
+    uint32_t *blocks;
+    uint64_t blocks_size;
+};
+
+static void free_stage(Stage *s)
+{
+    free(s->index);
+    free(s->blocks);
+    s->index = s->blocks = NULL;
+}
+
+/*
+    Split `in` into blocks of `2**bits`, padding the last with 0, and
+    store each distinct block once.
+
+    On failure, `c->error_message` is set.
+*/
+static bool dedup_blocks(CrabFile *c, const uint32_t *in, uint64_t n, unsigned bits, Stage *out)
+{
+    uint64_t block = (uint64_t)1 << bits;
+    uint64_t num_blocks = (n + block - 1) >> bits;
+    uint64_t num_buckets = 1, mask, b, i;
+    uint64_t *buckets = NULL;
+    uint32_t *padded = NULL;
+
+    memset(out, 0, sizeof(*out));
+    while (num_buckets < 2 * num_blocks)
+        num_buckets *= 2;
+    mask = num_buckets - 1;
+    if (num_blocks << bits > UINT32_MAX)
+        ERROR2("<num values>", EOVERFLOW);
+    out->index = TRY_P(malloc, (num_blocks * sizeof(uint32_t) + 1));
+    out->blocks = TRY_P(malloc, ((num_blocks << bits) * sizeof(uint32_t) + 1));
+    buckets = TRY_P(calloc, (num_buckets, sizeof(*buckets)));
+    padded = TRY_P(calloc, (block, sizeof(*padded)));
+
+    for (b = 0; b < num_blocks; ++b)
+    {
+        const uint32_t *data = in + (b << bits);
+        uint32_t h;
+        if (n - (b << bits) < block)
+        {
+            memcpy(padded, data, (n - (b << bits)) * sizeof(*padded));
+            data = padded;
+        }
+        h = crab_string_hash((const char *)data, block * sizeof(*data));
+        for (i = h & mask; buckets[i]; i = (i + 1) & mask)
+        {
+            if (memcmp(out->blocks + (buckets[i] - 1), data, block * sizeof(*data)) == 0)
+                break;
+        }
+        if (!buckets[i])
+        {
+            memcpy(out->blocks + out->blocks_size, data, block * sizeof(*data));
+            buckets[i] = out->blocks_size + 1;
+            out->blocks_size += block;
+        }
+        out->index[b] = buckets[i] - 1;
+    }
+    out->index_size = num_blocks;
+
+    free(buckets);
+    free(padded);
+    return true;
+
+err:
+    free(buckets);
+    free(padded);
+    free_stage(out);
+    return false;
+}
+
+static unsigned value_bytes_for(uint32_t max)
+{
+    return max > 0xffff ? 4 : max > 0xff ? 2 : 1;
+}
+
+/*
+    Build all the stages; `top` is the top-level index, `mid` and `leaf`
+    the blocks of the others. Returns the section size, or 0 on failure.
+*/
+static uint64_t build_stages(CrabFile *c, const uint32_t *values, uint64_t count, unsigned leaf_bits, unsigned mid_bits, unsigned value_bytes, Stage *top, Stage *leaf)
+{
+    memset(top, 0, sizeof(*top));
+    if (!dedup_blocks(c, values, count, leaf_bits, leaf))
+        return 0;
+    if (mid_bits && !dedup_blocks(c, leaf->index, leaf->index_size, mid_bits, top))
+    {
+        free_stage(leaf);
+        return 0;
+    }
+    return sizeof(CrabTrieData)
+        + (mid_bits ? top->index_size + top->blocks_size : leaf->index_size) * sizeof(uint32_t)
+        + leaf->blocks_size * value_bytes;
+}
+
+
+CrabSection *crab_file_add_trie(CrabFile *c, const uint32_t *values, uint64_t count, unsigned leaf_bits, unsigned mid_bits, const char *schema, uint16_t purpose)
+{
+    CrabTrieData *data = NULL;
+    Stage top, leaf;
+    uint32_t max = 0;
+    const uint32_t *top_index;
+    unsigned char *p;
+    unsigned value_bytes;
+    uint64_t size, i;
+    CrabSection *s;
+
+    memset(&top, 0, sizeof(top));
+    memset(&leaf, 0, sizeof(leaf));
+    if (leaf_bits > MAX_BLOCK_BITS || mid_bits > MAX_BLOCK_BITS)
+        ERROR2("<block bits>", EINVAL);
+    if (count > UINT32_MAX)
+        ERROR2("<num values>", EOVERFLOW);
+    for (i = 0; i < count; ++i)
+    {
+        if (values[i] > max)
+            max = values[i];
+    }
+    value_bytes = value_bytes_for(max);
+
+    if (!leaf_bits)
+    {
+        unsigned bits;
+        uint64_t best_size = 0;
+        for (bits = MIN_AUTO_LEAF_BITS; bits <= MAX_AUTO_LEAF_BITS; ++bits)
+        {
+            Stage t, l;
+            size = build_stages(c, values, count, bits, mid_bits, value_bytes, &t, &l);
+            if (!size)
+                goto err;
+            free_stage(&t);
+            free_stage(&l);
+            if (!best_size || size < best_size)
+            {
+                best_size = size;
+                leaf_bits = bits;
+            }
+        }
+    }
+    size = build_stages(c, values, count, leaf_bits, mid_bits, value_bytes, &top, &leaf);
+    if (!size)
+        goto err;
+    /* The stages' 32-bit sizes were checked by build_stages(). */
+    if (size != (size_t)size)
+        ERROR2("<num values>", EOVERFLOW);
+
+    data = (CrabTrieData *)TRY_P(calloc, (1, size));
+    data->num_values = count;
+    data->num_stages = mid_bits ? 3 : 2;
+    data->value_bytes = value_bytes;
+    data->leaf_bits = leaf_bits;
+    data->mid_bits = mid_bits;
+    data->top_size = mid_bits ? top.index_size : leaf.index_size;
+    data->mid_size = mid_bits ? top.blocks_size : 0;
+    data->leaf_size = leaf.blocks_size;
+
+    p = (unsigned char *)(data + 1);
+    top_index = mid_bits ? top.index : leaf.index;
+    for (i = 0; i < data->top_size; ++i, p += 4)
+        ((CrabTrieWord *)p)->v = top_index[i];
+    for (i = 0; i < data->mid_size; ++i, p += 4)
+        ((CrabTrieWord *)p)->v = top.blocks[i];
+    for (i = 0; i < data->leaf_size; ++i, p += value_bytes)
+    {
+        if (value_bytes == 1)
+            *p = leaf.blocks[i];
+        else if (value_bytes == 2)
+            ((CrabTrieHalf *)p)->v = leaf.blocks[i];
+        else
+            ((CrabTrieWord *)p)->v = leaf.blocks[i];
+    }
+    free_stage(&top);
+    free_stage(&leaf);
+
+    s = TRY_P(crab_file_section_add_many, (c, 1, schema, purpose));
+    TRY_B(crab_section_set_data, (s, CRAB_SECTION_FLAG_OWN, (CrabAbstractData *)data, size));
+    return s;
+
+err:
+    free_stage(&top);
+    free_stage(&leaf);
+    free(data);
+    maybe_perror(c);
+    return NULL;
+}
+
+/* Check that every block an index points to fits in the next stage. */
+static bool check_index(const CrabTrieWord *index, uint64_t size, unsigned bits, uint64_t next_size)
+{
+    uint64_t i;
+    for (i = 0; i < size; ++i)
+    {
+        if (index[i].v + ((uint64_t)1 << bits) > next_size)
+            return false;
+    }
+    return true;
+}
+
+bool crab_trie_open(CrabSection *s, CrabTrie *view)
+{
+    CrabFile *c = s->c;
+    const CrabTrieData *data = (const CrabTrieData *)crab_section_data(s);
+    uint64_t size = crab_section_data_size(s);
+    uint64_t num_values, top_size, mid_size, leaf_size, top_block;
+    unsigned leaf_bits, mid_bits, value_bytes, top_shift;
+    const CrabTrieWord *top, *mid;
+
+    if (!data && size)
+        goto err;
+    if (size < sizeof(CrabTrieData))
+        goto fmt_err;
+    num_values = data->num_values;
+    value_bytes = data->value_bytes;
+    leaf_bits = data->leaf_bits;
+    mid_bits = data->mid_bits;
+    top_size = data->top_size;
+    mid_size = data->mid_size;
+    leaf_size = data->leaf_size;
+    if (value_bytes != 1 && value_bytes != 2 && value_bytes != 4)
+        goto fmt_err;
+    if (leaf_bits > MAX_BLOCK_BITS || mid_bits > MAX_BLOCK_BITS)
+        goto fmt_err;
+    if (data->num_stages != (mid_bits ? 3 : 2))
+        goto fmt_err;
+    if (!mid_bits && mid_size)
+        goto fmt_err;
+    top_shift = leaf_bits + mid_bits;
+    top_block = (uint64_t)1 << top_shift;
+    if (top_size != num_values / top_block + (num_values % top_block != 0))
+        goto fmt_err;
+    /* due to having 32-bit inputs, this cannot overflow */
+    if (size != sizeof(CrabTrieData) + (top_size + mid_size) * 4 + leaf_size * value_bytes)
+        goto fmt_err;
+
+    top = (const CrabTrieWord *)(data + 1);
+    mid = top + top_size;
+    if (mid_bits)
+    {
+        if (!check_index(top, top_size, mid_bits, mid_size))
+            goto fmt_err;
+        if (!check_index(mid, mid_size, leaf_bits, leaf_size))
+            goto fmt_err;
+    }
+    else
+    {
+        if (!check_index(top, top_size, leaf_bits, leaf_size))
+            goto fmt_err;
+    }
+
+    view->top = (const void *)top;
+    view->mid = mid_bits ? (const void *)mid : NULL;
+    view->leaf = (const unsigned char *)(mid + mid_size);
+    view->num_values = num_values;
+    view->leaf_mask = ((uint64_t)1 << leaf_bits) - 1;
+    view->mid_mask = ((uint64_t)1 << mid_bits) - 1;
+    view->leaf_bits = leaf_bits;
+    view->top_shift = top_shift;
+    view->value_bytes = value_bytes;
+    return true;
+
+fmt_err:
+    c->error_message = "<file format>";
+    c->error_number = EINVAL;
+err:
+    maybe_perror(c);
+    return false;
+}
+
+uint64_t crab_trie_count(const CrabTrie *view)
+{
+    return view->num_values;
+}
+
+uint32_t crab_trie_get(const CrabTrie *view, uint64_t i)
+{
+    return crab_trie_get_inline(view, i);
+}